@@ -43,9 +43,20 @@ struct player_device_info {
 /* defined in rio.c */
 extern struct player_device_info player_devices[];
 
+/* replaces the driver's read_bulk, write_bulk and control_msg when set.
+   lets the tests stand in for a player. */
+struct rio_transport {
+  int (*read_bulk)  (rios_t *rio, unsigned char *buffer, u_int32_t size);
+  int (*write_bulk) (rios_t *rio, unsigned char *buffer, u_int32_t size);
+  int (*control_msg)(rios_t *rio, u_int8_t request, u_int16_t value,
+		     u_int16_t index, u_int16_t length, unsigned char *buffer);
+};
+
 struct rioutil_usbdevice {
   void *dev;
   struct player_device_info *entry;
+
+  struct rio_transport *transport;
 };
 
 extern char driver_method[];
@@ -139,6 +139,49 @@ typedef struct _rio_info {
   u_int32_t caps;
 } rio_info_t;
 
+/* one operation of a journaled batch (see journal_begin_rio) */
+enum {
+  RIO_JOB_UPLOAD = 0,
+  RIO_JOB_DOWNLOAD,
+  RIO_JOB_DELETE
+};
+
+typedef struct _rio_job {
+  int op;
+
+  u_int8_t  memory_unit;
+  u_int32_t rio_num; /* file on the device (downloads and deletes) */
+  u_int32_t size;
+
+  /* local file to upload or directory to download into */
+  char *path;
+  char *name;
+
+  /* tags given on the command line for an upload */
+  char *artist;
+  char *title;
+  char *album;
+
+  int done;
+} rio_job_t;
+
+/* counters kept by the library for each rio instance (see get_stats_rio) */
+typedef struct _rio_stats {
+  /* free space queries sent to the device (RIO_MEMRI) */
+  u_int32_t memri_queries;
+  /* free space changes predicted on the host */
+  u_int32_t predictions;
+  /* times the predicted free space was checked against the device */
+  u_int32_t reconciles;
+  /* difference between predicted and reported free space, in bytes */
+  u_int64_t drift;
+  u_int64_t max_drift;
+  /* file data sent to the device and the time spent sending it, in
+     microseconds. headers and commands are not included. */
+  u_int64_t bytes_uploaded;
+  u_int64_t upload_usecs;
+} rio_stats_t;
+
 typedef struct _rios {
   /* void here to avoid the user needing to define WITH_USBDEVFS and such */
   void *dev;
@@ -157,6 +200,29 @@ typedef struct _rios {
 
   /* make rioutil thread-safe */
   int lock;
+
+  /* host-side record of uploaded files (see open_manifest_rio) */
+  void *manifest;
+
+  /* journal of the current batch (see journal_begin_rio) */
+  void *journal;
+
+  /* worker thread for asynchronous jobs (see add_song_rio_async) */
+  void *async;
+
+  /* database writes are deferred inside a batch (see begin_batch_rio) */
+  int batch;
+  int db_dirty;
+
+  /* host-side free space accounting (see update_free_intrn_rio) */
+  struct {
+    u_int32_t alloc_unit;
+    u_int32_t overhead;
+    int samples;
+    int pending;
+  } space[MAX_MEM_UNITS];
+
+  rio_stats_t stats;
 } rios_t;
 
 typedef rios_t rio_instance_t;
@@ -170,11 +236,138 @@ void close_rio (rios_t *rio);
 int set_info_rio (rios_t *rio, rio_info_t *info);
 int add_song_rio (rios_t *rio, u_int8_t memory_unit, char *file_name, char *artist, char *title, char *album);
 int download_file_rio (rios_t *rio, u_int8_t memory_unit, u_int32_t fileno, char *fileName);
+
+/* Called as each file of a download_files_rio batch is finished. error is
+   URIO_SUCCESS or < 0. Called from the library's writer thread. */
+typedef void (*rio_download_done_t) (rios_t *rio, u_int8_t memory_unit, u_int32_t fileno,
+				     char *file_name, int error, void *ptr);
+
+/* Download several files in one session into directory (the current
+   directory if NULL) using the names stored on the device. Returns the
+   number of files downloaded or < 0 on error. */
+int download_files_rio (rios_t *rio, u_int8_t memory_unit, u_int32_t *filenos, int num_files,
+			char *directory, rio_download_done_t done, void *ptr);
+
+/* Receives the data of a file as it arrives from the device. Return < 0 to
+   stop the download. ctx is the pointer given to download_to_sink_rio. */
+typedef int (*rio_sink_fn_t) (void *ctx, unsigned char *data, size_t length);
+
+/* Download a file without creating a local file: every block is handed to
+   sink_fn. The device is not read faster than sink_fn consumes the data.
+   Returns URIO_SUCCESS, -EINTR if the transfer was aborted or < 0 on error. */
+int download_to_sink_rio (rios_t *rio, u_int8_t memory_unit, u_int32_t fileno,
+			  rio_sink_fn_t sink_fn, void *ctx);
+
+/* sinks for download_to_sink_rio. fd_sink_rio writes to the file
+   descriptor pointed to by ctx. memory_sink_rio appends to a
+   rio_memory_sink_t (start it zeroed and free data when done). */
+typedef struct _rio_memory_sink {
+  unsigned char *data;
+  size_t length;
+  size_t size;
+} rio_memory_sink_t;
+
+int fd_sink_rio (void *ctx, unsigned char *data, size_t length);
+int memory_sink_rio (void *ctx, unsigned char *data, size_t length);
+
+/* Archive every file on the device (with its header), the preferences and
+   the memory layout in file_name. Returns the number of files archived or
+   < 0 on error. */
+int backup_rio (rios_t *rio, char *file_name);
+
+/* Erase the memory units covered by an archive made with backup_rio and
+   upload its files (and preferences) again. Returns the number of files
+   restored or < 0 on error. */
+int restore_rio (rios_t *rio, char *file_name);
+
+/* Read a file once and build its header, data blocks and block checksums.
+   The result can be sent to any number of players of the same type as rio,
+   from one thread per player, with send_upload_rio. */
+typedef struct _rio_upload rio_upload_t;
+
+int prepare_upload_rio (rios_t *rio, char *file_name, char *artist, char *title, char *album,
+			rio_upload_t **upload);
+int send_upload_rio (rios_t *rio, u_int8_t memory_unit, rio_upload_t *upload);
+void free_upload_rio (rio_upload_t *upload);
+
+/* The type of player (see return_type_rio) an upload was prepared for. */
+int upload_type_rio (rio_upload_t *upload);
+
+/* Step-wise uploads, downloads and file list refreshes, so one thread can
+   drive several players. No i/o is done by the *_begin_rio calls. Each
+   call to rio_step makes one exchange with the player (at most one block
+   or file header) and returns RIO_STEP_AGAIN until the operation is over,
+   then URIO_SUCCESS or < 0. rio_op_free aborts an unfinished operation. */
+#define RIO_STEP_AGAIN 1
+
+typedef struct _rio_op rio_op_t;
+
+int upload_begin_rio (rios_t *rio, u_int8_t memory_unit, rio_upload_t *upload, rio_op_t **op);
+int download_begin_rio (rios_t *rio, u_int8_t memory_unit, u_int32_t fileno,
+			rio_sink_fn_t sink_fn, void *ctx, rio_op_t **op);
+int refresh_begin_rio (rios_t *rio, rio_op_t **op);
+int rio_step (rio_op_t *op);
+void rio_op_free (rio_op_t *op);
+
 int upload_from_pipe_rio (rios_t *rio, u_int8_t memory_unit, int addpipe, char *name, char *artist,
 			  char *album, char *title, int mp3, int bitrate, int samplerate);
 int delete_file_rio (rios_t *rio, u_int8_t memory_unit, u_int32_t fileno);
+/* Delete several files at once. The database is written and the free space
+   checked once for the whole batch. Returns the number of files deleted. */
+int delete_files_rio (rios_t *rio, u_int8_t memory_unit, const u_int32_t *filenos, int num_files);
 int format_mem_rio (rios_t *rio, u_int8_t memory_unit);
 
+/* Asynchronous jobs. Each call queues a job and returns its id (> 0) or
+   < 0 on error. The jobs of an instance run in order in a worker thread
+   and report through callback (called from the worker) or, if callback is
+   NULL, through next_event_rio and the descriptor from event_fd_rio. The
+   instance must not be used directly while it has jobs. */
+enum {
+  RIO_EVENT_PROGRESS = 0,
+  RIO_EVENT_DONE
+};
+
+typedef struct _rio_event {
+  int job;
+  int type;
+
+  /* progress: x of X */
+  int x, X;
+
+  /* done: what the blocking call returned (-ECANCELED if cancelled) */
+  int result;
+} rio_event_t;
+
+typedef void (*rio_event_cb_t) (rios_t *rio, rio_event_t *event, void *ptr);
+
+int add_song_rio_async (rios_t *rio, u_int8_t memory_unit, char *file_name, char *artist,
+			char *title, char *album, rio_event_cb_t callback, void *ptr);
+int download_file_rio_async (rios_t *rio, u_int8_t memory_unit, u_int32_t fileno, char *file_name,
+			     rio_event_cb_t callback, void *ptr);
+int delete_file_rio_async (rios_t *rio, u_int8_t memory_unit, u_int32_t fileno,
+			   rio_event_cb_t callback, void *ptr);
+/* Cancel a queued or running job. A running job stops before its next
+   block. */
+int cancel_job_rio (rios_t *rio, int job);
+int event_fd_rio (rios_t *rio);
+/* Returns -EAGAIN if no event is waiting. */
+int next_event_rio (rios_t *rio, rio_event_t *event);
+
+/* Journal a batch in ~/.rioutil so it can be resumed if it is interrupted.
+   journal_begin_rio records the planned jobs, journal_done_rio each one
+   that finishes and journal_end_rio removes the journal once the batch is
+   over. */
+int journal_begin_rio (rios_t *rio, rio_job_t *jobs, int num_jobs);
+int journal_done_rio (rios_t *rio, int job);
+int journal_end_rio (rios_t *rio);
+/* Load the journal of an interrupted batch. Returns the number of jobs or
+   -ENOENT if there is none. */
+int journal_load_rio (rios_t *rio, rio_job_t **jobs);
+/* Mark the jobs that finished (or can no longer be done) by looking at the
+   device and the local files. Returns the number of jobs left. */
+int journal_reconcile_rio (rios_t *rio, rio_job_t *jobs, int num_jobs);
+void journal_free_rio (rio_job_t *jobs, int num_jobs);
+
 /* upgrade the rio's firmware from a file */
 int firmware_upgrade_rio (rios_t *rio, char *file_name);
 
@@ -189,6 +382,14 @@ void set_progress_rio  (rios_t *rio, void (*f)(int x, int X, void *ptr), void *p
 /* These only work with S-Series or newer Rios */
 int create_playlist_rio (rios_t *rio, char *name, int songs[], int memory_units[], int nsongs);
 int overwrite_file_rio (rios_t *rio, u_int8_t memory_unit, u_int32_t fileno, char *filename);
+/* Replace the tags (title, artist, album, genre, year and track number) of a
+   file with those in fields without uploading it again. S-Series and newer. */
+int set_file_info_rio (rios_t *rio, u_int8_t memory_unit, u_int32_t fileno, flist_rio_t *fields);
+
+/* Group a series of uploads, deletes and retags. The Nitrus database is
+   written once by end_batch_rio instead of after every change. */
+int begin_batch_rio (rios_t *rio);
+int end_batch_rio (rios_t *rio);
 int return_serial_number_rio (rios_t *rio, u_int8_t serial_number[16]);
 
 
@@ -196,9 +397,55 @@ int return_serial_number_rio (rios_t *rio, u_int8_t serial_number[16]);
 /* Returns the file number that will be assigned to the next file uploaded. */
 int first_free_file_rio (rios_t *rio, u_int8_t memory_unit);
 
+/* Host-side manifest and duplicate detection.
+
+   The manifest records a digest of every file uploaded while it is open. It
+   is keyed by the device's serial number and is saved by close_rio. If
+   file_name is NULL the manifest is kept in ~/.rioutil. Opening the manifest
+   that is already open does nothing. */
+int open_manifest_rio (rios_t *rio, char *file_name);
+int save_manifest_rio (rios_t *rio);
+
+/* Host-side catalog of local files.
+
+   While the catalog is open the header built for a local MP3 file is
+   remembered by device, inode, size and modification time, so the file is
+   not parsed again until it changes. If file_name is NULL the catalog is
+   ~/.rioutil/catalog. close_catalog_rio saves it. */
+int open_catalog_rio (char *file_name);
+int close_catalog_rio (void);
+
+/* Fill entry with the information that would be sent to the device for the
+   local file file_name. entry->size is the number of bytes that would be
+   uploaded. rio may be NULL, the strings are then UTF-8. */
+int probe_file_rio (rios_t *rio, char *file_name, flist_rio_t *entry);
+
+/* Returns the file number of an identical file already on the device (and
+   stores its memory unit in memory_unit) or -ENOENT. entry should come from
+   probe_file_rio. */
+int find_duplicate_rio (rios_t *rio, char *file_name, flist_rio_t *entry, u_int8_t *memory_unit);
+
+/* Returns 1 if the audio of the local file file_name is the same as that of
+   file fileno on the device (only the tags were changed), 0 if it differs or
+   the manifest does not know, or < 0 on error. */
+int same_audio_rio (rios_t *rio, char *file_name, u_int8_t memory_unit, u_int32_t fileno);
+
+/* Choose a memory unit for each file of a batch so that as much of it as
+   possible fits in the free space. sizes are upload sizes in bytes (see
+   probe_file_rio). units[i] is set to -1 for files that will not fit.
+   Returns the number of files placed. */
+int plan_uploads_rio (rios_t *rio, u_int32_t *sizes, int num_files, int *units);
+
+/* As plan_uploads_rio, for a batch that must all go to memory_unit. */
+int plan_unit_uploads_rio (rios_t *rio, u_int8_t memory_unit, u_int32_t *sizes, int num_files,
+			   int *units);
+
 /* library info */
 char          *return_conn_method_rio(void);
 
+/* Copy the statistics for this instance into stats. */
+int get_stats_rio (rios_t *rio, rio_stats_t *stats);
+
 /*
   retrieve information on the rio's memory units
 
@@ -44,6 +44,8 @@
 
 #include <stdlib.h>
 #include <stdio.h>
+#include <sys/time.h>
+#include <sys/stat.h>
 
 /***
 
@@ -547,8 +549,99 @@ typedef struct _info_page {
     rio_file_t *data;
 
     int skip;
+
+    /* fingerprint of the audio in an MP3, 0 if unknown (see probe_audio_rio) */
+    u_int64_t audio;
 } info_page_t;
 
+/* a local file opened once for probing and uploading (see probe_open_rio) */
+typedef struct _rio_probe {
+  char *file_name;
+
+  int fd;
+  struct stat statinfo;
+
+  /* the whole file, mapped or read into memory */
+  unsigned char *data;
+  size_t size;
+  int mapped;
+
+  size_t tagv2_size;  /* id3v2 tag at the start of the file */
+  int has_v1;         /* id3v1 tag in the last 128 bytes */
+  size_t lyrics_size; /* Lyrics v2.00 in front of the id3v1 tag */
+  size_t data_end;    /* end of the data before any trailing tags */
+} rio_probe_t;
+
+/* an upload ready to be sent to several players (see prepare_upload_rio) */
+struct _rio_upload {
+  /* type of player the header and checksums were made for */
+  int type;
+
+  rio_file_t header;
+
+  /* the file's data, padded with zeros to a whole number of blocks */
+  unsigned char *data;
+  size_t length;
+
+  u_int32_t block_size;
+  u_int32_t num_blocks;
+  u_int32_t *cksums;
+
+  u_int64_t digest;
+  u_int64_t audio;
+};
+
+/* an operation advanced by rio_step: an upload (upload_begin_rio), a
+   download (download_begin_rio) or a refresh of the file lists
+   (refresh_begin_rio). */
+struct _rio_op {
+  rios_t *rio;
+  int state;
+  int result;
+  int locked;
+
+  /* make the next exchange with the player */
+  int (*step) (struct _rio_op *op);
+  /* abort an unfinished operation and free what it holds (may be NULL) */
+  void (*release) (struct _rio_op *op);
+
+  u_int8_t memory_unit;
+  int overwrite;
+  info_page_t info;
+
+  /* data source: a prepared upload or a descriptor and a block buffer */
+  rio_upload_t *upload;
+  int fd;
+  unsigned char *buffer;
+
+  u_int32_t block_size;
+  u_int32_t block;
+  size_t copied;
+  u_int64_t digest;
+
+  /* frames of an MP3 whose length is not known up front */
+  struct _mp3_stream *stream;
+
+  struct timeval start;
+
+  /* downloads: the file is handed to sink a block at a time */
+  struct _rio_sink *sink;
+  u_int32_t fileno;
+  u_int32_t size;
+  u_int32_t blocks;
+  int sink_error;
+  int complete;      /* the device ended the transfer itself */
+  int session;       /* the caller wakes the device and closes the session */
+  int close_session; /* the closing commands are still owed to the device */
+  int fatal;         /* the transfer was aborted */
+
+  /* refreshes: the next file header to read from memory_unit */
+  int file_no;
+
+  /* freed with the operation */
+  void *priv;
+};
+
 /*
  * RIOT Preferences Structure
  */
@@ -586,6 +679,30 @@ typedef struct _riot_rio_prefs {
   u_int8_t	unk13[1952];
 } riot_prefs_t;
 
+/*
+ * Host-side manifest of files uploaded to a device. Entries are kept
+ * sorted by memory unit and rio_num. The digest covers exactly the bytes
+ * that were sent to the device.
+ */
+struct manifest_entry {
+  u_int8_t  memory_unit;
+  u_int32_t rio_num;
+  u_int32_t size;
+  u_int64_t digest;
+
+  /* fingerprint of the audio alone, 0 if unknown */
+  u_int64_t audio;
+};
+
+typedef struct _manifest {
+  char *file_name;
+  int dirty;
+
+  int num_entries;
+  int max_entries;
+  struct manifest_entry *entries;
+} manifest_t;
+
 /***
 
   Internal Functions
@@ -601,44 +718,126 @@ void unlock_rio   (rios_t *rio);
 
 /* rio.c : used to build a rios_t */
 int get_file_info_rio (rios_t *rio, rio_file_t *file, u_int8_t memory_unit, u_int16_t file_no);
+int fetch_file_info_rio (rios_t *rio, rio_file_t *file, u_int8_t memory_unit, u_int16_t file_no);
 int get_memory_info_rio (rios_t *rio, rio_mem_t *memory, u_int8_t memory_unit);
 
 void free_info_rio (rios_t *rio);
 int return_generation_rio (rios_t *rio);
 int return_type_rio(rios_t *rio);
-void update_free_intrn_rio (rios_t *rio, u_int8_t memory_unit);
+void update_free_intrn_rio (rios_t *rio, u_int8_t memory_unit, u_int32_t size, int added);
+int reconcile_free_rio (rios_t *rio, u_int8_t memory_unit);
 float return_version_rio (rios_t *rio);
+int read_prefs_rio (rios_t *rio, unsigned char *prefs);
+int write_prefs_rio (rios_t *rio, unsigned char *prefs);
 
 /* rioio.c */
 int read_block_rio (rios_t *rio, unsigned char *ptr, u_int32_t size, u_int32_t block_size);
 int write_cksum_rio (rios_t *rio, unsigned char *ptr, u_int32_t size, char *cksum_hdr);
 int write_block_rio (rios_t *rio, unsigned char *ptr, u_int32_t size, char *cksum_hdr);
+int write_block_cksum_rio (rios_t *rio, unsigned char *ptr, u_int32_t size, char *cksum_hdr,
+			   u_int32_t cksum);
+u_int32_t block_cksum_rio (rios_t *rio, unsigned char *ptr, u_int32_t size, char *cksum_hdr);
 int abort_transfer_rio (rios_t *rio);
 int send_command_rio (rios_t *rio, int request, int value, int index);
 
 /* id3.c */
-int get_id3_info (char *file_name, rio_file_t *mp3_file, const char *out_encoding);
+int get_id3_info (rio_probe_t *probe, rio_file_t *mp3_file, const char *out_encoding);
+int id3v2_size (unsigned char data[14]);
+
+/* probe.c */
+int probe_open_rio (char *file_name, rio_probe_t *probe);
+void probe_memory_rio (const void *buf, size_t len, rio_probe_t *probe);
+u_int64_t probe_audio_rio (rio_probe_t *probe);
+void probe_close_rio (rio_probe_t *probe);
 
 /* mp3.c, downloadable.c, playlist.c */
-int mp3_info (info_page_t *newInfo, char *file_name, rios_t *rio);
+/* state of an MP3 seen a block at a time (see mp3_stream_init_rio) */
+typedef struct _mp3_stream {
+  int state;
+
+  /* a header being read or the first frame */
+  unsigned char buffer[2048];
+  size_t have, want;
+
+  /* bytes until the next header */
+  u_int64_t skip;
+
+  u_int32_t first_header;
+  int samplerate;
+  int samples;
+  int delay, padding;
+
+  long long frames;
+  long long frame_bytes;
+} mp3_stream_t;
+
+void mp3_stream_init_rio (mp3_stream_t *stream);
+void mp3_stream_feed_rio (mp3_stream_t *stream, unsigned char *data, size_t length);
+void mp3_stream_finish_rio (mp3_stream_t *stream, rio_file_t *file);
+
+int mp3_info (info_page_t *newInfo, rio_probe_t *probe, rios_t *rio);
+int probe_buffer_rio (const void *buf, size_t len, rio_file_t *out, const char *encoding);
 int downloadable_info (info_page_t *newInfo, char *file_name);
 int playlist_info (info_page_t *newInfo, char *file_name);
 int new_playlist_info (info_page_t *newInfo, char *file_name, char *name);
 
 /* file_list.c */
-int generate_flist_riomc (rios_t *rio, u_int8_t memory_unit);
+int generate_mem_list_rio (rios_t *rio);
 int generate_flist_riohd (rios_t *rio);
 int flist_add_rio (rios_t *rio, int memory_unit, info_page_t info);
 int flist_remove_rio (rios_t *rio, int memory_unit, int file_no);
 int size_flist_rio (rios_t *rio, int memory_unit);
 int flist_first_free_rio (rios_t *rio, int memory_unit);
+void info_to_flist_rio (rio_file_t *file, flist_rio_t *flist);
+void flist_to_info_rio (rios_t *rio, flist_rio_t *flist, rio_file_t *file);
 
 /* song_management.c */
+int file_info_rio (rios_t *rio, char *file_name, info_page_t *info);
+int probe_info_rio (rios_t *rio, rio_probe_t *probe, info_page_t *info);
 int do_upload (rios_t *rio, u_int8_t memory_unit, int addpipe, info_page_t info, int overwrite);
+int upload_dummy_hdr (rios_t *rio, u_int8_t memory_unit, u_int32_t fileno);
 int update_db_rio (rios_t *rio);
 
 /* cksum.c */
+#define FNV64_INIT 0xcbf29ce484222325ULL
+
 u_int32_t crc32_rio (u_int8_t *, size_t);
+u_int64_t fnv64_rio (u_int64_t hash, u_int8_t *buf, size_t length);
+u_int64_t fingerprint_rio (u_int8_t *buf, size_t length);
+
+/* manifest.c */
+int state_path_rio (rios_t *rio, char *kind, char *path, size_t path_size);
+void free_manifest_rio (rios_t *rio);
+struct manifest_entry *manifest_lookup_rio (rios_t *rio, u_int8_t memory_unit, u_int32_t rio_num);
+int manifest_record_rio (rios_t *rio, u_int8_t memory_unit, u_int32_t rio_num, u_int32_t size,
+			 u_int64_t digest, u_int64_t audio);
+void manifest_forget_rio (rios_t *rio, u_int8_t memory_unit, u_int32_t rio_num);
+int digest_file_rio (char *file_name, off_t skip, u_int32_t size, u_int64_t *digest);
+
+/* catalog.c */
+int catalog_lookup_rio (rio_probe_t *probe, int utf8, info_page_t *info);
+void catalog_record_rio (rio_probe_t *probe, int utf8, info_page_t *info);
+
+/* download.c */
+/* destination of a download. open gets the file's header (machine byte
+   order). close is called once for every file, even if open was not (or
+   failed); error is the result of the transfer. */
+typedef struct _rio_sink {
+  int (*open)  (struct _rio_sink *sink, rio_file_t *header, u_int32_t size);
+  int (*write) (struct _rio_sink *sink, unsigned char *data, size_t length);
+  int (*close) (struct _rio_sink *sink, int error);
+} rio_sink_t;
+
+int download_session_rio (rios_t *rio, u_int8_t memory_unit, u_int32_t *filenos, rio_sink_t **sinks,
+			  char **names, int num_files, rio_download_done_t done, void *ptr);
+char *download_name_rio (flist_rio_t *tmp);
+
+/* async.c */
+void stop_async_rio (rios_t *rio);
+
+/* plan.c */
+int pack_units_rio (u_int64_t *capacity, int num_units, u_int32_t *sizes, int num_files,
+		    u_int32_t granule, int *units);
 
 /* hexdump.c */
 void pretty_print_block (unsigned char *, int, FILE *);
@@ -0,0 +1,559 @@
+/**
+ *   (c) 2001-2006 Nathan Hjelm <hjelmn@users.sourceforge.net>
+ *   v1.0 async.c
+ *
+ *   Asynchronous jobs: a worker thread per rio instance.
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU Library Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU Library Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ **/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+
+#include "rioi.h"
+
+#if !defined (ECANCELED)
+#define ECANCELED EINTR
+#endif
+
+/*
+  Jobs queued on an instance are run in order by a single worker thread,
+  started with the first job. Each one is an ordinary blocking call
+  (add_song_rio, download_file_rio, ...) made from the worker.
+
+  Events are passed to the job's callback, from the worker thread. Jobs
+  without a callback queue their events instead and write a byte to a pipe
+  (see event_fd_rio) so an application can wait for them with select or
+  poll next to its other descriptors. When the pipe becomes readable the
+  application should call next_event_rio until it returns -EAGAIN.
+
+  A job that is cancelled while it runs is stopped by the abort flag, which
+  is checked before every block sent or received.
+*/
+enum {
+  ASYNC_UPLOAD = 0,
+  ASYNC_DOWNLOAD,
+  ASYNC_DELETE
+};
+
+struct async_job {
+  int id;
+  int op;
+  int cancelled;
+
+  u_int8_t  memory_unit;
+  u_int32_t fileno;
+  char *file_name;
+  char *artist;
+  char *title;
+  char *album;
+
+  rio_event_cb_t callback;
+  void *ptr;
+
+  /* progress is reported when the percentage changes */
+  int last_percent;
+
+  struct async_job *next;
+};
+
+struct async_worker {
+  rios_t *rio;
+
+  pthread_t thread;
+  pthread_mutex_t lock;
+  pthread_cond_t wake;
+  int stopping;
+
+  struct async_job *head, *tail;
+  struct async_job *current;
+  int next_id;
+
+  /* events of jobs without a callback. a slot is reserved for the
+     completion of each such job when it is queued. */
+  rio_event_t *events;
+  int num_events, max_events;
+  int reserved;
+  int pipe[2];
+};
+
+static char *dup_string (char *string) {
+  return string ? strdup (string) : NULL;
+}
+
+static void free_job (struct async_job *job) {
+  free (job->file_name);
+  free (job->artist);
+  free (job->title);
+  free (job->album);
+  free (job);
+}
+
+/* make room for needed events. called with the lock held. */
+static int grow_events (struct async_worker *worker, int needed) {
+  rio_event_t *tmp;
+  int max_events;
+
+  if (needed <= worker->max_events)
+    return URIO_SUCCESS;
+
+  for (max_events = worker->max_events ? worker->max_events : 16 ; max_events < needed ; max_events *= 2);
+
+  if ((tmp = realloc (worker->events, max_events * sizeof (rio_event_t))) == NULL)
+    return -ENOMEM;
+
+  worker->events     = tmp;
+  worker->max_events = max_events;
+
+  return URIO_SUCCESS;
+}
+
+/* deliver an event. called from the worker without the lock held. */
+static void post_event (struct async_worker *worker, struct async_job *job, rio_event_t *event) {
+  char byte = 0;
+
+  if (job->callback) {
+    job->callback (worker->rio, event, job->ptr);
+    return;
+  }
+
+  pthread_mutex_lock (&worker->lock);
+
+  if (event->type == RIO_EVENT_DONE) {
+    /* the slot was reserved by queue_job */
+    worker->reserved--;
+  } else if (grow_events (worker, worker->num_events + worker->reserved + 1) != URIO_SUCCESS) {
+    /* a lost progress event does no harm. the completion still has its slot. */
+    pthread_mutex_unlock (&worker->lock);
+
+    rio_log (worker->rio, -ENOMEM, "post_event: progress event for job %i lost\n", event->job);
+    return;
+  }
+
+  worker->events[worker->num_events++] = *event;
+
+  pthread_mutex_unlock (&worker->lock);
+
+  write (worker->pipe[1], &byte, 1);
+}
+
+static void async_progress (int x, int X, void *ptr) {
+  struct async_worker *worker = (struct async_worker *)ptr;
+  struct async_job *job = worker->current;
+  rio_event_t event;
+  int percent;
+
+  if (job == NULL || X <= 0)
+    return;
+
+  percent = (int)(((int64_t)x * 100) / X);
+  if (percent == job->last_percent)
+    return;
+
+  job->last_percent = percent;
+
+  memset (&event, 0, sizeof (event));
+  event.job  = job->id;
+  event.type = RIO_EVENT_PROGRESS;
+  event.x    = x;
+  event.X    = X;
+
+  post_event (worker, job, &event);
+}
+
+static int run_job (struct async_worker *worker, struct async_job *job) {
+  rios_t *rio = worker->rio;
+
+  switch (job->op) {
+  case ASYNC_UPLOAD:
+    return add_song_rio (rio, job->memory_unit, job->file_name, job->artist, job->title, job->album);
+  case ASYNC_DOWNLOAD:
+    return download_file_rio (rio, job->memory_unit, job->fileno, job->file_name);
+  case ASYNC_DELETE:
+    return delete_file_rio (rio, job->memory_unit, job->fileno);
+  }
+
+  return -EINVAL;
+}
+
+static void *async_worker_thread (void *arg) {
+  struct async_worker *worker = (struct async_worker *)arg;
+  rios_t *rio = worker->rio;
+  void (*progress)(int x, int X, void *ptr);
+  void *progress_ptr;
+  struct async_job *job;
+  rio_event_t event;
+  int result;
+
+  for ( ; ; ) {
+    pthread_mutex_lock (&worker->lock);
+
+    while (worker->head == NULL && !worker->stopping)
+      pthread_cond_wait (&worker->wake, &worker->lock);
+
+    if ((job = worker->head) == NULL) {
+      pthread_mutex_unlock (&worker->lock);
+      break;
+    }
+
+    worker->head = job->next;
+    if (worker->head == NULL)
+      worker->tail = NULL;
+
+    if (!job->cancelled && !worker->stopping) {
+      worker->current = job;
+      /* a cancel aimed at the previous job must not stop this one */
+      rio->abort = 0;
+    }
+
+    pthread_mutex_unlock (&worker->lock);
+
+    if (worker->current == job) {
+      progress     = rio->progress;
+      progress_ptr = rio->progress_ptr;
+
+      rio->progress     = async_progress;
+      rio->progress_ptr = worker;
+      job->last_percent = -1;
+
+      result = run_job (worker, job);
+
+      rio->progress     = progress;
+      rio->progress_ptr = progress_ptr;
+
+      pthread_mutex_lock (&worker->lock);
+      worker->current = NULL;
+      /* a cancel that came too late must not stop the next call */
+      rio->abort = 0;
+      pthread_mutex_unlock (&worker->lock);
+    } else
+      result = -ECANCELED;
+
+    if (job->cancelled && result == -EINTR)
+      result = -ECANCELED;
+
+    memset (&event, 0, sizeof (event));
+    event.job    = job->id;
+    event.type   = RIO_EVENT_DONE;
+    event.result = result;
+
+    post_event (worker, job, &event);
+
+    free_job (job);
+  }
+
+  return NULL;
+}
+
+/* rio->async is set and cleared under this lock, so two threads queueing
+   the first job on an instance do not both start a worker */
+static pthread_mutex_t async_start_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static struct async_worker *new_worker (rios_t *rio) {
+  struct async_worker *worker;
+
+  if ((worker = calloc (1, sizeof (struct async_worker))) == NULL)
+    return NULL;
+
+  worker->rio     = rio;
+  worker->next_id = 1;
+
+  if (pipe (worker->pipe) < 0) {
+    free (worker);
+    return NULL;
+  }
+
+  fcntl (worker->pipe[0], F_SETFL, O_NONBLOCK);
+  fcntl (worker->pipe[1], F_SETFL, O_NONBLOCK);
+
+  pthread_mutex_init (&worker->lock, NULL);
+  pthread_cond_init (&worker->wake, NULL);
+
+  if (pthread_create (&worker->thread, NULL, async_worker_thread, worker) != 0) {
+    pthread_mutex_destroy (&worker->lock);
+    pthread_cond_destroy (&worker->wake);
+    close (worker->pipe[0]);
+    close (worker->pipe[1]);
+    free (worker);
+
+    return NULL;
+  }
+
+  return worker;
+}
+
+/* start the instance's worker if it is not running */
+static struct async_worker *start_async_rio (rios_t *rio) {
+  struct async_worker *worker;
+
+  pthread_mutex_lock (&async_start_lock);
+
+  if ((worker = (struct async_worker *)rio->async) == NULL &&
+      (worker = new_worker (rio)) != NULL)
+    rio->async = worker;
+
+  pthread_mutex_unlock (&async_start_lock);
+
+  return worker;
+}
+
+/*
+  stop_async_rio:
+
+  Cancel every job that has not finished and wait for the worker to exit.
+  Called by close_rio.
+*/
+void stop_async_rio (rios_t *rio) {
+  struct async_worker *worker;
+  struct async_job *job;
+
+  if (rio == NULL)
+    return;
+
+  /* jobs queued from now on start a new worker */
+  pthread_mutex_lock (&async_start_lock);
+  worker = (struct async_worker *)rio->async;
+  rio->async = NULL;
+  pthread_mutex_unlock (&async_start_lock);
+
+  if (worker == NULL)
+    return;
+
+  pthread_mutex_lock (&worker->lock);
+
+  worker->stopping = 1;
+
+  for (job = worker->head ; job ; job = job->next)
+    job->cancelled = 1;
+
+  if (worker->current) {
+    worker->current->cancelled = 1;
+    rio->abort = 1;
+  }
+
+  pthread_cond_signal (&worker->wake);
+  pthread_mutex_unlock (&worker->lock);
+
+  pthread_join (worker->thread, NULL);
+
+  pthread_mutex_destroy (&worker->lock);
+  pthread_cond_destroy (&worker->wake);
+  close (worker->pipe[0]);
+  close (worker->pipe[1]);
+
+  free (worker->events);
+  free (worker);
+}
+
+static int queue_job (rios_t *rio, struct async_job *job) {
+  struct async_worker *worker;
+  int id;
+
+  if ((worker = start_async_rio (rio)) == NULL) {
+    free_job (job);
+
+    return -ENOMEM;
+  }
+
+  pthread_mutex_lock (&worker->lock);
+
+  /* a job without a callback must be able to report that it is done */
+  if (job->callback == NULL) {
+    if (grow_events (worker, worker->num_events + worker->reserved + 1) != URIO_SUCCESS) {
+      pthread_mutex_unlock (&worker->lock);
+      free_job (job);
+
+      return -ENOMEM;
+    }
+
+    worker->reserved++;
+  }
+
+  id = job->id = worker->next_id++;
+
+  if (worker->tail)
+    worker->tail->next = job;
+  else
+    worker->head = job;
+
+  worker->tail = job;
+
+  pthread_cond_signal (&worker->wake);
+  pthread_mutex_unlock (&worker->lock);
+
+  rio_log (rio, 0, "queue_job: queued job %i\n", id);
+
+  return id;
+}
+
+static struct async_job *new_job (int op, u_int8_t memory_unit, rio_event_cb_t callback, void *ptr) {
+  struct async_job *job;
+
+  if ((job = calloc (1, sizeof (struct async_job))) == NULL)
+    return NULL;
+
+  job->op          = op;
+  job->memory_unit = memory_unit;
+  job->callback    = callback;
+  job->ptr         = ptr;
+
+  return job;
+}
+
+int add_song_rio_async (rios_t *rio, u_int8_t memory_unit, char *file_name, char *artist,
+			char *title, char *album, rio_event_cb_t callback, void *ptr) {
+  struct async_job *job;
+
+  if (rio == NULL || file_name == NULL)
+    return -EINVAL;
+
+  if ((job = new_job (ASYNC_UPLOAD, memory_unit, callback, ptr)) == NULL)
+    return -ENOMEM;
+
+  job->file_name = dup_string (file_name);
+  job->artist    = dup_string (artist);
+  job->title     = dup_string (title);
+  job->album     = dup_string (album);
+
+  return queue_job (rio, job);
+}
+
+int download_file_rio_async (rios_t *rio, u_int8_t memory_unit, u_int32_t fileno, char *file_name,
+			     rio_event_cb_t callback, void *ptr) {
+  struct async_job *job;
+
+  if (rio == NULL)
+    return -EINVAL;
+
+  if ((job = new_job (ASYNC_DOWNLOAD, memory_unit, callback, ptr)) == NULL)
+    return -ENOMEM;
+
+  job->fileno    = fileno;
+  job->file_name = dup_string (file_name);
+
+  return queue_job (rio, job);
+}
+
+int delete_file_rio_async (rios_t *rio, u_int8_t memory_unit, u_int32_t fileno,
+			   rio_event_cb_t callback, void *ptr) {
+  struct async_job *job;
+
+  if (rio == NULL)
+    return -EINVAL;
+
+  if ((job = new_job (ASYNC_DELETE, memory_unit, callback, ptr)) == NULL)
+    return -ENOMEM;
+
+  job->fileno = fileno;
+
+  return queue_job (rio, job);
+}
+
+/*
+  cancel_job_rio:
+
+  A queued job is dropped before it starts. A running one stops before its
+  next block. Either way its completion event reports -ECANCELED (or the
+  job's result if it finished first). Returns -ENOENT if the job is not
+  queued or running.
+*/
+int cancel_job_rio (rios_t *rio, int id) {
+  struct async_worker *worker;
+  struct async_job *job;
+  int ret = -ENOENT;
+
+  if (rio == NULL)
+    return -EINVAL;
+
+  if ((worker = (struct async_worker *)rio->async) == NULL)
+    return -ENOENT;
+
+  pthread_mutex_lock (&worker->lock);
+
+  if (worker->current && worker->current->id == id) {
+    worker->current->cancelled = 1;
+    rio->abort = 1;
+    ret = URIO_SUCCESS;
+  } else {
+    for (job = worker->head ; job ; job = job->next)
+      if (job->id == id) {
+	job->cancelled = 1;
+	ret = URIO_SUCCESS;
+	break;
+      }
+  }
+
+  pthread_mutex_unlock (&worker->lock);
+
+  return ret;
+}
+
+/*
+  event_fd_rio:
+
+  A descriptor that becomes readable when an event is waiting for
+  next_event_rio. Starts the worker if needed.
+*/
+int event_fd_rio (rios_t *rio) {
+  struct async_worker *worker;
+
+  if (rio == NULL)
+    return -EINVAL;
+
+  if ((worker = start_async_rio (rio)) == NULL)
+    return -ENOMEM;
+
+  return worker->pipe[0];
+}
+
+/*
+  next_event_rio:
+
+  Take the oldest waiting event. Returns -EAGAIN if there is none.
+*/
+int next_event_rio (rios_t *rio, rio_event_t *event) {
+  struct async_worker *worker;
+  char byte;
+
+  if (rio == NULL || event == NULL)
+    return -EINVAL;
+
+  if ((worker = (struct async_worker *)rio->async) == NULL)
+    return -EAGAIN;
+
+  pthread_mutex_lock (&worker->lock);
+
+  if (worker->num_events == 0) {
+    pthread_mutex_unlock (&worker->lock);
+
+    return -EAGAIN;
+  }
+
+  *event = worker->events[0];
+
+  memmove (worker->events, &worker->events[1], --worker->num_events * sizeof (rio_event_t));
+
+  pthread_mutex_unlock (&worker->lock);
+
+  read (worker->pipe[0], &byte, 1);
+
+  return URIO_SUCCESS;
+}
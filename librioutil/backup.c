@@ -0,0 +1,608 @@
+/**
+ *   (c) 2001-2006 Nathan Hjelm <hjelmn@users.sourceforge.net>
+ *   v1.0 backup.c
+ *
+ *   Whole device backup archives.
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU Library Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU Library Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ **/
+
+/* archives of hard drive players are larger than 2GB */
+#define _FILE_OFFSET_BITS 64
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+
+#include <sys/stat.h>
+
+#include "rioi.h"
+
+/*
+  Layout of an archive. All values are little endian.
+
+    header   BACKUP_HEADER bytes (see backup_rio)
+    prefs    RIO_MTS bytes, the device's raw preferences block
+    units    BACKUP_UNIT bytes for each memory unit
+    files    for each file its header (as sent by the device) then its data
+    index    BACKUP_ENTRY bytes for each file
+
+  The index is written last and the header points to it, so an archive is
+  produced in one pass and any file in it can be found without reading the
+  others.
+*/
+#define BACKUP_MAGIC   "RIOBACK1"
+#define BACKUP_VERSION 1
+
+#define BACKUP_HEADER  128
+#define BACKUP_UNIT    64
+#define BACKUP_ENTRY   24
+
+/* the archive has a copy of the device's preferences */
+#define BACKUP_HAVE_PREFS 0x1
+
+struct backup_entry {
+  u_int32_t memory_unit;
+  u_int32_t rio_num;
+  u_int32_t size;
+
+  /* offset of the file's header. the data follows it. */
+  u_int64_t offset;
+};
+
+struct backup_archive {
+  rios_t *rio;
+
+  int fd;
+  u_int64_t offset;
+
+  struct backup_entry *entries;
+  int num_entries;
+};
+
+/* download sink that appends a file to the archive */
+struct backup_sink {
+  rio_sink_t sink;
+
+  struct backup_archive *archive;
+  u_int8_t memory_unit;
+  flist_rio_t *flist;
+
+  int opened;
+  u_int64_t start;
+};
+
+static void put32 (unsigned char *p, u_int32_t value) {
+  p[0] = value & 0xff;
+  p[1] = (value >> 8) & 0xff;
+  p[2] = (value >> 16) & 0xff;
+  p[3] = (value >> 24) & 0xff;
+}
+
+static void put64 (unsigned char *p, u_int64_t value) {
+  put32 (p, value & 0xffffffff);
+  put32 (p + 4, value >> 32);
+}
+
+static u_int32_t get32 (unsigned char *p) {
+  return p[0] | (p[1] << 8) | (p[2] << 16) | ((u_int32_t)p[3] << 24);
+}
+
+static u_int64_t get64 (unsigned char *p) {
+  return get32 (p) | ((u_int64_t)get32 (p + 4) << 32);
+}
+
+static int write_at (int fd, unsigned char *data, size_t length, u_int64_t offset) {
+  if (lseek (fd, offset, SEEK_SET) < 0)
+    return -errno;
+
+  return fd_sink_rio (&fd, data, length);
+}
+
+static int read_at (int fd, unsigned char *data, size_t length, u_int64_t offset) {
+  ssize_t ret;
+
+  while (length > 0) {
+    ret = pread (fd, data, length, offset);
+    if (ret < 0) {
+      if (errno == EINTR)
+	continue;
+
+      return -errno;
+    }
+
+    /* the archive is truncated */
+    if (ret == 0)
+      return -EIO;
+
+    data   += ret;
+    length -= ret;
+    offset += ret;
+  }
+
+  return URIO_SUCCESS;
+}
+
+static int backup_sink_open (rio_sink_t *sink, rio_file_t *header, u_int32_t size) {
+  struct backup_sink *bsink = (struct backup_sink *)sink;
+  struct backup_archive *archive = bsink->archive;
+  rio_file_t file;
+  int ret;
+
+  /* these players do not return complete headers */
+  if (return_type_rio (archive->rio) == RIORIOT || return_type_rio (archive->rio) == RIONITRUS)
+    flist_to_info_rio (archive->rio, bsink->flist, &file);
+  else
+    memcpy (&file, header, sizeof (rio_file_t));
+
+  file.size = size;
+
+  /* store the header as the device sends it */
+  file_to_me (&file);
+
+  bsink->opened = 1;
+  bsink->start  = archive->offset;
+
+  if ((ret = fd_sink_rio (&archive->fd, (unsigned char *)&file, sizeof (rio_file_t))) < 0)
+    return ret;
+
+  archive->offset += sizeof (rio_file_t);
+
+  return URIO_SUCCESS;
+}
+
+static int backup_sink_write (rio_sink_t *sink, unsigned char *data, size_t length) {
+  struct backup_sink *bsink = (struct backup_sink *)sink;
+  struct backup_archive *archive = bsink->archive;
+  int ret;
+
+  if ((ret = fd_sink_rio (&archive->fd, data, length)) < 0)
+    return ret;
+
+  archive->offset += length;
+
+  return URIO_SUCCESS;
+}
+
+static int backup_sink_close (rio_sink_t *sink, int error) {
+  struct backup_sink *bsink = (struct backup_sink *)sink;
+  struct backup_archive *archive = bsink->archive;
+  struct backup_entry *entry;
+
+  if (!bsink->opened)
+    return error;
+
+  if (error != 0) {
+    /* drop whatever part of the file was written */
+    if (ftruncate (archive->fd, bsink->start) < 0 || lseek (archive->fd, bsink->start, SEEK_SET) < 0)
+      return -errno;
+
+    archive->offset = bsink->start;
+
+    return error;
+  }
+
+  entry = &archive->entries[archive->num_entries++];
+
+  entry->memory_unit = bsink->memory_unit;
+  entry->rio_num     = bsink->flist->rio_num;
+  entry->size        = archive->offset - bsink->start - sizeof (rio_file_t);
+  entry->offset      = bsink->start;
+
+  return URIO_SUCCESS;
+}
+
+/* archive every file on a memory unit in one download session */
+static int backup_unit (struct backup_archive *archive, u_int8_t memory_unit) {
+  rios_t *rio = archive->rio;
+  struct backup_sink *bsinks;
+  rio_sink_t **sinks;
+  u_int32_t *filenos;
+  flist_rio_t *tmp;
+  int i, num_files = 0, ret;
+
+  for (tmp = rio->info.memory[memory_unit].files ; tmp ; tmp = tmp->next)
+    num_files++;
+
+  bsinks  = calloc (num_files + 1, sizeof (struct backup_sink));
+  sinks   = calloc (num_files + 1, sizeof (rio_sink_t *));
+  filenos = calloc (num_files + 1, sizeof (u_int32_t));
+  if (bsinks == NULL || sinks == NULL || filenos == NULL) {
+    free (bsinks);
+    free (sinks);
+    free (filenos);
+
+    return -ENOMEM;
+  }
+
+  for (i = 0, tmp = rio->info.memory[memory_unit].files ; tmp ; tmp = tmp->next, i++) {
+    bsinks[i].sink.open   = backup_sink_open;
+    bsinks[i].sink.write  = backup_sink_write;
+    bsinks[i].sink.close  = backup_sink_close;
+    bsinks[i].archive     = archive;
+    bsinks[i].memory_unit = memory_unit;
+    bsinks[i].flist       = tmp;
+
+    sinks[i]   = &bsinks[i].sink;
+    filenos[i] = tmp->num;
+  }
+
+  ret = download_session_rio (rio, memory_unit, filenos, sinks, NULL, num_files, NULL, NULL);
+
+  if (ret >= 0 && ret < num_files)
+    rio_log (rio, 0, "backup_unit: %i of %i files on memory unit %i could not be archived\n",
+	     num_files - ret, num_files, memory_unit);
+
+  free (bsinks);
+  free (sinks);
+  free (filenos);
+
+  return ret;
+}
+
+/*
+  backup_rio:
+
+  Write every file on the device, with its header, to the archive
+  file_name along with the device's preferences and memory layout. Files
+  are read from the device sequentially, one download session for each
+  memory unit, and appended to the archive as they arrive.
+
+  PostCondition:
+      - The number of files archived. Files that could not be downloaded
+        are left out of the archive.
+      - < 0 if an error occured (the archive is removed).
+*/
+int backup_rio (rios_t *rio, char *file_name) {
+  unsigned char header[BACKUP_HEADER], prefs[RIO_MTS], unit[BACKUP_UNIT];
+  struct backup_archive archive;
+  unsigned char *index = NULL;
+  u_int32_t flags = 0;
+  flist_rio_t *tmp;
+  int i, num_units, num_files = 0;
+  int ret;
+
+  if (rio == NULL || file_name == NULL)
+    return -EINVAL;
+
+  /* older players delete music files as they are downloaded (see download_file_rio) */
+  if (return_generation_rio (rio) < 4 && return_version_rio (rio) < 2.0 &&
+      return_type_rio (rio) != RIORIOT) {
+    rio_log (rio, -EPERM, "backup_rio: files can not be downloaded from this player\n");
+
+    return -EPERM;
+  }
+
+  num_units = return_mem_units_rio (rio);
+  if (num_units > MAX_MEM_UNITS)
+    num_units = MAX_MEM_UNITS;
+
+  for (i = 0 ; i < num_units ; i++)
+    for (tmp = rio->info.memory[i].files ; tmp ; tmp = tmp->next)
+      num_files++;
+
+  memset (&archive, 0, sizeof (archive));
+  archive.rio = rio;
+
+  archive.entries = calloc (num_files + 1, sizeof (struct backup_entry));
+  if (archive.entries == NULL)
+    return -ENOMEM;
+
+  archive.fd = open (file_name, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+  if (archive.fd < 0) {
+    ret = -errno;
+    rio_log (rio, ret, "backup_rio: could not create %s: %s\n", file_name, strerror (errno));
+
+    free (archive.entries);
+    return ret;
+  }
+
+  rio_log (rio, 0, "backup_rio: archiving %i files to %s\n", num_files, file_name);
+
+  /* preferences. an archive without them can still be restored. */
+  memset (prefs, 0, RIO_MTS);
+
+  if ((ret = try_lock_rio (rio)) != 0)
+    goto backup_done;
+
+  if ((ret = wake_rio (rio)) == URIO_SUCCESS && (ret = read_prefs_rio (rio, prefs)) == URIO_SUCCESS)
+    flags |= BACKUP_HAVE_PREFS;
+  else
+    rio_log (rio, ret, "backup_rio: could not read preferences\n");
+
+  unlock_rio (rio);
+
+  /* the header is completed once the index has been written */
+  memset (header, 0, BACKUP_HEADER);
+
+  if ((ret = write_at (archive.fd, header, BACKUP_HEADER, 0)) < 0 ||
+      (ret = fd_sink_rio (&archive.fd, prefs, RIO_MTS)) < 0)
+    goto backup_done;
+
+  for (i = 0 ; i < num_units ; i++) {
+    memset (unit, 0, BACKUP_UNIT);
+
+    put32 (unit, rio->info.memory[i].size);
+    put32 (unit + 4, rio->info.memory[i].free);
+    put32 (unit + 8, rio->info.memory[i].num_files);
+    memcpy (unit + 16, rio->info.memory[i].name, 32);
+
+    if ((ret = fd_sink_rio (&archive.fd, unit, BACKUP_UNIT)) < 0)
+      goto backup_done;
+  }
+
+  archive.offset = BACKUP_HEADER + RIO_MTS + num_units * BACKUP_UNIT;
+
+  for (i = 0 ; i < num_units ; i++)
+    if ((ret = backup_unit (&archive, i)) < 0)
+      goto backup_done;
+
+  /* index */
+  index = calloc (archive.num_entries + 1, BACKUP_ENTRY);
+  if (index == NULL) {
+    ret = -ENOMEM;
+    goto backup_done;
+  }
+
+  for (i = 0 ; i < archive.num_entries ; i++) {
+    put32 (index + i * BACKUP_ENTRY, archive.entries[i].memory_unit);
+    put32 (index + i * BACKUP_ENTRY + 4, archive.entries[i].rio_num);
+    put32 (index + i * BACKUP_ENTRY + 8, archive.entries[i].size);
+    put64 (index + i * BACKUP_ENTRY + 16, archive.entries[i].offset);
+  }
+
+  if ((ret = write_at (archive.fd, index, archive.num_entries * BACKUP_ENTRY, archive.offset)) < 0)
+    goto backup_done;
+
+  memcpy (header, BACKUP_MAGIC, 8);
+  put32 (header + 8, BACKUP_VERSION);
+  put32 (header + 12, flags);
+  put32 (header + 16, return_type_rio (rio));
+  put32 (header + 20, num_units);
+  put32 (header + 24, archive.num_entries);
+  put64 (header + 32, archive.offset);
+  memcpy (header + 40, rio->info.serial_number, 16);
+  put32 (header + 56, (u_int32_t)(rio->info.firmware_version * 100.0 + 0.5));
+
+  ret = write_at (archive.fd, header, BACKUP_HEADER, 0);
+
+ backup_done:
+  if (close (archive.fd) < 0 && ret >= 0)
+    ret = -errno;
+
+  if (ret < 0)
+    unlink (file_name);
+  else
+    ret = archive.num_entries;
+
+  rio_log (rio, 0, "backup_rio: complete (%i)\n", ret);
+
+  free (index);
+  free (archive.entries);
+
+  return ret;
+}
+
+/* upload one file from the archive. the caller holds the lock. */
+static int restore_file (rios_t *rio, int fd, struct backup_entry *entry) {
+  info_page_t info;
+  int addpipe;
+  int ret;
+
+  info.data = calloc (1, sizeof (rio_file_t));
+  info.skip = 0;
+  info.audio = 0;
+  if (info.data == NULL)
+    return -ENOMEM;
+
+  if ((ret = read_at (fd, (unsigned char *)info.data, sizeof (rio_file_t), entry->offset)) < 0) {
+    free (info.data);
+    return ret;
+  }
+
+  file_to_me (info.data);
+
+  if (info.data->size != entry->size) {
+    rio_log (rio, -EIO, "restore_file: header and index of file %i disagree\n", entry->rio_num);
+
+    free (info.data);
+    return -EIO;
+  }
+
+  /* the device chooses where the file goes */
+  info.data->file_no = 0;
+  info.data->start   = 0;
+
+  /* position a copy of the descriptor at the file's data; do_upload
+     reads no more than the file's size. */
+  if ((addpipe = dup (fd)) < 0) {
+    ret = -errno;
+    free (info.data);
+
+    return ret;
+  }
+
+  if (lseek (addpipe, entry->offset + sizeof (rio_file_t), SEEK_SET) < 0)
+    ret = -errno;
+  else
+    ret = do_upload (rio, entry->memory_unit, addpipe, info, 0);
+
+  close (addpipe);
+  free (info.data);
+
+  return ret;
+}
+
+/*
+  restore_rio:
+
+  Replay an archive written by backup_rio. The memory units in the archive
+  are erased and every file in it is uploaded again, in one batch, with
+  its original header. The preferences are restored when the archive came
+  from the same kind of player.
+
+  PostCondition:
+      - The number of files restored.
+      - < 0 if an error occured.
+*/
+int restore_rio (rios_t *rio, char *file_name) {
+  unsigned char header[BACKUP_HEADER], prefs[RIO_MTS];
+  struct backup_entry *entries = NULL;
+  unsigned char *index = NULL;
+  u_int32_t flags, num_entries;
+  u_int64_t index_offset, files_start;
+  struct stat statinfo;
+  int fd, i, num_units, restored = 0;
+  int ret;
+
+  if (rio == NULL || file_name == NULL)
+    return -EINVAL;
+
+  if ((fd = open (file_name, O_RDONLY)) < 0) {
+    ret = -errno;
+    rio_log (rio, ret, "restore_rio: could not open %s: %s\n", file_name, strerror (errno));
+
+    return ret;
+  }
+
+  if ((ret = read_at (fd, header, BACKUP_HEADER, 0)) < 0)
+    goto restore_done;
+
+  if (memcmp (header, BACKUP_MAGIC, 8) != 0 || get32 (header + 8) != BACKUP_VERSION) {
+    rio_log (rio, -EINVAL, "restore_rio: %s is not a rioutil backup\n", file_name);
+
+    ret = -EINVAL;
+    goto restore_done;
+  }
+
+  flags        = get32 (header + 12);
+  num_units    = get32 (header + 20);
+  num_entries  = get32 (header + 24);
+  index_offset = get64 (header + 32);
+
+  if (fstat (fd, &statinfo) < 0) {
+    ret = -errno;
+    goto restore_done;
+  }
+
+  files_start = BACKUP_HEADER + RIO_MTS + (u_int64_t)num_units * BACKUP_UNIT;
+
+  /* nothing is erased until the whole index has been checked */
+  if (num_units < 0 || num_units > MAX_MEM_UNITS || index_offset < files_start ||
+      index_offset > (u_int64_t)statinfo.st_size ||
+      num_entries > ((u_int64_t)statinfo.st_size - index_offset) / BACKUP_ENTRY) {
+    rio_log (rio, -EINVAL, "restore_rio: %s is corrupt\n", file_name);
+
+    ret = -EINVAL;
+    goto restore_done;
+  }
+
+  if ((ret = read_at (fd, prefs, RIO_MTS, BACKUP_HEADER)) < 0)
+    goto restore_done;
+
+  index   = calloc ((size_t)num_entries + 1, BACKUP_ENTRY);
+  entries = calloc ((size_t)num_entries + 1, sizeof (struct backup_entry));
+  if (index == NULL || entries == NULL) {
+    ret = -ENOMEM;
+    goto restore_done;
+  }
+
+  if ((ret = read_at (fd, index, (size_t)num_entries * BACKUP_ENTRY, index_offset)) < 0)
+    goto restore_done;
+
+  for (i = 0 ; i < num_entries ; i++) {
+    entries[i].memory_unit = get32 (index + i * BACKUP_ENTRY);
+    entries[i].rio_num     = get32 (index + i * BACKUP_ENTRY + 4);
+    entries[i].size        = get32 (index + i * BACKUP_ENTRY + 8);
+    entries[i].offset      = get64 (index + i * BACKUP_ENTRY + 16);
+
+    /* the file's header and data lie between the units and the index */
+    if (entries[i].memory_unit >= (u_int32_t)num_units || entries[i].offset < files_start ||
+	entries[i].offset > index_offset ||
+	index_offset - entries[i].offset < sizeof (rio_file_t) + (u_int64_t)entries[i].size) {
+      rio_log (rio, -EINVAL, "restore_rio: entry %i of %s is corrupt\n", i, file_name);
+
+      ret = -EINVAL;
+      goto restore_done;
+    }
+  }
+
+  if (num_units > return_mem_units_rio (rio)) {
+    rio_log (rio, 0, "restore_rio: the archive has %i memory units, the device %i. "
+	     "Files on the missing units will not be restored.\n", num_units,
+	     return_mem_units_rio (rio));
+
+    num_units = return_mem_units_rio (rio);
+  }
+
+  rio_log (rio, 0, "restore_rio: restoring %i files from %s\n", num_entries, file_name);
+
+  for (i = 0 ; i < num_units ; i++)
+    if ((ret = format_mem_rio (rio, i)) != URIO_SUCCESS)
+      goto restore_done;
+
+  /* the file lists and free space are stale after a format */
+  if ((ret = update_info_rio (rio)) != URIO_SUCCESS)
+    goto restore_done;
+
+  if ((ret = begin_batch_rio (rio)) != URIO_SUCCESS)
+    goto restore_done;
+
+  if ((ret = try_lock_rio (rio)) != 0) {
+    end_batch_rio (rio);
+    goto restore_done;
+  }
+
+  if ((ret = wake_rio (rio)) == URIO_SUCCESS) {
+    for (i = 0 ; i < num_entries ; i++) {
+      if (entries[i].memory_unit >= num_units)
+	continue;
+
+      if ((ret = restore_file (rio, fd, &entries[i])) != URIO_SUCCESS) {
+	rio_log (rio, ret, "restore_rio: could not restore file %i\n", entries[i].rio_num);
+	break;
+      }
+
+      restored++;
+    }
+  }
+
+  if (ret == URIO_SUCCESS && (flags & BACKUP_HAVE_PREFS)) {
+    if (get32 (header + 16) != return_type_rio (rio))
+      rio_log (rio, 0, "restore_rio: the archive is from another kind of player, "
+	       "not restoring preferences\n");
+    else if ((ret = wake_rio (rio)) == URIO_SUCCESS)
+      ret = write_prefs_rio (rio, prefs);
+  }
+
+  unlock_rio (rio);
+
+  if (end_batch_rio (rio) != URIO_SUCCESS)
+    rio_log (rio, 0, "restore_rio: could not update the database\n");
+
+ restore_done:
+  close (fd);
+
+  free (index);
+  free (entries);
+
+  rio_log (rio, 0, "restore_rio: %i files restored\n", restored);
+
+  return (ret < 0) ? ret : restored;
+}
@@ -0,0 +1,527 @@
+/**
+ *   (c) 2001-2006 Nathan Hjelm <hjelmn@users.sourceforge.net>
+ *   v1.0 catalog.c
+ *
+ *   Host-side catalog of what was learned from local music files.
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU Library Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU Library Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ **/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include "rioi.h"
+
+#if defined(HAVE_MMAP)
+#include <sys/mman.h>
+#endif
+
+#if !defined (PATH_MAX)
+#define PATH_MAX 255
+#endif
+
+#define CATALOG_MAGIC "RIOCAT02"
+
+/*
+  The catalog is a binary file, ~/.rioutil/catalog, in the host's byte
+  order: a header followed by entries sorted by (device, inode, utf8).
+  An entry is only used if the file's size, modification time and change
+  time still match. The file is mapped and searched in place; entries
+  added while it is open are kept in a hash table and merged into a new
+  file when the catalog is closed.
+*/
+struct catalog_header {
+  char magic[8];
+  u_int32_t entry_size;
+  u_int32_t num_entries;
+};
+
+struct catalog_entry {
+  u_int64_t dev;
+  u_int64_t ino;
+  u_int64_t size;
+  int64_t mtime;
+  int64_t ctime;
+
+  /* strings were converted to UTF-8 (not ISO-8859-1) */
+  u_int32_t utf8;
+
+  /* see probe_audio_rio */
+  u_int64_t audio;
+
+  /* what mp3_info put in the header */
+  u_int32_t skip;
+  u_int32_t upload_size;
+  u_int32_t time;
+  u_int32_t sample_rate;
+  u_int32_t bit_rate;
+  u_int32_t bits;
+  u_int32_t type;
+  u_int32_t foo4;
+
+  u_int8_t trackno;
+  u_int8_t genre[22];
+  u_int8_t year[4];
+  u_int8_t pad;
+
+  char title[64];
+  char artist[64];
+  char album[64];
+};
+
+static struct {
+  pthread_mutex_t lock;
+  char *file_name;
+
+  /* the catalog file */
+  void *map;
+  size_t map_size;
+  int mapped;
+  struct catalog_entry *entries;
+  u_int32_t num_entries;
+
+  /* entries added since it was opened */
+  struct catalog_entry *added;
+  int num_added, max_added;
+
+  /* open addressing, indices into added plus one */
+  int *hash;
+  int hash_size;
+} catalog = {PTHREAD_MUTEX_INITIALIZER};
+
+static int catalog_compare (const void *a, const void *b) {
+  const struct catalog_entry *x = (const struct catalog_entry *)a;
+  const struct catalog_entry *y = (const struct catalog_entry *)b;
+
+  if (x->dev != y->dev)
+    return (x->dev < y->dev) ? -1 : 1;
+
+  if (x->ino != y->ino)
+    return (x->ino < y->ino) ? -1 : 1;
+
+  if (x->utf8 != y->utf8)
+    return (x->utf8 < y->utf8) ? -1 : 1;
+
+  return 0;
+}
+
+static unsigned int catalog_hash (struct catalog_entry *key) {
+  u_int64_t hash = FNV64_INIT;
+
+  hash = fnv64_rio (hash, (u_int8_t *)&key->dev, sizeof (key->dev));
+  hash = fnv64_rio (hash, (u_int8_t *)&key->ino, sizeof (key->ino));
+  hash = fnv64_rio (hash, (u_int8_t *)&key->utf8, sizeof (key->utf8));
+
+  return (unsigned int)(hash ^ (hash >> 32));
+}
+
+/* returns the slot holding key or the empty slot where it belongs */
+static int catalog_slot (struct catalog_entry *key) {
+  int slot = catalog_hash (key) & (catalog.hash_size - 1);
+
+  while (catalog.hash[slot] && catalog_compare (key, &catalog.added[catalog.hash[slot] - 1]) != 0)
+    slot = (slot + 1) & (catalog.hash_size - 1);
+
+  return slot;
+}
+
+static int catalog_grow_hash (void) {
+  int *old_hash = catalog.hash, old_size = catalog.hash_size, i;
+
+  catalog.hash_size = old_size ? 2 * old_size : 256;
+  if ((catalog.hash = calloc (catalog.hash_size, sizeof (int))) == NULL) {
+    catalog.hash      = old_hash;
+    catalog.hash_size = old_size;
+
+    return -ENOMEM;
+  }
+
+  for (i = 0 ; i < old_size ; i++)
+    if (old_hash[i])
+      catalog.hash[catalog_slot (&catalog.added[old_hash[i] - 1])] = old_hash[i];
+
+  free (old_hash);
+
+  return URIO_SUCCESS;
+}
+
+static void catalog_key (rio_probe_t *probe, int utf8, struct catalog_entry *key) {
+  memset (key, 0, sizeof (struct catalog_entry));
+
+  key->dev   = probe->statinfo.st_dev;
+  key->ino   = probe->statinfo.st_ino;
+  key->size  = probe->statinfo.st_size;
+  key->mtime = probe->statinfo.st_mtime;
+  key->ctime = probe->statinfo.st_ctime;
+  key->utf8  = utf8 ? 1 : 0;
+}
+
+static struct catalog_entry *catalog_find (struct catalog_entry *key) {
+  struct catalog_entry *entry = NULL;
+  int slot;
+
+  if (catalog.hash_size && catalog.hash[slot = catalog_slot (key)])
+    entry = &catalog.added[catalog.hash[slot] - 1];
+  else if (catalog.num_entries)
+    entry = bsearch (key, catalog.entries, catalog.num_entries, sizeof (struct catalog_entry),
+		     catalog_compare);
+
+  /* the file changed */
+  if (entry && (entry->size != key->size || entry->mtime != key->mtime || entry->ctime != key->ctime))
+    return NULL;
+
+  return entry;
+}
+
+static int catalog_path (char *path, size_t path_size) {
+  char *home = getenv ("HOME");
+  int len;
+
+  if (home == NULL)
+    home = ".";
+
+  len = snprintf (path, path_size, "%s/.rioutil", home);
+  if (len < 0 || len >= path_size)
+    return -ENAMETOOLONG;
+
+  if (mkdir (path, 0700) < 0 && errno != EEXIST)
+    return -errno;
+
+  if (snprintf (&path[len], path_size - len, "/catalog") >= path_size - len)
+    return -ENAMETOOLONG;
+
+  return URIO_SUCCESS;
+}
+
+static void catalog_unmap (void) {
+  if (catalog.map == NULL)
+    return;
+
+#if defined(HAVE_MMAP)
+  if (catalog.mapped)
+    munmap (catalog.map, catalog.map_size);
+  else
+#endif
+    free (catalog.map);
+
+  catalog.map         = NULL;
+  catalog.entries     = NULL;
+  catalog.num_entries = 0;
+}
+
+/* map an existing catalog file. a missing or foreign file is left to be replaced. */
+static int catalog_map (void) {
+  struct catalog_header *header;
+  struct stat statinfo;
+  int fd, ret = URIO_SUCCESS;
+
+  if ((fd = open (catalog.file_name, O_RDONLY)) < 0)
+    return (errno == ENOENT) ? URIO_SUCCESS : -errno;
+
+  if (fstat (fd, &statinfo) < 0 || statinfo.st_size < sizeof (struct catalog_header)) {
+    close (fd);
+    return URIO_SUCCESS;
+  }
+
+  catalog.map_size = statinfo.st_size;
+
+#if defined(HAVE_MMAP)
+  catalog.map = mmap (NULL, catalog.map_size, PROT_READ, MAP_PRIVATE, fd, 0);
+
+  if (catalog.map != MAP_FAILED)
+    catalog.mapped = 1;
+  else
+#endif
+  {
+    if ((catalog.map = malloc (catalog.map_size)) == NULL)
+      ret = -ENOMEM;
+    else if (read (fd, catalog.map, catalog.map_size) != catalog.map_size)
+      ret = -EIO;
+
+    catalog.mapped = 0;
+  }
+
+  close (fd);
+
+  if (ret != URIO_SUCCESS) {
+    free (catalog.map);
+    catalog.map = NULL;
+
+    return ret;
+  }
+
+  header = (struct catalog_header *)catalog.map;
+
+  if (memcmp (header->magic, CATALOG_MAGIC, 8) != 0 || header->entry_size != sizeof (struct catalog_entry) ||
+      header->num_entries > (catalog.map_size - sizeof (struct catalog_header)) / sizeof (struct catalog_entry)) {
+    catalog_unmap ();
+
+    return URIO_SUCCESS;
+  }
+
+  catalog.entries     = (struct catalog_entry *)(header + 1);
+  catalog.num_entries = header->num_entries;
+
+  return URIO_SUCCESS;
+}
+
+/*
+  open_catalog_rio:
+
+  Open the catalog of local files. If file_name is NULL the catalog is
+  ~/.rioutil/catalog. A missing catalog is not an error; it is created when
+  the catalog is closed.
+*/
+int open_catalog_rio (char *file_name) {
+  char path[PATH_MAX];
+  int ret;
+
+  if (file_name == NULL) {
+    if ((ret = catalog_path (path, PATH_MAX)) != URIO_SUCCESS)
+      return ret;
+
+    file_name = path;
+  }
+
+  pthread_mutex_lock (&catalog.lock);
+
+  if (catalog.file_name != NULL) {
+    ret = (strcmp (catalog.file_name, file_name) == 0) ? URIO_SUCCESS : -EBUSY;
+    pthread_mutex_unlock (&catalog.lock);
+
+    return ret;
+  }
+
+  if ((catalog.file_name = strdup (file_name)) == NULL)
+    ret = -ENOMEM;
+  else if ((ret = catalog_map ()) != URIO_SUCCESS) {
+    free (catalog.file_name);
+    catalog.file_name = NULL;
+  }
+
+  pthread_mutex_unlock (&catalog.lock);
+
+  return ret;
+}
+
+/* write the mapped entries and the new ones, sorted, to a new catalog file */
+static int catalog_save (void) {
+  struct catalog_header header;
+  char tmp_name[PATH_MAX];
+  u_int32_t i = 0, j = 0;
+  FILE *fh;
+  int cmp;
+
+  qsort (catalog.added, catalog.num_added, sizeof (struct catalog_entry), catalog_compare);
+
+  snprintf (tmp_name, PATH_MAX, "%s.new", catalog.file_name);
+
+  if ((fh = fopen (tmp_name, "w")) == NULL)
+    return -errno;
+
+  memset (&header, 0, sizeof (header));
+  memcpy (header.magic, CATALOG_MAGIC, 8);
+  header.entry_size  = sizeof (struct catalog_entry);
+  header.num_entries = 0;
+
+  fwrite (&header, sizeof (header), 1, fh);
+
+  while (i < catalog.num_entries || j < catalog.num_added) {
+    if (i == catalog.num_entries)
+      cmp = 1;
+    else if (j == catalog.num_added)
+      cmp = -1;
+    else
+      cmp = catalog_compare (&catalog.entries[i], &catalog.added[j]);
+
+    /* a new entry replaces the old one */
+    if (cmp < 0)
+      fwrite (&catalog.entries[i++], sizeof (struct catalog_entry), 1, fh);
+    else {
+      fwrite (&catalog.added[j++], sizeof (struct catalog_entry), 1, fh);
+
+      if (cmp == 0)
+	i++;
+    }
+
+    header.num_entries++;
+  }
+
+  /* the count goes in last so a short file is never taken for a good one */
+  rewind (fh);
+  fwrite (&header, sizeof (header), 1, fh);
+
+  if (fclose (fh) != 0 || rename (tmp_name, catalog.file_name) < 0) {
+    unlink (tmp_name);
+
+    return -errno;
+  }
+
+  return URIO_SUCCESS;
+}
+
+/*
+  close_catalog_rio:
+
+  Save the entries added since the catalog was opened and close it.
+*/
+int close_catalog_rio (void) {
+  int ret = URIO_SUCCESS;
+
+  pthread_mutex_lock (&catalog.lock);
+
+  if (catalog.file_name == NULL) {
+    pthread_mutex_unlock (&catalog.lock);
+
+    return URIO_SUCCESS;
+  }
+
+  if (catalog.num_added)
+    ret = catalog_save ();
+
+  catalog_unmap ();
+
+  free (catalog.added);
+  free (catalog.hash);
+  free (catalog.file_name);
+
+  catalog.added     = NULL;
+  catalog.hash      = NULL;
+  catalog.file_name = NULL;
+  catalog.num_added = catalog.max_added = catalog.hash_size = 0;
+
+  pthread_mutex_unlock (&catalog.lock);
+
+  return ret;
+}
+
+/*
+  catalog_lookup_rio:
+
+  Fill in the header of a probed MP3 from the catalog. Returns -ENOENT if
+  the catalog is not open or the file is new or has changed.
+*/
+int catalog_lookup_rio (rio_probe_t *probe, int utf8, info_page_t *info) {
+  struct catalog_entry key, *entry;
+  rio_file_t *file = info->data;
+  int ret = -ENOENT;
+
+  pthread_mutex_lock (&catalog.lock);
+
+  if (catalog.file_name != NULL) {
+    catalog_key (probe, utf8, &key);
+
+    if ((entry = catalog_find (&key)) != NULL) {
+      info->skip  = entry->skip;
+      info->audio = entry->audio;
+
+      file->size        = entry->upload_size;
+      file->time        = entry->time;
+      file->sample_rate = entry->sample_rate;
+      file->bit_rate    = entry->bit_rate;
+      file->bits        = entry->bits;
+      file->type        = entry->type;
+      file->foo4        = entry->foo4;
+      file->trackno2    = entry->trackno;
+
+      memcpy (file->genre2, entry->genre, sizeof (file->genre2));
+      memcpy (file->year2, entry->year, sizeof (file->year2));
+      memcpy (file->title, entry->title, sizeof (file->title));
+      memcpy (file->artist, entry->artist, sizeof (file->artist));
+      memcpy (file->album, entry->album, sizeof (file->album));
+
+      ret = URIO_SUCCESS;
+    }
+  }
+
+  pthread_mutex_unlock (&catalog.lock);
+
+  return ret;
+}
+
+/*
+  catalog_record_rio:
+
+  Remember the header mp3_info built for a probed file.
+*/
+void catalog_record_rio (rio_probe_t *probe, int utf8, info_page_t *info) {
+  struct catalog_entry *entry, *tmp;
+  rio_file_t *file = info->data;
+  int slot;
+
+  pthread_mutex_lock (&catalog.lock);
+
+  if (catalog.file_name == NULL) {
+    pthread_mutex_unlock (&catalog.lock);
+
+    return;
+  }
+
+  /* keep the hash table at most half full */
+  if (2 * (catalog.num_added + 1) > catalog.hash_size && catalog_grow_hash () != URIO_SUCCESS) {
+    pthread_mutex_unlock (&catalog.lock);
+
+    return;
+  }
+
+  if (catalog.num_added == catalog.max_added) {
+    int new_max = catalog.max_added ? 2 * catalog.max_added : 256;
+
+    if ((tmp = realloc (catalog.added, new_max * sizeof (struct catalog_entry))) == NULL) {
+      pthread_mutex_unlock (&catalog.lock);
+
+      return;
+    }
+
+    catalog.added     = tmp;
+    catalog.max_added = new_max;
+  }
+
+  entry = &catalog.added[catalog.num_added];
+  catalog_key (probe, utf8, entry);
+
+  /* the file changed since it was recorded */
+  if (catalog.hash[slot = catalog_slot (entry)])
+    entry = &catalog.added[catalog.hash[slot] - 1];
+  else
+    catalog.hash[slot] = ++catalog.num_added;
+
+  catalog_key (probe, utf8, entry);
+
+  entry->skip        = info->skip;
+  entry->audio       = info->audio;
+  entry->upload_size = file->size;
+  entry->time        = file->time;
+  entry->sample_rate = file->sample_rate;
+  entry->bit_rate    = file->bit_rate;
+  entry->bits        = file->bits;
+  entry->type        = file->type;
+  entry->foo4        = file->foo4;
+  entry->trackno     = file->trackno2;
+
+  memcpy (entry->genre, file->genre2, sizeof (entry->genre));
+  memcpy (entry->year, file->year2, sizeof (entry->year));
+  memcpy (entry->title, file->title, sizeof (entry->title));
+  memcpy (entry->artist, file->artist, sizeof (entry->artist));
+  memcpy (entry->album, file->album, sizeof (entry->album));
+
+  pthread_mutex_unlock (&catalog.lock);
+}
@@ -19,6 +19,7 @@
 
 #include <stdlib.h>
 #include <sys/types.h>
+#include <pthread.h>
 
 #include "rioi.h"
 
@@ -31,13 +32,12 @@ static void crc32_init_table(void);
 
 static u_int32_t crc32_table[256];
 
-static int crc32_initialized = 0;
+/* the table is built exactly once, even if several threads checksum at once */
+static pthread_once_t crc32_once = PTHREAD_ONCE_INIT;
 
 static void crc32_init_table(void) {
   u_int32_t i, j, r;
 
-  crc32_initialized = 1;
-
   for (i = 0 ; i < 256 ; i++) {
     r = i;
 
@@ -56,8 +56,7 @@ u_int32_t crc32_rio (u_int8_t *buf, size_t length) {
   unsigned long crc = 0;
   int i;
 
-  if (crc32_initialized == 0)
-    crc32_init_table();
+  pthread_once (&crc32_once, crc32_init_table);
 
   for (i = 0 ; i < length ; i++)
     crc = (crc >> 8) ^ crc32_table[(crc ^ buf[i]) & 0xff];
@@ -65,3 +64,101 @@ u_int32_t crc32_rio (u_int8_t *buf, size_t length) {
   crc = big32_2_arch32 (crc);
   return crc;
 }
+
+/*
+ * 64-bit FNV-1a. This is used to fingerprint the contents of local files so
+ * they can be recognized later. It is never sent to the device.
+ */
+#define FNV64_PRIME 0x00000100000001b3ULL
+
+u_int64_t fnv64_rio (u_int64_t hash, u_int8_t *buf, size_t length) {
+  size_t i;
+
+  for (i = 0 ; i < length ; i++) {
+    hash ^= buf[i];
+    hash *= FNV64_PRIME;
+  }
+
+  return hash;
+}
+
+/*
+ * XXH64, for the fingerprint of the audio in a local file. It reads eight
+ * bytes at a time in four independent lanes, so it is several times faster
+ * than fnv64_rio over a whole track.
+ */
+#define XXH_PRIME1 0x9e3779b185ebca87ULL
+#define XXH_PRIME2 0xc2b2ae3d27d4eb4fULL
+#define XXH_PRIME3 0x165667b19e3779f9ULL
+#define XXH_PRIME4 0x85ebca77c2b2ae63ULL
+#define XXH_PRIME5 0x27d4eb2f165667c5ULL
+
+#define XXH_ROTL(x, r) (((x) << (r)) | ((x) >> (64 - (r))))
+
+static u_int64_t xxh_read64 (u_int8_t *buf) {
+  return (u_int64_t)buf[0] | ((u_int64_t)buf[1] << 8) | ((u_int64_t)buf[2] << 16) |
+    ((u_int64_t)buf[3] << 24) | ((u_int64_t)buf[4] << 32) | ((u_int64_t)buf[5] << 40) |
+    ((u_int64_t)buf[6] << 48) | ((u_int64_t)buf[7] << 56);
+}
+
+static u_int64_t xxh_round (u_int64_t acc, u_int64_t input) {
+  acc += input * XXH_PRIME2;
+  acc  = XXH_ROTL(acc, 31);
+
+  return acc * XXH_PRIME1;
+}
+
+static u_int64_t xxh_merge (u_int64_t hash, u_int64_t acc) {
+  hash ^= xxh_round (0, acc);
+
+  return hash * XXH_PRIME1 + XXH_PRIME4;
+}
+
+u_int64_t fingerprint_rio (u_int8_t *buf, size_t length) {
+  u_int8_t *end = buf + length;
+  u_int64_t hash;
+
+  if (length >= 32) {
+    u_int64_t v1 = XXH_PRIME1 + XXH_PRIME2, v2 = XXH_PRIME2, v3 = 0, v4 = -XXH_PRIME1;
+
+    for ( ; buf + 32 <= end ; buf += 32) {
+      v1 = xxh_round (v1, xxh_read64 (buf));
+      v2 = xxh_round (v2, xxh_read64 (buf + 8));
+      v3 = xxh_round (v3, xxh_read64 (buf + 16));
+      v4 = xxh_round (v4, xxh_read64 (buf + 24));
+    }
+
+    hash = XXH_ROTL(v1, 1) + XXH_ROTL(v2, 7) + XXH_ROTL(v3, 12) + XXH_ROTL(v4, 18);
+    hash = xxh_merge (hash, v1);
+    hash = xxh_merge (hash, v2);
+    hash = xxh_merge (hash, v3);
+    hash = xxh_merge (hash, v4);
+  } else
+    hash = XXH_PRIME5;
+
+  hash += (u_int64_t)length;
+
+  for ( ; buf + 8 <= end ; buf += 8) {
+    hash ^= xxh_round (0, xxh_read64 (buf));
+    hash  = XXH_ROTL(hash, 27) * XXH_PRIME1 + XXH_PRIME4;
+  }
+
+  if (buf + 4 <= end) {
+    hash ^= (u_int64_t)(buf[0] | (buf[1] << 8) | (buf[2] << 16) | ((u_int32_t)buf[3] << 24)) * XXH_PRIME1;
+    hash  = XXH_ROTL(hash, 23) * XXH_PRIME2 + XXH_PRIME3;
+    buf  += 4;
+  }
+
+  for ( ; buf < end ; buf++) {
+    hash ^= *buf * XXH_PRIME5;
+    hash  = XXH_ROTL(hash, 11) * XXH_PRIME1;
+  }
+
+  hash ^= hash >> 33;
+  hash *= XXH_PRIME2;
+  hash ^= hash >> 29;
+  hash *= XXH_PRIME3;
+  hash ^= hash >> 32;
+
+  return hash;
+}
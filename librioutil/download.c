@@ -0,0 +1,1066 @@
+/**
+ *   (c) 2001-2006 Nathan Hjelm <hjelmn@users.sourceforge.net>
+ *   v1.0 download.c
+ *
+ *   Download sessions: files are read from the device in one thread and
+ *   written out by another.
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU Library Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU Library Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ **/
+
+/* fallocate and FALLOC_FL_KEEP_SIZE */
+#if !defined (_GNU_SOURCE)
+#define _GNU_SOURCE
+#endif
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+
+#include <sys/stat.h>
+
+#include "rioi.h"
+
+#if !defined (PATH_MAX)
+#define PATH_MAX 255
+#endif
+
+#if !defined (ECANCELED)
+#define ECANCELED EINTR
+#endif
+
+/* number of blocks that can be waiting for the writer */
+#define RING_SLOTS 64
+
+/* file sinks collect this much data before writing it out */
+#define FILE_SINK_BUFFER (1024 * 1024)
+
+enum slot_kind {SLOT_BEGIN, SLOT_DATA, SLOT_END, SLOT_QUIT};
+
+struct download_slot {
+  enum slot_kind kind;
+  int file;
+
+  size_t length;
+  int error;
+
+  unsigned char data[RIO_FTS];
+};
+
+struct download_file {
+  u_int32_t fileno;
+  u_int32_t size;
+  char *name;
+
+  rio_sink_t *sink;
+  int error;
+};
+
+struct download_job {
+  rios_t *rio;
+  u_int8_t memory_unit;
+
+  struct download_file *files;
+  int num_files;
+  int completed;
+
+  rio_download_done_t done;
+  void *ptr;
+
+  /* ring of blocks between the usb thread and the writer thread */
+  pthread_mutex_t lock;
+  pthread_cond_t not_empty, not_full;
+  struct download_slot *slots;
+  int head, count;
+};
+
+/* ring routines. the usb thread fills slots, the writer thread drains them */
+static struct download_slot *ring_get_free (struct download_job *job) {
+  struct download_slot *slot;
+
+  pthread_mutex_lock (&job->lock);
+
+  while (job->count == RING_SLOTS)
+    pthread_cond_wait (&job->not_full, &job->lock);
+
+  slot = &job->slots[(job->head + job->count) % RING_SLOTS];
+
+  pthread_mutex_unlock (&job->lock);
+
+  return slot;
+}
+
+static void ring_push (struct download_job *job) {
+  pthread_mutex_lock (&job->lock);
+
+  job->count++;
+  pthread_cond_signal (&job->not_empty);
+
+  pthread_mutex_unlock (&job->lock);
+}
+
+static void ring_push_marker (struct download_job *job, enum slot_kind kind, int file, int error) {
+  struct download_slot *slot = ring_get_free (job);
+
+  slot->kind   = kind;
+  slot->file   = file;
+  slot->length = 0;
+  slot->error  = error;
+
+  ring_push (job);
+}
+
+static struct download_slot *ring_peek (struct download_job *job) {
+  struct download_slot *slot;
+
+  pthread_mutex_lock (&job->lock);
+
+  while (job->count == 0)
+    pthread_cond_wait (&job->not_empty, &job->lock);
+
+  slot = &job->slots[job->head];
+
+  pthread_mutex_unlock (&job->lock);
+
+  return slot;
+}
+
+static void ring_pop (struct download_job *job) {
+  pthread_mutex_lock (&job->lock);
+
+  job->head = (job->head + 1) % RING_SLOTS;
+  job->count--;
+  pthread_cond_signal (&job->not_full);
+
+  pthread_mutex_unlock (&job->lock);
+}
+
+/*
+  writer_thread:
+
+  Drain the ring into each file's sink. Sink errors are remembered and the
+  rest of that file's data is dropped; the usb thread keeps going.
+*/
+static void *writer_thread (void *arg) {
+  struct download_job *job = (struct download_job *)arg;
+  struct download_slot *slot;
+  struct download_file *file;
+  rio_file_t header;
+  int ret;
+
+  while ((slot = ring_peek (job))->kind != SLOT_QUIT) {
+    file = &job->files[slot->file];
+
+    switch (slot->kind) {
+    case SLOT_BEGIN:
+      /* the begin marker carries the file's header */
+      memcpy (&header, slot->data, sizeof (rio_file_t));
+
+      if ((ret = file->sink->open (file->sink, &header, file->size)) < 0)
+	file->error = ret;
+
+      break;
+    case SLOT_DATA:
+      if (file->error == 0 && (ret = file->sink->write (file->sink, slot->data, slot->length)) < 0)
+	file->error = ret;
+
+      break;
+    case SLOT_END:
+      if (file->error == 0)
+	file->error = slot->error;
+
+      ret = file->sink->close (file->sink, file->error);
+      if (file->error == 0)
+	file->error = ret;
+
+      if (file->error == 0)
+	job->completed++;
+
+      if (job->done)
+	job->done (job->rio, job->memory_unit, file->fileno, file->name, file->error, job->ptr);
+
+      break;
+    default:
+      break;
+    }
+
+    ring_pop (job);
+  }
+
+  ring_pop (job);
+
+  return NULL;
+}
+
+/*
+  Downloads are run as a state machine so they can be advanced one exchange
+  with the device at a time (see rio_step). A session steps each of its
+  files to the end.
+*/
+enum {
+  DOWNLOAD_START = 0, /* send the file's header */
+  DOWNLOAD_DATA,      /* read the next block */
+  DOWNLOAD_FINISH,    /* acknowledge the last block */
+  DOWNLOAD_DONE
+};
+
+static int download_step (rio_op_t *op);
+
+/* buffer must hold RIO_FTS bytes. sink is always closed once the download
+   is over. it is only opened if the device has the file. */
+static void download_op_init (rio_op_t *op, rios_t *rio, u_int8_t memory_unit, u_int32_t fileno,
+			      rio_sink_t *sink, unsigned char *buffer) {
+  memset (op, 0, sizeof (rio_op_t));
+
+  op->rio         = rio;
+  op->state       = DOWNLOAD_START;
+  op->memory_unit = memory_unit;
+  op->fileno      = fileno;
+  op->sink        = sink;
+  op->buffer      = buffer;
+  op->step        = download_step;
+
+  /* older rios (rio600, rio800, etc) send file data in smaller (4096 byte) chunks. */
+  op->block_size = (return_generation_rio (rio) >= 4) ? RIO_FTS : 4096;
+
+  /* the last block is acknowledged even if there were none */
+  memset (buffer, 0, RIO_FTS);
+}
+
+/* the download is over: hand the result to the sink */
+static int download_end (rio_op_t *op, int error) {
+  int ret;
+
+  if (op->sink_error != 0)
+    error = op->sink_error;
+
+  ret = op->sink->close (op->sink, error);
+  if (error == 0)
+    error = ret;
+
+  op->state  = DOWNLOAD_DONE;
+  op->result = error;
+
+  return error;
+}
+
+static int download_start_step (rio_op_t *op) {
+  rios_t *rio = op->rio;
+  u_int8_t memory_unit = op->memory_unit;
+  u_int32_t fileno = op->fileno;
+  int player_generation = return_generation_rio (rio);
+  flist_rio_t *tmp;
+  rio_file_t file;
+  int ret;
+
+  /* a session wakes the device once for all of its files */
+  if (!op->session) {
+    if ((ret = wake_rio (rio)) != URIO_SUCCESS)
+      return ret;
+
+    op->close_session = 1;
+  }
+
+  /* fetch the file's info */
+  for (tmp = rio->info.memory[memory_unit].files ; tmp ; tmp = tmp->next)
+    if (tmp->num == fileno)
+      break;
+
+  if (tmp == NULL) {
+    rio_log (rio, -ENOENT, "download_one_rio: no such file %i.\n", fileno);
+
+    return -ENOENT;
+  }
+
+  if ((ret = fetch_file_info_rio(rio, &file, memory_unit, fileno)) != URIO_SUCCESS) {
+    rio_log (rio, ret, "download_one_rio: error getting file info.\n");
+
+    return ret;
+  }
+
+  if (player_generation < 5 && return_version_rio(rio) < 2.0 && return_type_rio (rio) != RIORIOT) {
+    /*
+      This code is only relevant to older players
+
+      A dummy header is not needed with newer players/firmwares and the RIOT as
+      they do not have the same restrictions on downloading from the device.
+    */
+    if (file.start == 0)
+      return -EPERM;
+
+    if (player_generation == 3 && !(file.bits & 0x00000080)) {
+      /* Older players will only allow non-music files to be downloaded. A fake
+	 file header is used to download these files. Such a download will cause
+	 the deletion of the file off of the device. */
+      fileno = upload_dummy_hdr (rio, memory_unit, fileno);
+    }
+
+    if ((ret = get_file_info_rio(rio, &file, memory_unit, fileno)) != URIO_SUCCESS) {
+      rio_log (rio, ret, "download_one_rio: could not fetch song info.\n");
+
+      return ret;
+    }
+  }
+
+  op->size = tmp->size;
+
+  /* send the send file command */
+  if ((ret = send_command_rio(rio, RIO_READF, memory_unit, 0)) != URIO_SUCCESS ||
+      (ret = read_block_rio(rio, NULL, 64, RIO_FTS)) != URIO_SUCCESS) {
+    op->fatal = 1;
+
+    return ret;
+  }
+
+  /* send the file's info page */
+  file_to_me(&file);
+  write_block_rio(rio, (unsigned char *)&file, sizeof(rio_file_t), NULL);
+  file_to_me(&file);
+
+  if (memcmp(rio->buffer, "SRIONOFL", 8) == 0) {
+    /* file does not exist */
+    rio_log (rio, -ENOENT, "download_one_rio: (device) no such file\n");
+
+    return -ENOENT;
+  }
+
+  /* a sink that can not take the file drops its data, the device is read anyway */
+  if ((ret = op->sink->open (op->sink, &file, op->size)) < 0)
+    op->sink_error = ret;
+
+  op->blocks = op->size/op->block_size + ((op->size % op->block_size) ? 1 : 0);
+  op->state  = op->blocks ? DOWNLOAD_DATA : DOWNLOAD_FINISH;
+
+  return URIO_SUCCESS;
+}
+
+/* retrieve one block of file data from the device */
+static int download_data_step (rio_op_t *op) {
+  rios_t *rio = op->rio;
+  u_int32_t read_size;
+  int ret;
+
+  if (rio->abort) {
+    if (rio->progress)
+      rio->progress(1, 1, rio->progress_ptr);
+
+    op->fatal = 1;
+
+    return -EINTR;
+  }
+
+  memset (op->buffer, 0, op->block_size);
+
+  /* the rio appears to expect a checksum in the CRIODATA packet */
+  write_cksum_rio (rio, op->buffer, op->block_size, "CRIODATA");
+
+  if ((ret = read_block_rio(rio, NULL, 64, 64)) != URIO_SUCCESS) {
+    op->fatal = 1;
+
+    return ret;
+  }
+
+  /* check for completion */
+  if (memcmp(rio->buffer, "SRIODONE", 8) == 0) {
+    op->complete = 1;
+    op->state    = DOWNLOAD_FINISH;
+
+    return URIO_SUCCESS;
+  }
+
+  read_size = (op->size - op->copied >= op->block_size) ? op->block_size : op->size - op->copied;
+
+  if ((ret = read_block_rio (rio, op->buffer, RIO_FTS, op->block_size)) != URIO_SUCCESS) {
+    op->fatal = 1;
+
+    return ret;
+  }
+
+  if (op->sink_error == 0 && (ret = op->sink->write (op->sink, op->buffer, read_size)) < 0)
+    op->sink_error = ret;
+
+  if (rio->progress)
+    rio->progress(op->block, op->blocks, rio->progress_ptr);
+
+  op->copied += read_size;
+
+  if (++op->block == op->blocks)
+    op->state = DOWNLOAD_FINISH;
+
+  return URIO_SUCCESS;
+}
+
+static int download_finish_step (rio_op_t *op) {
+  rios_t *rio = op->rio;
+
+  if (!op->complete) {
+    /* acknowledge the last block. the buffer still holds it. */
+    write_cksum_rio (rio, op->buffer, op->block_size, "CRIODATA");
+
+    if (return_generation_rio (rio) < 4)
+      read_block_rio(rio, NULL, 64, RIO_FTS);
+  }
+
+  if (rio->progress)
+    rio->progress(1, 1, rio->progress_ptr);
+
+  if (op->close_session) {
+    send_command_rio(rio, 0x65, 0, 0);
+    send_command_rio(rio, 0x66, 0, 0);
+  }
+
+  return download_end (op, URIO_SUCCESS);
+}
+
+/* advance a download. returns RIO_STEP_AGAIN until it is over. */
+static int download_step (rio_op_t *op) {
+  rios_t *rio = op->rio;
+  int ret;
+
+  switch (op->state) {
+  case DOWNLOAD_START:
+    ret = download_start_step (op);
+    break;
+  case DOWNLOAD_DATA:
+    ret = download_data_step (op);
+    break;
+  case DOWNLOAD_FINISH:
+    return download_finish_step (op);
+  default:
+    return op->result;
+  }
+
+  if (ret != URIO_SUCCESS) {
+    if (op->fatal) {
+      /* the device can not continue with this session */
+      abort_transfer_rio (rio);
+      rio->abort = 0;
+    } else if (op->close_session) {
+      send_command_rio(rio, 0x65, 0, 0);
+      send_command_rio(rio, 0x66, 0, 0);
+    }
+
+    return download_end (op, ret);
+  }
+
+  return RIO_STEP_AGAIN;
+}
+
+/* sink that passes a session's file to the writer thread */
+struct ring_sink {
+  rio_sink_t sink;
+
+  struct download_job *job;
+  int index;
+};
+
+static int ring_sink_open (rio_sink_t *sink, rio_file_t *header, u_int32_t size) {
+  struct ring_sink *rsink = (struct ring_sink *)sink;
+  struct download_job *job = rsink->job;
+  struct download_slot *slot;
+
+  job->files[rsink->index].size = size;
+
+  /* the begin marker carries the file's header */
+  slot = ring_get_free (job);
+  slot->kind   = SLOT_BEGIN;
+  slot->file   = rsink->index;
+  slot->length = sizeof (rio_file_t);
+  slot->error  = 0;
+  memcpy (slot->data, header, sizeof (rio_file_t));
+  ring_push (job);
+
+  return URIO_SUCCESS;
+}
+
+static int ring_sink_write (rio_sink_t *sink, unsigned char *data, size_t length) {
+  struct ring_sink *rsink = (struct ring_sink *)sink;
+  struct download_slot *slot = ring_get_free (rsink->job);
+
+  slot->kind   = SLOT_DATA;
+  slot->file   = rsink->index;
+  slot->length = length;
+  slot->error  = 0;
+  memcpy (slot->data, data, length);
+  ring_push (rsink->job);
+
+  return URIO_SUCCESS;
+}
+
+static int ring_sink_close (rio_sink_t *sink, int error) {
+  struct ring_sink *rsink = (struct ring_sink *)sink;
+
+  ring_push_marker (rsink->job, SLOT_END, rsink->index, error);
+
+  return error;
+}
+
+/*
+  download_one_rio:
+
+  Transfer one file inside an open session. Returns < 0 if the session can
+  not continue. Errors that only affect this file are passed to the writer
+  with the file's end marker.
+*/
+static int download_one_rio (struct download_job *job, int index, unsigned char *buffer) {
+  struct ring_sink rsink;
+  rio_op_t op;
+  int ret;
+
+  rsink.sink.open  = ring_sink_open;
+  rsink.sink.write = ring_sink_write;
+  rsink.sink.close = ring_sink_close;
+  rsink.job        = job;
+  rsink.index      = index;
+
+  download_op_init (&op, job->rio, job->memory_unit, job->files[index].fileno, &rsink.sink, buffer);
+  op.session = 1;
+
+  while ((ret = download_step (&op)) == RIO_STEP_AGAIN);
+
+  return op.fatal ? ret : URIO_SUCCESS;
+}
+
+/*
+  download_session_rio:
+
+  Download several files in one session: the device is woken once and the
+  closing commands are sent after the last file. Each file is written to
+  its own sink by a separate thread so usb reads never wait on the sink.
+
+  Returns the number of files completed or < 0 if the session could not
+  be started.
+*/
+int download_session_rio (rios_t *rio, u_int8_t memory_unit, u_int32_t *filenos, rio_sink_t **sinks,
+			  char **names, int num_files, rio_download_done_t done, void *ptr) {
+  unsigned char buffer[RIO_FTS];
+  struct download_job job;
+  pthread_t writer;
+  int i, ret;
+
+  if (rio == NULL || filenos == NULL || sinks == NULL || num_files < 0 ||
+      memory_unit >= rio->info.total_memory_units)
+    return -EINVAL;
+
+  if ((ret = try_lock_rio (rio)) != 0)
+    return ret;
+
+  rio_log (rio, 0, "download_session_rio: downloading %i files\n", num_files);
+
+  memset (&job, 0, sizeof (job));
+
+  job.rio         = rio;
+  job.memory_unit = memory_unit;
+  job.num_files   = num_files;
+  job.done        = done;
+  job.ptr         = ptr;
+
+  job.files = calloc (num_files + 1, sizeof (struct download_file));
+  job.slots = malloc (RING_SLOTS * sizeof (struct download_slot));
+  if (job.files == NULL || job.slots == NULL) {
+    free (job.files);
+    free (job.slots);
+
+    UNLOCK(-ENOMEM);
+  }
+
+  for (i = 0 ; i < num_files ; i++) {
+    job.files[i].fileno = filenos[i];
+    job.files[i].sink   = sinks[i];
+    job.files[i].name   = names ? names[i] : NULL;
+  }
+
+  if ((ret = wake_rio (rio)) != URIO_SUCCESS) {
+    free (job.files);
+    free (job.slots);
+
+    UNLOCK(ret);
+  }
+
+  pthread_mutex_init (&job.lock, NULL);
+  pthread_cond_init (&job.not_empty, NULL);
+  pthread_cond_init (&job.not_full, NULL);
+
+  if ((ret = pthread_create (&writer, NULL, writer_thread, &job)) != 0) {
+    free (job.files);
+    free (job.slots);
+
+    UNLOCK(-ret);
+  }
+
+  for (i = 0, ret = URIO_SUCCESS ; i < num_files && ret == URIO_SUCCESS ; i++)
+    ret = download_one_rio (&job, i, buffer);
+
+  if (ret != URIO_SUCCESS) {
+    /* the transfer has been aborted. the rest of the batch did not happen */
+    for ( ; i < num_files ; i++)
+      ring_push_marker (&job, SLOT_END, i, ret);
+  } else {
+    send_command_rio(rio, 0x65, 0, 0);
+    send_command_rio(rio, 0x66, 0, 0);
+  }
+
+  ring_push_marker (&job, SLOT_QUIT, 0, 0);
+  pthread_join (writer, NULL);
+
+  pthread_mutex_destroy (&job.lock);
+  pthread_cond_destroy (&job.not_empty);
+  pthread_cond_destroy (&job.not_full);
+
+  free (job.files);
+  free (job.slots);
+
+  rio_log (rio, 0, "download_session_rio: %i of %i files complete\n", job.completed, num_files);
+
+  UNLOCK(job.completed);
+}
+
+/* sink that writes to a newly created local file */
+struct file_sink {
+  rio_sink_t sink;
+
+  char path[PATH_MAX];
+  int fd;
+
+  /* blocks are written out FILE_SINK_BUFFER bytes at a time */
+  unsigned char *buffer;
+  size_t buffered;
+  u_int64_t written;
+};
+
+static int file_sink_flush (struct file_sink *fsink) {
+  int ret;
+
+  if (fsink->buffered == 0)
+    return URIO_SUCCESS;
+
+  if ((ret = fd_sink_rio (&fsink->fd, fsink->buffer, fsink->buffered)) < 0)
+    return ret;
+
+  fsink->written += fsink->buffered;
+  fsink->buffered = 0;
+
+  return URIO_SUCCESS;
+}
+
+static int file_sink_open (rio_sink_t *sink, rio_file_t *header, u_int32_t size) {
+  struct file_sink *fsink = (struct file_sink *)sink;
+  int mode = S_IRUSR | S_IWUSR | S_IROTH | S_IRGRP;
+
+  fsink->buffered = 0;
+  fsink->written  = 0;
+
+  if ((fsink->buffer = malloc (FILE_SINK_BUFFER)) == NULL)
+    return -ENOMEM;
+
+  if ((fsink->fd = open (fsink->path, O_WRONLY | O_CREAT | O_TRUNC, mode)) < 0)
+    return -errno;
+
+#if defined(HAVE_FALLOCATE) && defined(FALLOC_FL_KEEP_SIZE)
+  /* the size is known up front. reserving it keeps the file in one piece.
+     the file's size still only grows with the data, so a download that
+     dies part way does not look finished. not every filesystem can do
+     this, the data is written either way. */
+  if (size > 0)
+    fallocate (fsink->fd, FALLOC_FL_KEEP_SIZE, 0, size);
+#endif
+
+  return URIO_SUCCESS;
+}
+
+static int file_sink_write (rio_sink_t *sink, unsigned char *data, size_t length) {
+  struct file_sink *fsink = (struct file_sink *)sink;
+  size_t amount;
+  int ret;
+
+  while (length > 0) {
+    amount = FILE_SINK_BUFFER - fsink->buffered;
+    if (amount > length)
+      amount = length;
+
+    memcpy (fsink->buffer + fsink->buffered, data, amount);
+    fsink->buffered += amount;
+
+    data   += amount;
+    length -= amount;
+
+    if (fsink->buffered == FILE_SINK_BUFFER && (ret = file_sink_flush (fsink)) < 0)
+      return ret;
+  }
+
+  return URIO_SUCCESS;
+}
+
+static int file_sink_close (rio_sink_t *sink, int error) {
+  struct file_sink *fsink = (struct file_sink *)sink;
+  int ret;
+
+  if (fsink->fd >= 0) {
+    if ((ret = file_sink_flush (fsink)) < 0 && error == 0)
+      error = ret;
+
+    /* drop any preallocated space that was not filled */
+    if (ftruncate (fsink->fd, fsink->written) < 0 && error == 0)
+      error = -errno;
+
+    if (close (fsink->fd) < 0 && error == 0)
+      error = -errno;
+
+    fsink->fd = -1;
+  }
+
+  free (fsink->buffer);
+  fsink->buffer = NULL;
+
+  return error;
+}
+
+/* sink that hands data to a user function */
+struct callback_sink {
+  rio_sink_t sink;
+
+  rio_sink_fn_t fn;
+  void *ctx;
+};
+
+static int callback_sink_open (rio_sink_t *sink, rio_file_t *header, u_int32_t size) {
+  return URIO_SUCCESS;
+}
+
+static int callback_sink_write (rio_sink_t *sink, unsigned char *data, size_t length) {
+  struct callback_sink *csink = (struct callback_sink *)sink;
+
+  return csink->fn (csink->ctx, data, length);
+}
+
+static int callback_sink_close (rio_sink_t *sink, int error) {
+  return error;
+}
+
+/*
+  fd_sink_rio:
+
+  download_to_sink_rio sink that writes to the file descriptor *ctx.
+*/
+int fd_sink_rio (void *ctx, unsigned char *data, size_t length) {
+  int fd = *((int *)ctx);
+  ssize_t ret;
+
+  while (length > 0) {
+    ret = write (fd, data, length);
+    if (ret < 0) {
+      if (errno == EINTR)
+	continue;
+
+      return -errno;
+    }
+
+    data   += ret;
+    length -= ret;
+  }
+
+  return URIO_SUCCESS;
+}
+
+/*
+  memory_sink_rio:
+
+  download_to_sink_rio sink that collects the file in memory.
+*/
+int memory_sink_rio (void *ctx, unsigned char *data, size_t length) {
+  rio_memory_sink_t *msink = (rio_memory_sink_t *)ctx;
+  unsigned char *tmp;
+  size_t new_size;
+
+  if (msink->length + length > msink->size) {
+    for (new_size = msink->size ? msink->size : RIO_FTS ; new_size < msink->length + length ; new_size *= 2);
+
+    if ((tmp = realloc (msink->data, new_size)) == NULL)
+      return -ENOMEM;
+
+    msink->data = tmp;
+    msink->size = new_size;
+  }
+
+  memcpy (msink->data + msink->length, data, length);
+  msink->length += length;
+
+  return URIO_SUCCESS;
+}
+
+static void download_sink_done (rios_t *rio, u_int8_t memory_unit, u_int32_t fileno,
+				char *file_name, int error, void *ptr) {
+  *((int *)ptr) = error;
+}
+
+/*
+  download_to_sink_rio:
+
+  Download a file straight to sink_fn. The ring between the usb thread and
+  the writer is bounded so the device is only read as fast as the sink
+  accepts data.
+*/
+int download_to_sink_rio (rios_t *rio, u_int8_t memory_unit, u_int32_t fileno,
+			  rio_sink_fn_t sink_fn, void *ctx) {
+  struct callback_sink csink;
+  rio_sink_t *sink = &csink.sink;
+  int error = -ENOENT;
+  int ret;
+
+  if (rio == NULL || sink_fn == NULL || memory_unit >= MAX_MEM_UNITS)
+    return -EINVAL;
+
+  csink.sink.open  = callback_sink_open;
+  csink.sink.write = callback_sink_write;
+  csink.sink.close = callback_sink_close;
+  csink.fn         = sink_fn;
+  csink.ctx        = ctx;
+
+  ret = download_session_rio (rio, memory_unit, &fileno, &sink, NULL, 1, download_sink_done, &error);
+  if (ret < 0)
+    return ret;
+
+  return error;
+}
+
+/* what a download started by download_begin_rio holds */
+struct download_op {
+  struct callback_sink csink;
+
+  unsigned char buffer[RIO_FTS];
+};
+
+/* a download that has started is aborted. sink_fn sees -ECANCELED. */
+static void download_release (rio_op_t *op) {
+  if (op->state == DOWNLOAD_DONE)
+    return;
+
+  if (op->state != DOWNLOAD_START)
+    abort_transfer_rio (op->rio);
+
+  download_end (op, -ECANCELED);
+}
+
+/*
+  download_begin_rio:
+    Start a download of a file to sink_fn. No i/o is done: each call to
+  rio_step makes one exchange with the player (at most one block of data).
+  rio stays locked until the download is over or the operation is freed
+  with rio_op_free.
+*/
+int download_begin_rio (rios_t *rio, u_int8_t memory_unit, u_int32_t fileno,
+			rio_sink_fn_t sink_fn, void *ctx, rio_op_t **opp) {
+  struct download_op *dop;
+  rio_op_t *op;
+  int error;
+
+  if (rio == NULL || sink_fn == NULL || opp == NULL || memory_unit >= rio->info.total_memory_units)
+    return -EINVAL;
+
+  *opp = NULL;
+
+  op  = malloc (sizeof (rio_op_t));
+  dop = malloc (sizeof (struct download_op));
+  if (op == NULL || dop == NULL) {
+    free (op);
+    free (dop);
+
+    return -ENOMEM;
+  }
+
+  if ((error = try_lock_rio (rio)) != 0) {
+    free (op);
+    free (dop);
+
+    return error;
+  }
+
+  dop->csink.sink.open  = callback_sink_open;
+  dop->csink.sink.write = callback_sink_write;
+  dop->csink.sink.close = callback_sink_close;
+  dop->csink.fn         = sink_fn;
+  dop->csink.ctx        = ctx;
+
+  download_op_init (op, rio, memory_unit, fileno, &dop->csink.sink, dop->buffer);
+  op->release = download_release;
+  op->priv    = dop;
+  op->locked  = 1;
+
+  *opp = op;
+
+  return URIO_SUCCESS;
+}
+
+/*
+  download_name_rio:
+
+  The name a downloaded file gets locally: the name stored on the device
+  with any DOS path removed.
+*/
+char *download_name_rio (flist_rio_t *tmp) {
+  char *tmp_np;
+
+  if (strchr ((char *)tmp->name, ':') == NULL)
+    return tmp->name;
+
+  /* Some files have a full DOS path in their name field. Get the basename
+     and use that as the file name of the local file. */
+  for (tmp_np = (char *)&(tmp->name[strlen((char *)tmp->name) - 1]) ;
+       tmp_np != tmp->name && *tmp_np != '\\' ; tmp_np--);
+
+  return tmp_np;
+}
+
+/*
+  download_files_rio:
+
+  Download a batch of files into directory (the current directory if NULL)
+  in one session. done is called (from the writer thread) as each file is
+  finished.
+*/
+int download_files_rio (rios_t *rio, u_int8_t memory_unit, u_int32_t *filenos, int num_files,
+			char *directory, rio_download_done_t done, void *ptr) {
+  struct file_sink *fsinks;
+  rio_sink_t **sinks;
+  char **names;
+  flist_rio_t *tmp;
+  int i, ret;
+
+  if (rio == NULL || filenos == NULL || num_files < 0 || memory_unit >= MAX_MEM_UNITS)
+    return -EINVAL;
+
+  fsinks = calloc (num_files + 1, sizeof (struct file_sink));
+  sinks  = calloc (num_files + 1, sizeof (rio_sink_t *));
+  names  = calloc (num_files + 1, sizeof (char *));
+  if (fsinks == NULL || sinks == NULL || names == NULL) {
+    free (fsinks);
+    free (sinks);
+    free (names);
+
+    return -ENOMEM;
+  }
+
+  for (i = 0 ; i < num_files ; i++) {
+    fsinks[i].sink.open  = file_sink_open;
+    fsinks[i].sink.write = file_sink_write;
+    fsinks[i].sink.close = file_sink_close;
+    fsinks[i].fd         = -1;
+
+    for (tmp = rio->info.memory[memory_unit].files ; tmp ; tmp = tmp->next)
+      if (tmp->num == filenos[i])
+	break;
+
+    /* missing files are reported by the session */
+    if (tmp != NULL) {
+      if (directory)
+	snprintf (fsinks[i].path, PATH_MAX, "%s/%s", directory, download_name_rio (tmp));
+      else
+	snprintf (fsinks[i].path, PATH_MAX, "%s", download_name_rio (tmp));
+    }
+
+    sinks[i] = &fsinks[i].sink;
+    names[i] = fsinks[i].path;
+  }
+
+  ret = download_session_rio (rio, memory_unit, filenos, sinks, names, num_files, done, ptr);
+
+  free (fsinks);
+  free (sinks);
+  free (names);
+
+  return ret;
+}
+
+/*
+  download_file_rio:
+  Function takes in the number of the file
+  and attemt to download it from the Rio.
+
+  Note: This only works with the following files:
+  - Recorded WAVE files on the Rio 800
+  - preferences.bin file
+  - bookmarks.bin file
+  - non-music files uploaded by rioutil
+  - any file from an S-Series** or newer player
+
+  ** In order to support downloading an S-Series player should be
+  updated with the latest firmware.
+
+  -- Note --
+  Any file on a third generation player that has the 0x80 bit
+  set can be downloaded.
+
+  It seems that, probably due to the riaa, diamond has
+  made it so that wma and mp3 files CAN NOT
+  be downloaded. mp3s that are downloaded will be deleted
+  :(! Keep that in mind (rio600/800/900 only).
+
+  All of the newer players from Rio support the download of any
+  file on the player!
+*/
+int download_file_rio (rios_t *rio, u_int8_t memory_unit, u_int32_t fileno, char *fileName) {
+  struct file_sink fsink;
+  rio_sink_t *sink = &fsink.sink;
+  flist_rio_t *tmp;
+  int error = -ENOENT;
+  int ret;
+
+  if (rio == NULL || memory_unit >= MAX_MEM_UNITS)
+    return -EINVAL;
+
+  rio_log (rio, 0, "librioutil/download.c download_file_rio: entering...\n");
+
+  memset (&fsink, 0, sizeof (fsink));
+  fsink.sink.open  = file_sink_open;
+  fsink.sink.write = file_sink_write;
+  fsink.sink.close = file_sink_close;
+  fsink.fd         = -1;
+
+  if (fileName == NULL) {
+    /* Use the filename stored on the device as the local file name */
+    for (tmp = rio->info.memory[memory_unit].files ; tmp ; tmp = tmp->next)
+      if (tmp->num == fileno)
+	break;
+
+    if (tmp == NULL) {
+      rio_log (rio, -ENOENT, "librioutil/download.c download_file_rio: no such file.\n");
+
+      return -ENOENT;
+    }
+
+    snprintf (fsink.path, PATH_MAX, "%s", download_name_rio (tmp));
+  } else
+    /* Create a file with a user-specified name. */
+    snprintf (fsink.path, PATH_MAX, "%s", fileName);
+
+  rio_log (rio, 0, "librioutil/download.c download_file_rio: downloading to file %s\n", fsink.path);
+
+  ret = download_session_rio (rio, memory_unit, &fileno, &sink, NULL, 1, download_sink_done, &error);
+  if (ret < 0)
+    return ret;
+
+  /* an interrupted download is not an error */
+  if (error == -EINTR)
+    error = URIO_SUCCESS;
+
+  rio_log (rio, 0, "librioutil/download.c download_file_rio: complete.\n");
+
+  return error;
+}
@@ -39,47 +39,6 @@
 #include <libgen.h>
 #endif
 
-/*
-  get_flist_riomc:
-    Downloads the file list off of flash based players (Rio600, Rio800, S-Series, etc.).
-*/
-int generate_flist_riomc (rios_t *rio, u_int8_t memory_unit) {
-  int i, ret;
-  rio_file_t file;
-  
-  info_page_t info;
-
-  info.data = &file;
-
-  rio_log (rio, 0, "generate_flist_riomc: entering...\n");
-
-  ret = URIO_SUCCESS;
-
-  /*
-    MAX_RIO_FILES is an arbitrary file limit. Rios can get into a state where
-    the data in the file headers is garbage. This state can result in the termination
-    condition (file number == 0) never being reached.
-  */
-  for (i = 0 ; i < MAX_RIO_FILES ; i++) {
-    ret = get_file_info_rio(rio, &file, memory_unit, i);
-
-    if (ret != URIO_SUCCESS) {
-      if (ret == -ENOENT) 
-	ret = URIO_SUCCESS;  /* not an error */
-      break;
-    }
-
-    flist_add_rio (rio, memory_unit, info);
-
-    if (rio->progress != NULL)
-      rio->progress(i, 0, rio->progress_ptr);
-  }
-  
-  rio_log (rio, 0, "generate_flist_riomc: complete\n");
-
-  return ret;
-}
-
 int hdfile_to_mcfile  (hd_file_t *hdf, rio_file_t *file, int file_no) {
   if (hdf == NULL || file == NULL)
     return -EINVAL;
@@ -179,6 +138,80 @@ int flist_first_free_rio (rios_t *rio, int memory_unit) {
   return next_num;
 }
 
+/*
+  info_to_flist_rio:
+
+  copies the descriptive fields of a file header into a file list entry
+*/
+void info_to_flist_rio (rio_file_t *file, flist_rio_t *flist) {
+  strncpy(flist->artist, file->artist, 64);
+  strncpy(flist->title,  file->title, 64);
+  strncpy(flist->album,  file->album, 64);
+  strncpy(flist->name,   file->name, 64);
+  strncpy(flist->genre,  (char *)file->genre2, 17);
+
+  strncpy(flist->year,   (char *)file->year2, 4);
+  
+  flist->time       = file->time;  
+  flist->bitrate    = file->bit_rate >> 7;
+  flist->samplerate = file->sample_rate;
+  flist->mod_date   = file->mod_date;
+  flist->size       = file->size;
+  flist->start      = file->start;
+  flist->track_number = file->trackno2;
+  
+  if (file->type == TYPE_MP3)
+    flist->type = MP3;
+  else if (file->type == TYPE_WMA)
+    flist->type = WMA;
+  else if (file->type == TYPE_WAV)
+    flist->type = WAV;
+  else if (file->type == TYPE_WAVE)
+    flist->type = WAVE;
+  else
+    flist->type = OTHER;
+}
+
+/*
+  flist_to_info_rio:
+
+  rebuilds a file header from a file list entry. used with players that do
+  not return complete headers (Riot and Nitrus).
+*/
+void flist_to_info_rio (rios_t *rio, flist_rio_t *flist, rio_file_t *file) {
+  memset (file, 0, sizeof (rio_file_t));
+
+  file->file_no     = flist->rio_num;
+  file->start       = flist->start;
+  file->size        = flist->size;
+  file->time        = flist->time;
+  file->mod_date    = flist->mod_date;
+  file->sample_rate = flist->samplerate;
+  file->bit_rate    = flist->bitrate << 7;
+  file->trackno2    = flist->track_number;
+
+  if (flist->type == MP3) {
+    file->bits = 0x10000b11;
+    file->type = TYPE_MP3;
+    file->foo4 = 0x00020000;
+  } else if (flist->type == WMA)
+    file->type = TYPE_WMA;
+  else if (flist->type == WAV)
+    file->type = TYPE_WAV;
+  else if (flist->type == WAVE)
+    file->type = TYPE_WAVE;
+
+  if (rio->info.caps & CAP_UTF8STRINGS)
+    file->bits |= ATTR_UTF8STRINGS;
+
+  snprintf (file->name, sizeof (file->name), "%.63s", flist->name);
+  snprintf (file->title, sizeof (file->title), "%.63s", flist->title);
+  snprintf (file->artist, sizeof (file->artist), "%.63s", flist->artist);
+  snprintf (file->album, sizeof (file->album), "%.63s", flist->album);
+  snprintf ((char *)file->genre2, sizeof (file->genre2), "%.16s", flist->genre);
+  memcpy (file->year2, flist->year, 4);
+}
+
 /*
   flist_add_rio:
 
@@ -237,34 +270,8 @@ int flist_add_rio (rios_t *rio, int memory_unit, info_page_t info) {
 
   flist->rio_num = next_num;
 
-  strncpy(flist->artist, info.data->artist, 64);
-  strncpy(flist->title,  info.data->title, 64);
-  strncpy(flist->album,  info.data->album, 64);
-  strncpy(flist->name,   info.data->name, 64);
-  strncpy(flist->genre,  (char *)info.data->genre2, 17);
+  info_to_flist_rio (info.data, flist);
 
-  strncpy(flist->year,   (char *)info.data->year2, 4);
-  
-  flist->time       = info.data->time;  
-  flist->bitrate    = info.data->bit_rate >> 7;
-  flist->samplerate = info.data->sample_rate;
-  flist->mod_date   = info.data->mod_date;
-  flist->size       = info.data->size;
-  flist->start      = info.data->start;
-  flist->track_number = info.data->trackno2;
-  flist->prev = prev;
-  
-  if (info.data->type == TYPE_MP3)
-    flist->type = MP3;
-  else if (info.data->type == TYPE_WMA)
-    flist->type = WMA;
-  else if (info.data->type == TYPE_WAV)
-    flist->type = WAV;
-  else if (info.data->type == TYPE_WAVE)
-    flist->type = WAVE;
-  else
-    flist->type = OTHER;
-  
   if (return_generation_rio (rio) > 3)
     memcpy (flist->sflags, info.data->unk1, 3);
   
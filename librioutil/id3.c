@@ -31,6 +31,7 @@
 #include <time.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <pthread.h>
 
 #include "rioi.h"
 #include "genre.h"
@@ -42,11 +43,13 @@
 #include <iconv.h>
 #endif
 
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
 #define ID3FLAG_EXTENDED 0x40
 #define ID3FLAG_FOOTER   0x10
 
-#define TAG_DATA_SIZE 65536
-
                        /* v2.2 v2.3 */
 char *ID3_TITLE[2]   = {"TT2", "TIT2"};
 char *ID3_ARTIST[2]  = {"TP1", "TPE1"};
@@ -61,9 +64,9 @@ char *ID3_YEARNEW[2] = {"TYE", "TDRC"};
 char *ID3_DISC[2]    = {"TPA", "TPOS"};
 char *ID3_ARTWORK[2] = {"PIC", "APIC"};
 
-static int find_id3 (int version, FILE *fh, unsigned char *tag_data, int *tag_datalen,
-		     int *id3_len, int *major_version);
-static void one_pass_parse_id3 (FILE *fh, unsigned char *tag_data, int tag_datalen, int version,
+static int find_id3 (int version, rio_probe_t *probe, unsigned char **tag, int *tag_datalen,
+		     int *major_version);
+static void one_pass_parse_id3 (unsigned char *tag, int tag_datalen, int version,
                                 int id3v2_majorversion, rio_file_t *mp3_file, const char *out_encoding);
 static int synchsafe_to_int (unsigned char *buf, int nbytes);
 
@@ -122,76 +125,61 @@ int id3v2_size (unsigned char data[14]) {
 }
 
 /*
-  find_id3 takes in a file descriptor, a pointer to where the tag data is to be put,
-  and a pointer to where the data length is to be put.
+  find_id3 takes in a probed file, a pointer to where the address of the tag data
+  is to be put, and a pointer to where the data length is to be put.
 
   find_id3 returns:
     0 for no id3 tags
     1 for id3v1 tag
     2 for id3v2 tag
-
-  The file descriptor is reset to the start of the file on completion.
 */
-static int find_id3 (int version, FILE *fh, unsigned char *tag_data, int *tag_datalen,
-		     int *id3_len, int *major_version) {
-    int head;
-    unsigned char data[10];
+static int find_id3 (int version, rio_probe_t *probe, unsigned char **tag, int *tag_datalen,
+		     int *major_version) {
+    unsigned char *data = probe->data;
 
     char id3v2_flags;
     int  id3v2_len;
-    int  id3v2_extendedlen;
-
-    fread(&head, 4, 1, fh);
-    
-    head = big32_2_arch32(head);
+    int  id3v2_extendedlen = 0;
 
     if (version == 2) {
       /* version 2 */
-      if ((head & 0xffffff00) == 0x49443300) {
-	fread(data, 1, 10, fh);
-	
-	*major_version = head & 0xff;
-	
-	id3v2_flags = data[1];
-	
-	id3v2_len = *id3_len = synchsafe_to_int (&data[2], 4);
+      if (probe->size >= 14 && memcmp (data, "ID3", 3) == 0) {
+	*major_version = data[3];
+
+	id3v2_flags = data[5];
 
-	*id3_len += 10; /* total length = id3v2len + 010 + footer (if present) */
-	*id3_len += (id3v2_flags & 0x10) ? 10 : 0; /* ID3v2 footer */
+	id3v2_len = synchsafe_to_int (&data[6], 4);
 
 	/* the 6th bit of the flag field being set indicates that an
 	   extended header is present */
-	if (id3v2_flags & 0x40) {
+	if (id3v2_flags & 0x40)
 	  /* Skip extended header */
-	  id3v2_extendedlen = synchsafe_to_int (&data[6], 4);
-	  
-	  fseek(fh, 0xa + id3v2_extendedlen, SEEK_SET);
-	  *tag_datalen = id3v2_len - id3v2_extendedlen;
-	} else {
-	  /* Skip standard header */
-	  fseek(fh, 0xa, SEEK_SET);
-	  *tag_datalen = id3v2_len;
-	}
-	
+	  id3v2_extendedlen = synchsafe_to_int (&data[10], 4);
+
+	if (id3v2_extendedlen < 0 || (size_t)(10 + id3v2_extendedlen) > probe->size)
+	  return 0;
+
+	*tag         = data + 10 + id3v2_extendedlen;
+	*tag_datalen = id3v2_len - id3v2_extendedlen;
+
+	if (*tag_datalen <= 0)
+	  return 0;
+
+	/* a truncated file */
+	if ((size_t) *tag_datalen > probe->size - 10 - id3v2_extendedlen)
+	  *tag_datalen = probe->size - 10 - id3v2_extendedlen;
+
 	return 2;
       }
     } else if (version == 1) {
-      fseek(fh, 0, SEEK_SET);
-      
-      /* tag not at beginning? */
-      if ((head & 0xffffff00) != 0x54414700) {
-	/* maybe end */
-	fseek(fh, -128, SEEK_END);
-	fread(&head, 1, 4, fh);
-	fseek(fh, -128, SEEK_END);
-	
-	head = big32_2_arch32(head);
-      }
-      
-      /* version 1 */
-      if ((head & 0xffffff00) == 0x54414700) {
-	fread(tag_data, 1, 128, fh);
-	
+      /* tag not at beginning? maybe end */
+      if (probe->size >= 128 && memcmp (data, "TAG", 3) == 0) {
+	*tag = data;
+
+	return 1;
+      } else if (probe->has_v1) {
+	*tag = data + probe->size - 128;
+
 	return 1;
       }
     }
@@ -200,9 +188,9 @@ static int find_id3 (int version, FILE *fh, unsigned char *tag_data, int *tag_da
     return 0;
 }
 
-static char *id3v1_string (unsigned char *unclean) {
+/* buffer must hold 31 bytes */
+static char *id3v1_string (unsigned char *unclean, char *buffer) {
   int i;
-  static char buffer[31];
 
   memset (buffer, 0, 31);
 
@@ -215,79 +203,369 @@ static char *id3v1_string (unsigned char *unclean) {
   return buffer;
 }
 
+/*
+  Text frames are almost always Latin-1, UTF-16 or UTF-8 and the player
+  wants UTF-8 or Latin-1, so those conversions are done here. They stop,
+  leaving the rest to iconv, at anything they do not handle: characters
+  that must be transliterated and malformed input (iconv decides what
+  happens to it). A character that does not fit in the output ends the
+  conversion, as it does for iconv.
+*/
+enum {ID3_LATIN1 = 0, ID3_UTF16LE, ID3_UTF16BE, ID3_UTF8};
+enum {ID3_OUT_UTF8 = 0, ID3_OUT_LATIN1, ID3_OUT_OTHER};
+
+/* returns 0 if the character does not fit */
+static int id3_put_char (u_int32_t c, int to, unsigned char **out, size_t *out_left) {
+  unsigned char *p = *out;
+  size_t n;
+
+  if (to == ID3_OUT_LATIN1) {
+    n = 1;
+    if (*out_left < n)
+      return 0;
+
+    p[0] = c;
+  } else if (c < 0x80) {
+    n = 1;
+    if (*out_left < n)
+      return 0;
+
+    p[0] = c;
+  } else if (c < 0x800) {
+    n = 2;
+    if (*out_left < n)
+      return 0;
+
+    p[0] = 0xc0 | (c >> 6);
+    p[1] = 0x80 | (c & 0x3f);
+  } else if (c < 0x10000) {
+    n = 3;
+    if (*out_left < n)
+      return 0;
+
+    p[0] = 0xe0 | (c >> 12);
+    p[1] = 0x80 | ((c >> 6) & 0x3f);
+    p[2] = 0x80 | (c & 0x3f);
+  } else {
+    n = 4;
+    if (*out_left < n)
+      return 0;
+
+    p[0] = 0xf0 | (c >> 18);
+    p[1] = 0x80 | ((c >> 12) & 0x3f);
+    p[2] = 0x80 | ((c >> 6) & 0x3f);
+    p[3] = 0x80 | (c & 0x3f);
+  }
+
+  *out      += n;
+  *out_left -= n;
+
+  return 1;
+}
+
+/* decode one strictly valid UTF-8 character. returns its length or 0. */
+static size_t id3_get_utf8 (unsigned char *in, size_t in_left, u_int32_t *c) {
+  if (in[0] < 0x80) {
+    *c = in[0];
+    return 1;
+  } else if (in[0] >= 0xc2 && in[0] < 0xe0) {
+    if (in_left < 2 || (in[1] & 0xc0) != 0x80)
+      return 0;
+
+    *c = ((in[0] & 0x1f) << 6) | (in[1] & 0x3f);
+    return 2;
+  } else if (in[0] >= 0xe0 && in[0] < 0xf0) {
+    if (in_left < 3 || (in[1] & 0xc0) != 0x80 || (in[2] & 0xc0) != 0x80)
+      return 0;
+
+    *c = ((in[0] & 0x0f) << 12) | ((in[1] & 0x3f) << 6) | (in[2] & 0x3f);
+
+    /* overlong or a surrogate */
+    return (*c < 0x800 || (*c >= 0xd800 && *c < 0xe000)) ? 0 : 3;
+  } else if (in[0] >= 0xf0 && in[0] < 0xf5) {
+    if (in_left < 4 || (in[1] & 0xc0) != 0x80 || (in[2] & 0xc0) != 0x80 || (in[3] & 0xc0) != 0x80)
+      return 0;
+
+    *c = ((in[0] & 0x07) << 18) | ((in[1] & 0x3f) << 12) | ((in[2] & 0x3f) << 6) | (in[3] & 0x3f);
+
+    return (*c < 0x10000 || *c > 0x10ffff) ? 0 : 4;
+  }
+
+  return 0;
+}
+
+/* decode one UTF-16 character. returns the number of bytes or 0. */
+static size_t id3_get_utf16 (unsigned char *in, size_t in_left, int big_endian, u_int32_t *c) {
+  u_int32_t low;
+
+  if (in_left < 2)
+    return 0;
+
+  *c = big_endian ? ((in[0] << 8) | in[1]) : ((in[1] << 8) | in[0]);
+
+  if (*c < 0xd800 || *c >= 0xe000)
+    return 2;
+
+  /* a surrogate pair */
+  if (*c >= 0xdc00 || in_left < 4)
+    return 0;
+
+  low = big_endian ? ((in[2] << 8) | in[3]) : ((in[3] << 8) | in[2]);
+  if (low < 0xdc00 || low >= 0xe000)
+    return 0;
+
+  *c = 0x10000 + ((*c - 0xd800) << 10) + (low - 0xdc00);
+
+  return 4;
+}
+
+/*
+  id3_convert:
+
+  Convert as much of the input as possible. Returns 1 if iconv should
+  carry on from where it stopped, 0 if it is done.
+*/
+static int id3_convert (int from, int to, unsigned char **in, size_t *in_left,
+			unsigned char **out, size_t *out_left) {
+  u_int32_t c;
+  size_t n;
+
+  if (to == ID3_OUT_OTHER)
+    return 1;
+
+  while (*in_left > 0) {
+#if defined(__SSE2__)
+    /* sixteen (or eight UTF-16) ASCII characters at a time */
+    if (from == ID3_UTF16LE || from == ID3_UTF16BE) {
+      while (*in_left >= 16 && *out_left >= 8) {
+	__m128i units = _mm_loadu_si128 ((__m128i *)*in);
+
+	if (from == ID3_UTF16BE)
+	  units = _mm_or_si128 (_mm_slli_epi16 (units, 8), _mm_srli_epi16 (units, 8));
+
+	if (_mm_movemask_epi8 (_mm_cmpeq_epi16 (_mm_and_si128 (units, _mm_set1_epi16 ((short)0xff80)),
+						_mm_setzero_si128 ())) != 0xffff)
+	  break;
+
+	_mm_storel_epi64 ((__m128i *)*out, _mm_packus_epi16 (units, units));
+
+	*in       += 16;
+	*in_left  -= 16;
+	*out      += 8;
+	*out_left -= 8;
+      }
+    } else {
+      while (*in_left >= 16 && *out_left >= 16) {
+	__m128i bytes = _mm_loadu_si128 ((__m128i *)*in);
+
+	if (_mm_movemask_epi8 (bytes) != 0)
+	  break;
+
+	_mm_storeu_si128 ((__m128i *)*out, bytes);
+
+	*in       += 16;
+	*in_left  -= 16;
+	*out      += 16;
+	*out_left -= 16;
+      }
+    }
+
+    if (*in_left == 0)
+      break;
+#endif
+
+    switch (from) {
+    case ID3_LATIN1:
+      c = (*in)[0];
+      n = 1;
+      break;
+    case ID3_UTF8:
+      n = id3_get_utf8 (*in, *in_left, &c);
+      break;
+    default:
+      n = id3_get_utf16 (*in, *in_left, from == ID3_UTF16BE, &c);
+    }
+
+    /* malformed input, or a character that has to be transliterated */
+    if (n == 0 || (to == ID3_OUT_LATIN1 && c > 0xff))
+      return 1;
+
+    if (!id3_put_char (c, to, out, out_left))
+      return 0;
+
+    *in      += n;
+    *in_left -= n;
+  }
+
+  return 0;
+}
+
+#ifdef HAVE_ICONV
+/*
+  Opening a converter is expensive so each thread keeps the last few it
+  used, keyed by the pair of encodings.
+*/
+#define ICONV_CACHE_SIZE 4
+
+struct iconv_cache {
+  struct {
+    char from[16];
+    char to[64];
+    iconv_t ic;
+  } entries[ICONV_CACHE_SIZE];
+
+  int next;
+};
+
+static pthread_key_t iconv_cache_key;
+static pthread_once_t iconv_cache_once = PTHREAD_ONCE_INIT;
+
+static void iconv_cache_free (void *arg) {
+  struct iconv_cache *cache = (struct iconv_cache *)arg;
+  int i;
+
+  for (i = 0 ; i < ICONV_CACHE_SIZE ; i++)
+    if (cache->entries[i].from[0])
+      iconv_close (cache->entries[i].ic);
+
+  free (cache);
+}
+
+static void iconv_cache_init (void) {
+  pthread_key_create (&iconv_cache_key, iconv_cache_free);
+}
+
+/*
+  id3_iconv_open:
+
+  Returns a converter from one encoding to another, reset to its initial
+  state. *cached is cleared if the converter is not in the cache and
+  must be closed by the caller.
+*/
+static iconv_t id3_iconv_open (const char *to, const char *from, int *cached) {
+  struct iconv_cache *cache;
+  iconv_t ic;
+  int i;
+
+  pthread_once (&iconv_cache_once, iconv_cache_init);
+
+  *cached = 0;
+
+  if (strlen (from) >= 16 || strlen (to) >= 64)
+    return iconv_open (to, from);
+
+  if ((cache = pthread_getspecific (iconv_cache_key)) == NULL) {
+    if ((cache = calloc (1, sizeof (struct iconv_cache))) == NULL ||
+	pthread_setspecific (iconv_cache_key, cache) != 0) {
+      free (cache);
+
+      return iconv_open (to, from);
+    }
+  }
+
+  for (i = 0 ; i < ICONV_CACHE_SIZE ; i++)
+    if (strcmp (cache->entries[i].from, from) == 0 && strcmp (cache->entries[i].to, to) == 0) {
+      iconv (cache->entries[i].ic, NULL, NULL, NULL, NULL);
+      *cached = 1;
+
+      return cache->entries[i].ic;
+    }
+
+  if ((ic = iconv_open (to, from)) == (iconv_t)-1)
+    return ic;
+
+  /* replace the oldest entry */
+  i = cache->next;
+  cache->next = (cache->next + 1) % ICONV_CACHE_SIZE;
+
+  if (cache->entries[i].from[0])
+    iconv_close (cache->entries[i].ic);
+
+  strcpy (cache->entries[i].from, from);
+  strcpy (cache->entries[i].to, to);
+  cache->entries[i].ic = ic;
+
+  *cached = 1;
+
+  return ic;
+}
+#endif
+
+/* the text frames that end up in the rio header */
+static int id3_wanted (char *identifier, int newv) {
+  return (strcmp (identifier, ID3_TITLE[newv]) == 0 || strcmp (identifier, ID3_ARTIST[newv]) == 0 ||
+	  strcmp (identifier, ID3_TRACK[newv]) == 0 || strcmp (identifier, ID3_ALBUM[newv]) == 0 ||
+	  strcmp (identifier, ID3_YEARNEW[newv]) == 0 || strcmp (identifier, ID3_YEAR[newv]) == 0 ||
+	  strcmp (identifier, ID3_GENRE[newv]) == 0);
+}
+
 /*
   parse_id3
+
+  The tag is parsed where it lies in the probed file: frames that are not
+  needed (artwork, comments, ...) are skipped by their length and text is
+  converted straight out of the frame.
 */
-static void one_pass_parse_id3 (FILE *fh, unsigned char *tag_data, int tag_datalen, int version,
+static void one_pass_parse_id3 (unsigned char *tag, int tag_datalen, int version,
 				int id3v2_majorversion, rio_file_t *mp3_file, const char *out_encoding) {
-  int i, j;
+  int j;
   unsigned char *dstp;
-  char *slash;
 
   if (version == 2) {
-    unsigned char *tag_temp;
+    unsigned char *tag_temp, *frame;
     char genre_temp[4];
+    char number[16];
     char encoding[11];
+    int from;
+    int to = (strcmp (out_encoding, "UTF-8") == 0) ? ID3_OUT_UTF8 :
+      ((strncmp (out_encoding, "ISO-8859-1", 10) == 0) ? ID3_OUT_LATIN1 : ID3_OUT_OTHER);
     char identifier[5];
     int newv = (id3v2_majorversion > 2) ? 1 : 0;
+    int header_size = newv ? 10 : 6;
+    unsigned char *end = tag + tag_datalen;
+    size_t available;
     
     memset (identifier, 0, 5);
     
-    for (i = 0 ; i < tag_datalen ; ) {
+    while (end - tag >= header_size) {
       size_t length = 0;
       size_t out_length = 0;
       
-      fread (tag_data, 1, (id3v2_majorversion > 2) ? 10 : 6, fh);
-      
-      if (tag_data[0] == 0)
+      if (tag[0] == 0)
 	return;
       
-      memcpy (identifier, tag_data, newv ? 4 : 3);
+      memcpy (identifier, tag, newv ? 4 : 3);
       
       if (id3v2_majorversion > 2) {
 	/* id3v2.3 does not use synchsafe integers in frame headers. */
 	if (id3v2_majorversion == 3 || strcmp (identifier, "APIC") == 0 ||
 	    strcmp (identifier, "COMM") == 0 || strcmp (identifier, "COM ") == 0 ||
 	    strcmp (identifier, "GEOB")) {
-	  length = big32_2_arch32(((int *)tag_data)[1]);
+	  length = (tag[4] << 24) | (tag[5] << 16) | (tag[6] << 8) | tag[7];
 	} else
-	  length = synchsafe_to_int (&tag_data[4], 4);
+	  length = synchsafe_to_int (&tag[4], 4);
+      } else
+	length = (tag[3] << 16) | (tag[4] << 8) | tag[5];
 
-	i += 10 + length;
-      } else {
-	length = (tag_data[3] << 16) | (tag_data[4] << 8) | tag_data[5];
+      tag += header_size;
+      available = end - tag;
 
-	i += 6 + length;
-      }
+      if (length > available)
+	length = available;
 
-      if (length < 0) {
-	fprintf (stderr, "id3v2 tag data length is < 0... Aborting!\n");
-	break;
-      } else if (length == 0)
-	continue;
-      
-      if (length < 2) {
-	fseek (fh, length, SEEK_CUR);
+      frame = tag;
+      tag  += length;
 
+      if (length < 2 || !id3_wanted (identifier, newv))
 	continue;
-      }
-
-      if (length > TAG_DATA_SIZE) {
-	fseek (fh, length - TAG_DATA_SIZE, SEEK_CUR);
-	if (strcmp (identifier, "APIC") != 0 &&
-	    strcmp (identifier, "PIC") != 0)
-	  length = TAG_DATA_SIZE;
-      }
 
-      memset (tag_data, 0, TAG_DATA_SIZE);
-      fread (tag_data, 1, (length < TAG_DATA_SIZE) ? length : TAG_DATA_SIZE, fh);
-
-      tag_temp = tag_data;
+      tag_temp = frame;
 
       /* Get the tag encoding */
       switch (*tag_temp) {
       case 0x00:
 	sprintf (encoding, "ISO-8859-1");
+	from = ID3_LATIN1;
 	tag_temp++;
 	break;
       case 0x01:
@@ -296,33 +574,39 @@ static void one_pass_parse_id3 (FILE *fh, unsigned char *tag_data, int tag_datal
 	// Skip BOM
         if (length > 2 && tag_temp[1] == 0xff && tag_temp[2] == 0xfe) {
           sprintf (encoding, "UTF-16LE");
-          length -= 2;
+          from = ID3_UTF16LE;
           tag_temp += 3;
         } else if (length > 2 && tag_temp[1] == 0xfe && tag_temp[2] == 0xff) {
           sprintf (encoding, "UTF-16BE");
-          length -= 2;
+          from = ID3_UTF16BE;
           tag_temp += 3;
         } else {
           // No BOM? Assume little endian then
           sprintf (encoding, "UTF-16LE");
+          from = ID3_UTF16LE;
           tag_temp ++;
         }
 	break;
       case 0x02:
         sprintf (encoding, "UTF-16BE");
+        from = ID3_UTF16BE;
         tag_temp++;
         break;
       case 0x03:
 	sprintf (encoding, "UTF-8");
+	from = ID3_UTF8;
 	tag_temp++;
 	break;
       default:
         // If it's anything else then just assume it's Latin-1
 	sprintf (encoding, "ISO-8859-1");
+	from = ID3_LATIN1;
         tag_temp++;
         break;
       }
 
+      length = frame + length - tag_temp;
+
       if (length <= 0)
 	continue;
 
@@ -335,14 +619,11 @@ static void one_pass_parse_id3 (FILE *fh, unsigned char *tag_data, int tag_datal
 	dstp = (unsigned char *)mp3_file->artist;
 	out_length = 63;
       } else if (strcmp (identifier, ID3_TRACK[newv]) == 0) {
-	/* some id3 tags have track/total tracks in the TRK field */
-	slash = strchr ((char *)tag_temp, '/');
+	/* some id3 tags have track/total tracks in the TRK field (strtol stops at the slash) */
+	memset (number, 0, sizeof (number));
+	memcpy (number, tag_temp, (length < sizeof (number)) ? length : sizeof (number) - 1);
 	
-	if (slash) *slash = 0;
-	
-	mp3_file->trackno2 = strtol ((char *)tag_temp, NULL, 10);
-	
-	if (slash) *slash = '/';
+	mp3_file->trackno2 = strtol (number, NULL, 10);
       } else if (strcmp (identifier, ID3_ALBUM[newv]) == 0) {
 	dstp = (unsigned char *)mp3_file->album;
 	out_length = 63;
@@ -356,7 +637,7 @@ static void one_pass_parse_id3 (FILE *fh, unsigned char *tag_data, int tag_datal
 	  out_length = 22;
 	} else {
 	  /* 41 is right parenthesis */
-	  for (j = 0 ; (*(tag_temp + 1 + j) != 41) ; j++) {
+	  for (j = 0 ; j < 3 && j + 1 < length && (*(tag_temp + 1 + j) != 41) ; j++) {
 	    genre_temp[j] = *(tag_temp + 1 + j);
 	  }
 	  
@@ -372,10 +653,20 @@ static void one_pass_parse_id3 (FILE *fh, unsigned char *tag_data, int tag_datal
 	continue;
       
       if (dstp) {
+	/* the common encodings do not need iconv */
+	if (id3_convert (from, to, &tag_temp, &length, &dstp, &out_length)) {
 #ifdef HAVE_ICONV
-	iconv_t ic = iconv_open(out_encoding, encoding);
-	iconv(ic, &tag_temp, &length, &dstp, &out_length);
-	iconv_close(ic);
+	  int cached;
+	  iconv_t ic = id3_iconv_open(out_encoding, encoding, &cached);
+
+	  if (ic != (iconv_t)-1) {
+	    iconv(ic, (char **)&tag_temp, &length, (char **)&dstp, &out_length);
+
+	    if (!cached)
+	      iconv_close(ic);
+	  }
+#endif
+	}
 
 	// iconv isn't guaranteed to terminate its output (and may
 	// leave unwanted characters immediately after the output) so
@@ -383,81 +674,63 @@ static void one_pass_parse_id3 (FILE *fh, unsigned char *tag_data, int tag_datal
 	// always left room for a terminator afterwards so we can just
 	// append it anyway.
 	*dstp = 0;
-#else // !HAVE_ICONV
-	if (out_length > length) {
-	  out_length = length;
-	  strncpy ((char *)dstp, (char *)tag_temp, out_length);
-	}
-#endif // !HAVE_ICONV
       }
     }    
   } else if (version == 1) {
-    char *tmp;
+    char buffer[31], *tmp;
 
     if (strlen (mp3_file->title) == 0) {
-      tmp = id3v1_string (&tag_data[3]);
+      tmp = id3v1_string (&tag[3], buffer);
       strncpy (mp3_file->title, tmp, strlen (tmp));
     }
 
     if (strlen (mp3_file->artist) == 0) {
-      tmp = id3v1_string (&tag_data[33]);
+      tmp = id3v1_string (&tag[33], buffer);
       strncpy (mp3_file->artist, tmp, strlen (tmp));
     }
 
     if (strlen (mp3_file->album) == 0) {
-      tmp = id3v1_string (&tag_data[63]);
+      tmp = id3v1_string (&tag[63], buffer);
       strncpy (mp3_file->album, tmp, strlen (tmp));
     }
 
-    if (strlen ((char *)mp3_file->genre2) == 0 && tag_data[127] != 0xff)
-      strncpy ((char *)mp3_file->genre2, genre_table[tag_data[127]], strlen (genre_table[tag_data[127]]));
+    if (strlen ((char *)mp3_file->genre2) == 0 && tag[127] != 0xff)
+      strncpy ((char *)mp3_file->genre2, genre_table[tag[127]], strlen (genre_table[tag[127]]));
 
     if (mp3_file->trackno2 == 0)
-      if (tag_data[126] != 0xff)
-	mp3_file->trackno2 = tag_data[126];
+      if (tag[126] != 0xff)
+	mp3_file->trackno2 = tag[126];
   }
 }
 
-int get_id3_info (char *file_name, rio_file_t *mp3_file, const char *out_encoding) {
-  int tag_datalen = 0, id3_len = 0;
-  unsigned char tag_data[TAG_DATA_SIZE];
+int get_id3_info (rio_probe_t *probe, rio_file_t *mp3_file, const char *out_encoding) {
+  int tag_datalen = 0;
+  unsigned char *tag;
   int version;
-  int id3v2_majorversion;
+  int id3v2_majorversion = 0;
   int has_v2 = 0;
-  FILE *fh;
-
-  if ((fh = fopen (file_name, "r")) == NULL)
-    return errno;
 
   /* built-in id3tag reading -- id3v2, id3v1 */
-  if ((version = find_id3(2, fh, tag_data, &tag_datalen, &id3_len, &id3v2_majorversion)) != 0) {
-    one_pass_parse_id3(fh, tag_data, tag_datalen, version, id3v2_majorversion, mp3_file, out_encoding);
+  if ((version = find_id3(2, probe, &tag, &tag_datalen, &id3v2_majorversion)) != 0) {
+    one_pass_parse_id3(tag, tag_datalen, version, id3v2_majorversion, mp3_file, out_encoding);
     has_v2 = 1;
   }
 
   /* some mp3's have both tags so check v1 even if v2 is available */
-  if ((version = find_id3(1, fh, tag_data, &tag_datalen, NULL, &id3v2_majorversion)) != 0)
-    one_pass_parse_id3(fh, tag_data, tag_datalen, version, id3v2_majorversion, mp3_file, out_encoding);
+  if ((version = find_id3(1, probe, &tag, &tag_datalen, &id3v2_majorversion)) != 0)
+    one_pass_parse_id3(tag, 128, version, id3v2_majorversion, mp3_file, out_encoding);
   
-  /* Set the file descriptor at the end of the id3v2 header (if one exists) */
-  fseek (fh, id3_len, SEEK_SET);
-  
-  if (strlen (mp3_file->title) == 0) {
-    char *tfile_name = strdup (file_name);
-    char *tmp = (char *)basename(tfile_name);
-    int i;
-
-    for (i = strlen(tmp) - 1 ; i > 0 ; i--)
-      if (tmp[i] == '.') {
-	tmp[i] = 0;
-	break;
-      }
+  /* the file name without its extension */
+  if (strlen (mp3_file->title) == 0 && probe->file_name != NULL) {
+    char *tmp = strrchr (probe->file_name, '/'), *dot;
+    size_t length;
+
+    tmp    = (tmp != NULL) ? tmp + 1 : probe->file_name;
+    dot    = strrchr (tmp, '.');
+    length = (dot != NULL && dot != tmp) ? (size_t)(dot - tmp) : strlen (tmp);
 
-    memmove (mp3_file->title, tmp, (strlen(tmp) > 63) ? 63 : strlen(tmp));
-    free (tfile_name);
+    memmove (mp3_file->title, tmp, (length > 63) ? 63 : length);
   }
- 
-  fclose (fh);
   
   if (has_v2)
     return 2;
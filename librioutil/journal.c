@@ -0,0 +1,371 @@
+/**
+ *   (c) 2001-2006 Nathan Hjelm <hjelmn@users.sourceforge.net>
+ *   v1.0 journal.c
+ *
+ *   Journal of batch operations so an interrupted batch can be resumed.
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU Library Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU Library Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ **/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <unistd.h>
+#include <errno.h>
+
+#include "rioi.h"
+
+#if !defined (PATH_MAX)
+#define PATH_MAX 255
+#endif
+
+#define JOURNAL_MAGIC "# rioutil journal v1"
+
+/* longest line in a journal: a plan record with a path and four strings */
+#define JOURNAL_LINE (PATH_MAX + 512)
+
+/*
+  The journal is a text file, ~/.rioutil/journal-<serial number>, that is
+  only ever appended to:
+
+    plan <job> <op> <memory unit> <rio_num> <size>\t<path>\t<name>\t<artist>\t<title>\t<album>
+    done <job>
+
+  Every job of a batch is planned before the first one is started and a
+  done record is written (and synced) as each one finishes. A line
+  without a newline was cut short by a crash and is ignored.
+*/
+static const char *job_names[] = {"upload", "download", "delete"};
+
+/* the journal's fields are separated by tabs */
+static void put_field (FILE *fh, char *value) {
+  fputc ('\t', fh);
+
+  for ( ; value && *value ; value++)
+    fputc ((*value == '\t' || *value == '\n') ? ' ' : *value, fh);
+}
+
+static char *get_field (char **line) {
+  char *field = *line, *end;
+
+  if (field == NULL)
+    return NULL;
+
+  if ((end = strchr (field, '\t')) != NULL) {
+    *end = '\0';
+    *line = end + 1;
+  } else
+    *line = NULL;
+
+  return (*field) ? strdup (field) : NULL;
+}
+
+static int journal_sync (FILE *fh) {
+  if (fflush (fh) != 0 || fsync (fileno (fh)) < 0)
+    return -errno;
+
+  return URIO_SUCCESS;
+}
+
+/*
+  journal_begin_rio:
+
+  Start a new journal for a batch. Any previous journal for this device is
+  replaced.
+*/
+int journal_begin_rio (rios_t *rio, rio_job_t *jobs, int num_jobs) {
+  char path[PATH_MAX];
+  FILE *fh;
+  int i, ret;
+
+  if (rio == NULL || (jobs == NULL && num_jobs > 0))
+    return -EINVAL;
+
+  if ((ret = state_path_rio (rio, "journal", path, PATH_MAX)) != URIO_SUCCESS)
+    return ret;
+
+  if (rio->journal != NULL)
+    fclose ((FILE *)rio->journal);
+
+  rio->journal = fh = fopen (path, "w");
+  if (fh == NULL) {
+    rio_log (rio, -errno, "journal_begin_rio: could not create %s: %s\n", path, strerror (errno));
+
+    return -errno;
+  }
+
+  fprintf (fh, "%s\n", JOURNAL_MAGIC);
+
+  for (i = 0 ; i < num_jobs ; i++) {
+    fprintf (fh, "plan %i %s %u %x %u", i, job_names[jobs[i].op], jobs[i].memory_unit,
+	     jobs[i].rio_num, jobs[i].size);
+
+    put_field (fh, jobs[i].path);
+    put_field (fh, jobs[i].name);
+    put_field (fh, jobs[i].artist);
+    put_field (fh, jobs[i].title);
+    put_field (fh, jobs[i].album);
+    fputc ('\n', fh);
+
+    if (jobs[i].done)
+      fprintf (fh, "done %i\n", i);
+  }
+
+  rio_log (rio, 0, "journal_begin_rio: %i jobs planned in %s\n", num_jobs, path);
+
+  return journal_sync (fh);
+}
+
+/*
+  journal_done_rio:
+
+  Record that a job of the current batch has finished.
+*/
+int journal_done_rio (rios_t *rio, int job) {
+  FILE *fh;
+
+  if (rio == NULL || rio->journal == NULL)
+    return -EINVAL;
+
+  fh = (FILE *)rio->journal;
+
+  fprintf (fh, "done %i\n", job);
+
+  return journal_sync (fh);
+}
+
+/*
+  journal_end_rio:
+
+  The batch is over, there is nothing to resume. Removes the journal.
+*/
+int journal_end_rio (rios_t *rio) {
+  char path[PATH_MAX];
+  int ret;
+
+  if (rio == NULL)
+    return -EINVAL;
+
+  if (rio->journal != NULL) {
+    fclose ((FILE *)rio->journal);
+    rio->journal = NULL;
+  }
+
+  if ((ret = state_path_rio (rio, "journal", path, PATH_MAX)) != URIO_SUCCESS)
+    return ret;
+
+  if (unlink (path) < 0 && errno != ENOENT)
+    return -errno;
+
+  return URIO_SUCCESS;
+}
+
+/*
+  journal_load_rio:
+
+  Read the journal left by an unfinished batch. On success *jobs is set to
+  an array (free it with journal_free_rio) and the number of jobs is
+  returned. Returns -ENOENT if there is no journal.
+*/
+int journal_load_rio (rios_t *rio, rio_job_t **jobs) {
+  char path[PATH_MAX], line[JOURNAL_LINE], op[16];
+  rio_job_t *list = NULL, *tmp;
+  unsigned int memory_unit, rio_num, size;
+  int num_jobs = 0, max_jobs = 0, job, offset, i;
+  char *fields;
+  FILE *fh;
+  int ret;
+
+  if (rio == NULL || jobs == NULL)
+    return -EINVAL;
+
+  *jobs = NULL;
+
+  if ((ret = state_path_rio (rio, "journal", path, PATH_MAX)) != URIO_SUCCESS)
+    return ret;
+
+  if ((fh = fopen (path, "r")) == NULL)
+    return -errno;
+
+  if (fgets (line, JOURNAL_LINE, fh) == NULL || strncmp (line, JOURNAL_MAGIC, strlen (JOURNAL_MAGIC)) != 0) {
+    rio_log (rio, -EINVAL, "journal_load_rio: %s is not a rioutil journal\n", path);
+
+    fclose (fh);
+    return -EINVAL;
+  }
+
+  while (fgets (line, JOURNAL_LINE, fh) != NULL) {
+    /* the last record was not completely written */
+    if (line[strlen (line) - 1] != '\n')
+      break;
+
+    line[strlen (line) - 1] = '\0';
+
+    if (sscanf (line, "done %i", &job) == 1) {
+      if (job >= 0 && job < num_jobs)
+	list[job].done = 1;
+
+      continue;
+    }
+
+    if (sscanf (line, "plan %i %15s %u %x %u%n", &job, op, &memory_unit, &rio_num, &size, &offset) != 5 ||
+	job != num_jobs)
+      continue;
+
+    if (num_jobs == max_jobs) {
+      max_jobs = max_jobs ? 2 * max_jobs : 64;
+
+      if ((tmp = realloc (list, max_jobs * sizeof (rio_job_t))) == NULL) {
+	journal_free_rio (list, num_jobs);
+	fclose (fh);
+
+	return -ENOMEM;
+      }
+
+      list = tmp;
+    }
+
+    memset (&list[num_jobs], 0, sizeof (rio_job_t));
+
+    for (i = 0 ; i < sizeof (job_names) / sizeof (job_names[0]) ; i++)
+      if (strcmp (op, job_names[i]) == 0)
+	list[num_jobs].op = i;
+
+    list[num_jobs].memory_unit = memory_unit;
+    list[num_jobs].rio_num     = rio_num;
+    list[num_jobs].size        = size;
+
+    /* skip the tab before the first field */
+    fields = (line[offset] == '\t') ? &line[offset + 1] : NULL;
+
+    list[num_jobs].path   = get_field (&fields);
+    list[num_jobs].name   = get_field (&fields);
+    list[num_jobs].artist = get_field (&fields);
+    list[num_jobs].title  = get_field (&fields);
+    list[num_jobs].album  = get_field (&fields);
+
+    num_jobs++;
+  }
+
+  fclose (fh);
+
+  rio_log (rio, 0, "journal_load_rio: %i jobs in %s\n", num_jobs, path);
+
+  *jobs = list;
+
+  return num_jobs;
+}
+
+void journal_free_rio (rio_job_t *jobs, int num_jobs) {
+  int i;
+
+  if (jobs == NULL)
+    return;
+
+  for (i = 0 ; i < num_jobs ; i++) {
+    free (jobs[i].path);
+    free (jobs[i].name);
+    free (jobs[i].artist);
+    free (jobs[i].title);
+    free (jobs[i].album);
+  }
+
+  free (jobs);
+}
+
+/* find the file list entry a download or delete refers to */
+static flist_rio_t *journal_find_file (rios_t *rio, rio_job_t *job) {
+  flist_rio_t *tmp;
+
+  if (job->memory_unit >= MAX_MEM_UNITS)
+    return NULL;
+
+  for (tmp = rio->info.memory[job->memory_unit].files ; tmp ; tmp = tmp->next)
+    if (tmp->rio_num == job->rio_num && (job->name == NULL || strcmp (tmp->name, job->name) == 0))
+      return tmp;
+
+  return NULL;
+}
+
+/*
+  journal_reconcile_rio:
+
+  Compare the unfinished jobs of a journal with the device and the local
+  files and mark the ones that are finished after all. The device only
+  lists an uploaded file once its header has been sent, after all of its
+  data, so an upload that is cut short leaves nothing behind on the
+  device. A local file says nothing about a download: it may have been
+  cut short after its space was reserved, so only a download recorded as
+  done is finished. The download is run again over whatever it left.
+
+  Returns the number of jobs that still need to be done.
+*/
+int journal_reconcile_rio (rios_t *rio, rio_job_t *jobs, int num_jobs) {
+  flist_rio_t *tmp, probe;
+  int i, pending = 0;
+
+  if (rio == NULL || (jobs == NULL && num_jobs > 0))
+    return -EINVAL;
+
+  for (i = 0 ; i < num_jobs ; i++) {
+    rio_job_t *job = &jobs[i];
+
+    if (job->done)
+      continue;
+
+    switch (job->op) {
+    case RIO_JOB_UPLOAD:
+      if (job->path == NULL || probe_file_rio (rio, job->path, &probe) != URIO_SUCCESS) {
+	rio_log (rio, 0, "journal_reconcile_rio: %s can no longer be read\n", job->path);
+
+	job->done = 1;
+	break;
+      }
+
+      /* the upload finished before it could be recorded */
+      if (job->memory_unit < MAX_MEM_UNITS)
+	for (tmp = rio->info.memory[job->memory_unit].files ; tmp ; tmp = tmp->next)
+	  if (strcmp (tmp->name, probe.name) == 0 && tmp->size == probe.size) {
+	    job->done = 1;
+	    break;
+	  }
+
+      break;
+    case RIO_JOB_DOWNLOAD:
+      if (journal_find_file (rio, job) == NULL) {
+	rio_log (rio, 0, "journal_reconcile_rio: file %x is no longer on the device\n", job->rio_num);
+
+	job->done = 1;
+      }
+
+      break;
+    case RIO_JOB_DELETE:
+      if (journal_find_file (rio, job) == NULL)
+	job->done = 1;
+
+      break;
+    default:
+      job->done = 1;
+    }
+
+    if (!job->done)
+      pending++;
+  }
+
+  rio_log (rio, 0, "journal_reconcile_rio: %i of %i jobs left\n", pending, num_jobs);
+
+  return pending;
+}
@@ -0,0 +1,467 @@
+/**
+ *   (c) 2001-2006 Nathan Hjelm <hjelmn@users.sourceforge.net>
+ *   v1.0 manifest.c
+ *
+ *   Host-side record of the files that have been uploaded to a device.
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU Library Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU Library Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ **/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+
+#include <sys/stat.h>
+
+#include "rioi.h"
+
+#if !defined (PATH_MAX)
+#define PATH_MAX 255
+#endif
+
+#define MANIFEST_MAGIC "# rioutil manifest v1"
+
+/*
+  state_path_rio:
+
+  Build the path of a per-device state file: ~/.rioutil/<kind>-<serial number>.
+  The directory is created if it does not exist.
+*/
+int state_path_rio (rios_t *rio, char *kind, char *path, size_t path_size) {
+  char *home = getenv ("HOME");
+  int i, len;
+
+  if (rio == NULL || kind == NULL || path == NULL)
+    return -EINVAL;
+
+  if (home == NULL)
+    home = ".";
+
+  len = snprintf (path, path_size, "%s/.rioutil", home);
+  if (len < 0 || len >= path_size)
+    return -ENAMETOOLONG;
+
+  if (mkdir (path, 0700) < 0 && errno != EEXIST)
+    return -errno;
+
+  len += snprintf (&path[len], path_size - len, "/%s-", kind);
+
+  for (i = 0 ; i < 16 && len < path_size ; i++)
+    len += snprintf (&path[len], path_size - len, "%02x", rio->info.serial_number[i]);
+
+  if (len >= path_size)
+    return -ENAMETOOLONG;
+
+  return URIO_SUCCESS;
+}
+
+static int manifest_compare (u_int8_t memory_unit, u_int32_t rio_num, struct manifest_entry *entry) {
+  if (memory_unit != entry->memory_unit)
+    return (memory_unit < entry->memory_unit) ? -1 : 1;
+
+  if (rio_num != entry->rio_num)
+    return (rio_num < entry->rio_num) ? -1 : 1;
+
+  return 0;
+}
+
+/* returns the index of the entry or the index at which it should be inserted */
+static int manifest_search (manifest_t *manifest, u_int8_t memory_unit, u_int32_t rio_num, int *found) {
+  int low = 0, high = manifest->num_entries - 1, mid, cmp;
+
+  *found = 0;
+
+  while (low <= high) {
+    mid = (low + high) / 2;
+    cmp = manifest_compare (memory_unit, rio_num, &manifest->entries[mid]);
+
+    if (cmp == 0) {
+      *found = 1;
+      return mid;
+    } else if (cmp < 0)
+      high = mid - 1;
+    else
+      low = mid + 1;
+  }
+
+  return low;
+}
+
+struct manifest_entry *manifest_lookup_rio (rios_t *rio, u_int8_t memory_unit, u_int32_t rio_num) {
+  manifest_t *manifest;
+  int i, found;
+
+  if (rio == NULL || rio->manifest == NULL)
+    return NULL;
+
+  manifest = (manifest_t *)rio->manifest;
+
+  i = manifest_search (manifest, memory_unit, rio_num, &found);
+
+  return found ? &manifest->entries[i] : NULL;
+}
+
+int manifest_record_rio (rios_t *rio, u_int8_t memory_unit, u_int32_t rio_num, u_int32_t size,
+			 u_int64_t digest, u_int64_t audio) {
+  manifest_t *manifest;
+  struct manifest_entry *entry;
+  int i, found;
+
+  if (rio == NULL || rio->manifest == NULL)
+    return URIO_SUCCESS;
+
+  manifest = (manifest_t *)rio->manifest;
+
+  i = manifest_search (manifest, memory_unit, rio_num, &found);
+
+  if (!found) {
+    if (manifest->num_entries == manifest->max_entries) {
+      int new_max = manifest->max_entries ? 2 * manifest->max_entries : 64;
+
+      entry = realloc (manifest->entries, new_max * sizeof (struct manifest_entry));
+      if (entry == NULL) {
+	rio_log (rio, -errno, "manifest_record_rio: realloc returned an error (%s).\n", strerror (errno));
+
+	return -errno;
+      }
+
+      manifest->entries     = entry;
+      manifest->max_entries = new_max;
+    }
+
+    memmove (&manifest->entries[i + 1], &manifest->entries[i],
+	     (manifest->num_entries - i) * sizeof (struct manifest_entry));
+    manifest->num_entries++;
+  }
+
+  entry = &manifest->entries[i];
+
+  memset (entry, 0, sizeof (struct manifest_entry));
+  entry->memory_unit = memory_unit;
+  entry->rio_num     = rio_num;
+  entry->size        = size;
+  entry->digest      = digest;
+  entry->audio       = audio;
+
+  manifest->dirty = 1;
+
+  return URIO_SUCCESS;
+}
+
+/*
+  manifest_forget_rio:
+
+  Remove an entry from the manifest. A rio_num of 0 (never a valid file
+  number) removes every entry on the memory unit.
+*/
+void manifest_forget_rio (rios_t *rio, u_int8_t memory_unit, u_int32_t rio_num) {
+  manifest_t *manifest;
+  int i, j, found;
+
+  if (rio == NULL || rio->manifest == NULL)
+    return;
+
+  manifest = (manifest_t *)rio->manifest;
+
+  if (rio_num == 0) {
+    for (i = 0, j = 0 ; i < manifest->num_entries ; i++)
+      if (manifest->entries[i].memory_unit != memory_unit)
+	manifest->entries[j++] = manifest->entries[i];
+
+    if (j != manifest->num_entries)
+      manifest->dirty = 1;
+
+    manifest->num_entries = j;
+
+    return;
+  }
+
+  i = manifest_search (manifest, memory_unit, rio_num, &found);
+  if (!found)
+    return;
+
+  memmove (&manifest->entries[i], &manifest->entries[i + 1],
+	   (manifest->num_entries - i - 1) * sizeof (struct manifest_entry));
+  manifest->num_entries--;
+  manifest->dirty = 1;
+}
+
+/*
+  open_manifest_rio:
+
+  Load the manifest for this device. A missing manifest file is not an error;
+  it will be created when the manifest is saved.
+*/
+int open_manifest_rio (rios_t *rio, char *file_name) {
+  char path[PATH_MAX];
+  char line[256];
+  manifest_t *manifest;
+  FILE *fh;
+  int ret;
+
+  if (rio == NULL)
+    return -EINVAL;
+
+  if (file_name == NULL) {
+    if ((ret = state_path_rio (rio, "manifest", path, PATH_MAX)) != URIO_SUCCESS)
+      return ret;
+
+    file_name = path;
+  }
+
+  if (rio->manifest != NULL) {
+    /* already open: nothing to do */
+    if (strcmp (((manifest_t *)rio->manifest)->file_name, file_name) == 0)
+      return URIO_SUCCESS;
+
+    save_manifest_rio (rio);
+    free_manifest_rio (rio);
+  }
+
+  manifest = calloc (1, sizeof (manifest_t));
+  if (manifest == NULL)
+    return -errno;
+
+  manifest->file_name = strdup (file_name);
+  rio->manifest = manifest;
+
+  rio_log (rio, 0, "open_manifest_rio: using manifest %s\n", file_name);
+
+  fh = fopen (file_name, "r");
+  if (fh == NULL)
+    return (errno == ENOENT) ? URIO_SUCCESS : -errno;
+
+  if (fgets (line, 256, fh) == NULL || strncmp (line, MANIFEST_MAGIC, strlen (MANIFEST_MAGIC)) != 0) {
+    rio_log (rio, -EINVAL, "open_manifest_rio: %s is not a rioutil manifest\n", file_name);
+
+    fclose (fh);
+    return -EINVAL;
+  }
+
+  while (fgets (line, 256, fh) != NULL) {
+    unsigned int memory_unit, rio_num, size;
+    unsigned long long digest, audio = 0;
+
+    /* older manifests have no audio fingerprint */
+    if (sscanf (line, "%u %x %u %llx %llx", &memory_unit, &rio_num, &size, &digest, &audio) < 4)
+      continue;
+
+    manifest_record_rio (rio, memory_unit, rio_num, size, digest, audio);
+  }
+
+  fclose (fh);
+
+  manifest->dirty = 0;
+
+  rio_log (rio, 0, "open_manifest_rio: %i entries\n", manifest->num_entries);
+
+  return URIO_SUCCESS;
+}
+
+int save_manifest_rio (rios_t *rio) {
+  char tmp_name[PATH_MAX];
+  manifest_t *manifest;
+  FILE *fh;
+  int i;
+
+  if (rio == NULL)
+    return -EINVAL;
+
+  manifest = (manifest_t *)rio->manifest;
+
+  if (manifest == NULL || manifest->dirty == 0)
+    return URIO_SUCCESS;
+
+  /* write a new copy and move it into place so a crash can not leave a partial manifest */
+  snprintf (tmp_name, PATH_MAX, "%s.new", manifest->file_name);
+
+  fh = fopen (tmp_name, "w");
+  if (fh == NULL) {
+    rio_log (rio, -errno, "save_manifest_rio: could not create %s: %s\n", tmp_name, strerror (errno));
+
+    return -errno;
+  }
+
+  fprintf (fh, "%s\n", MANIFEST_MAGIC);
+
+  for (i = 0 ; i < manifest->num_entries ; i++) {
+    struct manifest_entry *entry = &manifest->entries[i];
+
+    fprintf (fh, "%u %x %u %016llx %016llx\n", entry->memory_unit, entry->rio_num, entry->size,
+	     (unsigned long long)entry->digest, (unsigned long long)entry->audio);
+  }
+
+  if (fclose (fh) != 0 || rename (tmp_name, manifest->file_name) < 0) {
+    rio_log (rio, -errno, "save_manifest_rio: could not write %s: %s\n", manifest->file_name,
+	     strerror (errno));
+
+    unlink (tmp_name);
+    return -errno;
+  }
+
+  manifest->dirty = 0;
+
+  return URIO_SUCCESS;
+}
+
+void free_manifest_rio (rios_t *rio) {
+  manifest_t *manifest = (manifest_t *)rio->manifest;
+
+  if (manifest == NULL)
+    return;
+
+  free (manifest->entries);
+  free (manifest->file_name);
+  free (manifest);
+
+  rio->manifest = NULL;
+}
+
+/*
+  digest_file_rio:
+
+  Compute the digest of size bytes of a local file starting at skip. This
+  covers the same bytes do_upload sends to the device.
+*/
+int digest_file_rio (char *file_name, off_t skip, u_int32_t size, u_int64_t *digest) {
+  unsigned char buffer[RIO_FTS];
+  u_int64_t hash = FNV64_INIT;
+  ssize_t amount;
+  int fd;
+
+  if ((fd = open (file_name, O_RDONLY)) < 0)
+    return -errno;
+
+  if (lseek (fd, skip, SEEK_SET) < 0) {
+    close (fd);
+    return -errno;
+  }
+
+  while (size > 0 && (amount = read (fd, buffer, (size < RIO_FTS) ? size : RIO_FTS)) > 0) {
+    hash  = fnv64_rio (hash, buffer, amount);
+    size -= amount;
+  }
+
+  close (fd);
+
+  if (size != 0)
+    return -EIO;
+
+  *digest = hash;
+
+  return URIO_SUCCESS;
+}
+
+/*
+  find_duplicate_rio:
+
+  Look for a file on the device that is identical to a local file. Candidates
+  must match on size, duration, title, artist, and album. A candidate is only
+  reported if the manifest has a digest for it that matches the local file.
+*/
+int find_duplicate_rio (rios_t *rio, char *file_name, flist_rio_t *entry, u_int8_t *memory_unit) {
+  struct manifest_entry *mentry;
+  struct stat statinfo;
+  flist_rio_t *tmp;
+  u_int64_t digest = 0;
+  int have_digest = 0;
+  int i;
+
+  if (rio == NULL || file_name == NULL || entry == NULL)
+    return -EINVAL;
+
+  if (rio->manifest == NULL)
+    return -ENOENT;
+
+  for (i = 0 ; i < rio->info.total_memory_units ; i++)
+    for (tmp = rio->info.memory[i].files ; tmp ; tmp = tmp->next) {
+      if (tmp->size != entry->size || tmp->time != entry->time ||
+	  strcmp (tmp->title, entry->title) || strcmp (tmp->artist, entry->artist) ||
+	  strcmp (tmp->album, entry->album))
+	continue;
+
+      mentry = manifest_lookup_rio (rio, i, tmp->rio_num);
+      if (mentry == NULL || mentry->size != tmp->size)
+	continue;
+
+      /* only read the local file once we have something to compare it against */
+      if (!have_digest) {
+	if (stat (file_name, &statinfo) < 0)
+	  return -errno;
+
+	if (digest_file_rio (file_name, statinfo.st_size - entry->size, entry->size, &digest) != URIO_SUCCESS)
+	  return -ENOENT;
+
+	have_digest = 1;
+      }
+
+      if (mentry->digest == digest) {
+	rio_log (rio, 0, "find_duplicate_rio: %s is file %i on memory unit %i\n", file_name, tmp->num, i);
+
+	if (memory_unit)
+	  *memory_unit = i;
+
+	return tmp->num;
+      }
+    }
+
+  return -ENOENT;
+}
+
+/*
+  same_audio_rio:
+
+  Check whether a local file has the same audio as file fileno on the
+  device, so only their tags can differ. The device's file must have been
+  uploaded while the manifest was open.
+
+  PostCondition:
+      - 1 if the audio is the same.
+      - 0 if it differs or is not known.
+      - < 0 if an error occured.
+*/
+int same_audio_rio (rios_t *rio, char *file_name, u_int8_t memory_unit, u_int32_t fileno) {
+  struct manifest_entry *mentry;
+  flist_rio_t *tmp;
+  info_page_t info;
+  u_int64_t audio;
+  int ret;
+
+  if (rio == NULL || file_name == NULL || memory_unit >= rio->info.total_memory_units)
+    return -EINVAL;
+
+  for (tmp = rio->info.memory[memory_unit].files ; tmp ; tmp = tmp->next)
+    if (tmp->num == fileno)
+      break;
+
+  if (tmp == NULL)
+    return -ENOENT;
+
+  mentry = manifest_lookup_rio (rio, memory_unit, tmp->rio_num);
+  if (mentry == NULL || mentry->audio == 0)
+    return 0;
+
+  if ((ret = file_info_rio (rio, file_name, &info)) != 0)
+    return ret;
+
+  audio = info.audio;
+  free (info.data);
+
+  return (audio != 0 && audio == mentry->audio) ? 1 : 0;
+}
@@ -20,6 +20,7 @@
  **/
 
 #include <string.h>
+#include <strings.h>
 #include <errno.h>
 
 #include <stdlib.h>
@@ -34,9 +35,14 @@
 #include <time.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <pthread.h>
 
 #include "rioi.h"
 
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
 #ifdef HAVE_LIBGEN_H
 #include <libgen.h>
 #endif
@@ -57,7 +63,10 @@ void mp3_debug (char *format, ...) {
 }
 
 struct mp3_file {
-  FILE *fh;
+  /* the whole file (see probe_open_rio) */
+  unsigned char *data;
+  size_t map_size;
+  size_t pos;     /* offset of the next header */
 
   int file_size;  /* Bytes */
   int tagv2_size; /* Bytes */
@@ -72,6 +81,10 @@ struct mp3_file {
   int frames;
   int xdata_size;
 
+  int samples;    /* per frame */
+  int delay;      /* encoder delay and padding (samples) */
+  int padding;
+
   int layer;
   int version;
 
@@ -134,27 +147,60 @@ size_t layer_table[] = {
 #define SAMPLERATE(header) samplerate_table[MPEG_VERSION(header)][MPEG_SAMPLERATEI(header)]
 #define PADDING(header) ((MPEG_LAYER(header) == 0x3) ? 4 : 1)
 
-static size_t mpeg_frame_length (int header) {
-  double bitrate = (double)BITRATE(header) * 1000.0;
-  double samplerate = (double)SAMPLERATE(header);
-  double padding = (double)MPEG_PADDING(header);
-  char layer = MPEG_LAYER(header);
-  size_t frame_length;
+/*
+  Frame lengths (in bytes) indexed by the version, layer, bitrate, sample
+  rate and padding bits of a header (11 bits: the protection bit does not
+  matter). A length of 0 marks a header that is not valid.
+*/
+#define FRAME_INDEX(header) ((((header) >> 10) & 0x780) | (((header) >> 9) & 0x7f))
+
+static u_int16_t frame_length_table[2048];
+static pthread_once_t frame_length_once = PTHREAD_ONCE_INIT;
+
+static void frame_length_init (void) {
+  u_int32_t header;
+  int i, bitrate, samplerate, padding;
+
+  for (i = 0 ; i < 2048 ; i++) {
+    header = 0xffe00000 | ((i & 0x780) << 10) | ((i & 0x7f) << 9);
+
+    bitrate    = BITRATE(header) * 1000;
+    samplerate = SAMPLERATE(header);
+    padding    = MPEG_PADDING(header);
+
+    /* MPEG 2.5 files are not supported */
+    if (MPEG_VERSION(header) == 0 || bitrate <= 0 || samplerate <= 0)
+      frame_length_table[i] = 0;
+    else if (MPEG_LAYER(header) == 0x3) /* layer I */
+      frame_length_table[i] = (12 * bitrate / samplerate + padding) * 4;
+    else if (MPEG_LAYER(header) == 0x1 && MPEG_VERSION(header) != 0x3) /* MPEG 2 layer III */
+      frame_length_table[i] = 72 * bitrate / samplerate + padding;
+    else
+      frame_length_table[i] = 144 * bitrate / samplerate + padding;
+  }
+}
 
-  if (layer == 0x11)
-    frame_length = 144.0 * bitrate/samplerate + padding;
-  else
-    frame_length = (12 * bitrate/samplerate + padding) * 4.0;
+static size_t mpeg_frame_length (u_int32_t header) {
+  return frame_length_table[FRAME_INDEX(header)];
+}
 
-  return (size_t)((layer != 0x11) ? (144.0 * bitrate/samplerate + padding)
-	  : (12 * bitrate/samplerate + padding) * 4.0);
+static u_int32_t mp3_read32 (unsigned char *data) {
+  return ((u_int32_t)data[0] << 24) | (data[1] << 16) | (data[2] << 8) | data[3];
+}
+
+/* samples in each frame: 384 for layer I, 576 for MPEG 2 layer III */
+static int mpeg_frame_samples (u_int32_t header) {
+  if (MPEG_LAYER(header) == 0x3)
+    return 384;
+  else if (MPEG_LAYER(header) == 0x1 && MPEG_VERSION(header) != 0x3)
+    return 576;
+
+  return 1152;
 }
 
 /* check_mp3_header: returns 0 on success */
-static int check_mp3_header (int header) {
-  if (((header & 0xffe00000) == 0xffe00000) &&
-      (MPEG_VERSION(header) > 0.0) && (BITRATE(header) > 0)
-      && (SAMPLERATE(header) > 0))
+static int check_mp3_header (u_int32_t header) {
+  if (((header & 0xffe00000) == 0xffe00000) && mpeg_frame_length (header) > 0)
     return 0;
   else if (header == 0x4d4c4c54) /* MLLT */
     return 2;
@@ -162,211 +208,263 @@ static int check_mp3_header (int header) {
     return 1;
 }
 
-static int find_first_frame (struct mp3_file *mp3) {
-  int header;
-  int buffer;
-  int ret;
-  mp3->skippage = 0;
-
-  while (fread (&header, 4, 1, mp3->fh)) {
-    header = big32_2_arch32(header);
-
-    /* MPEG-1 Layer III */
-    if ((ret = check_mp3_header (header)) == 0) {
-      /* Check for Xing frame and skip it */
-      fseek (mp3->fh, 32, SEEK_CUR);
-      fread (&buffer, 4, 1, mp3->fh);
-
-      buffer = big32_2_arch32(buffer);
-
-      if (buffer == ('X' << 24 | 'i' << 16 | 'n' << 8 | 'g') ) {
-	int xstart = ftell (mp3->fh);
-	int xflags;
-
-	/* an mp3 with an Xing header is ALWAYS vbr */
-	mp3->vbr = 1;
+/*
+  next_candidate:
 
-	fread (&xflags, 4, 1, mp3->fh);
+  Returns the offset of the first byte at or after pos (and before end)
+  that could start a header: an 0xffe sync word or the 'M' of an MLLT
+  frame. Returns end if there is none. The byte after end - 1 must be
+  readable.
+*/
+static size_t next_candidate (unsigned char *data, size_t pos, size_t end) {
+#if defined(__SSE2__)
+  const __m128i sync = _mm_set1_epi8 ((char)0xff);
+  const __m128i sync_low = _mm_set1_epi8 ((char)0xe0);
+  const __m128i mllt = _mm_set1_epi8 ('M');
+
+  /* sixteen offsets at a time, comparing each byte and the one after it */
+  for ( ; pos + 16 <= end ; pos += 16) {
+    __m128i first  = _mm_loadu_si128 ((__m128i *)(data + pos));
+    __m128i second = _mm_loadu_si128 ((__m128i *)(data + pos + 1));
+    __m128i hits;
+    int mask;
+
+    hits = _mm_and_si128 (_mm_cmpeq_epi8 (first, sync),
+			  _mm_cmpeq_epi8 (_mm_and_si128 (second, sync_low), sync_low));
+    hits = _mm_or_si128 (hits, _mm_cmpeq_epi8 (first, mllt));
+
+    if ((mask = _mm_movemask_epi8 (hits)) != 0)
+      return pos + __builtin_ctz (mask);
+  }
+#endif
 
-	mp3_debug ("Xing flags = %08x\n", xflags);
+  for ( ; pos < end ; pos++)
+    if ((data[pos] == 0xff && (data[pos + 1] & 0xe0) == 0xe0) || data[pos] == 'M')
+      break;
 
-	if (xflags & 0x00000001) {
-	  fread (&buffer, 4, 1, mp3->fh);
-	  mp3->frames = buffer;
+  return pos;
+}
 
-	  mp3_debug ("MPEG file has %i frames\n", mp3->frames);
-	}
+static int find_first_frame (struct mp3_file *mp3) {
+  size_t start = mp3->pos, end;
+  u_int32_t header;
+  int ret;
 
-	if (xflags & 0x00000002) {
-	  fread (&buffer, 4, 1, mp3->fh);
-	  mp3->xdata_size = buffer;
+  mp3->skippage = 0;
 
-	  mp3_debug ("MPEG file has %i bytes of data\n", mp3->xdata_size);
-	}
+  /* last offset a header fits at */
+  end = (mp3->map_size > 3) ? mp3->map_size - 3 : 0;
 
-	fseek (mp3->fh, xstart, SEEK_SET);
-      }
+  while ((mp3->pos = next_candidate (mp3->data, mp3->pos, end)) < end) {
+    header = mp3_read32 (mp3->data + mp3->pos);
+    mp3->skippage = mp3->pos - start;
 
+    if ((ret = check_mp3_header (header)) == 0) {
       mp3->initial_header = header;
 
       mp3->samplerate = SAMPLERATE(header);
 
       mp3_debug ("Inital bitrate = %i\n", BITRATE(header));
 
-      fseek (mp3->fh, -40, SEEK_CUR);
       return 0;
-    } else if (ret == 2)
+    } else if (ret == 2) {
+      mp3->pos += 4;
       return -2;
-    
-    fseek (mp3->fh, -3, SEEK_CUR);
-    mp3->skippage++;
+    }
+
+    mp3->pos++;
   }
 
+  mp3->skippage = (end > start) ? end - start : 0;
+
   return -1;
 }
 
+/*
+  mp3_info_frame:
 
-static int mp3_open (char *file_name, struct mp3_file *mp3) {
-  struct stat statinfo;
+  Encoders put a frame with no audio at the start of a file that holds
+  the number of frames and bytes that follow it: a Xing (VBR) or Info
+  (CBR) header after the side information, possibly followed by a LAME
+  header with the encoder delay and padding, or a Fraunhofer VBRI header
+  32 bytes after the frame header. The frame is skipped if it is found.
+*/
+static void mp3_info_frame (struct mp3_file *mp3) {
+  u_int32_t header = mp3->initial_header;
+  unsigned char *frame = mp3->data + mp3->pos;
+  size_t frame_size = mpeg_frame_length (header);
+  size_t xing, lame;
+  u_int32_t xflags;
+  int mono = ((header & 0x000000c0) == 0x000000c0);
+
+  if (mp3->pos + frame_size > mp3->map_size)
+    return;
+
+  /* the header is followed by 17 or 32 bytes (MPEG 1) or 9 or 17 bytes (MPEG 2) of side information */
+  if (MPEG_VERSION(header) == 0x3)
+    xing = mono ? 21 : 36;
+  else
+    xing = mono ? 13 : 21;
 
-  char buffer[14];
-  int has_v1 = 0;
+  if (xing + 8 <= frame_size && (memcmp (frame + xing, "Xing", 4) == 0 || memcmp (frame + xing, "Info", 4) == 0)) {
+    /* an mp3 with an Xing header is ALWAYS vbr */
+    if (frame[xing] == 'X')
+      mp3->vbr = 1;
 
-  mp3_debug ("mp3_open: Entering...\n");
+    xflags = mp3_read32 (frame + xing + 4);
+    lame   = xing + 120;
+    xing  += 8;
 
-  memset (mp3, 0 , sizeof (struct mp3_file));
+    mp3_debug ("Xing flags = %08x\n", xflags);
 
-  if (stat (file_name, &statinfo) < 0)
-    return -errno;
+    if ((xflags & 0x00000001) && xing + 4 <= frame_size) {
+      mp3->frames = mp3_read32 (frame + xing);
+      xing += 4;
 
-  mp3->file_size = mp3->data_size = statinfo.st_size;
-  mp3->mod_date  = statinfo.st_mtime;
+      mp3_debug ("MPEG file has %i frames\n", mp3->frames);
+    }
 
-  mp3->fh = fopen (file_name, "r");
-  if (mp3->fh == NULL) 
-    return -errno;
+    if ((xflags & 0x00000002) && xing + 4 <= frame_size) {
+      mp3->xdata_size = mp3_read32 (frame + xing);
 
-  /* Adjust total_size if an id3v1 tag exists */
-  fseek (mp3->fh, -128, SEEK_END);
-  memset (buffer, 0, 5);
+      mp3_debug ("MPEG file has %i bytes of data\n", mp3->xdata_size);
+    }
 
-  fread (buffer, 1, 3, mp3->fh);
-  if (strncmp (buffer, "TAG", 3) == 0) {
-    mp3->data_size -= 128;
+    /* 12 bits each of delay and padding, 21 bytes into the LAME header */
+    if (lame + 24 <= frame_size && (memcmp (frame + lame, "LAME", 4) == 0 || memcmp (frame + lame, "Lavf", 4) == 0 ||
+				    memcmp (frame + lame, "Lavc", 4) == 0)) {
+      mp3->delay   = (frame[lame + 21] << 4) | (frame[lame + 22] >> 4);
+      mp3->padding = ((frame[lame + 22] & 0x0f) << 8) | frame[lame + 23];
 
-    has_v1 = 1;
+      mp3_debug ("LAME delay = %i, padding = %i\n", mp3->delay, mp3->padding);
+    }
+  } else if (36 + 18 <= frame_size && memcmp (frame + 36, "VBRI", 4) == 0) {
+    /* VBRI: version (2), delay (2), quality (2), bytes (4), frames (4) */
+    mp3->vbr        = 1;
+    mp3->xdata_size = mp3_read32 (frame + 46);
+    mp3->frames     = mp3_read32 (frame + 50);
 
-    mp3_debug ("mp3_open: Found id3v1 tag.\n");
-  }
-  /*                                          */
+    mp3_debug ("VBRI: MPEG file has %i frames and %i bytes of data\n", mp3->frames, mp3->xdata_size);
+  } else
+    return;
 
-  /* Check for Lyrics v2.00 */
-  fseek (mp3->fh, -9 - (has_v1 ? 128 : 0), SEEK_END);
-  memset (buffer, 0, 10);
-  fread (buffer, 1, 9, mp3->fh);
+  mp3->pos += frame_size;
+}
 
-  if (strncmp (buffer, "LYRICS200", 9) == 0) {
-    int lyrics_size;
-    mp3_debug ("mp3_open: Found Lyrics v2.00\n");
+static int mp3_open (rio_probe_t *probe, struct mp3_file *mp3) {
+  int ret;
 
-    /* Get the size of the Lyrics */
-    fseek (mp3->fh, -15, SEEK_CUR);
-    memset (buffer, 0, 7);
-    fread (buffer, 1, 6, mp3->fh);
+  mp3_debug ("mp3_open: Entering...\n");
 
-    /* Include the size if LYRICS200 (9) and the size field (6) */
-    lyrics_size = strtol (buffer, NULL, 10) + 15;
-    mp3->data_size -= lyrics_size;
+  memset (mp3, 0 , sizeof (struct mp3_file));
 
-    mp3_debug ("mp3_open: Lyrics are 0x%x Bytes in length.\n", lyrics_size);
-  }
+  pthread_once (&frame_length_once, frame_length_init);
 
-  /* find and skip id3v2 tag if it exists */
-  fseek (mp3->fh, 0, SEEK_SET);
-  fread (buffer, 1, 14, mp3->fh);    
-  mp3->tagv2_size = id3v2_size (buffer);
+  mp3->data      = probe->data;
+  mp3->map_size  = probe->size;
+  mp3->file_size = probe->size;
+  mp3->mod_date  = probe->statinfo.st_mtime;
+
+  /* the id3v1 tag and Lyrics v2.00 are not part of the data */
+  mp3->data_size = probe->data_end;
 
-  fseek (mp3->fh, mp3->tagv2_size, SEEK_SET);
+  /* find and skip id3v2 tag if it exists */
+  mp3->tagv2_size = probe->tagv2_size;
+  mp3->pos        = probe->tagv2_size;
 
   mp3_debug ("mp3_open: id3v2 size: 0x%08x\n", mp3->tagv2_size);
   /****************************************/
 
   mp3->vbr = 0;
 
+  if ((ret = find_first_frame (mp3)) < 0)
+    return ret;
+
+  mp3_info_frame (mp3);
+
   mp3_debug ("mp3_open: Complete\n");
 
-  return find_first_frame (mp3);
+  return 0;
 }
 
-#define FRAME_COUNT 30
+/*
+  mp3_scan:
 
+  Finds the length of the file. The frame count from an Xing, Info or
+  VBRI header is trusted, otherwise every frame is walked, so the
+  duration is exact for both CBR and VBR files.
+*/
 static int mp3_scan (struct mp3_file *mp3) {
-  int header;
+  u_int32_t header;
   int ret;
   int frames = 0;
   int last_bitrate = -1;
   int total_framesize = 0;
+  long long samples;
 
   size_t bitrate;
   int frame_size;
 
   mp3_debug ("mp3_scan: Entering...\n");
 
-  if (mp3->frames == 0 || mp3->xdata_size == 0) {
-    while (ftell (mp3->fh) < mp3->data_size && (frames < FRAME_COUNT || mp3->vbr)) {
-      fread (&header, 4, 1, mp3->fh);
+  mp3->samples = mpeg_frame_samples (mp3->initial_header);
+
+  if (mp3->frames == 0) {
+    while (mp3->pos < mp3->data_size) {
+      if (mp3->pos + 4 > mp3->map_size)
+	break;
+
+      header = mp3_read32 (mp3->data + mp3->pos);
 
-      header = big32_2_arch32 (header);
-      
       if (check_mp3_header (header) != 0) {
-	fseek (mp3->fh, -4, SEEK_CUR);
+	mp3_debug ("mp3_scan: Invalid header %08x %08x Bytes into the file.\n", header, mp3->pos);
 
-	mp3_debug ("mp3_scan: Invalid header %08x %08x Bytes into the file.\n", header, ftell(mp3->fh));
-	
 	if ((ret = find_first_frame (mp3)) == -1) {
 	  mp3_debug ("mp3_scan: An error occured at line: %i\n", __LINE__);
-	  
+
 	  /* This is hack-ish, but there might be junk at the end of the file. */
-	  
+
 	  break;
 	} else if (ret == -2) {
 	  mp3_debug ("mp3_scan: Ran into MLLT frame.\n");
-	  
-	  mp3->data_size -= (mp3->file_size) - ftell (mp3->fh);
-	  
+
+	  mp3->data_size -= (mp3->file_size) - mp3->pos;
+
 	  break;
 	}
-	
+
 	continue;
       }
-      
+
       bitrate = BITRATE(header);
-      
+
       if (!mp3->vbr && (last_bitrate != -1) && (bitrate != last_bitrate))
 	mp3->vbr = 1;
       else
 	last_bitrate = bitrate;
-      
+
       frame_size = mpeg_frame_length (header);
       total_framesize += frame_size;
-      fseek (mp3->fh, frame_size - 4, SEEK_CUR);      
+      mp3->pos += frame_size;
       frames++;
     }
 
-    if (frames == FRAME_COUNT) {
-      frames = (int)(((double)(mp3->data_size - mp3->tagv2_size) * FRAME_COUNT) / (double)total_framesize);
-      total_framesize = mp3->data_size - mp3->tagv2_size;
-    }
-
-    if (mp3->frames == 0)
-      mp3->frames = frames;
+    mp3->frames = frames;
 
     if (mp3->xdata_size == 0)
       mp3->xdata_size = total_framesize;
-  }
+  } else if (mp3->xdata_size == 0)
+    mp3->xdata_size = mp3->data_size - mp3->pos;
+
+  samples = (long long)mp3->frames * mp3->samples - mp3->delay - mp3->padding;
 
-  mp3->length     = (int)((double)mp3->frames * 26.12245); /* each mpeg frame represents 26.12245ms */
-  mp3->bitrate    = (int)(((float)mp3->xdata_size * 8.0)/(float)mp3->length);
+  if (mp3->samplerate > 0 && samples > 0)
+    mp3->length = (int)(samples * 1000 / mp3->samplerate);
+  else
+    mp3->length = 0;
+
+  if (mp3->length > 0)
+    mp3->bitrate  = (int)(((float)mp3->xdata_size * 8.0)/(float)mp3->length);
 
   mp3_debug ("mp3_scan: Finished scan. SampleRate: %i, BitRate: %i, Length: %i, Frames: %i.\n",
 	     mp3->samplerate, mp3->bitrate, mp3->length, mp3->frames);
@@ -377,69 +475,275 @@ static int mp3_scan (struct mp3_file *mp3) {
   return 0;
 }
 
-static void mp3_close (struct mp3_file *mp3) {
-  fclose (mp3->fh);
-}
-
-static int get_mp3_info (char *file_name, rio_file_t *mp3_file) {
+static int get_mp3_info (rio_probe_t *probe, rio_file_t *mp3_file) {
   struct mp3_file mp3;
+  int skippage;
 
-  if (mp3_open (file_name, &mp3) < 0)
+  if (mp3_open (probe, &mp3) < 0)
     return -1;
 
+  /* junk found while scanning is not in front of the first frame */
+  skippage = mp3.skippage;
+
   mp3_scan (&mp3);
-  mp3_close (&mp3);
 
   mp3_file->bit_rate    = mp3.bitrate << 7;
   mp3_file->sample_rate = mp3.samplerate;
   mp3_file->time        = mp3.length/1000;
   mp3_file->size        = mp3.file_size;
 
-  return mp3.skippage;
+  return skippage;
 }
 
 
+enum {
+  MP3_STREAM_START = 0, /* looking for an id3v2 tag */
+  MP3_STREAM_SYNC,      /* looking for the next header */
+  MP3_STREAM_FIRST      /* reading the first frame */
+};
+
 /*
-  mp3_info:
-    Function takes in a file name (MP3) and returns a
-  Info structure containing the amount of junk (in bytes)
-  and a compete Rio header struct.
+  mp3_stream_init_rio:
+
+  Start parsing an MP3 that is only seen a block at a time, such as one
+  uploaded from a pipe. Frames are counted as the blocks go by; nothing
+  but a header or the first frame is ever kept.
+*/
+void mp3_stream_init_rio (mp3_stream_t *stream) {
+  memset (stream, 0, sizeof (mp3_stream_t));
+
+  pthread_once (&frame_length_once, frame_length_init);
+
+  stream->state = MP3_STREAM_START;
+  stream->want  = 10;
+}
+
+/* the first frame may be an Xing, Info or VBRI frame (see mp3_info_frame) */
+static void mp3_stream_first (mp3_stream_t *stream) {
+  struct mp3_file mp3;
+
+  memset (&mp3, 0, sizeof (struct mp3_file));
+
+  mp3.data           = stream->buffer;
+  mp3.map_size       = stream->have;
+  mp3.initial_header = stream->first_header;
+
+  mp3_info_frame (&mp3);
+
+  if (mp3.pos == 0) {
+    stream->frames++;
+    stream->frame_bytes += stream->have;
+  } else {
+    stream->delay   = mp3.delay;
+    stream->padding = mp3.padding;
+  }
+}
+
+/* act on a full buffer */
+static void mp3_stream_buffer (mp3_stream_t *stream) {
+  unsigned char *buffer = stream->buffer;
+  u_int32_t header;
+  size_t frame_size;
+
+  switch (stream->state) {
+  case MP3_STREAM_START:
+    stream->state = MP3_STREAM_SYNC;
+
+    if (memcmp (buffer, "ID3", 3) == 0) {
+      /* the rest of the tag (and its footer) */
+      stream->skip = ((buffer[6] & 0x7f) << 21) | ((buffer[7] & 0x7f) << 14) |
+	((buffer[8] & 0x7f) << 7) | (buffer[9] & 0x7f);
+      if (buffer[5] & 0x10) /* footer */
+	stream->skip += 10;
+
+      stream->have = 0;
+      break;
+    }
+
+    /* fall through - the ten bytes may hold a header */
+  case MP3_STREAM_SYNC:
+    for ( ; stream->have >= 4 ; memmove (buffer, buffer + 1, --stream->have)) {
+      header = mp3_read32 (buffer);
+
+      if (check_mp3_header (header) != 0)
+	continue;
+
+      /* the version, layer and sample rate do not change */
+      if (stream->first_header && (header & 0xfffe0c00) != (stream->first_header & 0xfffe0c00))
+	continue;
+
+      frame_size = mpeg_frame_length (header);
+      if (frame_size < stream->have)
+	continue;
+
+      if (stream->first_header == 0) {
+	stream->first_header = header;
+	stream->samplerate   = SAMPLERATE(header);
+	stream->samples      = mpeg_frame_samples (header);
+
+	if (frame_size <= sizeof (stream->buffer)) {
+	  stream->state = MP3_STREAM_FIRST;
+	  stream->want  = frame_size;
+
+	  return;
+	}
+      }
+
+      stream->frames++;
+      stream->frame_bytes += frame_size;
+      stream->skip         = frame_size - stream->have;
+      stream->have         = 0;
+
+      break;
+    }
+
+    break;
+  case MP3_STREAM_FIRST:
+    mp3_stream_first (stream);
+
+    stream->state = MP3_STREAM_SYNC;
+    stream->have  = 0;
+
+    break;
+  }
+
+  stream->want = 4;
+}
+
+/*
+  mp3_stream_feed_rio:
+
+  Parse the next length bytes of the stream.
 */
-int mp3_info (info_page_t *newInfo, char *file_name, rios_t *rio){
-  rio_file_t *mp3_file = newInfo->data;
+void mp3_stream_feed_rio (mp3_stream_t *stream, unsigned char *data, size_t length) {
+  size_t amount;
 
+  while (length > 0) {
+    /* the rest of a frame or tag */
+    if (stream->skip > 0) {
+      amount = (stream->skip < length) ? stream->skip : length;
+
+      stream->skip -= amount;
+      data         += amount;
+      length       -= amount;
+
+      continue;
+    }
+
+    amount = stream->want - stream->have;
+    if (amount > length)
+      amount = length;
+
+    memcpy (stream->buffer + stream->have, data, amount);
+    stream->have += amount;
+    data         += amount;
+    length       -= amount;
+
+    if (stream->have == stream->want)
+      mp3_stream_buffer (stream);
+  }
+}
+
+/*
+  mp3_stream_finish_rio:
+
+  Fill in the length, sample rate and average bitrate of the stream once
+  all of it has been seen. file is left alone if no frames were found.
+*/
+void mp3_stream_finish_rio (mp3_stream_t *stream, rio_file_t *file) {
+  long long samples = (long long)stream->frames * stream->samples - stream->delay - stream->padding;
+  long long length;
+
+  if (stream->frames == 0 || stream->samplerate <= 0 || samples <= 0)
+    return;
+
+  length = samples * 1000 / stream->samplerate;
+
+  file->time        = length / 1000;
+  file->sample_rate = stream->samplerate;
+
+  if (length > 0)
+    file->bit_rate  = (int)(stream->frame_bytes * 8 / length) << 7;
+
+  mp3_debug ("mp3_stream_finish_rio: %lli frames, %lli ms, %i Hz.\n", stream->frames, length,
+	     stream->samplerate);
+}
+
+/*
+  mp3_header:
+    Fill in the header of the probed MP3 and return the amount of junk
+  (in bytes) in front of the first frame, or -1 if it is not an MP3.
+*/
+static int mp3_header (rio_probe_t *probe, rio_file_t *mp3_file, const char *out_encoding) {
   int id3_version;
   int mp3_header_offset;
+  int skip;
 
-  if ((mp3_header_offset = get_mp3_info(file_name, mp3_file)) < 0) {
-    free(mp3_file);
-    newInfo->data = NULL;
+  if ((mp3_header_offset = get_mp3_info(probe, mp3_file)) < 0)
     return -1;
-  }
 
-  const char *out_encoding = (rio->info.caps & CAP_UTF8STRINGS) ? "UTF-8" : "ISO-8859-1//TRANSLIT";
-  
-  if ((id3_version = get_id3_info(file_name, mp3_file, out_encoding)) < 0) {
-    free(mp3_file);
-    newInfo->data = NULL;
+  if ((id3_version = get_id3_info(probe, mp3_file, out_encoding)) < 0)
     return -1;
-  }
   
   /* the file that will be uploaded is smaller if there is junk */
   if (mp3_header_offset > 0 && !(id3_version >= 2)) {
       mp3_file->size -= mp3_header_offset;
-      newInfo->skip = mp3_header_offset;
+      skip = mp3_header_offset;
   } else
     /* dont want to not copy the id3v2 tags */
-    newInfo->skip = 0;
+    skip = 0;
 
   /* it is an mp3 all right, finish up the INFO structure */
   mp3_file->bits     = 0x10000b11;
   mp3_file->type     = TYPE_MP3;
   mp3_file->foo4     = 0x00020000;
 
-  if (rio->info.caps & CAP_UTF8STRINGS)
+  if (strncasecmp (out_encoding, "UTF-8", 5) == 0)
       mp3_file->bits |= ATTR_UTF8STRINGS;
 
+  return skip;
+}
+
+/*
+  probe_buffer_rio:
+    Build the Rio header for an MP3 that is already in memory. encoding is
+  the character set of the strings: UTF-8 for players with UTF-8 strings,
+  ISO-8859-1//TRANSLIT for the rest. No file i/o is done, nothing is kept
+  between calls and out is the only thing written, so it can be called
+  from any thread.
+
+  PostCondition:
+      - >= 0 the amount of junk (in bytes) before the first frame. out->size
+        does not include it.
+      - < 0 if buf does not hold an MP3.
+*/
+int probe_buffer_rio (const void *buf, size_t len, rio_file_t *out, const char *encoding) {
+  rio_probe_t probe;
+
+  if (buf == NULL || out == NULL || encoding == NULL)
+    return -EINVAL;
+
+  probe_memory_rio (buf, len, &probe);
+
+  return mp3_header (&probe, out, encoding);
+}
+
+/*
+  mp3_info:
+    Function takes in a probed file (MP3) and returns a
+  Info structure containing the amount of junk (in bytes)
+  and a compete Rio header struct. The header belongs to
+  the caller, even if this fails.
+*/
+int mp3_info (info_page_t *newInfo, rio_probe_t *probe, rios_t *rio){
+  const char *out_encoding = (rio == NULL || (rio->info.caps & CAP_UTF8STRINGS)) ? "UTF-8" :
+    "ISO-8859-1//TRANSLIT";
+  int skip;
+
+  if ((skip = mp3_header (probe, newInfo->data, out_encoding)) < 0)
+    return -1;
+
+  newInfo->skip = skip;
+
   return URIO_SUCCESS;
 }
@@ -0,0 +1,237 @@
+/**
+ *   (c) 2001-2006 Nathan Hjelm <hjelmn@users.sourceforge.net>
+ *   v1.0 plan.c
+ *
+ *   Assign a batch of uploads to the memory units of a device.
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU Library Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU Library Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ **/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <errno.h>
+
+#include "rioi.h"
+
+/* upper bound on the size of the subset-sum table (capacity cells * files) */
+#define PLAN_MAX_CELLS (1 << 27)
+
+/*
+  fill_unit:
+
+  Choose the subset of the unplaced files that fills a unit of the given
+  capacity (in granules) as completely as possible. The table stores, for
+  each reachable fill level, the first file that reached it. Walking back
+  from the best level through those files yields a subset with exactly
+  that fill.
+*/
+static int fill_unit (u_int64_t capacity, u_int64_t *weights, int num_files, int *units, int unit) {
+  u_int64_t total = 0, scale = 1, cap, w, c;
+  int *reach;
+  int i, candidates = 0, placed = 0;
+
+  for (i = 0 ; i < num_files ; i++)
+    if (units[i] == -1 && weights[i] <= capacity) {
+      total += weights[i];
+      candidates++;
+    }
+
+  if (candidates == 0)
+    return 0;
+
+  /* everything fits, no need to choose */
+  if (total <= capacity) {
+    for (i = 0 ; i < num_files ; i++)
+      if (units[i] == -1 && weights[i] <= capacity) {
+	units[i] = unit;
+	placed++;
+      }
+
+    return placed;
+  }
+
+  /* keep the table bounded by coarsening the granule. rounding the sizes up
+     and the capacity down keeps the plan conservative. */
+  if (capacity > PLAN_MAX_CELLS / candidates)
+    scale = (capacity * candidates + PLAN_MAX_CELLS - 1) / PLAN_MAX_CELLS;
+
+  cap = capacity / scale;
+
+  reach = malloc ((cap + 1) * sizeof (int));
+  if (reach == NULL)
+    return -errno;
+
+  for (c = 0 ; c <= cap ; c++)
+    reach[c] = -1;
+
+  reach[0] = num_files;
+
+  for (i = 0 ; i < num_files ; i++) {
+    if (units[i] != -1 || weights[i] > capacity)
+      continue;
+
+    w = (weights[i] + scale - 1) / scale;
+
+    /* a file may be used once: walk down so this file's own entries are not reused */
+    for (c = cap ; c >= w && c > 0 ; c--)
+      if (reach[c] == -1 && reach[c - w] != -1)
+	reach[c] = i;
+  }
+
+  for (c = cap ; reach[c] == -1 ; c--);
+
+  while (c > 0) {
+    i = reach[c];
+    units[i] = unit;
+    placed++;
+
+    c -= (weights[i] + scale - 1) / scale;
+  }
+
+  free (reach);
+
+  return placed;
+}
+
+/*
+  pack_units_rio:
+
+  Assign files of the given sizes to memory units. Sizes are rounded up to
+  the allocation granule. On return units[i] is the unit for file i or -1
+  if it could not be placed.
+
+  Units are filled smallest first, each with the subset of the remaining
+  files that leaves the least space unused. With two units this places
+  everything whenever the smaller unit can be filled exactly.
+
+  Returns the number of files placed or < 0 on error.
+*/
+int pack_units_rio (u_int64_t *capacity, int num_units, u_int32_t *sizes, int num_files,
+		    u_int32_t granule, int *units) {
+  u_int64_t *weights;
+  int *order;
+  int i, j, tmp, ret, placed = 0;
+
+  if (capacity == NULL || sizes == NULL || units == NULL || num_units < 0 || num_files < 0)
+    return -EINVAL;
+
+  if (granule == 0)
+    granule = 1;
+
+  for (i = 0 ; i < num_files ; i++)
+    units[i] = -1;
+
+  weights = calloc (num_files + 1, sizeof (u_int64_t));
+  order   = calloc (num_units + 1, sizeof (int));
+
+  if (weights == NULL || order == NULL) {
+    free (weights);
+    free (order);
+
+    return -ENOMEM;
+  }
+
+  for (i = 0 ; i < num_files ; i++) {
+    weights[i] = ((u_int64_t)sizes[i] + granule - 1) / granule;
+
+    /* even an empty file occupies a block */
+    if (weights[i] == 0)
+      weights[i] = 1;
+  }
+
+  for (i = 0 ; i < num_units ; i++)
+    order[i] = i;
+
+  for (i = 1 ; i < num_units ; i++)
+    for (j = i ; j > 0 && capacity[order[j]] < capacity[order[j - 1]] ; j--) {
+      tmp = order[j];
+      order[j] = order[j - 1];
+      order[j - 1] = tmp;
+    }
+
+  for (i = 0 ; i < num_units ; i++) {
+    ret = fill_unit (capacity[order[i]] / granule, weights, num_files, units, order[i]);
+    if (ret < 0) {
+      placed = ret;
+      break;
+    }
+
+    placed += ret;
+  }
+
+  free (weights);
+  free (order);
+
+  return placed;
+}
+
+/* plan over the free space of the memory units, or of only one if
+   memory_unit is not -1 */
+static int plan_intrn_rio (rios_t *rio, int memory_unit, u_int32_t *sizes, int num_files, int *units) {
+  u_int64_t capacity[MAX_MEM_UNITS];
+  u_int32_t granule;
+  int i, num_units, free_kib;
+
+  if (rio == NULL || sizes == NULL || units == NULL)
+    return -EINVAL;
+
+  num_units = return_mem_units_rio (rio);
+  if (num_units > MAX_MEM_UNITS)
+    num_units = MAX_MEM_UNITS;
+
+  if (memory_unit >= num_units)
+    return -EINVAL;
+
+  for (i = 0 ; i < num_units ; i++) {
+    free_kib = return_free_mem_rio (rio, i);
+    capacity[i] = (free_kib > 0) ? (u_int64_t)free_kib * 1024 : 0;
+
+    /* only memory_unit is filled */
+    if (memory_unit >= 0 && i != memory_unit)
+      capacity[i] = 0;
+  }
+
+  /* files are sent (and allocated) in whole transfer blocks */
+  granule = (return_type_rio (rio) == RIONITRUS) ? 2 * RIO_FTS : RIO_FTS;
+
+  rio_log (rio, 0, "plan_uploads_rio: planning %i files over %i memory units\n", num_files,
+	   (memory_unit >= 0) ? 1 : num_units);
+
+  return pack_units_rio (capacity, num_units, sizes, num_files, granule, units);
+}
+
+/*
+  plan_uploads_rio:
+
+  Decide which memory unit each file of a batch should be uploaded to so
+  that as much of the batch as possible fits. sizes are the number of bytes
+  that will be sent for each file (see probe_file_rio).
+*/
+int plan_uploads_rio (rios_t *rio, u_int32_t *sizes, int num_files, int *units) {
+  return plan_intrn_rio (rio, -1, sizes, num_files, units);
+}
+
+/*
+  plan_unit_uploads_rio:
+
+  Like plan_uploads_rio, but every file must go to memory_unit. units[i]
+  is memory_unit for the files chosen to fill it and -1 for the others.
+*/
+int plan_unit_uploads_rio (rios_t *rio, u_int8_t memory_unit, u_int32_t *sizes, int num_files,
+			   int *units) {
+  return plan_intrn_rio (rio, memory_unit, sizes, num_files, units);
+}
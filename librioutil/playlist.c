@@ -132,6 +132,7 @@ int playlist_info (info_page_t *newInfo, char *file_name) {
   playlist_file->bits = 0x21000590; /* playlist bits + file bits + download bit */
   
   newInfo->skip = 0;
+  newInfo->audio = 0;
   newInfo->data = playlist_file;
   
   return URIO_SUCCESS;
@@ -147,6 +148,7 @@ int new_playlist_info (info_page_t *newInfo, char *file_name, char *name) {
   playlist_file->type = TYPE_PLS;
 
   newInfo->skip = 0;
+  newInfo->audio = 0;
   newInfo->data = playlist_file;
   
   return URIO_SUCCESS;
@@ -0,0 +1,197 @@
+/**
+ *   (c) 2001-2006 Nathan Hjelm <hjelmn@users.sourceforge.net>
+ *   v1.0 probe.c
+ *
+ *   Open a local file once for probing and uploading.
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU Library Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU Library Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ **/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+
+#include "rioi.h"
+
+#if defined(HAVE_MMAP)
+#include <sys/mman.h>
+#endif
+
+/* map the file, or read all of it if it can not be mapped */
+static int probe_map (rio_probe_t *probe) {
+  ssize_t ret;
+  size_t count;
+
+#if defined(HAVE_MMAP)
+  if (probe->size > 0) {
+    probe->data = mmap (NULL, probe->size, PROT_READ, MAP_PRIVATE, probe->fd, 0);
+
+    if (probe->data != MAP_FAILED) {
+      probe->mapped = 1;
+
+      return URIO_SUCCESS;
+    }
+  }
+#endif
+
+  /* one byte more so an empty file still has a buffer */
+  if ((probe->data = malloc (probe->size + 1)) == NULL)
+    return -ENOMEM;
+
+  for (count = 0 ; count < probe->size ; count += ret)
+    if ((ret = read (probe->fd, probe->data + count, probe->size - count)) <= 0) {
+      if (ret < 0 && errno == EINTR) {
+	ret = 0;
+	continue;
+      }
+
+      /* the file got shorter */
+      probe->size = count;
+      break;
+    }
+
+  /* the descriptor is handed to the upload */
+  lseek (probe->fd, 0, SEEK_SET);
+
+  return URIO_SUCCESS;
+}
+
+/* find the tags at either end of the file */
+static void probe_tags (rio_probe_t *probe) {
+  unsigned char buffer[14];
+  char lyrics[7];
+  size_t tail = probe->size;
+
+  memset (buffer, 0, 14);
+  if (probe->size > 0)
+    memcpy (buffer, probe->data, (probe->size < 14) ? probe->size : 14);
+  probe->tagv2_size = id3v2_size (buffer);
+
+  if (tail >= 128 && strncmp ((char *)probe->data + tail - 128, "TAG", 3) == 0) {
+    probe->has_v1 = 1;
+    tail -= 128;
+  }
+
+  /* Lyrics v2.00: the lyrics, a six digit size and LYRICS200 */
+  if (tail >= 15 && strncmp ((char *)probe->data + tail - 9, "LYRICS200", 9) == 0) {
+    memset (lyrics, 0, 7);
+    memcpy (lyrics, probe->data + tail - 15, 6);
+
+    probe->lyrics_size = strtol (lyrics, NULL, 10) + 15;
+    tail = (probe->lyrics_size < tail) ? tail - probe->lyrics_size : 0;
+  }
+
+  probe->data_end = tail;
+}
+
+/*
+  probe_open_rio:
+
+  Open, stat and map a local file once. Everything that looks at the file
+  before and during its upload (mp3_info, get_id3_info, do_upload) works
+  from the probe.
+
+  PostCondition:
+      - URIO_SUCCESS and the probe is filled in (close it with probe_close_rio).
+      - < 0 if an error occured.
+*/
+int probe_open_rio (char *file_name, rio_probe_t *probe) {
+  int ret;
+
+  if (file_name == NULL || probe == NULL)
+    return -EINVAL;
+
+  memset (probe, 0, sizeof (rio_probe_t));
+
+  probe->file_name = file_name;
+
+  if ((probe->fd = open (file_name, O_RDONLY)) < 0)
+    return -errno;
+
+  if (fstat (probe->fd, &probe->statinfo) < 0) {
+    ret = -errno;
+    close (probe->fd);
+
+    return ret;
+  }
+
+  probe->size = probe->statinfo.st_size;
+
+  if ((ret = probe_map (probe)) != URIO_SUCCESS) {
+    close (probe->fd);
+
+    return ret;
+  }
+
+  probe_tags (probe);
+
+  return URIO_SUCCESS;
+}
+
+/*
+  probe_memory_rio:
+
+  Describe a file that is already in memory. The probe has no name or
+  descriptor, the buffer is not copied and there is nothing to close.
+*/
+void probe_memory_rio (const void *buf, size_t len, rio_probe_t *probe) {
+  memset (probe, 0, sizeof (rio_probe_t));
+
+  probe->fd   = -1;
+  probe->data = (unsigned char *)buf;
+  probe->size = len;
+
+  probe_tags (probe);
+}
+
+/*
+  probe_audio_rio:
+
+  Fingerprint the audio of a probed file: everything between the end of an
+  id3v2 tag and the start of an id3v1 tag or Lyrics. Changing only the
+  tags of a file does not change it. Returns 0 if the file has no audio.
+*/
+u_int64_t probe_audio_rio (rio_probe_t *probe) {
+  u_int64_t audio;
+
+  if (probe->tagv2_size >= probe->data_end)
+    return 0;
+
+  audio = fingerprint_rio (probe->data + probe->tagv2_size, probe->data_end - probe->tagv2_size);
+
+  /* 0 means unknown */
+  return audio ? audio : 1;
+}
+
+void probe_close_rio (rio_probe_t *probe) {
+  if (probe == NULL || probe->data == NULL || probe->fd < 0)
+    return;
+
+#if defined(HAVE_MMAP)
+  if (probe->mapped)
+    munmap (probe->data, probe->size);
+  else
+#endif
+    free (probe->data);
+
+  close (probe->fd);
+
+  probe->data = NULL;
+  probe->fd   = -1;
+}
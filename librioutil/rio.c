@@ -196,6 +196,9 @@ static int set_time_rio (rios_t *rio) {
   Close connection with rio and free buffer.
 */
 void close_rio (rios_t *rio) {
+  /* the worker holds the lock while it runs a job */
+  stop_async_rio (rio);
+
   if (try_lock_rio (rio) != 0)
     return;
   
@@ -210,6 +213,18 @@ void close_rio (rios_t *rio) {
   /* release the memory used by this instance */
   free_info_rio (rio);
 
+  /* write back any changes to the upload manifest */
+  if (rio->manifest) {
+    save_manifest_rio (rio);
+    free_manifest_rio (rio);
+  }
+
+  /* an unfinished journal is left for rioutil --resume */
+  if (rio->journal) {
+    fclose ((FILE *)rio->journal);
+    rio->journal = NULL;
+  }
+
   unlock_rio (rio);
   
   rio_log (rio, 0, "close_rio: complete\n");
@@ -225,6 +240,17 @@ int get_file_info_rio(rios_t *rio, rio_file_t *file,
   if ((ret = wake_rio(rio)) != URIO_SUCCESS)
     return ret;
 
+  return fetch_file_info_rio (rio, file, memory_unit, file_no);
+}
+
+/*
+  fetch_file_info_rio:
+
+  get_file_info_rio for callers that have already woken the device.
+*/
+int fetch_file_info_rio (rios_t *rio, rio_file_t *file, u_int8_t memory_unit, u_int16_t file_no) {
+  int ret;
+
   memset (file, 0, sizeof (rio_file_t));
 
   /* TODO -- Clean up code so it is easier to associate this with Riot
@@ -254,57 +280,200 @@ int get_file_info_rio(rios_t *rio, rio_file_t *file,
   return URIO_SUCCESS;
 }
 
+/*
+  The file lists are refreshed by a state machine so a refresh can be
+  advanced one exchange with the device at a time (see rio_step).
+  generate_mem_list_rio simply runs it to the end.
+*/
+enum {
+  REFRESH_START = 0, /* drop the old lists */
+  REFRESH_UNIT,      /* read the next memory unit's info */
+  REFRESH_FILE,      /* read the next file header */
+  REFRESH_DONE
+};
+
+static int refresh_step (rio_op_t *op);
+
+static void refresh_op_init (rio_op_t *op, rios_t *rio) {
+  memset (op, 0, sizeof (rio_op_t));
+
+  op->rio   = rio;
+  op->state = REFRESH_START;
+  op->step  = refresh_step;
+}
+
+static int refresh_unit_step (rio_op_t *op) {
+  rios_t *rio = op->rio;
+  mlist_rio_t *list = rio->info.memory;
+  rio_mem_t memory;
+  int ret;
+
+  ret = get_memory_info_rio (rio, &memory, op->memory_unit);
+
+  if (ret == ENOMEM) {
+    /* not an error: there are no more memory units */
+    op->state = REFRESH_DONE;
+
+    return URIO_SUCCESS;
+  } else if (ret != URIO_SUCCESS)
+    return ret;
+
+  list[op->memory_unit].size = memory.size;
+  list[op->memory_unit].free = memory.free;
+
+  if (return_type_rio (rio) == RIORIOT) {
+    /* Riots have only one memory unit and list all of their files at once */
+    if ((ret = generate_flist_riohd (rio)) != URIO_SUCCESS)
+      return ret;
+
+    op->state = REFRESH_DONE;
+
+    return URIO_SUCCESS;
+  }
+
+  strncpy (list[op->memory_unit].name, memory.name, 32);
+
+  op->file_no = 0;
+  op->state   = REFRESH_FILE;
+
+  return URIO_SUCCESS;
+}
+
+static int refresh_file_step (rio_op_t *op) {
+  rios_t *rio = op->rio;
+  rio_file_t file;
+  info_page_t info;
+  int ret = -ENOENT;
+
+  info.data = &file;
+
+  /*
+    MAX_RIO_FILES is an arbitrary file limit. Rios can get into a state where
+    the data in the file headers is garbage. This state can result in the termination
+    condition (file number == 0) never being reached.
+  */
+  if (op->file_no < MAX_RIO_FILES)
+    ret = get_file_info_rio (rio, &file, op->memory_unit, op->file_no);
+
+  if (ret == -ENOENT) {
+    /* not an error: that was the last file on this unit */
+    op->memory_unit++;
+    op->state = (op->memory_unit < MAX_MEM_UNITS) ? REFRESH_UNIT : REFRESH_DONE;
+
+    return URIO_SUCCESS;
+  } else if (ret != URIO_SUCCESS)
+    return ret;
+
+  flist_add_rio (rio, op->memory_unit, info);
+
+  if (rio->progress != NULL)
+    rio->progress(op->file_no, 0, rio->progress_ptr);
+
+  op->file_no++;
+
+  return URIO_SUCCESS;
+}
+
+/* advance a refresh. returns RIO_STEP_AGAIN until it is over. */
+static int refresh_step (rio_op_t *op) {
+  rios_t *rio = op->rio;
+  int ret = URIO_SUCCESS;
+  int i;
+
+  switch (op->state) {
+  case REFRESH_START:
+    rio_log (rio, 0, "create_mem_list_rio: entering...\n");
+
+    free_info_rio (rio);
+    memset (rio->info.memory, 0, sizeof (mlist_rio_t) * MAX_MEM_UNITS);
+
+    op->memory_unit = 0;
+    op->state       = REFRESH_UNIT;
+    break;
+  case REFRESH_UNIT:
+    ret = refresh_unit_step (op);
+    break;
+  case REFRESH_FILE:
+    ret = refresh_file_step (op);
+    break;
+  default:
+    return op->result;
+  }
+
+  if (ret != URIO_SUCCESS) {
+    op->state  = REFRESH_DONE;
+    op->result = ret;
+
+    return ret;
+  }
+
+  if (op->state != REFRESH_DONE)
+    return RIO_STEP_AGAIN;
+
+  for (i = 0, rio->info.total_memory_units = 0 ; (i < MAX_MEM_UNITS) && rio->info.memory[i].size ; i++)
+    rio->info.total_memory_units++;
+
+  rio_log (rio, 0, "create_mem_list_rio: complete\n");
+
+  return URIO_SUCCESS;
+}
+
+/* partial lists are dropped so the next return_flist_rio reads them again */
+static void refresh_release (rio_op_t *op) {
+  if (op->state == REFRESH_START || op->state == REFRESH_DONE)
+    return;
+
+  free_info_rio (op->rio);
+  memset (op->rio->info.memory, 0, sizeof (mlist_rio_t) * MAX_MEM_UNITS);
+  op->rio->info.total_memory_units = 0;
+}
+
 /*
   generate_mem_list_rio:
 
   Generates the info->memory field of the rio structure.
 */
 int generate_mem_list_rio (rios_t *rio) {
-  int i, ret;
-  rio_mem_t memory;
-  int num_mem_units = MAX_MEM_UNITS;
+  rio_op_t op;
+  int ret;
 
-  mlist_rio_t *list = rio->info.memory;
+  refresh_op_init (&op, rio);
 
-  rio_log (rio, 0, "create_mem_list_rio: entering...\n");
+  while ((ret = refresh_step (&op)) == RIO_STEP_AGAIN);
 
-  memset(list, 0, sizeof(mlist_rio_t) * MAX_MEM_UNITS);
+  return ret;
+}
 
-  if (return_type_rio(rio) == RIORIOT) {
-    /* Riots have only one memory unit */
-    ret = get_memory_info_rio (rio, &memory, 0);
-    
-    if (ret != URIO_SUCCESS)
-      return ret;
+/*
+  refresh_begin_rio:
+    Start reading the file lists again, as update_info_rio does. No i/o is
+  done: each call to rio_step reads one memory unit's info or one file
+  header. rio stays locked until the refresh is over or the operation is
+  freed with rio_op_free.
+*/
+int refresh_begin_rio (rios_t *rio, rio_op_t **opp) {
+  rio_op_t *op;
+  int error;
 
-    list[0].size       = memory.size;
-    list[0].free       = memory.free;
-      
-    ret = generate_flist_riohd (rio);
+  if (rio == NULL || opp == NULL)
+    return -EINVAL;
 
-    if (ret != URIO_SUCCESS)
-      return ret;
-  } else {
-    for (i = 0 ; i < num_mem_units ; i++) {
-      ret = get_memory_info_rio (rio, &memory, i);
-      
-      if (ret == ENOMEM)
-	break; /* not an error */
-      else if (ret != URIO_SUCCESS)
-	return ret;
-      
-      list[i].size       = memory.size;
-      list[i].free       = memory.free;
-      strncpy(list[i].name, memory.name, 32);
-      
-      ret = generate_flist_riomc (rio, i);
-      
-      if (ret != URIO_SUCCESS)
-	return ret;
-    }
+  *opp = NULL;
+
+  if ((op = malloc (sizeof (rio_op_t))) == NULL)
+    return -ENOMEM;
+
+  if ((error = try_lock_rio (rio)) != 0) {
+    free (op);
+
+    return error;
   }
 
-  rio_log (rio, 0, "create_mem_list_rio: complete\n");
+  refresh_op_init (op, rio);
+  op->release = refresh_release;
+  op->locked  = 1;
+
+  *opp = op;
 
   return URIO_SUCCESS;
 }
@@ -335,13 +504,136 @@ int get_memory_info_rio(rios_t *rio, rio_mem_t *memory, u_int8_t memory_unit) {
   return URIO_SUCCESS;
 }
 
-/* this should work better that before */
-void update_free_intrn_rio (rios_t *rio, u_int8_t memory_unit) {
+/* free space accounting */
+#define SPACE_SAMPLES      3        /* measured changes before predicting */
+#define SPACE_INTERVAL     16       /* predicted changes between measurements */
+#define SPACE_MARGIN       0x400000 /* always measure when this close to full */
+
+/* Riots report free space in kB, everything else in bytes */
+static int64_t free_bytes_rio (rios_t *rio, u_int8_t memory_unit) {
+  int64_t free = rio->info.memory[memory_unit].free;
+
+  return (return_type_rio (rio) == RIORIOT) ? free * 1024 : free;
+}
+
+static void set_free_bytes_rio (rios_t *rio, u_int8_t memory_unit, int64_t free) {
+  if (free < 0)
+    free = 0;
+
+  rio->info.memory[memory_unit].free = (return_type_rio (rio) == RIORIOT) ? free / 1024 : free;
+}
+
+/*
+  learn_alloc_unit_rio:
+
+  A file of size bytes changed the free space by used bytes. Find the
+  largest power of two allocation unit consistent with that and treat
+  anything left over as a fixed per-file overhead. The smallest unit
+  seen over several samples wins.
+*/
+static void learn_alloc_unit_rio (rios_t *rio, u_int8_t memory_unit, u_int32_t size, int64_t used) {
+  int64_t rounded, best_rounded = size;
+  u_int32_t unit, best = 1;
+
+  if (used < size)
+    return;
+
+  for (unit = 512 ; unit <= 0x100000 ; unit <<= 1) {
+    rounded = ((int64_t)size + unit - 1) / unit * unit;
+    if (rounded > used)
+      break;
+
+    best = unit;
+    best_rounded = rounded;
+  }
+
+  if (rio->space[memory_unit].samples == 0 || best < rio->space[memory_unit].alloc_unit) {
+    rio->space[memory_unit].alloc_unit = best;
+    rio->space[memory_unit].overhead   = used - best_rounded;
+  } else if (best == rio->space[memory_unit].alloc_unit &&
+	     used - best_rounded > rio->space[memory_unit].overhead)
+    rio->space[memory_unit].overhead   = used - best_rounded;
+
+  rio->space[memory_unit].samples++;
+
+  rio_log (rio, 0, "learn_alloc_unit_rio: memory unit %i: allocation unit %u, overhead %u\n",
+	   memory_unit, rio->space[memory_unit].alloc_unit, rio->space[memory_unit].overhead);
+}
+
+/*
+  reconcile_free_rio:
+
+  Ask the device for the free space on a memory unit and record how far
+  the prediction had drifted.
+*/
+int reconcile_free_rio (rios_t *rio, u_int8_t memory_unit) {
   rio_mem_t memory;
+  int64_t predicted, drift;
+  int ret;
 
-  get_memory_info_rio(rio, &memory, memory_unit);
+  predicted = free_bytes_rio (rio, memory_unit);
 
+  if ((ret = get_memory_info_rio(rio, &memory, memory_unit)) != URIO_SUCCESS)
+    return ret;
+
+  rio->stats.memri_queries++;
   rio->info.memory[memory_unit].free = memory.free;
+
+  if (rio->space[memory_unit].pending) {
+    drift = predicted - free_bytes_rio (rio, memory_unit);
+    if (drift < 0)
+      drift = -drift;
+
+    rio->stats.reconciles++;
+    rio->stats.drift += drift;
+
+    if (drift > rio->stats.max_drift)
+      rio->stats.max_drift = drift;
+
+    if (drift)
+      rio_log (rio, 0, "reconcile_free_rio: memory unit %i: prediction off by %lli bytes\n",
+	       memory_unit, (long long)drift);
+
+    rio->space[memory_unit].pending = 0;
+  }
+
+  return URIO_SUCCESS;
+}
+
+/*
+  update_free_intrn_rio:
+
+  Account for a file of size bytes being added to or removed from a memory
+  unit. The first few changes are measured on the device to learn how it
+  allocates space. After that the change is predicted on the host and the
+  device is only asked every SPACE_INTERVAL changes (or when nearly full).
+*/
+void update_free_intrn_rio (rios_t *rio, u_int8_t memory_unit, u_int32_t size, int added) {
+  u_int32_t alloc_unit = rio->space[memory_unit].alloc_unit;
+  int64_t before, used;
+
+  if (rio->space[memory_unit].samples < SPACE_SAMPLES && rio->space[memory_unit].pending == 0) {
+    before = free_bytes_rio (rio, memory_unit);
+
+    if (reconcile_free_rio (rio, memory_unit) != URIO_SUCCESS)
+      return;
+
+    used = added ? before - free_bytes_rio (rio, memory_unit) : free_bytes_rio (rio, memory_unit) - before;
+    learn_alloc_unit_rio (rio, memory_unit, size, used);
+
+    return;
+  }
+
+  used = ((int64_t)size + alloc_unit - 1) / alloc_unit * alloc_unit + rio->space[memory_unit].overhead;
+
+  set_free_bytes_rio (rio, memory_unit, free_bytes_rio (rio, memory_unit) + (added ? -used : used));
+
+  rio->space[memory_unit].pending++;
+  rio->stats.predictions++;
+
+  if (rio->space[memory_unit].pending >= SPACE_INTERVAL ||
+      free_bytes_rio (rio, memory_unit) < SPACE_MARGIN)
+    reconcile_free_rio (rio, memory_unit);
 }
 
 int return_type_rio(rios_t *rio) {
@@ -379,7 +671,6 @@ static int return_intrn_info_rio(rios_t *rio) {
   unsigned char cmd;
 
   int ret;
-  int i;
   
   if ((ret = try_lock_rio (rio)) != 0)
     return ret;
@@ -429,8 +720,9 @@ static int return_intrn_info_rio(rios_t *rio) {
    * prefs
    */
   
+  /* this also counts the memory units */
   if ((ret = generate_mem_list_rio(rio)) != URIO_SUCCESS) 
-    return ret;
+    UNLOCK(ret);
 
   /*
     retrieve changeable values
@@ -487,12 +779,6 @@ static int return_intrn_info_rio(rios_t *rio) {
     }
   } else /* Failed the read */ 
       rio_log (rio, -1, "return_info_rio: Rio did not respond to Preference read command.\n");
-     
-  /*
-    memory
-  */
-  for (i = 0 ; (i < MAX_MEM_UNITS) && info->memory[i].size; i++)
-    info->total_memory_units++;
 
   UNLOCK(URIO_SUCCESS);
 }
@@ -514,7 +800,6 @@ static void sane_info_copy (rio_info_t *info, rio_prefs_t *prefs);
 int set_info_rio(rios_t *rio, rio_info_t *info) {
   rio_prefs_t pref_buf;
   int ret;
-  unsigned char cmd;
 
   if ((ret = try_lock_rio (rio)) != 0)
     return ret;
@@ -523,16 +808,8 @@ int set_info_rio(rios_t *rio, rio_info_t *info) {
   if (info == NULL)
     return -1;
 
-  cmd = RIO_PREFR;
-  if ((ret = send_command_rio(rio, cmd, 0, 0)) != 0) {
-    rio_log (rio, ret, "set_info_rio: Error sending command\n");
-
-    UNLOCK(ret);
-  }
-  
-  ret = read_block_rio(rio, (unsigned char *)&pref_buf, RIO_MTS, RIO_FTS);
-  if (ret != URIO_SUCCESS) {
-    rio_log (rio, ret, "Error reading data after command 0x%x\n", cmd);
+  if ((ret = read_prefs_rio (rio, (unsigned char *)&pref_buf)) != URIO_SUCCESS) {
+    rio_log (rio, ret, "set_info_rio: error reading preferences\n");
     
     UNLOCK(ret);
   }
@@ -542,24 +819,48 @@ int set_info_rio(rios_t *rio, rio_info_t *info) {
   if ((ret = wake_rio(rio)) != URIO_SUCCESS)
     UNLOCK(ret);
 
-  cmd = RIO_PREFS;
-  if ((ret = send_command_rio(rio, cmd, 0, 0)) != 0) {
-    rio_log (rio, ret, "set_info_rio: Error sending command\n");
+  if ((ret = write_prefs_rio (rio, (unsigned char *)&pref_buf)) != URIO_SUCCESS)
+    rio_log (rio, ret, "set_info_rio: error writing preferences\n");
 
-    UNLOCK(ret);
+  UNLOCK(ret);
+}
+
+/*
+  read_prefs_rio:
+  Read the raw preferences block (RIO_MTS bytes) from the device.
+*/
+int read_prefs_rio (rios_t *rio, unsigned char *prefs) {
+  int ret;
+
+  if ((ret = send_command_rio(rio, RIO_PREFR, 0, 0)) != URIO_SUCCESS) {
+    rio_log (rio, ret, "read_prefs_rio: Error sending command\n");
+
+    return ret;
   }
 
-  ret = read_block_rio(rio, NULL, 64, RIO_FTS);
-  if (ret != URIO_SUCCESS) {
-    rio_log (rio, ret, "set_info_rio: error reading data after command 0x%x\n", cmd);
-    
-    UNLOCK(ret);
+  return read_block_rio(rio, prefs, RIO_MTS, RIO_FTS);
+}
+
+/*
+  write_prefs_rio:
+  Replace the preferences block on the device with prefs (RIO_MTS bytes).
+*/
+int write_prefs_rio (rios_t *rio, unsigned char *prefs) {
+  int ret;
+
+  if ((ret = send_command_rio(rio, RIO_PREFS, 0, 0)) != URIO_SUCCESS) {
+    rio_log (rio, ret, "write_prefs_rio: Error sending command\n");
+
+    return ret;
   }
 
-  if ((ret = write_block_rio(rio, (unsigned char *)&pref_buf, RIO_MTS, NULL)) != URIO_SUCCESS)
-    rio_log (rio, ret, "set_info_rio: error writing preferences\n");
+  if ((ret = read_block_rio(rio, NULL, 64, RIO_FTS)) != URIO_SUCCESS) {
+    rio_log (rio, ret, "write_prefs_rio: error reading data after command 0x%x\n", RIO_PREFS);
 
-  UNLOCK(ret);
+    return ret;
+  }
+
+  return write_block_rio(rio, prefs, RIO_MTS, NULL);
 }
 
 /*
@@ -629,6 +930,9 @@ int format_mem_rio (rios_t *rio, u_int8_t memory_unit) {
 
   rio_log (rio, 0, "librioutil/rio.c format_mem_rio: erase complete\n");
 
+  /* nothing we uploaded to this unit survives a format */
+  manifest_forget_rio (rio, memory_unit, 0);
+
   UNLOCK(URIO_SUCCESS);
 }
 
@@ -1043,6 +1347,20 @@ void set_progress_rio (rios_t *rio, void (*f)(int x, int X, void *ptr), void *pt
   }
 }
 
+/*
+  get_stats_rio:
+
+  Copy the statistics for this instance.
+*/
+int get_stats_rio (rios_t *rio, rio_stats_t *stats) {
+  if (rio == NULL || stats == NULL)
+    return -EINVAL;
+
+  *stats = rio->stats;
+
+  return URIO_SUCCESS;
+}
+
 /*
   return_conn_method_rio: return the driver librioutil is using (soon to be deprecated)
 */
@@ -1078,3 +1396,45 @@ int try_lock_rio (rios_t *rio) {
 void unlock_rio (rios_t *rio) {
   rio->lock = 0;
 }
+
+/*
+  rio_step:
+    Make the next exchange of an operation started with upload_begin_rio,
+  download_begin_rio or refresh_begin_rio. One thread can drive several
+  players by stepping each of their operations in turn.
+
+  PostCondition:
+      - RIO_STEP_AGAIN if there is more to do.
+      - URIO_SUCCESS once the operation has finished.
+      - < 0 if it failed (the player is ready for a new operation).
+*/
+int rio_step (rio_op_t *op) {
+  int ret;
+
+  if (op == NULL)
+    return -EINVAL;
+
+  ret = op->step (op);
+
+  if (ret != RIO_STEP_AGAIN && op->locked) {
+    unlock_rio (op->rio);
+    op->locked = 0;
+  }
+
+  return ret;
+}
+
+/* Free an operation. One that has not finished is aborted. */
+void rio_op_free (rio_op_t *op) {
+  if (op == NULL)
+    return;
+
+  if (op->release != NULL)
+    op->release (op);
+
+  if (op->locked)
+    unlock_rio (op->rio);
+
+  free (op->priv);
+  free (op);
+}
@@ -26,6 +26,36 @@
 #include "rioi.h"
 #include "driver.h"
 
+/* times a command the device did not answer is sent again */
+#define SEND_COMMAND_RETRIES 3
+
+/* the driver's calls unless the device has a transport of its own */
+static struct rio_transport *transport_rio (rios_t *rio) {
+  return ((struct rioutil_usbdevice *)rio->dev)->transport;
+}
+
+static int bulk_read_rio (rios_t *rio, unsigned char *buffer, u_int32_t size) {
+  struct rio_transport *transport = transport_rio (rio);
+
+  return transport ? transport->read_bulk (rio, buffer, size) : read_bulk (rio, buffer, size);
+}
+
+static int bulk_write_rio (rios_t *rio, unsigned char *buffer, u_int32_t size) {
+  struct rio_transport *transport = transport_rio (rio);
+
+  return transport ? transport->write_bulk (rio, buffer, size) : write_bulk (rio, buffer, size);
+}
+
+static int command_msg_rio (rios_t *rio, u_int8_t request, u_int16_t value, u_int16_t index,
+			    u_int16_t length, unsigned char *buffer) {
+  struct rio_transport *transport = transport_rio (rio);
+
+  if (transport)
+    return transport->control_msg (rio, request, value, index, length, buffer);
+
+  return control_msg (rio, request, value, index, length, buffer);
+}
+
 int read_block_rio (rios_t *rio, unsigned char *ptr, u_int32_t size, u_int32_t block_size) {
   int ret;
   unsigned char *buffer;
@@ -38,9 +68,9 @@ int read_block_rio (rios_t *rio, unsigned char *ptr, u_int32_t size, u_int32_t b
 
   if (size > block_size)
     for (i = 0 ; i < size ; i += block_size)
-      ret = read_bulk (rio, &buffer[i], block_size);
+      ret = bulk_read_rio (rio, &buffer[i], block_size);
   else
-    ret = read_bulk (rio, buffer, size);
+    ret = bulk_read_rio (rio, buffer, size);
 
   if (ret < 0)
     return ret;
@@ -50,23 +80,29 @@ int read_block_rio (rios_t *rio, unsigned char *ptr, u_int32_t size, u_int32_t b
   return URIO_SUCCESS;
 }
 
-int write_cksum_rio (rios_t *rio, unsigned char *ptr, u_int32_t size, char *cksum_hdr) {
+/* the checksum sent ahead of a block of size bytes at ptr */
+u_int32_t block_cksum_rio (rios_t *rio, unsigned char *ptr, u_int32_t size, char *cksum_hdr) {
+  if (strcmp (cksum_hdr, "CRIOINFO") == 0)
+    return 0;
+
+  if (ptr != NULL && return_type_rio (rio) != RIONITRUS)
+    return crc32_rio(ptr, size);
+
+  return 0x00800000;
+}
+
+static int write_cksum_value_rio (rios_t *rio, char *cksum_hdr, u_int32_t cksum) {
   unsigned int *intp;
   int ret;
 
   memset(rio->buffer, 0, 64);
   intp = (unsigned int *)rio->buffer;
 
-  if (strcmp (cksum_hdr, "CRIOINFO") != 0) {
-    if (ptr != NULL && return_type_rio (rio) != RIONITRUS)
-      intp[2] = crc32_rio(ptr, size);
-    else
-      intp[2] = 0x00800000;
-  }
+  intp[2] = cksum;
 
   memcpy (rio->buffer, cksum_hdr, 8);
 
-  ret = write_bulk (rio, rio->buffer, 64);
+  ret = bulk_write_rio (rio, rio->buffer, 64);
   if (ret < 0)
     return ret;
   
@@ -75,7 +111,26 @@ int write_cksum_rio (rios_t *rio, unsigned char *ptr, u_int32_t size, char *cksu
   return URIO_SUCCESS;
 }
 
+int write_cksum_rio (rios_t *rio, unsigned char *ptr, u_int32_t size, char *cksum_hdr) {
+  return write_cksum_value_rio (rio, cksum_hdr, block_cksum_rio (rio, ptr, size, cksum_hdr));
+}
+
 int write_block_rio (rios_t *rio, unsigned char *ptr, u_int32_t size, char *cksum_hdr) {
+  if (!rio || !rio->dev)
+    return -1;
+
+  return write_block_cksum_rio (rio, ptr, size, cksum_hdr,
+				cksum_hdr ? block_cksum_rio (rio, ptr, size, cksum_hdr) : 0);
+}
+
+/*
+  write_block_cksum_rio:
+
+  Same as write_block_rio for a block whose checksum is already known (see
+  block_cksum_rio). Uploads sent to several players compute it once.
+*/
+int write_block_cksum_rio (rios_t *rio, unsigned char *ptr, u_int32_t size, char *cksum_hdr,
+			   u_int32_t cksum) {
   int ret;
 
   if (!rio || !rio->dev)
@@ -88,11 +143,11 @@ int write_block_rio (rios_t *rio, unsigned char *ptr, u_int32_t size, char *cksu
       return -EINTR;
     }
 
-    if ((ret = write_cksum_rio (rio, ptr, size, cksum_hdr)) != URIO_SUCCESS)
+    if ((ret = write_cksum_value_rio (rio, cksum_hdr, cksum)) != URIO_SUCCESS)
       return ret;
   }
 
-  ret = write_bulk (rio, ptr, size);    
+  ret = bulk_write_rio (rio, ptr, size);    
 
   if (ret < 0)
     return ret;
@@ -117,35 +172,32 @@ int write_block_rio (rios_t *rio, unsigned char *ptr, u_int32_t size, char *cksu
 
 /* all this command does is call control_msg but it allows to print debug without editing mutiple files */
 int send_command_rio (rios_t *rio, int request, int value, int index) {
-  static int cretry = 0;
-  int ret = URIO_SUCCESS;
+  int retry;
 
-  if (cretry > 3)
-    return -ENODEV;
-  else if (!rio || !rio->dev)
+  if (!rio || !rio->dev)
     return -EINVAL;
   
-  if (rio->debug > 1) {
-    rio_log (rio, 0, "\nCommand:\n");
-    rio_log (rio, 0, "len: 0x0c rt: 0x00 rq: 0x%02x va: 0x%04x id: 0x%04x\n", 
-	     request, value, index);
-  }
+  /* the retry count is per call so several players can be driven at once */
+  for (retry = 0 ; ; retry++) {
+    if (rio->debug > 1) {
+      rio_log (rio, 0, "\nCommand:\n");
+      rio_log (rio, 0, "len: 0x0c rt: 0x00 rq: 0x%02x va: 0x%04x id: 0x%04x\n", 
+	       request, value, index);
+    }
 
-  if (control_msg(rio, request, value, index, 0x0c, rio->cmd_buffer) < 0)
-    return -ENODEV;
+    if (command_msg_rio (rio, request, value, index, 0x0c, rio->cmd_buffer) < 0)
+      return -ENODEV;
   
-  rio_log_data (rio, "Command", rio->cmd_buffer, 0xc);
+    rio_log_data (rio, "Command", rio->cmd_buffer, 0xc);
 
-  if (rio->cmd_buffer[0] != 0x1 && request != 0x66 && request != 0x61) {
-    cretry++;
-    rio_log (rio, -1, "Device did not respond to command. Retrying..");
+    if (rio->cmd_buffer[0] == 0x1 || request == 0x66 || request == 0x61)
+      return URIO_SUCCESS;
 
-    ret = send_command_rio (rio, request, value, index);
+    if (retry == SEND_COMMAND_RETRIES)
+      return -ENODEV;
 
-    cretry = 0;
+    rio_log (rio, -1, "Device did not respond to command. Retrying..");
   }
-
-  return ret;
 }
 
 int abort_transfer_rio(rios_t *rio) {
@@ -155,7 +207,7 @@ int abort_transfer_rio(rios_t *rio) {
   sprintf((char *)rio->buffer, "CRIOABRT");
   
   /* write an abort to the rio */
-  ret = write_bulk (rio, rio->buffer, 64);
+  ret = bulk_write_rio (rio, rio->buffer, 64);
   if (ret < 0)
     return ret;
 
@@ -25,6 +25,7 @@
 #include <ctype.h>
 
 #include <sys/stat.h>
+#include <sys/time.h>
 
 #include "rioi.h"
 
@@ -35,25 +36,65 @@
 static int init_new_upload_rio (rios_t *rio, u_int8_t memory_unit);
 static int init_overwrite_rio (rios_t *rio, u_int8_t memory_unit);
 static int complete_upload_rio (rios_t *rio, u_int8_t memory_unit, info_page_t info);
-static int bulk_upload_rio (rios_t *rio, info_page_t info, int addpipe);
-static int delete_dummy_hdr (rios_t *rio, u_int8_t memory_unit, u_int32_t fileno);
-static int upload_dummy_hdr (rios_t *rio, u_int8_t memory_unit, u_int32_t fileno);
+static void fill_riot_fields_rio (rios_t *rio, rio_file_t *file);
+static int upload_step (rio_op_t *op);
 
-/* the guts of any upload */
-int do_upload (rios_t *rio, u_int8_t memory_unit, int addpipe, info_page_t info, int overwrite) {
+/*
+  Uploads are run as a state machine so they can be advanced one exchange
+  with the device at a time (see rio_step). The blocking calls simply run
+  it to the end.
+*/
+enum {
+  UPLOAD_START = 0, /* check the free space and start the upload */
+  UPLOAD_DATA,      /* send the next block */
+  UPLOAD_COMPLETE,  /* send the header and update the host's records */
+  UPLOAD_DONE
+};
+
+/* the data comes from addpipe or, if it is not NULL, a prepared upload.
+   addpipe still belongs to the caller once the upload is over. */
+static void upload_op_init (rio_op_t *op, rios_t *rio, u_int8_t memory_unit, int addpipe,
+			    info_page_t info, int overwrite, rio_upload_t *upload) {
+  memset (op, 0, sizeof (rio_op_t));
+
+  op->rio         = rio;
+  op->state       = UPLOAD_START;
+  op->memory_unit = memory_unit;
+  op->overwrite   = overwrite;
+  op->fd          = addpipe;
+  op->info        = info;
+  op->upload      = upload;
+  op->digest      = FNV64_INIT;
+  op->step        = upload_step;
+
+  if (upload != NULL)
+    op->block_size = upload->block_size;
+  else if (return_type_rio (rio) == RIONITRUS)
+    op->block_size = 2 * RIO_FTS;
+  else
+    op->block_size = RIO_FTS;
+}
+
+static int upload_start_step (rio_op_t *op) {
+  rios_t *rio = op->rio;
+  u_int8_t memory_unit = op->memory_unit;
+  info_page_t info = op->info;
   int error;
 
   rio_log (rio, 0, "do_upload: entering\n");
 
   /* check if there the device has sufficient space for the file */
-  if (overwrite == 0)
-    if (FREE_SPACE(memory_unit) < (info.data->size - info.skip)/1024) {
-      free (info.data);
-      
+  if (op->overwrite == 0 && FREE_SPACE(memory_unit) < info.data->size/1024) {
+    /* the free space may only be a prediction, ask the device before giving up */
+    if (rio->space[memory_unit].pending)
+      reconcile_free_rio (rio, memory_unit);
+
+    /* info.data belongs to the caller */
+    if (FREE_SPACE(memory_unit) < info.data->size/1024)
       return -ENOSPC;
-    }
+  }
     
-  if (overwrite == 0) {
+  if (op->overwrite == 0) {
     if ((error = init_new_upload_rio(rio, memory_unit)) != URIO_SUCCESS) {
       rio_log (rio, error, "init_upload_rio error\n");
       return error;
@@ -65,13 +106,124 @@ int do_upload (rios_t *rio, u_int8_t memory_unit, int addpipe, info_page_t info,
     }
   }
 
-  if ((error = bulk_upload_rio(rio, info, addpipe)) != URIO_SUCCESS) {
-    rio_log (rio, error, "bulk_upload_rio error\n");
-    abort_transfer_rio(rio);
-    return error;
+  rio_log (rio, 0, "bulk_upload_rio: entering\n");
+
+  if (op->upload == NULL) {
+    rio_log (rio, 0, "Skipping %08x bytes of input\n", info.skip);
+
+    /* without anything to skip the caller may have positioned the descriptor */
+    if (info.skip)
+      lseek(op->fd, info.skip, SEEK_SET);
+  }
+
+  gettimeofday (&op->start, NULL);
+
+  op->state = UPLOAD_DATA;
+
+  return URIO_SUCCESS;
+}
+
+/* send one block of data, or move on to UPLOAD_COMPLETE after the last one.
+   when the size of the file is known no more than that many bytes are read
+   so the data can be followed by something else (see restore_rio). */
+static int upload_data_step (rio_op_t *op) {
+  rios_t *rio = op->rio;
+  rio_upload_t *upload = op->upload;
+  info_page_t info = op->info;
+  unsigned char *data;
+  size_t read_size;
+  long int amount;
+  u_int32_t cksum;
+  int ret;
+
+  if (upload != NULL) {
+    if (op->block == upload->num_blocks) {
+      op->digest = upload->digest;
+      op->state  = UPLOAD_COMPLETE;
+
+      return URIO_SUCCESS;
+    }
+
+    if (rio->progress != NULL)
+      rio->progress(op->copied, upload->length, rio->progress_ptr);
+
+    data   = &upload->data[(size_t)op->block * upload->block_size];
+    cksum  = upload->cksums[op->block];
+    amount = upload->length - op->copied;
+    if (amount > op->block_size)
+      amount = op->block_size;
+  } else {
+    read_size = op->block_size;
+
+    /* the size is not known when uploading from a pipe */
+    if (info.data->size != 0 && info.data->size != (u_int32_t)-1 &&
+	info.data->size - op->copied < read_size)
+      read_size = info.data->size - op->copied;
+
+    amount = 0;
+
+    if (read_size > 0 && (amount = read (op->fd, op->buffer, read_size)) < 0)
+      return -errno;
+
+    if (amount == 0) {
+      op->state = UPLOAD_COMPLETE;
+
+      return URIO_SUCCESS;
+    }
+
+    /* if we dont know the size we dont know how close we are to finishing */
+    if (info.data->size && rio->progress != NULL)
+      rio->progress(op->copied, info.data->size, rio->progress_ptr);
+
+    /* the last block is padded with zeros */
+    memset (&op->buffer[amount], 0, op->block_size - amount);
+
+    data  = op->buffer;
+    cksum = block_cksum_rio (rio, data, op->block_size, "CRIODATA");
+
+    op->digest = fnv64_rio (op->digest, data, amount);
+
+    if (op->stream != NULL)
+      mp3_stream_feed_rio (op->stream, data, amount);
+  }
+
+  if ((ret = write_block_cksum_rio(rio, data, op->block_size, "CRIODATA", cksum)) != URIO_SUCCESS)
+    return ret;
+
+  op->block++;
+  op->copied += amount;
+
+  return URIO_SUCCESS;
+}
+
+static int upload_complete_step (rio_op_t *op) {
+  rios_t *rio = op->rio;
+  u_int8_t memory_unit = op->memory_unit;
+  info_page_t info = op->info;
+  struct timeval end;
+  u_int32_t rio_num;
+  int error;
+
+  gettimeofday (&end, NULL);
+
+  rio->stats.bytes_uploaded += op->copied;
+  rio->stats.upload_usecs   += (end.tv_sec - op->start.tv_sec) * 1000000LL +
+    (end.tv_usec - op->start.tv_usec);
+
+  rio_log (rio, 0, "Read in %08x bytes from file. File size is %08x\n", op->copied, info.data->size);
+
+  /* a pipe: the size, and the length of an MP3, are only known now */
+  if (info.data->size == 0 || info.data->size == (u_int32_t)-1) {
+    info.data->size = op->copied;
+
+    if (op->stream != NULL)
+      mp3_stream_finish_rio (op->stream, info.data);
   }
   
-  close (addpipe);
+  if (rio->progress != NULL)
+    rio->progress(1, 1, rio->progress_ptr);
+
+  rio_log (rio, 0, "bulk_upload_rio: finished\n");
 
   if ((error = complete_upload_rio(rio, memory_unit, info))!= URIO_SUCCESS) {
     rio_log (rio, error, "complete_upload_rio error\n");
@@ -80,15 +232,204 @@ int do_upload (rios_t *rio, u_int8_t memory_unit, int addpipe, info_page_t info,
   }
 
   /* rioutil keeps track of the rio's memory state */
-  update_free_intrn_rio(rio, memory_unit);
+  if (op->overwrite == 0)
+    update_free_intrn_rio(rio, memory_unit, info.data->size, 1);
+  else
+    reconcile_free_rio (rio, memory_unit);
+
+  /* flist_add_rio will give a new file the first free number */
+  rio_num = info.data->file_no ? info.data->file_no : flist_first_free_rio (rio, memory_unit);
 
   flist_add_rio (rio, memory_unit, info);
 
+  manifest_record_rio (rio, memory_unit, rio_num, info.data->size, op->digest, info.audio);
+
   if (info.data->type == TYPE_MP3)
     update_db_rio (rio);
 
   rio_log (rio, 0, "do_upload: complete\n");
 
+  op->state = UPLOAD_DONE;
+
+  return URIO_SUCCESS;
+}
+
+/* advance an upload. returns RIO_STEP_AGAIN until it is over. */
+static int upload_step (rio_op_t *op) {
+  int ret = URIO_SUCCESS;
+
+  switch (op->state) {
+  case UPLOAD_START:
+    ret = upload_start_step (op);
+    break;
+  case UPLOAD_DATA:
+    if ((ret = upload_data_step (op)) != URIO_SUCCESS) {
+      rio_log (op->rio, ret, "bulk_upload_rio error\n");
+      abort_transfer_rio(op->rio);
+    }
+    break;
+  case UPLOAD_COMPLETE:
+    ret = upload_complete_step (op);
+    break;
+  default:
+    return op->result;
+  }
+
+  if (ret != URIO_SUCCESS) {
+    op->state  = UPLOAD_DONE;
+    op->result = ret;
+
+    return ret;
+  }
+
+  return (op->state == UPLOAD_DONE) ? URIO_SUCCESS : RIO_STEP_AGAIN;
+}
+
+/* the guts of any upload */
+static int upload_intrn_rio (rios_t *rio, u_int8_t memory_unit, int addpipe, info_page_t info,
+			     int overwrite, rio_upload_t *upload) {
+  unsigned char buffer[2 * RIO_FTS];
+  mp3_stream_t stream;
+  rio_op_t op;
+  int ret;
+
+  upload_op_init (&op, rio, memory_unit, addpipe, info, overwrite, upload);
+  op.buffer = buffer;
+
+  /* the frames of an MP3 from a pipe are counted on the way to the device */
+  if (upload == NULL && info.data->type == TYPE_MP3 &&
+      (info.data->size == 0 || info.data->size == (u_int32_t)-1)) {
+    mp3_stream_init_rio (&stream);
+    op.stream = &stream;
+  }
+
+  while ((ret = upload_step (&op)) == RIO_STEP_AGAIN);
+
+  return ret;
+}
+
+int do_upload (rios_t *rio, u_int8_t memory_unit, int addpipe, info_page_t info, int overwrite) {
+  return upload_intrn_rio (rio, memory_unit, addpipe, info, overwrite, NULL);
+}
+
+/* copy any user-suplied tags into a header */
+static void set_tags_rio (rio_file_t *file, char *artist, char *title, char *album) {
+  if (file->type != TYPE_MP3)
+    return;
+
+  if (artist)
+    strncpy (file->artist, artist, 63);
+  
+  if (title)
+    strncpy (file->title, title, 63);
+  
+  if (album)
+    strncpy (file->album, album, 63);
+}
+
+/*
+  probe_info_rio:
+    Build the info page for a probed local file. The type of the file is
+  determined by its extension.
+
+  PostCondition:
+      - 0 and info->data points to a new header on success.
+      - < 0 if an error occured (info->data is NULL).
+*/
+int probe_info_rio (rios_t *rio, rio_probe_t *probe, info_page_t *info) {
+  char *file_name = probe->file_name;
+  char *tmp, *tmp2;
+  int error;
+
+  info->data = NULL;
+  info->skip = 0;
+  info->audio = 0;
+
+  /* common info */
+  if ((info->data = (rio_file_t *)calloc(1, sizeof(rio_file_t))) == NULL)
+    return -errno;
+
+  info->data->size = probe->size;
+  info->data->mod_date = probe->statinfo.st_mtime;
+  
+  /* set the filename */
+  tmp = strdup (file_name);
+  tmp2 = basename(tmp);
+  
+  strncpy((char *)info->data->name , tmp2, 63);
+  
+  free (tmp);
+
+  /* check for file types by extension */
+  tmp = file_name + strlen(file_name) - 3;
+
+  if (strspn(tmp, "mMpP3") == 3) {
+    /* without a player strings are UTF-8 */
+    int utf8 = (rio == NULL || (rio->info.caps & CAP_UTF8STRINGS) != 0);
+
+    /* a file seen before does not need to be parsed again */
+    if ((error = catalog_lookup_rio (probe, utf8, info)) != URIO_SUCCESS) {
+      error = mp3_info(info, probe, rio);
+
+      if (error == URIO_SUCCESS) {
+	info->audio = probe_audio_rio (probe);
+	catalog_record_rio (probe, utf8, info);
+      }
+    }
+  } else if (strstr(file_name, ".lst") == NULL && strstr (file_name, ".m3u") == NULL)
+    error = downloadable_info(info, file_name);
+  else
+    error = playlist_info(info, file_name);
+
+  if (error != 0 && info->data != NULL) {
+    free (info->data);
+    info->data = NULL;
+  }
+
+  return error;
+}
+
+/*
+  file_info_rio:
+    Build the info page for a local file (see probe_info_rio).
+*/
+int file_info_rio (rios_t *rio, char *file_name, info_page_t *info) {
+  rio_probe_t probe;
+  int error;
+
+  info->data = NULL;
+  info->skip = 0;
+
+  if ((error = probe_open_rio (file_name, &probe)) != URIO_SUCCESS)
+    return error;
+
+  error = probe_info_rio (rio, &probe, info);
+
+  probe_close_rio (&probe);
+
+  return error;
+}
+
+/*
+  probe_file_rio:
+    Fill a file list entry with the information that would be sent to
+  the device if the local file was uploaded. No device i/o is done.
+*/
+int probe_file_rio (rios_t *rio, char *file_name, flist_rio_t *entry) {
+  info_page_t info;
+  int error;
+
+  if (file_name == NULL || entry == NULL)
+    return -EINVAL;
+
+  if ((error = file_info_rio (rio, file_name, &info)) != 0)
+    return error;
+
+  memset (entry, 0, sizeof (flist_rio_t));
+  info_to_flist_rio (info.data, entry);
+
+  free (info.data);
+
   return URIO_SUCCESS;
 }
 
@@ -112,10 +453,8 @@ int do_upload (rios_t *rio, u_int8_t memory_unit, int addpipe, info_page_t info,
 int add_song_rio (rios_t *rio, u_int8_t memory_unit, char *file_name, char *artist,
 		  char *title, char *album) {
   info_page_t song_info;
+  rio_probe_t probe;
   int error;
-  int addpipe;
-  char *tmp, *tmp2;
-  struct stat statinfo;
 
   if (!rio)
     return -EINVAL;
@@ -125,71 +464,41 @@ int add_song_rio (rios_t *rio, u_int8_t memory_unit, char *file_name, char *arti
 
   rio_log (rio, 0, "add_song_rio: entering...\n");
   
-  if (stat(file_name, &statinfo) < 0)
-    return -ENOENT;
-
-  /* common info */
-  song_info.data = (rio_file_t *)calloc(1, sizeof(rio_file_t));
-  song_info.data->size = statinfo.st_size;
-  song_info.data->mod_date = statinfo.st_mtime;
-  
-  /* set the filename */
-  tmp = strdup (file_name);
-  tmp2 = basename(tmp);
-  
-  strncpy((char *)song_info.data->name , tmp2, 63);
-  
-  free (tmp);
+  /* the file is opened once: the descriptor is also used for the upload */
+  if ((error = probe_open_rio (file_name, &probe)) != URIO_SUCCESS) {
+    rio_log (rio, error, "Error opening song.\n");
 
-  /* check for file types by extension */
-  tmp = file_name + strlen(file_name) - 3;
+    return error;
+  }
 
-  if (strspn(tmp, "mMpP3") == 3) {
-    error = mp3_info(&song_info, file_name, rio);
-  
-    /* just in case one of the info funcs failed */
-    if (error != 0) {
-      rio_log (rio, error, "Error getting song info.\n");
+  if ((error = probe_info_rio (rio, &probe, &song_info)) != 0) {
+    rio_log (rio, error, "Error getting song info.\n");
+    probe_close_rio (&probe);
     
-      return error;
-    }
+    return error;
+  }
 
-    if ((error = try_lock_rio (rio)) != 0)
-      return error;
+  if ((error = try_lock_rio (rio)) != 0) {
+    free (song_info.data);
+    probe_close_rio (&probe);
 
-    /* copy any user-suplied data*/
-    if (artist)
-      sprintf(song_info.data->artist, artist, 63);
-  
-    if (title)
-      sprintf(song_info.data->title, title, 63);
-  
-    if (album)
-      sprintf(song_info.data->album, album, 63);
-  } else if (strstr(file_name, ".lst") == NULL && strstr (file_name, ".m3u") == NULL) {
-    if ((error = downloadable_info(&song_info, file_name)) != 0)
-      UNLOCK(error);
-  } else {
-    if ((error = playlist_info(&song_info, file_name)) != 0)
-      return error;
+    return error;
   }
 
-  /* upload the file */
-  addpipe = open(file_name, O_RDONLY);
-  if (addpipe < 0)
-    UNLOCK(-errno);
+  set_tags_rio (song_info.data, artist, title, album);
 
   rio_log (rio, 0, "add_song_rio: file opened and ready to send to rio.\n");
 
-  if ((error = do_upload (rio, memory_unit, addpipe, song_info, 0)) != URIO_SUCCESS) {
+  /* upload the file */
+  if ((error = do_upload (rio, memory_unit, probe.fd, song_info, 0)) != URIO_SUCCESS) {
     free(song_info.data);
     
-    close (addpipe);
+    probe_close_rio (&probe);
 
     UNLOCK(error);
   }
   
-  close (addpipe);
+  probe_close_rio (&probe);
 
   free(song_info.data);
   
@@ -198,6 +507,194 @@ int add_song_rio (rios_t *rio, u_int8_t memory_unit, char *file_name, char *arti
   UNLOCK(URIO_SUCCESS);
 }
 
+/*
+  prepare_upload_rio:
+    Read a local file and build everything that is sent to the player when
+  it is uploaded: the header, the data split into blocks and the checksum
+  of each block. The result can be sent to any number of players of the
+  same type as rio with send_upload_rio, from several threads at once.
+
+  PostCondition:
+      - URIO_SUCCESS and *upload is set (free it with free_upload_rio).
+      - < 0 if an error occured.
+*/
+int prepare_upload_rio (rios_t *rio, char *file_name, char *artist, char *title, char *album,
+			rio_upload_t **uploadp) {
+  rio_upload_t *upload;
+  rio_probe_t probe;
+  info_page_t info;
+  size_t length, copied = 0;
+  u_int32_t i;
+  int error;
+
+  if (rio == NULL || file_name == NULL || uploadp == NULL)
+    return -EINVAL;
+
+  *uploadp = NULL;
+
+  if ((error = probe_open_rio (file_name, &probe)) != URIO_SUCCESS)
+    return error;
+
+  if ((error = probe_info_rio (rio, &probe, &info)) != 0) {
+    probe_close_rio (&probe);
+
+    return error;
+  }
+
+  set_tags_rio (info.data, artist, title, album);
+
+  if ((upload = calloc (1, sizeof (rio_upload_t))) == NULL) {
+    error = -errno;
+    free (info.data);
+    probe_close_rio (&probe);
+
+    return error;
+  }
+
+  memcpy (&upload->header, info.data, sizeof (rio_file_t));
+  upload->audio = info.audio;
+  free (info.data);
+
+  upload->type       = return_type_rio (rio);
+  upload->block_size = (upload->type == RIONITRUS) ? 2 * RIO_FTS : RIO_FTS;
+  upload->num_blocks = (upload->header.size + upload->block_size - 1) / upload->block_size;
+
+  /* the last block is padded with zeros */
+  length = (size_t)upload->num_blocks * upload->block_size;
+
+  upload->data   = calloc (length + 1, 1);
+  upload->cksums = calloc (upload->num_blocks + 1, sizeof (u_int32_t));
+  if (upload->data == NULL || upload->cksums == NULL) {
+    free_upload_rio (upload);
+    probe_close_rio (&probe);
+
+    return -ENOMEM;
+  }
+
+  /* the data comes from the probe's view of the file */
+  if ((size_t) info.skip < probe.size) {
+    copied = probe.size - info.skip;
+
+    if (copied > upload->header.size)
+      copied = upload->header.size;
+
+    memcpy (upload->data, probe.data + info.skip, copied);
+  }
+
+  probe_close_rio (&probe);
+
+  /* never more than the file holds */
+  upload->num_blocks = (copied + upload->block_size - 1) / upload->block_size;
+  upload->length     = copied;
+  upload->digest     = fnv64_rio (FNV64_INIT, upload->data, copied);
+
+  for (i = 0 ; i < upload->num_blocks ; i++)
+    upload->cksums[i] = block_cksum_rio (rio, &upload->data[(size_t)i * upload->block_size],
+					 upload->block_size, "CRIODATA");
+
+  rio_log (rio, 0, "prepare_upload_rio: %s: %u blocks\n", file_name, upload->num_blocks);
+
+  *uploadp = upload;
+
+  return URIO_SUCCESS;
+}
+
+/* an upload that has started is aborted. the header is this operation's copy. */
+static void upload_release (rio_op_t *op) {
+  if (op->state != UPLOAD_START && op->state != UPLOAD_DONE)
+    abort_transfer_rio (op->rio);
+
+  free (op->info.data);
+}
+
+/*
+  upload_begin_rio:
+    Start an upload of a file prepared by prepare_upload_rio. No i/o is
+  done: each call to rio_step makes one exchange with the player (at most
+  one block of data). rio must be the same type of player the upload was
+  prepared with and stays locked until the upload is over or the operation
+  is freed with rio_op_free.
+*/
+int upload_begin_rio (rios_t *rio, u_int8_t memory_unit, rio_upload_t *upload, rio_op_t **opp) {
+  info_page_t info;
+  rio_op_t *op;
+  int error;
+
+  if (rio == NULL || upload == NULL || opp == NULL || memory_unit >= rio->info.total_memory_units)
+    return -EINVAL;
+
+  *opp = NULL;
+
+  /* the header and checksums depend on the type of player */
+  if (return_type_rio (rio) != upload->type)
+    return -EINVAL;
+
+  /* the header is changed while it is sent, each player gets a copy */
+  if ((info.data = malloc (sizeof (rio_file_t))) == NULL)
+    return -errno;
+
+  memcpy (info.data, &upload->header, sizeof (rio_file_t));
+  info.skip  = 0;
+  info.audio = upload->audio;
+
+  if ((op = malloc (sizeof (rio_op_t))) == NULL) {
+    free (info.data);
+
+    return -ENOMEM;
+  }
+
+  if ((error = try_lock_rio (rio)) != 0) {
+    free (info.data);
+    free (op);
+
+    return error;
+  }
+
+  upload_op_init (op, rio, memory_unit, -1, info, 0, upload);
+  op->release = upload_release;
+  op->locked  = 1;
+
+  *opp = op;
+
+  return URIO_SUCCESS;
+}
+
+/*
+  send_upload_rio:
+    Upload a file prepared by prepare_upload_rio. rio must be the same type
+  of player the upload was prepared with. Only rio is locked, so one thread
+  per player can send the same upload at the same time.
+*/
+int send_upload_rio (rios_t *rio, u_int8_t memory_unit, rio_upload_t *upload) {
+  rio_op_t *op;
+  int ret;
+
+  if ((ret = upload_begin_rio (rio, memory_unit, upload, &op)) != URIO_SUCCESS)
+    return ret;
+
+  while ((ret = rio_step (op)) == RIO_STEP_AGAIN);
+
+  rio_op_free (op);
+
+  return ret;
+}
+
+void free_upload_rio (rio_upload_t *upload) {
+  if (upload == NULL)
+    return;
+
+  free (upload->data);
+  free (upload->cksums);
+  free (upload);
+}
+
+int upload_type_rio (rio_upload_t *upload) {
+  if (upload == NULL)
+    return -EINVAL;
+
+  return upload->type;
+}
+
 int overwrite_file_rio (rios_t *rio, u_int8_t memory_unit, u_int32_t fileno, char *filename) {
   file_list *tmp;
   info_page_t song_info;  
@@ -212,13 +709,24 @@ int overwrite_file_rio (rios_t *rio, u_int8_t memory_unit, u_int32_t fileno, cha
   
   rio_log (rio, 0, "overwrite_file_rio: entering\n");
 
-  if (stat (filename, &statinfo) < 0) {
+  if ((addpipe = open(filename, O_RDONLY)) == -1) {
+    ret = -errno;
+    rio_log (rio, ret, "overwrite_file_rio: open failed\n");
+    UNLOCK(ret);
+  }
+
+  if (fstat (addpipe, &statinfo) < 0) {
+    ret = -errno;
     rio_log (rio, 0, "overwrite_file_rio: could not stat %s\n", filename);
-    UNLOCK(-errno);
+    close (addpipe);
+
+    UNLOCK(ret);
   }
 
-  if ((ret = wake_rio(rio)) != URIO_SUCCESS)
+  if ((ret = wake_rio(rio)) != URIO_SUCCESS) {
+    close (addpipe);
     UNLOCK(ret);
+  }
   
   /* hopefully this list is up to date */
   for (tmp = rio->info.memory[memory_unit].files ; tmp ; tmp = tmp->next)
@@ -228,19 +736,19 @@ int overwrite_file_rio (rios_t *rio, u_int8_t memory_unit, u_int32_t fileno, cha
   /* not really an error if the file doesnt exist */
   if (!tmp) {
     rio_log (rio, 0, "overwrite_file_rio: file not found %i on %i\n", memory_unit, fileno);
+    close (addpipe);
     UNLOCK(-1);
   }
 
-  if (get_file_info_rio(rio, &file, memory_unit, tmp->inum) != URIO_SUCCESS)
+  if (get_file_info_rio(rio, &file, memory_unit, tmp->inum) != URIO_SUCCESS) {
+    close (addpipe);
     UNLOCK(-1);
+  }
 
   file.size = statinfo.st_size;
-  song_info.data = &file;
-    
-  if ((addpipe = open(filename, O_RDONLY)) == -1) {
-    rio_log (rio, errno, "overwrite_file_rio: open failed\n");
-    return -1;
-  }
+  song_info.data  = &file;
+  song_info.skip  = 0;
+  song_info.audio = 0;
   
   if ((ret = do_upload (rio, 0, addpipe, song_info, 1)) != URIO_SUCCESS) {
     rio_log (rio, 0, "overwrite_file_rio: do_upload failed\n");
@@ -256,6 +764,105 @@ int overwrite_file_rio (rios_t *rio, u_int8_t memory_unit, u_int32_t fileno, cha
   UNLOCK(URIO_SUCCESS);
 }
 
+/*
+  set_file_info_rio:
+
+  Change the tags of a file without sending it again. Only the 2kB header
+  is rewritten (RIO_CHGIN). The title, artist, album, genre, year and track
+  number are all taken from fields.
+
+  PostCondition:
+      - URIO_SUCCESS if the header was replaced.
+      - -EPERM if the player can not change file headers (before S-Series).
+      - < 0 if some other error occured.
+*/
+int set_file_info_rio (rios_t *rio, u_int8_t memory_unit, u_int32_t fileno, flist_rio_t *fields) {
+  flist_rio_t *tmp;
+  rio_file_t file;
+  int ret;
+
+  if (rio == NULL || fields == NULL || memory_unit >= rio->info.total_memory_units)
+    return -EINVAL;
+
+  if (return_generation_rio (rio) < 4)
+    return -EPERM;
+
+  if ((ret = try_lock_rio (rio)) != 0)
+    return ret;
+
+  rio_log (rio, 0, "set_file_info_rio: entering...\n");
+
+  for (tmp = rio->info.memory[memory_unit].files ; tmp ; tmp = tmp->next)
+    if (tmp->num == fileno)
+      break;
+
+  if (tmp == NULL)
+    UNLOCK(-ENOENT);
+
+  if ((ret = wake_rio(rio)) != URIO_SUCCESS)
+    UNLOCK(ret);
+
+  if (return_type_rio (rio) == RIORIOT || return_type_rio (rio) == RIONITRUS) {
+    /* these players do not return complete headers. rebuild the header
+       from the file list (only music files carry tags). */
+    if (tmp->type != MP3)
+      UNLOCK(-EINVAL);
+
+    flist_to_info_rio (rio, tmp, &file);
+  } else if ((ret = get_file_info_rio(rio, &file, memory_unit, tmp->inum)) != URIO_SUCCESS)
+    UNLOCK(ret);
+
+  memset (file.title, 0, sizeof (file.title));
+  memset (file.artist, 0, sizeof (file.artist));
+  memset (file.album, 0, sizeof (file.album));
+  memset (file.genre2, 0, sizeof (file.genre2));
+
+  snprintf (file.title, sizeof (file.title), "%.63s", fields->title);
+  snprintf (file.artist, sizeof (file.artist), "%.63s", fields->artist);
+  snprintf (file.album, sizeof (file.album), "%.63s", fields->album);
+  snprintf ((char *)file.genre2, sizeof (file.genre2), "%.16s", fields->genre);
+  memcpy (file.year2, fields->year, 4);
+  file.trackno2 = fields->track_number;
+
+  fill_riot_fields_rio (rio, &file);
+
+  /* correct the endianness of data */
+  file_to_me (&file);
+
+  /* same exchange as RIO_DELET: ready, header, done */
+  if ((ret = send_command_rio(rio, RIO_CHGIN, memory_unit, 0)) != URIO_SUCCESS)
+    UNLOCK(ret);
+
+  if ((int)rio->cmd_buffer[0] == 0)
+    UNLOCK(-EIO);
+
+  if ((ret = read_block_rio(rio, NULL, 64, RIO_FTS)) != URIO_SUCCESS)
+    UNLOCK(ret);
+
+  if (strncmp((char *)rio->buffer, "SRIO", 4) != 0)
+    UNLOCK(-EIO);
+
+  if ((ret = write_block_rio(rio, (unsigned char *)&file, RIO_MTS, NULL)) != URIO_SUCCESS)
+    UNLOCK(ret);
+
+  if (strncmp((char *)rio->buffer, "SRIO", 4) != 0)
+    UNLOCK(-EIO);
+
+  /* keep the file list (and the Nitrus database built from it) current */
+  snprintf (tmp->title, sizeof (tmp->title), "%.63s", fields->title);
+  snprintf (tmp->artist, sizeof (tmp->artist), "%.63s", fields->artist);
+  snprintf (tmp->album, sizeof (tmp->album), "%.63s", fields->album);
+  snprintf (tmp->genre, sizeof (tmp->genre), "%.16s", fields->genre);
+  snprintf (tmp->year, sizeof (tmp->year), "%.4s", fields->year);
+  tmp->track_number = fields->track_number;
+
+  update_db_rio (rio);
+
+  rio_log (rio, 0, "set_file_info_rio: complete\n");
+
+  UNLOCK(URIO_SUCCESS);
+}
+
 int upload_from_pipe_rio (rios_t *rio, u_int8_t memory_unit, int addpipe, char *name, char *artist,
 			  char *album, char *title, int mp3, int bitrate, int samplerate) {
   info_page_t song_info;
@@ -273,6 +880,9 @@ int upload_from_pipe_rio (rios_t *rio, u_int8_t memory_unit, int addpipe, char *
     UNLOCK(-errno);
   }
 
+  song_info.skip  = 0;
+  song_info.audio = 0;
+
   rio_log (rio, 0, "Adding from pipe %i...\n", addpipe);
 
   /* copy any user-suplied data*/
@@ -303,6 +913,9 @@ int upload_from_pipe_rio (rios_t *rio, u_int8_t memory_unit, int addpipe, char *
     UNLOCK(error);
   }
 
+  /* the pipe has been read to its end */
+  close (addpipe);
+
   free(song_info.data);
   
   UNLOCK(URIO_SUCCESS);
@@ -352,55 +965,6 @@ static int init_overwrite_rio (rios_t *rio, u_int8_t memory_unit) {
   return init_upload_rio (rio, memory_unit, RIO_OVWRT);
 }
 
-/*
-  bulk_upload_rio:
-    function writes a file to the rio in blocks.
-*/
-static int bulk_upload_rio(rios_t *rio, info_page_t info, int addpipe) {
-  unsigned char file_buffer[2 * RIO_FTS];
-  size_t write_size;
-  long int copied = 0, amount;
-  
-  int ret;
-
-  if (return_type_rio (rio) == RIONITRUS)
-    write_size = 2 * RIO_FTS;
-  else
-    write_size = RIO_FTS;
-  
-  rio_log (rio, 0, "bulk_upload_rio: entering\n");
-  rio_log (rio, 0, "Skipping %08x bytes of input\n", info.skip);
-  lseek(addpipe, info.skip, SEEK_SET);
-  memset (file_buffer, 0, write_size);
-  
-  while ((amount = read (addpipe, file_buffer, write_size)) != 0) {
-    /* if we dont know the size we dont know how close we are to finishing */
-    if (info.data->size && rio->progress != NULL)
-      rio->progress(copied, info.data->size, rio->progress_ptr);
-
-    if ((ret = write_block_rio(rio, file_buffer, write_size, "CRIODATA")) != URIO_SUCCESS)
-      return ret;
-    
-    memset (file_buffer, 0, write_size);
-    copied += amount;
-  }
-
-  rio_log (rio, 0, "Read in %08x bytes from file. File size is %08x\n", copied, info.data->size);
-
-  if (info.data->size == -1) {
-    info.data->size = copied;
-
-    /* the time value should also be set, but there is no good way to do so */
-  }
-  
-  if (rio->progress != NULL)
-    rio->progress(1, 1, rio->progress_ptr);
-
-  rio_log (rio, 0, "bulk_upload_rio: finished\n");
-
-  return URIO_SUCCESS;
-}
-
 struct sort_list {
   int seq_number;
   flist_rio_t *ptr;
@@ -750,6 +1314,13 @@ int update_db_rio (rios_t *rio) {
   if (return_type_rio (rio) != RIONITRUS)
     return URIO_SUCCESS;
 
+  /* end_batch_rio will write the database */
+  if (rio->batch) {
+    rio->db_dirty = 1;
+
+    return URIO_SUCCESS;
+  }
+
   rio_log (rio, 0, "update_db_rio: entering...\n");
 
   buf = calloc (1, 8 * RIO_FTS);
@@ -794,44 +1365,91 @@ int update_db_rio (rios_t *rio) {
     return -EIO;
   }
 
-  for (i = 0 ; i < 8 * RIO_FTS ; i += RIO_FTS) {
-    if (i > db_size)
-      break;
+  for (i = 0 ; i < 8 * RIO_FTS ; i += RIO_FTS) {
+    if (i > db_size)
+      break;
+
+    write_block_rio (rio, &buf[i], RIO_FTS, "CRIODATA");
+  }
+
+  write_cksum_rio (rio, buf, 0, "CRIOINFO");
+  ret = read_block_rio (rio, NULL, 64, 64);
+
+  if (ret != URIO_SUCCESS || strncmp ((char *)rio->buffer, "SRIODONE", 8) != 0) {
+    rio_log (rio, ret, "update_db_rio: an unknown error occured while trying to write the updated database.\n");
+
+    free (buf);
+
+    return -EIO;
+  }
+
+  free (buf);
+
+  rio_log (rio, 0, "update_db_rio: complete.\n");
+
+  return URIO_SUCCESS;
+}
+
+/*
+  begin_batch_rio:
+
+  Defer database updates until end_batch_rio. Batches nest, the work is
+  done when the outermost batch ends.
+*/
+int begin_batch_rio (rios_t *rio) {
+  int ret;
+
+  if (rio == NULL)
+    return -EINVAL;
+
+  if ((ret = try_lock_rio (rio)) != 0)
+    return ret;
+
+  if (rio->batch++ == 0)
+    rio->db_dirty = 0;
+
+  UNLOCK(URIO_SUCCESS);
+}
+
+/*
+  end_batch_rio:
+
+  Finish a batch started with begin_batch_rio, write the database if
+  anything in the batch changed it and check the predicted free space
+  against the device.
+*/
+int end_batch_rio (rios_t *rio) {
+  int i, ret;
 
-    write_block_rio (rio, &buf[i], RIO_FTS, "CRIODATA");
-  }
+  if (rio == NULL)
+    return -EINVAL;
 
-  write_cksum_rio (rio, buf, 0, "CRIOINFO");
-  ret = read_block_rio (rio, NULL, 64, 64);
+  if ((ret = try_lock_rio (rio)) != 0)
+    return ret;
 
-  if (ret != URIO_SUCCESS || strncmp ((char *)rio->buffer, "SRIODONE", 8) != 0) {
-    rio_log (rio, ret, "update_db_rio: an unknown error occured while trying to write the updated database.\n");
+  if (rio->batch == 0 || --rio->batch > 0)
+    UNLOCK(URIO_SUCCESS);
 
-    free (buf);
+  for (i = 0 ; i < rio->info.total_memory_units && i < MAX_MEM_UNITS ; i++)
+    if (rio->space[i].pending)
+      reconcile_free_rio (rio, i);
 
-    return -EIO;
-  }
+  if (rio->db_dirty) {
+    rio->db_dirty = 0;
 
-  free (buf);
+    if ((ret = wake_rio (rio)) != URIO_SUCCESS)
+      UNLOCK(ret);
 
-  rio_log (rio, 0, "update_db_rio: complete.\n");
+    ret = update_db_rio (rio);
+  }
 
-  return URIO_SUCCESS;
+  UNLOCK(ret);
 }
 
 /*
-  complete_upload_rio:
-    function uploads the final info page to tell the rio the transfer is complete
-
-  * This function cannot be called before start_upload_rio.
-*/
-static int complete_upload_rio (rios_t *rio, u_int8_t memory_unit, info_page_t info) {
-  int ret;
-
-  rio_log (rio, 0, "complete_upload_rio: entering...\n");
-
+  fill_riot_fields_rio:
 
-  /* Kelly: 08-23-03
+  Kelly: 08-23-03
      TODO: Set some the data in the RIOT's portion of the
      data structure.  Exclude other players until it
      can be confirmed that they use it or that it
@@ -843,19 +1461,34 @@ static int complete_upload_rio (rios_t *rio, u_int8_t memory_unit, info_page_t i
      The size2 and possibly riot_file_no _MUST_ be
      set for the RIOT to successfully accept the data
      file. 
-  */
+*/
+static void fill_riot_fields_rio (rios_t *rio, rio_file_t *file) {
   if (return_type_rio(rio) == RIORIOT || return_type_rio (rio) == RIONITRUS) {
-    info.data->size2 = info.data->size;
-    info.data->riot_file_no = info.data->file_no;
-    info.data->time2 = info.data->time;
-    info.data->demarc = 0x20;
-    info.data->file_prefix = 0x2d203130;
+    file->size2 = file->size;
+    file->riot_file_no = file->file_no;
+    file->time2 = file->time;
+    file->demarc = 0x20;
+    file->file_prefix = 0x2d203130;
     
-    strncpy((char *)info.data->name2, info.data->name, 27);
-    strncpy((char *)info.data->title2, info.data->title, 48);
-    strncpy((char *)info.data->artist2, info.data->artist, 48);
-    strncpy((char *)info.data->album2, info.data->album, 48);
+    strncpy((char *)file->name2, file->name, 27);
+    strncpy((char *)file->title2, file->title, 48);
+    strncpy((char *)file->artist2, file->artist, 48);
+    strncpy((char *)file->album2, file->album, 48);
   }
+}
+
+/*
+  complete_upload_rio:
+    function uploads the final info page to tell the rio the transfer is complete
+
+  * This function cannot be called before start_upload_rio.
+*/
+static int complete_upload_rio (rios_t *rio, u_int8_t memory_unit, info_page_t info) {
+  int ret;
+
+  rio_log (rio, 0, "complete_upload_rio: entering...\n");
+
+  fill_riot_fields_rio (rio, info.data);
 
   file_to_me (info.data);
 
@@ -877,118 +1510,183 @@ static int complete_upload_rio (rios_t *rio, u_int8_t memory_unit, info_page_t i
 }
 
 /*
-  delete_file_rio:
+  delete_header_rio:
 
-  delete a file off the rio. if the file has two info pages then delete
-  both.
+  the RIO_DELET exchange: the device is sent the header of the file to
+  remove.
+*/
+static int delete_header_rio (rios_t *rio, u_int8_t memory_unit, rio_file_t *file) {
+  int ret;
+
+  if ((ret = send_command_rio(rio, RIO_DELET, memory_unit, 0)) != URIO_SUCCESS)
+    return ret;
+  
+  if ((int)rio->cmd_buffer[0] != 0) {
+    if ((ret = read_block_rio(rio, NULL, 64, RIO_FTS)) != URIO_SUCCESS)
+      return ret;
+  } else
+    return -EIO;
+    
+  if (strncmp((char *)rio->buffer, "SRIODELS", 8) != 0)
+    return -EIO;
+
+  /* correct the endianness of data */
+  file_to_me(file);
+
+  ret = write_block_rio(rio, (unsigned char *)file, RIO_MTS, NULL);
+
+  file_to_me(file);
+
+  if (ret != URIO_SUCCESS)
+    return ret;
+
+  if (strncmp((char *)rio->buffer, "SRIODELD", 8) != 0)
+    return -EIO;
+
+  return URIO_SUCCESS;
+}
+
+/*
+  delete_files_rio:
+
+  delete a batch of files off the rio. the headers of all of the files are
+  fetched before anything is deleted (the device renumbers its files as
+  they are removed), then the deletes are sent back to back. the database
+  is written and the free space checked once, at the end.
 
   PreCondition:
       - An initiated rio instance.
       - A memory unit.
-      - A file on the unit.
+      - Files on the unit.
 
   PostCondition:
-      - URIO_SUCCESS if the file was delete successfully.
-      - < 0 if some error occured.
+      - The number of files deleted. Numbers that are not on the unit are
+        skipped.
+      - < 0 if an error occured before anything was deleted.
 */
-int delete_file_rio (rios_t *rio, u_int8_t memory_unit, u_int32_t fileno) {
+int delete_files_rio (rios_t *rio, u_int8_t memory_unit, const u_int32_t *filenos, int num_files) {
+  struct {
+    rio_file_t file;
+    u_int32_t size;
+    int found;
+  } *files;
   flist_rio_t *tmp;
-  rio_file_t file;
+  int i, deleted = 0;
   int ret;
 
-  if ((ret = try_lock_rio (rio)) != 0)
+  if (rio == NULL || filenos == NULL || num_files < 0 ||
+      memory_unit >= rio->info.total_memory_units)
+    return -EINVAL;
+
+  if ((ret = begin_batch_rio (rio)) != URIO_SUCCESS)
     return ret;
 
-  rio_log (rio, 0, "delete_file_rio: entering...\n");
+  if ((ret = try_lock_rio (rio)) != 0) {
+    end_batch_rio (rio);
 
-  for (tmp = rio->info.memory[memory_unit].files ; tmp ; tmp = tmp->next) {
-    if (tmp->num == fileno)
-      break;
+    return ret;
+  }
+
+  rio_log (rio, 0, "delete_files_rio: deleting %i files\n", num_files);
+
+  files = calloc (num_files + 1, sizeof (*files));
+  if (files == NULL) {
+    ret = -ENOMEM;
+    goto delete_done;
   }
-  
-  if (tmp == NULL)
-    return -1;
-  
-  flist_remove_rio (rio, memory_unit, fileno);
-    
-  update_db_rio (rio);
 
   if ((ret = wake_rio(rio)) != URIO_SUCCESS)
-    UNLOCK(ret);
+    goto delete_done;
 
-  if (return_type_rio (rio) != RIONITRUS) {
-    if (get_file_info_rio(rio, &file, memory_unit, tmp->inum) != URIO_SUCCESS)
-      UNLOCK(-1);
-  } else {
-    memset (&file, 0, sizeof (rio_file_t));
-    file.file_no = tmp->rio_num;
+  /* resolve every file while the device's numbering is still intact */
+  for (i = 0 ; i < num_files ; i++) {
+    for (tmp = rio->info.memory[memory_unit].files ; tmp ; tmp = tmp->next)
+      if (tmp->num == filenos[i])
+	break;
+
+    if (tmp == NULL) {
+      rio_log (rio, -ENOENT, "delete_files_rio: no such file %i\n", filenos[i]);
+      continue;
+    }
+
+    if (return_type_rio (rio) != RIONITRUS) {
+      if ((ret = fetch_file_info_rio(rio, &files[i].file, memory_unit, tmp->inum)) != URIO_SUCCESS)
+	goto delete_done;
+    } else
+      files[i].file.file_no = tmp->rio_num;
+
+    files[i].size  = tmp->size;
+    files[i].found = 1;
   }
 
-  if ((ret = send_command_rio(rio, RIO_DELET, memory_unit, 0)) != URIO_SUCCESS)
-    UNLOCK(ret);
-  
-  if ((int)rio->cmd_buffer[0] != 0) {
-    if ((ret = read_block_rio(rio, NULL, 64, RIO_FTS)) != URIO_SUCCESS)
-      UNLOCK(ret);
-  } else
-    UNLOCK(-EIO);
-    
-  if (strncmp((char *)rio->buffer, "SRIODELS", 8) != 0)
-    UNLOCK(-EIO);
+  for (i = 0 ; i < num_files ; i++) {
+    if (!files[i].found)
+      continue;
 
-  /* correct the endianness of data */
-  file_to_me(&file);
+    if ((ret = delete_header_rio (rio, memory_unit, &files[i].file)) != URIO_SUCCESS) {
+      rio_log (rio, ret, "delete_files_rio: could not delete file %i\n", filenos[i]);
+      break;
+    }
 
-  if ((ret = write_block_rio(rio, (unsigned char *)&file, RIO_MTS, NULL)) != URIO_SUCCESS)
-    UNLOCK(ret);
+    for (tmp = rio->info.memory[memory_unit].files ; tmp ; tmp = tmp->next)
+      if (tmp->num == filenos[i])
+	break;
 
-  if (strncmp((char *)rio->buffer, "SRIODELD", 8) != 0)
-    UNLOCK(-EIO);
+    if (tmp != NULL) {
+      manifest_forget_rio (rio, memory_unit, tmp->rio_num);
 
-  update_free_intrn_rio (rio, memory_unit);
-    
-  rio_log (rio, 0, "delete_file_rio: complete.\n");
+      /* tmp is freed by flist_remove_rio */
+      flist_remove_rio (rio, memory_unit, filenos[i]);
+    }
 
-  UNLOCK(URIO_SUCCESS);
-}
+    update_free_intrn_rio (rio, memory_unit, files[i].size, 0);
 
-static int delete_dummy_hdr (rios_t *rio, u_int8_t memory_unit, u_int32_t fileno) {
-  rio_file_t file;
-  int error;
+    deleted++;
+  }
 
-  rio_log (rio, 0, "Clearing dummy header...\n");
+  /* deferred to the end of the batch */
+  if (deleted)
+    update_db_rio (rio);
 
-  if ((error = get_file_info_rio(rio, &file, memory_unit, fileno)) != URIO_SUCCESS)
-    return error;
+ delete_done:
+  free (files);
 
-  file.size = 0;
-  file.start = 0;
-  file.time = 0;
-  file.bits = 0;
+  unlock_rio (rio);
+  end_batch_rio (rio);
 
-  if ((error = send_command_rio (rio, RIO_DELET, memory_unit, 0)) != URIO_SUCCESS)
-    return error;
+  rio_log (rio, 0, "delete_files_rio: %i of %i files deleted.\n", deleted, num_files);
 
-  if (strncmp((char *)rio->buffer, "SRIODELS", 8) != 0)
-    return -EIO;
+  if (ret != URIO_SUCCESS && deleted == 0)
+    return ret;
 
-  /* check if the rio responded ok (with a 1) */
-  if ((error = read_block_rio (rio, NULL, 64, RIO_FTS)) != URIO_SUCCESS)
-    return error;
+  return deleted;
+}
 
-  /* correct the endianness of data */
-  file_to_me(&file);
+/*
+  delete_file_rio:
 
-  if ((error = write_block_rio(rio, (unsigned char *)&file, RIO_MTS, NULL)) != URIO_SUCCESS)
-    return error;
+  delete a file off the rio. if the file has two info pages then delete
+  both.
 
-  if (strncmp((char *)rio->buffer, "SRIODELD", 8) != 0)
-    return -EIO;
+  PreCondition:
+      - An initiated rio instance.
+      - A memory unit.
+      - A file on the unit.
 
-  return URIO_SUCCESS;
+  PostCondition:
+      - URIO_SUCCESS if the file was delete successfully.
+      - < 0 if some error occured.
+*/
+int delete_file_rio (rios_t *rio, u_int8_t memory_unit, u_int32_t fileno) {
+  int ret;
+
+  if ((ret = delete_files_rio (rio, memory_unit, &fileno, 1)) < 0)
+    return ret;
+
+  return (ret == 1) ? URIO_SUCCESS : -ENOENT;
 }
 
-static int upload_dummy_hdr (rios_t *rio, u_int8_t memory_unit, u_int32_t fileno) {
+int upload_dummy_hdr (rios_t *rio, u_int8_t memory_unit, u_int32_t fileno) {
   rio_file_t file;
   info_page_t info;
   int error;
@@ -1029,220 +1727,3 @@ static int upload_dummy_hdr (rios_t *rio, u_int8_t memory_unit, u_int32_t fileno
 
   return file_num;
 }
-
-/*
-  download_file_rio:
-  Function takes in the number of the file
-  and attemt to download it from the Rio.
- 
-  Note: This only works with the following files:
-  - Recorded WAVE files on the Rio 800
-  - preferences.bin file
-  - bookmarks.bin file
-  - non-music files uploaded by rioutil
-  - any file from an S-Series** or newer player 
-  
-  ** In order to support downloading an S-Series player should be
-  updated with the latest firmware.
-
-  -- Note --
-  Any file on a third generation player that has the 0x80 bit
-  set can be downloaded.
-  
-  It seems that, probably due to the riaa, diamond has
-  made it so that wma and mp3 files CAN NOT
-  be downloaded. mp3s that are downloaded will be deleted
-  :(! Keep that in mind (rio600/800/900 only).
-
-  All of the newer players from Rio support the download of any
-  file on the player!
-*/
-int download_file_rio (rios_t *rio, u_int8_t memory_unit, u_int32_t fileno, char *fileName) {
-  file_list *tmp;
-  rio_file_t file;
-  
-  int ret;
-
-  int downfd;
-  int i, blocks, size;
-  
-  int download_complete, cr_dummy = -1;
-  int mode = S_IRUSR | S_IWUSR | S_IROTH | S_IRGRP;
-  int block_size;
-
-  int type, player_generation;
-
-  unsigned char dload_buffer[RIO_FTS];
-
-  char *tmp_np;
-
-  if ((ret = try_lock_rio (rio)) != 0)
-    return ret;
-
-  type = return_type_rio (rio);
-  player_generation = return_generation_rio (rio);
-
-  rio_log (rio, 0, "librioutil/song_management.c download_file_rio: entering...\n");
-
-  /* fetch the file's info */
-  for (tmp = rio->info.memory[memory_unit].files ; tmp ; tmp = tmp->next)
-    if (tmp->num == fileno)
-      break;
-  
-  if (!tmp) {
-    rio_log (rio, -ENOENT, "librioutil/song_management.c download_file_rio: no such file.\n");
-
-    UNLOCK(-ENOENT);
-  }
-
-  if ((ret = get_file_info_rio(rio, &file, memory_unit, fileno)) != URIO_SUCCESS) {
-    rio_log (rio, ret, "librioutil/song_management.c download_file_rio: error getting file info.\n");
-
-    return ret;
-  }
-
-  if (return_generation_rio (rio) < 5 && return_version_rio(rio) < 2.0 && type != RIORIOT) {
-    /*
-      This code is only relevant to older players
-      
-      A dummy header is not needed with newer players/firmwares and the RIOT as
-      they do not have the same restrictions on downloading from the device.
-    */
-    if (file.start == 0)
-      UNLOCK(-EPERM);
-
-    if (player_generation == 3 && !(file.bits & 0x00000080)) {
-      /* Older players will only allow non-music files to be downloaded. A fake
-	 file header is used to download these files. Such a download will cause
-	 the deletion of the file off of the device. */
-      fileno = upload_dummy_hdr (rio, memory_unit, fileno);
-    }
-  
-    if ((ret = get_file_info_rio(rio, &file, memory_unit, fileno)) != URIO_SUCCESS) {
-      rio_log (rio, ret, "librioutil/song_management.c download_file_rio: could not fetch song info.\n");
-      UNLOCK(ret);
-    }
-  }
-
-  size = tmp->size;
-
-  if ((ret = wake_rio (rio)) != URIO_SUCCESS)
-    UNLOCK(ret);
-  
-  /* send the send file command */
-  if ((ret = send_command_rio(rio, RIO_READF, memory_unit, 0)) != URIO_SUCCESS)
-    UNLOCK(ret);
-  
-  if ((ret = read_block_rio(rio, NULL, 64, RIO_FTS)) != URIO_SUCCESS)
-    UNLOCK(ret);
-    
-  /* send the file's info page */
-  file_to_me(&file);
-  write_block_rio(rio, (unsigned char *)&file, sizeof(rio_file_t), NULL);
-  
-  if (memcmp(rio->buffer, "SRIONOFL", 8) == 0) {
-    /* file does not exist */
-    rio_log (rio, -ENOENT, "librioutil/song_management.c download_file_rio: (device) no such file\n");
-    UNLOCK(-1);
-  }
-
-  if (fileName == NULL) {
-    /* Use the filename stored on the device as the local file name */
-    if (strchr ((char *)tmp->name, ':')) {
-      /* Some files have a full DOS path in their name field. Get the basename
-	 and use that as the file name of the local file. */
-      for ( tmp_np = (char *)&(tmp->name[strlen((char *)tmp->name) - 1]) ; 
-	    tmp_np != tmp->name && *tmp_np != '\\' ; tmp_np--);
-    } else
-      tmp_np = (char *)tmp->name;
-  } else 
-    /* Create a file with a user-specified name. */
-    tmp_np = fileName;
-  
-  rio_log (rio, 0, "librioutil/song_management.c download_file_rio: downloading to file %s\n", tmp_np);
-
-  downfd = creat (tmp_np, mode);
-  if (downfd < 0) {
-    rio_log (rio, -errno, "librioutil/song_management.c download_file_rio: could not create local file %s: %s\n",
-	     tmp_np, strerror (errno));
-
-    abort_transfer_rio (rio);
-
-    UNLOCK(-1);
-  }
-
-  /* older rios (rio600, rio800, etc) send file data in smaller (4096 byte) chunks. */
-  block_size = (player_generation >= 4) ? RIO_FTS : 4096;
-  blocks = size/block_size + ((size % block_size) ? 1 : 0);
-
-  /* retrieve file data from the device */
-  for (i = 0, download_complete = 0 ; i < blocks ; i++) {
-    int read_size;
-    
-    memset (dload_buffer, 0, block_size);
-
-    if (rio->abort) {
-      abort_transfer_rio (rio);
-      rio->abort = 0;
-      
-      if (rio->progress)
-	rio->progress(1, 1, rio->progress_ptr);
-      
-      close(downfd);
-      UNLOCK(URIO_SUCCESS);
-    }
-    
-    /* the rio appears to expect a checksum in the CRIODATA packet */
-    write_cksum_rio (rio, dload_buffer, block_size, "CRIODATA");
-    
-    read_block_rio(rio, NULL, 64, 64);
-    
-    /* check for completion */
-    if (memcmp(rio->buffer, "SRIODONE", 8) == 0){
-      download_complete = 1;
-
-      break;
-    }
-    
-    if (size >= block_size)
-      read_size = block_size;
-    else
-      read_size = size;
-    
-    read_block_rio (rio, dload_buffer, RIO_FTS, block_size);
-    
-    if (rio->progress)
-      rio->progress(i, blocks, rio->progress_ptr);
-    
-    write(downfd, dload_buffer, read_size);
-    
-    size -= read_size;
-  }
-  
-  if (!download_complete) {
-    write_cksum_rio (rio, dload_buffer, block_size, "CRIODATA");
-  
-    if (return_generation_rio(rio) < 4)
-      read_block_rio(rio, NULL, 64, RIO_FTS);
-
-    if (rio->progress)
-      rio->progress(1, 1, rio->progress_ptr);
-  }
-
-  close(downfd);
-
-  send_command_rio(rio, 0x65, 0, 0);
-  send_command_rio(rio, 0x66, 0, 0);
-  
-  if (cr_dummy != -1) {
-    /* If a dummy header was uploaded, delete it. An unfortunate side-effect of this
-       deletion is the file's data will no longer be available as the device appears
-       to free the memory. */
-    delete_dummy_hdr (rio, memory_unit, fileno);
-    /* avoid a possibly bad device state by deleting the original header */
-    delete_file_rio (rio, memory_unit, cr_dummy);
-  }
-  
-  rio_log (rio, 0, "librioutil/song_management.c download_file_rio: complete.\n");
-  UNLOCK(URIO_SUCCESS);
-}
@@ -32,16 +32,23 @@
 #include <getopt.h>
 
 #include <signal.h>
+#include <pthread.h>
 
 #include <sys/stat.h>
+#include <sys/time.h>
 #include <dirent.h>
 
 #include <errno.h>
+#include <limits.h>
 
 #if defined HAVE_LIBGEN_H
 #include <libgen.h>
 #endif
 
+#if defined HAVE_STRINGS_H
+#include <strings.h>
+#endif
+
 #include "rio.h"
 #include "main.h"
 
@@ -56,17 +63,31 @@ char *basename_simple (char *x){
 }
 
 #define MAX_DEPTH_RIO 3
+#define MAX_DEVICES   16
 #define TOTAL_MARKS  20
 #define PROMPT "% "
 
 #define max(a, b) ((a > b) ? a : b)
 
+#if !defined (PATH_MAX)
+#define PATH_MAX 255
+#endif
+
 static rios_t *current_rio;
+/* players driven at once with -o 0,1,... (see fanout_tracks) */
+static rios_t *fanout_rios;
+static int num_fanout_rios;
+static int stdout_fd = -1;
 static int is_a_tty;
 static int last_nummarks;
 
 static void usage (void);
 static void print_version (void);
+static int parse_order (char *name);
+
+/* the order a batch of uploads is sent in (--order) */
+enum {ORDER_COMMAND = 0, ORDER_SMALLEST, ORDER_LARGEST, ORDER_ALBUM, ORDER_PRIORITY};
+static int upload_order = ORDER_COMMAND;
 
 static void progress_no_tty(int x, int X, void *ptr);
 static void new_printfiles(rios_t *rio, int mflag, int mem_unit);
@@ -74,12 +95,23 @@ void print_info(rios_t *rio, int mflag, int mem_unit);
 void enter_shell(rios_t *rio, int mflag, int mem_unit);
 int create_playlist (rios_t *rio, int argc, char *argv[]);
 int overwrite_file (rios_t *rio, int mem_unit, int argc, char *argv[]);
+int retag_files (rios_t *rio, int mem_unit, int argc, char *argv[], char *title, char *artist,
+		 char *album);
+int sync_tracks (rios_t *rio, char *dir);
+int scan_tracks (int num_paths, char *paths[], int num_threads, int json);
+int backup_device (rios_t *rio, char *file_name);
+int restore_device (rios_t *rio, char *file_name);
+int resume_jobs (rios_t *rio);
+int fanout_tracks (long int *devs, int num_devs, int debug);
+static int parse_devices (char *list, long int *devs);
 
 
 static struct upload_stack upstack = {NULL, NULL};
 
-static void upstack_push (int mem_unit, char *title, char *artist, char *album, char *filename, int recursive_depth);
-static void upstack_push_top (int mem_unit, char *title, char *artist, char *album, char *filename, int recursive_depth);
+static void upstack_push (int mem_unit, char *title, char *artist, char *album, char *filename, int recursive_depth,
+			  int weight);
+static void upstack_push_top (int mem_unit, char *title, char *artist, char *album, char *filename, int recursive_depth,
+			      int weight);
 static struct _song *upstack_pop (void);
 static void free__song (struct _song *);
 
@@ -87,7 +119,13 @@ static void free__song (struct _song *);
 /* signal handler */
 
 static void aborttransfer (int sigraised) {
-  current_rio->abort = 1;
+  int i;
+
+  if (current_rio)
+    current_rio->abort = 1;
+
+  for (i = 0 ; i < num_fanout_rios ; i++)
+    fanout_rios[i].abort = 1;
 }
 
 /******************/
@@ -98,14 +136,17 @@ int main (int argc, char *argv[]) {
   int aflag = 0, dflag = 0, uflag = 0, nflag = 0;
   int lflag = 0, iflag = 0, fflag = 0, cflag = 0;
   int jflag = 0, Oflag = 0, elvl = 0, bflag = 0, mflag = 0, gflag = 0;
-  int pipeu = 0;
-  int recovery = 0;
+  int pipeu = 0, Rflag = 0, Sflag = 0, xflag = 0, Bflag = 0, Uflag = 0;
+  int recovery = 0, qflag = 0;
+  int Xflag = 0, Jflag = 0, scan_threads = 0;
 
-  char *uopt = NULL, *dopt = NULL, *copt = NULL;
+  char *uopt = NULL, *dopt = NULL, *copt = NULL, *Sopt = NULL, *Bopt = NULL, *Uopt = NULL;
   char *title = NULL, *artist = NULL, *album = NULL, *name = NULL;
 
   unsigned int mem_unit = 0;
-  long int dev = 0;
+  long int dev = 0, devs[MAX_DEVICES] = {0};
+  int num_devs = 1;
+  int weight = 0;
 
   int i, ret = 0;
   rios_t rio;
@@ -129,11 +170,22 @@ int main (int argc, char *argv[]) {
     {"overwrite",0,0, 'O'},
     {"pipe",    0, 0, 'p'}, 
     {"album" ,  1, 0, 'r'},
+    {"retag",   0, 0, 'R'},
+    {"sync",    1, 0, 'S'},
+    {"stdout",  0, 0, 'x'},
+    {"backup",  1, 0, 'B'},
+    {"restore", 1, 0, 'U'},
+    {"resume",  0, 0, 'q'},
+    {"order",   1, 0, 'y'},
+    {"weight",  1, 0, 'w'},
     {"artist",  1, 0, 's'},
     {"title" ,  1, 0, 't'},
     {"update",  1, 0, 'u'},
     {"version", 0, 0, 'v'},
-    {"recovery",0, 0, 'z'}
+    {"recovery",0, 0, 'z'},
+    {"scan",    0, 0, 'X'},
+    {"jobs",    1, 0, 'P'},
+    {"json",    0, 0, 'J'}
   };
       
   /*
@@ -143,11 +195,11 @@ int main (int argc, char *argv[]) {
   */
   is_a_tty = isatty(1);
 
-  while((c = getopt_long(argc, argv, "W;a:bgld:ec:u:s:t:r:m:p:o:n:fh?ivgzjkO",
+  while((c = getopt_long(argc, argv, "W;a:bgld:ec:u:s:t:r:m:p:o:n:fh?ivgzjkORS:xB:U:y:w:qXP:J",
 			 long_options, &option_index)) != -1){
     switch(c){
     case 'a':
-      upstack_push (mem_unit, title, artist, album, optarg, 0);
+      upstack_push (mem_unit, title, artist, album, optarg, 0, weight);
       aflag = 1;
 
       break;
@@ -203,7 +255,13 @@ int main (int argc, char *argv[]) {
       
       break;
     case 'o':
-      dev = strtol(optarg, NULL, 0);
+      if ((num_devs = parse_devices (optarg, devs)) <= 0) {
+	fprintf (stderr, "Invalid device list %s. Use up to %i numbers separated by commas.\n",
+		 optarg, MAX_DEVICES);
+	exit (1);
+      }
+
+      dev = devs[0];
 
       break;
     case 'p':
@@ -234,10 +292,61 @@ int main (int argc, char *argv[]) {
     case 'O':
       Oflag = 1;
 
+      break;
+    case 'R':
+      Rflag = 1;
+
+      break;
+    case 'S':
+      Sflag = 1;
+      Sopt = optarg;
+
+      break;
+    case 'x':
+      xflag = 1;
+
+      break;
+    case 'B':
+      Bflag = 1;
+      Bopt = optarg;
+
+      break;
+    case 'U':
+      Uflag = 1;
+      Uopt = optarg;
+
+      break;
+    case 'y':
+      if ((upload_order = parse_order (optarg)) < 0) {
+	fprintf (stderr, "Unknown upload order %s. Use command, smallest, largest, album or priority.\n",
+		 optarg);
+	exit (1);
+      }
+
+      break;
+    case 'w':
+      weight = atoi (optarg);
+
+      break;
+    case 'q':
+      qflag = 1;
+
       break;
     case 'z':
       recovery = 1;
 
+      break;
+    case 'X':
+      Xflag = 1;
+
+      break;
+    case 'P':
+      scan_threads = atoi (optarg);
+
+      break;
+    case 'J':
+      Jflag = 1;
+
       break;
     case 'h':
     case '?':
@@ -253,12 +362,13 @@ int main (int argc, char *argv[]) {
     aflag = 1;
 
     for (i = optind ; i < argc ; i++)
-      upstack_push (mem_unit, title, artist, album, argv[i], 0);
+      upstack_push (mem_unit, title, artist, album, argv[i], 0, weight);
   }
 
   /* print usage and exit if no commands are specified */
   if (!gflag && !aflag && !dflag && !uflag && !fflag && !iflag && !lflag &&
-      !nflag && !cflag && !pipeu && !jflag && !Oflag)
+      !nflag && !cflag && !pipeu && !jflag && !Oflag && !Rflag && !Sflag && !Bflag && !Uflag &&
+      !qflag && !Xflag)
       usage();
 
   /* recovery mode is meant to work only with the format and upgrade commands */
@@ -277,8 +387,59 @@ int main (int argc, char *argv[]) {
 		       lflag || nflag || cflag || pipeu || jflag)) {
     fprintf (stderr, "File overwrite cannot be used with any other options.\n");
     exit (1);
+  } else if (Rflag && (gflag || aflag || dflag || uflag || fflag || iflag ||
+		       lflag || nflag || cflag || pipeu || jflag || Oflag)) {
+    fprintf (stderr, "Retagging cannot be used with any other commands.\n");
+    exit (1);
+  } else if (Sflag && (gflag || aflag || dflag || uflag || fflag || nflag ||
+		       cflag || pipeu || jflag || Oflag || Rflag)) {
+    fprintf (stderr, "Sync cannot be used with any other commands.\n");
+    exit (1);
+  } else if ((Bflag || Uflag) && (gflag || aflag || dflag || uflag || fflag || nflag ||
+				  cflag || pipeu || jflag || Oflag || Rflag || Sflag ||
+				  (Bflag && Uflag))) {
+    fprintf (stderr, "Backup and restore cannot be used with any other commands.\n");
+    exit (1);
+  } else if (qflag && (gflag || aflag || dflag || uflag || fflag || nflag || cflag || pipeu ||
+		       jflag || Oflag || Rflag || Sflag || Bflag || Uflag)) {
+    fprintf (stderr, "Resume cannot be used with any other commands.\n");
+    exit (1);
+  } else if (Xflag && (gflag || aflag || dflag || uflag || fflag || iflag || lflag || nflag ||
+		       cflag || pipeu || jflag || Oflag || Rflag || Sflag || Bflag || Uflag || qflag ||
+		       recovery)) {
+    fprintf (stderr, "Scan cannot be used with any other commands.\n");
+    exit (1);
+  }
+
+  /* no player is needed to look at local files */
+  if (Xflag)
+    return scan_tracks (argc - optind, &argv[optind], scan_threads, Jflag);
+
+  /* several players are only ever given the same tracks */
+  if (num_devs > 1) {
+    if (!aflag || gflag || dflag || uflag || fflag || iflag || lflag || nflag || cflag || pipeu ||
+	jflag || Oflag || Rflag || Sflag || Bflag || Uflag || qflag || recovery) {
+      fprintf (stderr, "Several devices (-o) can only be used to upload tracks.\n");
+      exit (1);
+    }
+
+    open_catalog_rio (NULL);
+    ret = fanout_tracks (devs, num_devs, elvl);
+    close_catalog_rio ();
+
+    return ret;
   }
 
+  if (xflag) {
+    if (!cflag) {
+      fprintf (stderr, "--stdout can only be used with -c.\n");
+      exit (1);
+    }
+
+    /* keep stdout for track data. everything else rioutil prints goes to stderr. */
+    stdout_fd = dup (1);
+    dup2 (2, 1);
+  }
   
   if (!recovery)
     printf ("Attempting to open Rio and retrieve song list.... ");
@@ -301,6 +462,10 @@ int main (int argc, char *argv[]) {
   
   printf ("complete\n");
 
+  /* tracks that were looked at before are not parsed again */
+  if (aflag || Sflag || qflag)
+    open_catalog_rio (NULL);
+
   /* set the progress bar function */
   set_progress_rio (&rio, ((is_a_tty) ? progress : progress_no_tty),
 		    NULL);
@@ -329,8 +494,21 @@ int main (int argc, char *argv[]) {
     ret = create_playlist (&rio, argc, argv);
   else if (Oflag)
     ret = overwrite_file (&rio, mem_unit, argc, argv);
+  else if (Rflag)
+    ret = retag_files (&rio, mem_unit, argc, argv, title, artist, album);
+  else if (Sflag)
+    ret = sync_tracks (&rio, Sopt);
+  else if (Bflag)
+    ret = backup_device (&rio, Bopt);
+  else if (Uflag)
+    ret = restore_device (&rio, Uopt);
+  else if (qflag) {
+    /* the manifest lets resumed uploads skip tracks that made it */
+    open_manifest_rio (&rio, NULL);
+    ret = resume_jobs (&rio);
+  }
   else if (cflag)
-    ret = download_tracks (&rio, copt, mflag);
+    ret = download_tracks (&rio, copt, mem_unit);
   else if (dflag)
     ret = delete_tracks (&rio, dopt, mem_unit);
   else if (gflag)
@@ -349,172 +527,1342 @@ int main (int argc, char *argv[]) {
     if ((ret = get_info_rio (&rio, &info)) != URIO_SUCCESS)
       printf ("could not retrieve information from the rio.\n");
 
-    if (ret == URIO_SUCCESS) {
-      sprintf(info->name, name, 16);
+    if (ret == URIO_SUCCESS) {
+      sprintf(info->name, name, 16);
+
+      if ((ret = set_info_rio (&rio, info)) == URIO_SUCCESS)
+        printf ("rename rio complete.\n");
+      else
+        printf ("rename rio failed.\n");
+
+      free (info);
+    }
+  } else if (uflag) {
+    printf ("Updating firmware, this will take about 30 seconds to complete.\n");
+
+    if ((ret = firmware_upgrade_rio (&rio, uopt)) == URIO_SUCCESS)
+      printf (" Rio update completed successfully.\n");
+    else
+      printf (" Rio update was not completed successfully.\n");
+  } else if (aflag) {
+    for (i = 0 ; i < return_mem_units_rio (&rio) ; i++)
+      printf ("Free space on %s is %03.01f MiB.\n", rio.info.memory[i].name,
+	     (float)return_free_mem_rio (&rio, i) / 1024.0);
+    
+    ret = add_tracks (&rio, mflag);
+  }
+
+  close_rio (&rio);
+  close_catalog_rio ();
+  
+  return ret;
+}
+
+static void dir_add_songs (char *filename, int depth, int mem_unit, int weight) {
+  struct stat statinfo;
+  DIR *dir_fd;
+  struct dirent *entry;
+  char *path_temp = NULL;
+
+  if (depth > MAX_DEPTH_RIO)
+    return;
+
+  if ((dir_fd = opendir (filename)) == NULL)
+    return;
+
+  while ((entry = readdir (dir_fd)) != NULL) {
+    if (path_temp) {
+      free (path_temp);
+      path_temp = NULL;
+    }
+      
+    path_temp = calloc (strlen(filename) + strlen(entry->d_name) + 2, 1);
+    sprintf (path_temp, "%s/%s", filename, entry->d_name);
+
+    if (entry->d_name[0] == '.')
+      continue;
+
+    if (stat (path_temp, &statinfo) < 0)
+      continue;
+    
+    if (S_ISDIR (statinfo.st_mode)) {
+      dir_add_songs (path_temp, depth + 1, mem_unit, weight);
+      continue;
+    }
+
+    upstack_push_top (mem_unit, NULL, NULL, NULL, path_temp, depth + 1, weight);
+  }
+
+  free (path_temp);
+  closedir (dir_fd);
+}
+
+static void print_upload_name (char *filename, off_t size) {
+  char display_name[32];
+  char *file_name;
+  int file_namel;
+
+  file_name = basename_simple (filename);
+  file_namel = strlen (file_name);
+
+  memset (display_name, 0, sizeof (display_name));
+  strncpy (display_name, file_name, 31);
+
+  if (file_namel > 32)
+    /* truncate long filenames */
+    sprintf (&display_name[14], "...%s", &file_name[file_namel - 14]);
+
+  printf("%32s [%03.1f MiB]: ", display_name, (double)size / 1048576.0);
+}
+
+/*
+  gather_tracks:
+
+  Pop everything off the upload stack (expanding directories) into an array
+  of regular files.
+*/
+static int gather_tracks (struct _song ***batchp) {
+  struct _song *p, **batch = NULL, **tmp;
+  struct stat statinfo;
+  int num_files = 0, max_files = 0;
+
+  while ((p = upstack_pop()) != NULL) {
+    if (stat(p->filename, &statinfo) < 0)
+      fprintf(stderr, "rioutil/src/main.c add_track: could not stat file %s (%s)\n", p->filename, strerror (errno));
+    else if (S_ISDIR(statinfo.st_mode))
+      /* add files from directory */
+      dir_add_songs (p->filename, p->recursive_depth, p->mem_unit, p->weight);
+    else if (!S_ISREG(statinfo.st_mode))
+      fprintf(stderr, "rioutil/src/main.c add_track: %s is not a regular file!\n", p->filename);
+    else {
+      if (num_files == max_files) {
+	max_files = max_files ? 2 * max_files : 64;
+
+	tmp = realloc (batch, max_files * sizeof (struct _song *));
+	if (tmp == NULL) {
+	  perror ("main.c/gather_tracks: realloc failed");
+
+	  exit (EXIT_FAILURE);
+	}
+
+	batch = tmp;
+      }
+
+      p->size = statinfo.st_size;
+      batch[num_files++] = p;
+      continue;
+    }
+
+    free__song (p);
+  }
+
+  *batchp = batch;
+
+  return num_files;
+}
+
+static const char *order_names[] = {"command", "smallest", "largest", "album", "priority"};
+
+static int parse_order (char *name) {
+  int i;
+
+  for (i = 0 ; i < sizeof (order_names) / sizeof (order_names[0]) ; i++)
+    if (strcasecmp (name, order_names[i]) == 0)
+      return i;
+
+  return -1;
+}
+
+/* one upload in a batch, as seen by the scheduler */
+struct scheduled_track {
+  int index;
+  u_int32_t size;
+  int weight;
+
+  flist_rio_t *probe;
+};
+
+static int schedule_compare (const void *a, const void *b) {
+  const struct scheduled_track *x = (const struct scheduled_track *)a;
+  const struct scheduled_track *y = (const struct scheduled_track *)b;
+  int cmp = 0;
+
+  switch (upload_order) {
+  case ORDER_SMALLEST:
+    cmp = (x->size > y->size) - (x->size < y->size);
+    break;
+  case ORDER_LARGEST:
+    cmp = (x->size < y->size) - (x->size > y->size);
+    break;
+  case ORDER_ALBUM:
+    if ((cmp = strcasecmp (x->probe->album, y->probe->album)) == 0)
+      cmp = x->probe->track_number - y->probe->track_number;
+    break;
+  case ORDER_PRIORITY:
+    cmp = y->weight - x->weight;
+    break;
+  }
+
+  /* otherwise keep the order the files were given in */
+  return cmp ? cmp : x->index - y->index;
+}
+
+/*
+  schedule_tracks:
+
+  Sort the uploads of a batch by the --order policy: smallest first gets
+  the most tracks across per minute, largest first packs best when space
+  runs out, album keeps each album's tracks together and priority sends
+  the files with the highest -w weight first.
+*/
+static void schedule_tracks (struct scheduled_track *schedule, int num_scheduled) {
+  if (upload_order != ORDER_COMMAND)
+    qsort (schedule, num_scheduled, sizeof (struct scheduled_track), schedule_compare);
+}
+
+/* rates assumed before anything has been sent: what a USB 1.1 player
+   manages for file data, and the tags, header and commands of each file */
+#define DEFAULT_UPLOAD_RATE (512 * 1024)
+#define DEFAULT_FILE_USECS  500000
+
+/*
+  estimate_upload:
+
+  Estimate the seconds needed for files_left files of bytes_left bytes.
+  Data moves at the rate measured by the library so far (see get_stats_rio),
+  and each file also costs the average time spent outside of the data
+  transfer (tags, headers, commands). Before the batch has sent anything
+  the earlier uploads of this instance are used, or the default rates.
+*/
+static int64_t estimate_upload (rios_t *rio, rio_stats_t *start_stats, struct timeval *start_time,
+				int files_done, int files_left, u_int64_t bytes_left) {
+  rio_stats_t stats;
+  struct timeval now;
+  int64_t wall, bytes, usecs, per_file;
+
+  if (get_stats_rio (rio, &stats) != URIO_SUCCESS)
+    memset (&stats, 0, sizeof (stats));
+
+  bytes = stats.bytes_uploaded - start_stats->bytes_uploaded;
+  usecs = stats.upload_usecs - start_stats->upload_usecs;
+
+  if (files_done > 0 && bytes > 0 && usecs > 0) {
+    gettimeofday (&now, NULL);
+    wall = (now.tv_sec - start_time->tv_sec) * 1000000LL + (now.tv_usec - start_time->tv_usec);
+
+    per_file = (wall > usecs) ? (wall - usecs) / files_done : 0;
+  } else if (stats.bytes_uploaded > 0 && stats.upload_usecs > 0) {
+    bytes    = stats.bytes_uploaded;
+    usecs    = stats.upload_usecs;
+    per_file = DEFAULT_FILE_USECS;
+  } else {
+    bytes    = DEFAULT_UPLOAD_RATE;
+    usecs    = 1000000;
+    per_file = DEFAULT_FILE_USECS;
+  }
+
+  return ((int64_t)bytes_left * usecs / bytes + files_left * per_file) / 1000000;
+}
+
+/* the time left in a batch, after each file */
+static void print_eta (rios_t *rio, rio_stats_t *start_stats, struct timeval *start_time,
+		       int files_done, int files_left, u_int64_t bytes_left) {
+  int64_t eta;
+
+  if (files_left == 0)
+    return;
+
+  eta = estimate_upload (rio, start_stats, start_time, files_done, files_left, bytes_left);
+
+  printf (" [%i left, about %i:%02i]", files_left, (int)(eta / 60), (int)(eta % 60));
+}
+
+/* with -m the files stay on the memory units they were given; only check
+   which of them fit there */
+static int plan_requested_units (rios_t *rio, struct _song **batch, int *planned, u_int32_t *sizes,
+				 int num_planned, int *units) {
+  u_int32_t *unit_sizes;
+  int *unit_files, *unit_units;
+  int i, n, unit, ret = 0;
+
+  unit_sizes = calloc (num_planned + 1, sizeof (u_int32_t));
+  unit_files = calloc (num_planned + 1, sizeof (int));
+  unit_units = calloc (num_planned + 1, sizeof (int));
+  if (unit_sizes == NULL || unit_files == NULL || unit_units == NULL) {
+    perror ("main.c/plan_requested_units: calloc failed");
+
+    exit (EXIT_FAILURE);
+  }
+
+  for (i = 0 ; i < num_planned ; i++)
+    units[i] = -1;
+
+  for (unit = 0 ; unit < return_mem_units_rio (rio) && ret >= 0 ; unit++) {
+    for (i = 0, n = 0 ; i < num_planned ; i++)
+      if (batch[planned[i]]->mem_unit == unit) {
+	unit_files[n] = i;
+	unit_sizes[n++] = sizes[i];
+      }
+
+    if (n == 0)
+      continue;
+
+    ret = plan_unit_uploads_rio (rio, unit, unit_sizes, n, unit_units);
+
+    for (i = 0 ; i < n && ret >= 0 ; i++)
+      units[unit_files[i]] = unit_units[i];
+  }
+
+  free (unit_sizes);
+  free (unit_files);
+  free (unit_units);
+
+  return ret;
+}
+
+int add_tracks (rios_t *rio, int mflag){
+  struct _song *p, **batch;
+  struct scheduled_track *schedule;
+  flist_rio_t *probes;
+  rio_job_t *jobs;
+  char real_path[PATH_MAX];
+  rio_stats_t start_stats;
+  struct timeval start_time;
+  u_int8_t dup_unit;
+  u_int32_t *sizes;
+  u_int64_t bytes_left = 0;
+  int64_t eta;
+  int *planned, *units;
+  int num_files, num_planned = 0, num_unfit = 0, num_scheduled = 0, num_done = 0;
+  int interrupted = 0;
+  int ret, i;
+  
+  fprintf(stderr, "Setting up signal handler\n");
+  signal (SIGINT, aborttransfer);
+  signal (SIGKILL, aborttransfer);
+
+  /* the manifest lets us recognize tracks that are already on the player */
+  if (open_manifest_rio (rio, NULL) != URIO_SUCCESS)
+    fprintf (stderr, "Could not open the upload manifest. Duplicate tracks will not be detected.\n");
+
+  num_files = gather_tracks (&batch);
+  if (num_files == 0)
+    return 0;
+
+  sizes    = calloc (num_files, sizeof (u_int32_t));
+  planned  = calloc (num_files, sizeof (int));
+  units    = calloc (num_files, sizeof (int));
+  probes   = calloc (num_files, sizeof (flist_rio_t));
+  schedule = calloc (num_files, sizeof (struct scheduled_track));
+  if (sizes == NULL || planned == NULL || units == NULL || probes == NULL || schedule == NULL) {
+    perror ("main.c/add_tracks: calloc failed");
+
+    exit (EXIT_FAILURE);
+  }
+
+  /* drop duplicates and find out how much will actually be sent for each file */
+  for (i = 0 ; i < num_files ; i++) {
+    p = batch[i];
+
+    /* files that can not be probed are left for add_song_rio to report */
+    if (probe_file_rio (rio, p->filename, &probes[i]) != URIO_SUCCESS) {
+      probes[i].size = p->size;
+      continue;
+    }
+
+    /* the track would be uploaded with the user-supplied tags */
+    if (p->artist)
+      strncpy (probes[i].artist, p->artist, 63);
+    if (p->title)
+      strncpy (probes[i].title, p->title, 63);
+    if (p->album)
+      strncpy (probes[i].album, p->album, 63);
+
+    if ((ret = find_duplicate_rio (rio, p->filename, &probes[i], &dup_unit)) >= 0) {
+      print_upload_name (p->filename, p->size);
+      printf(" Skipped: already on the player [memory %i, file %i]\n", dup_unit, ret);
+
+      free__song (p);
+      batch[i] = NULL;
+      continue;
+    }
+
+    sizes[num_planned] = probes[i].size;
+    planned[num_planned++] = i;
+  }
+
+  /* place the whole batch at once rather than file by file so space is not
+     stranded on either memory unit. memory units given with -m are kept. */
+  if (mflag)
+    ret = plan_requested_units (rio, batch, planned, sizes, num_planned, units);
+  else
+    ret = plan_uploads_rio (rio, sizes, num_planned, units);
+
+  if (ret < 0) {
+    fprintf (stderr, "Could not plan uploads. Using the requested memory units.\n");
+  } else {
+    for (i = 0 ; i < num_planned ; i++) {
+      p = batch[planned[i]];
+
+      if (units[i] >= 0) {
+	p->mem_unit = units[i];
+	continue;
+      }
+
+      if (num_unfit++ == 0)
+	printf ("The following files will not fit on the player:\n");
+
+      print_upload_name (p->filename, p->size);
+      printf(" Skipped: insufficient space\n");
+
+      free__song (p);
+      batch[planned[i]] = NULL;
+    }
+  }
+
+  for (i = 0 ; i < num_files ; i++) {
+    if (batch[i] == NULL)
+      continue;
+
+    schedule[num_scheduled].index  = i;
+    schedule[num_scheduled].size   = probes[i].size;
+    schedule[num_scheduled].weight = batch[i]->weight;
+    schedule[num_scheduled].probe  = &probes[i];
+    num_scheduled++;
+
+    bytes_left += probes[i].size;
+  }
+
+  schedule_tracks (schedule, num_scheduled);
+
+  /* record the batch so rioutil --resume can finish it if it is cut short */
+  if ((jobs = calloc (num_scheduled + 1, sizeof (rio_job_t))) == NULL) {
+    perror ("main.c/add_tracks: calloc failed");
+
+    exit (EXIT_FAILURE);
+  }
+
+  for (i = 0 ; i < num_scheduled ; i++) {
+    p = batch[schedule[i].index];
+
+    jobs[i].op          = RIO_JOB_UPLOAD;
+    jobs[i].memory_unit = p->mem_unit;
+    jobs[i].size        = schedule[i].size;
+    jobs[i].path        = strdup (realpath (p->filename, real_path) ? real_path : p->filename);
+    jobs[i].name        = schedule[i].probe->name;
+    jobs[i].artist      = p->artist;
+    jobs[i].title       = p->title;
+    jobs[i].album       = p->album;
+  }
+
+  if (num_scheduled && journal_begin_rio (rio, jobs, num_scheduled) != URIO_SUCCESS)
+    fprintf (stderr, "Could not write the journal. An interrupted upload can not be resumed.\n");
+
+  if (get_stats_rio (rio, &start_stats) != URIO_SUCCESS)
+    memset (&start_stats, 0, sizeof (start_stats));
+  gettimeofday (&start_time, NULL);
+
+  /* an estimate for the whole batch before the first file goes out */
+  if (num_scheduled > 1 || upload_order != ORDER_COMMAND) {
+    eta = estimate_upload (rio, &start_stats, &start_time, 0, num_scheduled, bytes_left);
+
+    printf ("Uploading %i files (%03.1f MiB), ", num_scheduled, (double)bytes_left / 1048576.0);
+    if (upload_order != ORDER_COMMAND)
+      printf ("%s first", order_names[upload_order]);
+    else
+      printf ("in the order given");
+    printf (", about %i:%02i.\n", (int)(eta / 60), (int)(eta % 60));
+  }
+
+  /* one database write and free space check for the whole batch */
+  begin_batch_rio (rio);
+
+  for (i = 0 ; i < num_scheduled ; i++) {
+    p = batch[schedule[i].index];
+
+    if (interrupted) {
+      free__song (p);
+      continue;
+    }
+
+    print_upload_name (p->filename, p->size);
+
+    ret = add_song_rio (rio, p->mem_unit, p->filename, p->artist, p->title, p->album);
+
+    bytes_left -= schedule[i].size;
+
+    if (ret == URIO_SUCCESS) {
+      printf(" Complete [memory %i]", p->mem_unit);
+      journal_done_rio (rio, i);
+      num_done++;
+    } else
+      printf(" Incomplete: %s", strerror (-ret));
+
+    if (ret == -EINTR)
+      interrupted = 1;
+    else
+      print_eta (rio, &start_stats, &start_time, i + 1, num_scheduled - i - 1, bytes_left);
+
+    printf ("\n");
+
+    free__song (p);
+  }
+
+  end_batch_rio (rio);
+
+  /* the journal is kept for anything that did not make it, not only for an
+     interrupt: a pulled cable fails every remaining file with -EIO */
+  if (num_done == num_scheduled)
+    journal_end_rio (rio);
+  else if (interrupted)
+    printf ("Upload interrupted. Run rioutil --resume to upload the remaining files.\n");
+  else
+    printf ("%i files were not uploaded. Run rioutil --resume to try them again.\n",
+	    num_scheduled - num_done);
+
+  for (i = 0 ; i < num_scheduled ; i++)
+    free (jobs[i].path);
+
+  free (jobs);
+
+  free (sizes);
+  free (planned);
+  free (units);
+  free (probes);
+  free (schedule);
+  free (batch);
+  
+  return 0;
+}
+
+static int parse_devices (char *list, long int *devs) {
+  int num_devs = 0;
+  char *endp;
+
+  do {
+    if (num_devs == MAX_DEVICES)
+      return -1;
+
+    devs[num_devs++] = strtol (list, &endp, 0);
+
+    if (endp == list || (*endp != ',' && *endp != '\0'))
+      return -1;
+
+    list = endp + 1;
+  } while (*endp == ',');
+
+  return num_devs;
+}
+
+/* uploads prepared but not yet sent to every player. bounds the memory used. */
+#define FANOUT_WINDOW 4
+
+/* a batch of tracks shared by the players of a fan-out */
+struct fanout {
+  pthread_mutex_t lock;
+  pthread_cond_t prepared, sent;
+
+  struct _song **batch;
+  int num_files;
+
+  /* filled in order by the main thread */
+  rio_upload_t **uploads;
+  int *errors;
+  int num_prepared;
+
+  /* players that still have to send each upload */
+  int *senders;
+  int in_flight;
+};
+
+struct fanout_device {
+  struct fanout *fanout;
+  rios_t *rio;
+  int number;
+
+  pthread_t thread;
+  int uploaded;
+};
+
+/* sends every track of the batch to one player */
+static void *fanout_thread (void *arg) {
+  struct fanout_device *device = (struct fanout_device *)arg;
+  struct fanout *fanout = device->fanout;
+  rios_t *rio = device->rio;
+  rio_upload_t *upload;
+  struct _song *p;
+  int i, ret, stopped = 0;
+
+  begin_batch_rio (rio);
+
+  for (i = 0 ; i < fanout->num_files ; i++) {
+    pthread_mutex_lock (&fanout->lock);
+    while (fanout->num_prepared <= i)
+      pthread_cond_wait (&fanout->prepared, &fanout->lock);
+
+    upload = fanout->uploads[i];
+    ret    = fanout->errors[i];
+    pthread_mutex_unlock (&fanout->lock);
+
+    p = fanout->batch[i];
+
+    if (ret == URIO_SUCCESS && !stopped) {
+      /* the upload was prepared for another type of player */
+      if (upload_type_rio (upload) != return_type_rio (rio))
+	ret = add_song_rio (rio, p->mem_unit, p->filename, p->artist, p->title, p->album);
+      else
+	ret = send_upload_rio (rio, p->mem_unit, upload);
+
+      if (ret == URIO_SUCCESS) {
+	device->uploaded++;
+	printf ("rio %i: %s: Complete [memory %i]\n", device->number, basename_simple (p->filename),
+		p->mem_unit);
+      } else
+	printf ("rio %i: %s: Incomplete: %s\n", device->number, basename_simple (p->filename),
+		strerror (-ret));
+
+      if (ret == -EINTR)
+	stopped = 1;
+    }
+
+    /* the last player to send an upload frees it */
+    pthread_mutex_lock (&fanout->lock);
+    if (--fanout->senders[i] == 0) {
+      free_upload_rio (fanout->uploads[i]);
+      fanout->uploads[i] = NULL;
+      fanout->in_flight--;
+      pthread_cond_signal (&fanout->sent);
+    }
+    pthread_mutex_unlock (&fanout->lock);
+  }
+
+  end_batch_rio (rio);
+
+  return NULL;
+}
+
+/*
+  fanout_tracks:
+
+  Upload the same tracks to several players at once. Each file is read,
+  parsed and checksummed once (see prepare_upload_rio) and every player is
+  driven by its own thread, so the batch takes about as long as it would
+  for the slowest player alone when they are on different USB controllers.
+*/
+int fanout_tracks (long int *devs, int num_devs, int debug) {
+  struct fanout_device *devices;
+  struct fanout fanout;
+  struct _song *p;
+  int i, ret, num_open = 0;
+
+  fanout_rios = calloc (num_devs, sizeof (rios_t));
+  devices     = calloc (num_devs, sizeof (struct fanout_device));
+  if (fanout_rios == NULL || devices == NULL) {
+    perror ("main.c/fanout_tracks: calloc failed");
+
+    exit (EXIT_FAILURE);
+  }
+
+  for (i = 0 ; i < num_devs ; i++) {
+    printf ("Attempting to open Rio %li and retrieve song list.... ", devs[i]);
+    fflush (stdout);
+
+    if ((ret = open_rio (&fanout_rios[num_open], devs[i], debug, 1)) != URIO_SUCCESS) {
+      fprintf (stderr, "failed!\n");
+      fprintf (stderr, "Reason: %s.\n", strerror (-ret));
+
+      continue;
+    }
+
+    printf ("complete\n");
+
+    /* the per-track lines replace the progress bars */
+    set_progress_rio (&fanout_rios[num_open], NULL, NULL);
+    open_manifest_rio (&fanout_rios[num_open], NULL);
+
+    devices[num_open].rio    = &fanout_rios[num_open];
+    devices[num_open].number = devs[i];
+    devices[num_open].fanout = &fanout;
+    num_open++;
+  }
+
+  num_fanout_rios = num_open;
+
+  if (num_open == 0) {
+    fprintf (stderr, "librioutil tried to use method: %s\n", return_conn_method_rio ());
+
+    exit (EXIT_FAILURE);
+  }
+
+  fprintf(stderr, "Setting up signal handler\n");
+  signal (SIGINT, aborttransfer);
+  signal (SIGKILL, aborttransfer);
+
+  memset (&fanout, 0, sizeof (fanout));
+  pthread_mutex_init (&fanout.lock, NULL);
+  pthread_cond_init (&fanout.prepared, NULL);
+  pthread_cond_init (&fanout.sent, NULL);
+
+  fanout.num_files = gather_tracks (&fanout.batch);
+  fanout.uploads   = calloc (fanout.num_files + 1, sizeof (rio_upload_t *));
+  fanout.errors    = calloc (fanout.num_files + 1, sizeof (int));
+  fanout.senders   = calloc (fanout.num_files + 1, sizeof (int));
+  if (fanout.uploads == NULL || fanout.errors == NULL || fanout.senders == NULL) {
+    perror ("main.c/fanout_tracks: calloc failed");
+
+    exit (EXIT_FAILURE);
+  }
+
+  printf ("Uploading %i files to %i players.\n", fanout.num_files, num_open);
+
+  for (i = 0 ; i < num_open ; i++)
+    pthread_create (&devices[i].thread, NULL, fanout_thread, &devices[i]);
+
+  /* prepare the uploads in order, staying at most FANOUT_WINDOW ahead of the slowest player */
+  for (i = 0 ; i < fanout.num_files ; i++) {
+    rio_upload_t *upload = NULL;
+
+    pthread_mutex_lock (&fanout.lock);
+    while (fanout.in_flight >= FANOUT_WINDOW)
+      pthread_cond_wait (&fanout.sent, &fanout.lock);
+    pthread_mutex_unlock (&fanout.lock);
+
+    p = fanout.batch[i];
+
+    if ((ret = prepare_upload_rio (&fanout_rios[0], p->filename, p->artist, p->title, p->album,
+				   &upload)) != URIO_SUCCESS) {
+      print_upload_name (p->filename, p->size);
+      printf (" Skipped: %s\n", strerror (-ret));
+    }
+
+    pthread_mutex_lock (&fanout.lock);
+    fanout.uploads[i] = upload;
+    fanout.errors[i]  = ret;
+    fanout.senders[i] = num_open;
+    fanout.num_prepared++;
+    fanout.in_flight++;
+    pthread_cond_broadcast (&fanout.prepared);
+    pthread_mutex_unlock (&fanout.lock);
+  }
+
+  for (i = 0 ; i < num_open ; i++)
+    pthread_join (devices[i].thread, NULL);
+
+  ret = 0;
+
+  for (i = 0 ; i < num_open ; i++) {
+    printf ("rio %i (%s): %i of %i files uploaded.\n", devices[i].number, fanout_rios[i].info.name,
+	    devices[i].uploaded, fanout.num_files);
+
+    if (devices[i].uploaded != fanout.num_files)
+      ret = 1;
+  }
+
+  num_fanout_rios = 0;
+
+  for (i = 0 ; i < num_open ; i++)
+    close_rio (&fanout_rios[i]);
+
+  for (i = 0 ; i < fanout.num_files ; i++)
+    free__song (fanout.batch[i]);
+
+  pthread_mutex_destroy (&fanout.lock);
+  pthread_cond_destroy (&fanout.prepared);
+  pthread_cond_destroy (&fanout.sent);
+
+  free (fanout.batch);
+  free (fanout.uploads);
+  free (fanout.errors);
+  free (fanout.senders);
+  free (devices);
+  free (fanout_rios);
+  fanout_rios = NULL;
+
+  return ret;
+}
+
+/* the tags and length of one local file (see scan_tracks) */
+struct scan_result {
+  flist_rio_t entry;
+  int ret;
+  double seconds;
+};
+
+struct scan {
+  struct _song **batch;
+  struct scan_result *results;
+  int num_files;
+
+  /* next file to probe */
+  int next;
+  pthread_mutex_t lock;
+};
+
+static void *scan_thread (void *arg) {
+  struct scan *scan = (struct scan *)arg;
+  struct scan_result *result;
+  struct timeval start, end;
+  int i;
+
+  for ( ; ; ) {
+    pthread_mutex_lock (&scan->lock);
+    i = scan->next++;
+    pthread_mutex_unlock (&scan->lock);
+
+    if (i >= scan->num_files)
+      break;
+
+    result = &scan->results[i];
+
+    gettimeofday (&start, NULL);
+    result->ret = probe_file_rio (NULL, scan->batch[i]->filename, &result->entry);
+    gettimeofday (&end, NULL);
+
+    result->seconds = (end.tv_sec - start.tv_sec) + (end.tv_usec - start.tv_usec) / 1000000.0;
+  }
+
+  return NULL;
+}
+
+/* strings are written as they are, without tabs or newlines */
+static void scan_print_tsv (char *string) {
+  for ( ; *string ; string++)
+    putchar ((*string == '\t' || *string == '\n' || *string == '\r') ? ' ' : *string);
+}
+
+static void scan_print_json (char *string) {
+  putchar ('"');
+
+  for ( ; *string ; string++) {
+    if (*string == '"' || *string == '\\')
+      printf ("\\%c", *string);
+    else if ((unsigned char)*string < 0x20)
+      printf ("\\u%04x", (unsigned char)*string);
+    else
+      putchar (*string);
+  }
+
+  putchar ('"');
+}
+
+static int scan_slower (const void *a, const void *b) {
+  double x = (*(struct scan_result **)a)->seconds, y = (*(struct scan_result **)b)->seconds;
+
+  return (x < y) ? 1 : ((x > y) ? -1 : 0);
+}
+
+#define SCAN_SLOWEST 5
+
+/*
+  scan_tracks:
+
+  Probe local files the way an upload would, without a player, using
+  num_threads threads. The header of each file is printed to stdout as tab
+  separated values (or JSON) and the throughput and slowest files to
+  stderr. Returns 1 if any file could not be probed.
+*/
+int scan_tracks (int num_paths, char *paths[], int num_threads, int json) {
+  struct scan_result **order;
+  struct timeval start, end;
+  struct scan scan;
+  pthread_t *threads;
+  double seconds, bytes = 0.0;
+  int i, failed = 0;
+
+  if (num_paths == 0) {
+    fprintf (stderr, "--scan needs at least one file or directory.\n");
+    return 1;
+  }
+
+  for (i = 0 ; i < num_paths ; i++)
+    upstack_push (0, NULL, NULL, NULL, paths[i], 0, 0);
+
+  memset (&scan, 0, sizeof (scan));
+  pthread_mutex_init (&scan.lock, NULL);
+
+  scan.num_files = gather_tracks (&scan.batch);
+
+  if (num_threads <= 0)
+    num_threads = sysconf (_SC_NPROCESSORS_ONLN);
+  if (num_threads <= 0)
+    num_threads = 1;
+  if (num_threads > scan.num_files && scan.num_files > 0)
+    num_threads = scan.num_files;
+
+  scan.results = calloc (scan.num_files + 1, sizeof (struct scan_result));
+  order        = calloc (scan.num_files + 1, sizeof (struct scan_result *));
+  threads      = calloc (num_threads, sizeof (pthread_t));
+  if (scan.results == NULL || order == NULL || threads == NULL) {
+    perror ("main.c/scan_tracks: calloc failed");
+
+    exit (EXIT_FAILURE);
+  }
+
+  gettimeofday (&start, NULL);
+
+  for (i = 0 ; i < num_threads ; i++)
+    pthread_create (&threads[i], NULL, scan_thread, &scan);
+
+  for (i = 0 ; i < num_threads ; i++)
+    pthread_join (threads[i], NULL);
+
+  gettimeofday (&end, NULL);
+
+  seconds = (end.tv_sec - start.tv_sec) + (end.tv_usec - start.tv_usec) / 1000000.0;
+
+  if (json)
+    printf ("[\n");
+  else
+    printf ("file\tsize\ttime\tbitrate\tsamplerate\ttitle\tartist\talbum\tgenre\tyear\ttrack\terror\n");
+
+  for (i = 0 ; i < scan.num_files ; i++) {
+    struct scan_result *result = &scan.results[i];
+    flist_rio_t *entry = &result->entry;
+    char *error = "";
+
+    /* mp3_info only says -1 */
+    if (result->ret == -1)
+      error = "could not be parsed";
+    else if (result->ret != URIO_SUCCESS)
+      error = strerror (-result->ret);
+
+    order[i] = result;
+    bytes   += scan.batch[i]->size;
+
+    if (result->ret != URIO_SUCCESS) {
+      failed++;
+      memset (entry, 0, sizeof (flist_rio_t));
+    }
+
+    if (json) {
+      printf ("  {\"file\": ");
+      scan_print_json (scan.batch[i]->filename);
+      printf (", \"size\": %i, \"time\": %i, \"bitrate\": %i, \"samplerate\": %i, \"title\": ",
+	      entry->size, entry->time, entry->bitrate, entry->samplerate);
+      scan_print_json (entry->title);
+      printf (", \"artist\": ");
+      scan_print_json (entry->artist);
+      printf (", \"album\": ");
+      scan_print_json (entry->album);
+      printf (", \"genre\": ");
+      scan_print_json (entry->genre);
+      printf (", \"year\": ");
+      scan_print_json (entry->year);
+      printf (", \"track\": %i", entry->track_number);
+
+      if (result->ret != URIO_SUCCESS) {
+	printf (", \"error\": ");
+	scan_print_json (error);
+      }
+
+      printf ("}%s\n", (i < scan.num_files - 1) ? "," : "");
+    } else {
+      scan_print_tsv (scan.batch[i]->filename);
+      printf ("\t%i\t%i\t%i\t%i\t", entry->size, entry->time, entry->bitrate, entry->samplerate);
+      scan_print_tsv (entry->title);
+      putchar ('\t');
+      scan_print_tsv (entry->artist);
+      putchar ('\t');
+      scan_print_tsv (entry->album);
+      putchar ('\t');
+      scan_print_tsv (entry->genre);
+      printf ("\t%s\t%i\t%s\n", entry->year, entry->track_number, error);
+    }
+  }
+
+  if (json)
+    printf ("]\n");
+
+  fflush (stdout);
+
+  fprintf (stderr, "Scanned %i files (%i failed), %03.1f MiB in %.3f s with %i threads: %.1f files/s, %.1f MiB/s\n",
+	   scan.num_files, failed, bytes / 1048576.0, seconds, num_threads,
+	   (seconds > 0.0) ? scan.num_files / seconds : 0.0,
+	   (seconds > 0.0) ? bytes / 1048576.0 / seconds : 0.0);
+
+  qsort (order, scan.num_files, sizeof (struct scan_result *), scan_slower);
+
+  if (scan.num_files > 0)
+    fprintf (stderr, "Slowest files:\n");
+
+  for (i = 0 ; i < scan.num_files && i < SCAN_SLOWEST ; i++)
+    fprintf (stderr, "  %8.2f ms  %s\n", order[i]->seconds * 1000.0,
+	     scan.batch[order[i] - scan.results]->filename);
+
+  for (i = 0 ; i < scan.num_files ; i++)
+    free__song (scan.batch[i]);
+
+  free (scan.batch);
+  free (scan.results);
+  free (order);
+  free (threads);
+
+  pthread_mutex_destroy (&scan.lock);
+
+  return failed ? 1 : 0;
+}
+
+/* one track in a sync, from either side (or both) */
+struct sync_entry {
+  char *name;
+
+  /* host side */
+  struct _song *local;
+  flist_rio_t probe;
+
+  /* player side */
+  flist_rio_t *remote;
+  int mem_unit;
+
+  /* only the player's header needs to change */
+  int retag;
+};
+
+static int sync_compare (const void *a, const void *b) {
+  return strcmp (((struct sync_entry *)a)->name, ((struct sync_entry *)b)->name);
+}
+
+/* every field set_file_info_rio rewrites */
+static int sync_tags_differ (flist_rio_t *a, flist_rio_t *b) {
+  return strcmp (a->title, b->title) || strcmp (a->artist, b->artist) ||
+    strcmp (a->album, b->album) || strncmp (a->genre, b->genre, 16) ||
+    strncmp (a->year, b->year, 4) || a->track_number != b->track_number;
+}
+
+/*
+  sync_tracks:
+
+  Make the music on the player match the directory dir. Both sides are
+  sorted by file name and merged, so the diff costs O(n log n). Tracks
+  only on the player are deleted, tracks only on the host are uploaded,
+  tracks with a different size are replaced unless the manifest shows
+  their audio is the same, and tracks with different tags have only their
+  header rewritten.
+*/
+int sync_tracks (rios_t *rio, char *dir) {
+  struct sync_entry *local = NULL, *remote = NULL;
+  struct _song **batch;
+  flist_rio_t *lists[MAX_MEM_UNITS];
+  flist_rio_t *tmpf;
+  int num_files, num_local = 0, num_remote = 0;
+  int uploads = 0, replaces = 0, retags = 0, deletes = 0, unchanged = 0;
+  double upload_bytes = 0.0;
+  int i, j, cmp, pushed, no_retag = 0, ret = 0;
+  int mem_units = return_mem_units_rio (rio);
+
+  memset (lists, 0, sizeof (lists));
+
+  /* the manifest must see the deletes */
+  open_manifest_rio (rio, NULL);
+
+  /* host side */
+  upstack_push (0, NULL, NULL, NULL, dir, 0, 0);
+  num_files = gather_tracks (&batch);
+
+  if (num_files > 0 && (local = calloc (num_files, sizeof (struct sync_entry))) == NULL) {
+    perror ("main.c/sync_tracks: calloc failed");
+
+    exit (EXIT_FAILURE);
+  }
+
+  for (i = 0 ; i < num_files ; i++) {
+    if (probe_file_rio (rio, batch[i]->filename, &local[num_local].probe) != URIO_SUCCESS) {
+      printf ("Skipping %s: could not read file information\n", batch[i]->filename);
+      free__song (batch[i]);
+      continue;
+    }
+
+    local[num_local].local = batch[i];
+    local[num_local].name  = local[num_local].probe.name;
+    num_local++;
+  }
+
+  free (batch);
 
-      if ((ret = set_info_rio (&rio, info)) == URIO_SUCCESS)
-        printf ("rename rio complete.\n");
-      else
-        printf ("rename rio failed.\n");
+  /* player side (music only, other files are left alone) */
+  for (j = 0 ; j < mem_units ; j++) {
+    if (return_flist_rio (rio, j, RMP3 | RWMA | RWAV, &lists[j]) < 0)
+      continue;
 
-      free (info);
+    for (tmpf = lists[j] ; tmpf ; tmpf = tmpf->next)
+      num_remote++;
+  }
+
+  if (num_remote > 0 && (remote = calloc (num_remote, sizeof (struct sync_entry))) == NULL) {
+    perror ("main.c/sync_tracks: calloc failed");
+
+    exit (EXIT_FAILURE);
+  }
+
+  for (j = 0, num_remote = 0 ; j < mem_units ; j++)
+    for (tmpf = lists[j] ; tmpf ; tmpf = tmpf->next) {
+      remote[num_remote].remote   = tmpf;
+      remote[num_remote].mem_unit = j;
+      remote[num_remote].name     = tmpf->name;
+      num_remote++;
     }
-  } else if (uflag) {
-    printf ("Updating firmware, this will take about 30 seconds to complete.\n");
 
-    if ((ret = firmware_upgrade_rio (&rio, uopt)) == URIO_SUCCESS)
-      printf (" Rio update completed successfully.\n");
+  qsort (local, num_local, sizeof (struct sync_entry), sync_compare);
+  qsort (remote, num_remote, sizeof (struct sync_entry), sync_compare);
+
+  /* merge. matched host entries get a pointer to their player entry and
+     matched player entries are marked by clearing their name. */
+  printf ("Sync plan for %s:\n", dir);
+
+  for (i = 0, j = 0 ; i < num_local || j < num_remote ; ) {
+    if (i == num_local)
+      cmp = 1;
+    else if (j == num_remote)
+      cmp = -1;
     else
-      printf (" Rio update was not completed successfully.\n");
-  } else if (aflag) {
-    for (i = 0 ; i < return_mem_units_rio (&rio) ; i++)
-      printf ("Free space on %s is %03.01f MiB.\n", rio.info.memory[i].name,
-	     (float)return_free_mem_rio (&rio, i) / 1024.0);
-    
-    ret = add_tracks (&rio);
+      cmp = strcmp (local[i].name, remote[j].name);
+
+    if (cmp < 0) {
+      if (i > 0 && strcmp (local[i].name, local[i - 1].name) == 0) {
+	printf ("  skip    %s (same name as %s)\n", local[i].local->filename,
+		local[i - 1].local->filename);
+	free__song (local[i].local);
+	local[i].local = NULL;
+      } else {
+	printf ("  upload  %s\n", local[i].local->filename);
+	upload_bytes += local[i].probe.size;
+	uploads++;
+      }
+
+      i++;
+    } else if (cmp > 0) {
+      printf ("  delete  [memory %i, file %i] %s\n", remote[j].mem_unit, remote[j].remote->num,
+	      remote[j].name);
+      deletes++;
+      j++;
+    } else {
+      local[i].remote   = remote[j].remote;
+      local[i].mem_unit = remote[j].mem_unit;
+      remote[j].name    = NULL;
+
+      /* editing the tags changes the size of a file but not its audio */
+      if (local[i].probe.size != remote[j].remote->size &&
+	  same_audio_rio (rio, local[i].local->filename, remote[j].mem_unit, remote[j].remote->num) != 1) {
+	printf ("  replace [memory %i, file %i] %s\n", remote[j].mem_unit, remote[j].remote->num,
+		local[i].local->filename);
+	upload_bytes += local[i].probe.size;
+	replaces++;
+      } else if (sync_tags_differ (&local[i].probe, remote[j].remote)) {
+	printf ("  retag   [memory %i, file %i] %s\n", remote[j].mem_unit, remote[j].remote->num,
+		local[i].local->filename);
+	local[i].retag = 1;
+	retags++;
+      } else {
+	free__song (local[i].local);
+	local[i].local = NULL;
+	unchanged++;
+      }
+
+      i++;
+      j++;
+    }
   }
 
-  close_rio (&rio);
-  
-  return ret;
-}
+  printf ("%i to upload and %i to replace (%03.1f MiB), %i to retag, %i to delete, %i unchanged.\n",
+	  uploads, replaces, upload_bytes / 1048576.0, retags, deletes, unchanged);
 
-static void dir_add_songs (char *filename, int depth, int mem_unit) {
-  struct stat statinfo;
-  DIR *dir_fd;
-  struct dirent *entry;
-  char *path_temp = NULL;
+  begin_batch_rio (rio);
 
-  if (depth > MAX_DEPTH_RIO)
-    return;
+  /* header-only updates. players that can not change headers get the
+     track replaced instead (it stays in local with a player entry). */
+  for (i = 0 ; i < num_local && !no_retag ; i++) {
+    if (local[i].local == NULL || local[i].remote == NULL || !local[i].retag)
+      continue;
 
-  dir_fd = opendir (filename);
+    printf ("Retagging %s:", local[i].name);
 
-  while ((entry = readdir (dir_fd)) != NULL) {
-    if (path_temp) {
-      free (path_temp);
-      path_temp = NULL;
+    if ((ret = set_file_info_rio (rio, local[i].mem_unit, local[i].remote->num, &local[i].probe)) == URIO_SUCCESS) {
+      printf (" Complete\n");
+
+      free__song (local[i].local);
+      local[i].local = NULL;
+    } else if (ret == -EPERM) {
+      printf (" Not supported by this player, replacing instead\n");
+
+      no_retag = 1;
+    } else {
+      printf (" Incomplete: %s\n", strerror (-ret));
+
+      free__song (local[i].local);
+      local[i].local = NULL;
     }
-      
-    path_temp = calloc (strlen(filename) + strlen(entry->d_name) + 1, 1);
-    sprintf (path_temp, "%s/%s", filename, entry->d_name);
+  }
 
-    if (entry->d_name[0] == '.')
+  /* deletes: unmatched player entries and replaced tracks */
+  for (j = 0 ; j < num_remote ; j++) {
+    if (remote[j].name == NULL)
       continue;
 
-    if (stat (path_temp, &statinfo) < 0)
-      continue;
-    
-    if (S_ISDIR (statinfo.st_mode)) {
-      dir_add_songs (path_temp, depth + 1, mem_unit);
-      continue;
-    }
+    printf ("Deleting %s:", remote[j].name);
 
-    upstack_push_top (mem_unit, NULL, NULL, NULL, path_temp, depth + 1);
+    if ((ret = delete_file_rio (rio, remote[j].mem_unit, remote[j].remote->num)) == URIO_SUCCESS)
+      printf (" Complete\n");
+    else
+      printf (" Incomplete: %s\n", strerror (-ret));
   }
 
-  closedir (dir_fd);
-}
+  for (i = 0 ; i < num_local ; i++) {
+    if (local[i].local == NULL || local[i].remote == NULL)
+      continue;
 
-int add_tracks (rios_t *rio){
-  struct _song *p;
-  struct stat statinfo;
-  char *file_name;
-  char display_name[32];
-  int free_size, mem_units, file_namel;
-  int ret, i;
-  
-  fprintf(stderr, "Setting up signal handler\n");
-  signal (SIGINT, aborttransfer);
-  signal (SIGKILL, aborttransfer);
-  
-  while ((p = upstack_pop()) != NULL) {
-    ret = URIO_SUCCESS;
+    printf ("Deleting %s:", local[i].name);
 
-    if (stat(p->filename, &statinfo) < 0)
-      printf("rioutil/src/main.c add_track: could not stat file %s (%s)\n", p->filename, strerror (errno));
-    else if (S_ISDIR(statinfo.st_mode))
-      /* add files from directory */
-      dir_add_songs (p->filename, p->recursive_depth, p->mem_unit);
-    else if (!S_ISREG(statinfo.st_mode))
-      printf("rioutil/src/main.c add_track: %s is not a regular file!\n", p->filename);
+    if ((ret = delete_file_rio (rio, local[i].mem_unit, local[i].remote->num)) == URIO_SUCCESS)
+      printf (" Complete\n");
     else {
-      file_name = basename_simple (p->filename);
-      file_namel = strlen (file_name);
+      printf (" Incomplete: %s\n", strerror (-ret));
 
-      strncpy (display_name, file_name, 31);
+      /* do not upload a second copy */
+      free__song (local[i].local);
+      local[i].local = NULL;
+    }
+  }
 
-      if (file_namel > 32)
-	/* truncate long filenames */
-	sprintf (&display_name[14], "...%s", &file_name[file_namel - 14]);
+  /* uploads: new tracks, replacements and retags the player could not
+     do in place, planned together */
+  for (i = 0, pushed = 0 ; i < num_local ; i++)
+    if (local[i].local != NULL) {
+      upstack_push (0, NULL, NULL, NULL, local[i].local->filename, 0, 0);
+      free__song (local[i].local);
+      pushed++;
+    }
 
-      printf("%32s [%03.1f MiB]: ", display_name, (double)statinfo.st_size / 1048576.0);
-    
-      /* mem_units will only ever be 1 or 2 */
-      mem_units = return_mem_units_rio (rio);
+  if (pushed > 0)
+    add_tracks (rio, 0);
 
-      for (i = 0 ; i < mem_units ; i++) {
-	free_size = return_free_mem_rio (rio, p->mem_unit) * 1024;
+  if ((ret = end_batch_rio (rio)) != URIO_SUCCESS)
+    printf ("Could not update the player's database: %s\n", strerror (-ret));
 
-	if (free_size >= statinfo.st_size)
-	  break;
+  for (j = 0 ; j < mem_units ; j++)
+    free_flist_rio (lists[j]);
 
-	/* insufficient space on this memory unit, try another */
-	p->mem_unit = (p->mem_unit + 1) % mem_units;
-      }
+  free (local);
+  free (remote);
 
-      if (i == mem_units)
-	ret = -ENOSPC;
-      else
-	ret = add_song_rio (rio, p->mem_unit, p->filename, p->artist, p->title, p->album);
+  return ret;
+}
 
-      if (ret == URIO_SUCCESS) 
-	printf(" Complete [memory %i]\n", p->mem_unit);
-      else
-	printf(" Incomplete: %s\n", strerror (-ret));
+/* file numbers gathered by parse_input for commands that work on a batch */
+static u_int32_t *batch_files;
+static int num_batch_files, max_batch_files;
+
+static int collect_file (rios_t *rio, int file, int mem_unit) {
+  u_int32_t *tmp;
+
+  if (num_batch_files == max_batch_files) {
+    max_batch_files = max_batch_files ? 2 * max_batch_files : 64;
+
+    tmp = realloc (batch_files, max_batch_files * sizeof (u_int32_t));
+    if (tmp == NULL) {
+      perror ("main.c/collect_file: realloc failed");
+
+      exit (EXIT_FAILURE);
     }
 
-    free__song (p);
-    p = NULL;
+    batch_files = tmp;
   }
-  
+
+  batch_files[num_batch_files++] = file;
+
   return 0;
 }
 
-static int download_single_file (rios_t *rio, int file, int mem_unit) {
-  int file_size;
-  char *file_name;
+/* find the entry for a file on the rio by its number in a listing */
+static flist_rio_t *find_track (flist_rio_t *list, int num) {
+  for ( ; list ; list = list->next)
+    if (list->num == num)
+      return list;
 
-  int ret;
+  return NULL;
+}
 
-  file_size = return_file_size_rio (rio, file, mem_unit);
-  file_name = return_file_name_rio (rio, file, mem_unit);
+/*
+  batch_jobs:
 
-  if (file_name != NULL) {
-    printf ("%32s [%03.01f MiB]:", file_name, (float)file_size/1048576.0);
-    free (file_name);
-  } else {
-    printf ("No file name associated with file number: %i. Aborting...\n", file);
-    return -1;
+  Journal entries for a download or delete of the files in batch_files.
+  Files that are not on the rio are marked done. Free the jobs (and list)
+  with free_batch_jobs.
+*/
+static rio_job_t *batch_jobs (rios_t *rio, int op, u_int32_t mem_unit, char *directory,
+			      flist_rio_t **list) {
+  flist_rio_t *tmpf;
+  rio_job_t *jobs;
+  int i;
+
+  if ((jobs = calloc (num_batch_files + 1, sizeof (rio_job_t))) == NULL) {
+    perror ("main.c/batch_jobs: calloc failed");
+
+    exit (EXIT_FAILURE);
   }
 
-  if ((ret = download_file_rio (rio, mem_unit, file, NULL)) == URIO_SUCCESS)
-    printf(" Download complete.\n");
-  else
-    printf(" Download failed. Reason: %s.\n", strerror (ret));
+  if (return_flist_rio (rio, mem_unit, RALL, list) < 0)
+    *list = NULL;
 
-  return ret;
+  for (i = 0 ; i < num_batch_files ; i++) {
+    jobs[i].op          = op;
+    jobs[i].memory_unit = mem_unit;
+    jobs[i].path        = directory;
+
+    if ((tmpf = find_track (*list, batch_files[i])) == NULL) {
+      jobs[i].done = 1;
+      continue;
+    }
+
+    jobs[i].rio_num = tmpf->rio_num;
+    jobs[i].size    = tmpf->size;
+    jobs[i].name    = tmpf->name;
+  }
+
+  return jobs;
 }
 
-static int delete_single_file (rios_t *rio, int file, int mem_unit) {
-  int ret;
-  
-  if ((ret = delete_file_rio (rio, mem_unit, file)) == URIO_SUCCESS)
-    printf("File %i successfully deleted.\n", file);
+static void free_batch_jobs (rio_job_t *jobs, flist_rio_t *list) {
+  free (jobs);
+  free_flist_rio (list);
+}
+
+/* progress of a journaled batch download (see download_done) */
+struct download_state {
+  rio_job_t *jobs;
+  int interrupted;
+};
+
+/* called by the library as each file of a batch download finishes */
+static void download_done (rios_t *rio, u_int8_t mem_unit, u_int32_t file, char *file_name,
+			   int error, void *ptr) {
+  struct download_state *state = (struct download_state *)ptr;
+  int file_size = return_file_size_rio (rio, file, mem_unit);
+  int i;
+
+  if (error == -EINTR)
+    state->interrupted = 1;
+
+  if (error == URIO_SUCCESS)
+    for (i = 0 ; i < num_batch_files ; i++)
+      if (batch_files[i] == file && !state->jobs[i].done) {
+	state->jobs[i].done = 1;
+	journal_done_rio (rio, i);
+	break;
+      }
+
+  if (file_name == NULL || *file_name == '\0') {
+    printf ("No file name associated with file number: %i.\n", file);
+    return;
+  }
+
+  printf ("%32s [%03.01f MiB]:", basename_simple (file_name), (float)file_size/1048576.0);
+
+  if (error == URIO_SUCCESS)
+    printf(" Download complete.\n");
   else
-    printf("File %i could not be deleted.\n", file);
+    printf(" Download failed. Reason: %s.\n", strerror (-error));
 
-  return ret;
+  fflush (stdout);
 }
 
 static int parse_input (rios_t *rio, char *copt, u_int32_t mem_unit, int (*fp)(rios_t *, int, int)) {
@@ -577,12 +1925,269 @@ static int parse_input (rios_t *rio, char *copt, u_int32_t mem_unit, int (*fp)(r
   return URIO_SUCCESS;
 }
 
+/*
+  download_batch:
+
+  Download the files in batch_files into directory (the current directory
+  if NULL) in one session, journaling each file as it finishes.
+*/
+static int download_batch (rios_t *rio, u_int32_t mem_unit, char *directory) {
+  struct download_state state;
+  char cwd[PATH_MAX];
+  flist_rio_t *list;
+  int i, num_done, ret;
+
+  /* the journal needs to know where the files went */
+  if (directory == NULL && getcwd (cwd, PATH_MAX) != NULL)
+    directory = cwd;
+
+  state.jobs        = batch_jobs (rio, RIO_JOB_DOWNLOAD, mem_unit, directory, &list);
+  state.interrupted = 0;
+
+  if (journal_begin_rio (rio, state.jobs, num_batch_files) != URIO_SUCCESS)
+    fprintf (stderr, "Could not write the journal. An interrupted download can not be resumed.\n");
+
+  /* all of the files are fetched in one session. the per-file lines replace
+     the progress bar since the writer thread reports files as they finish. */
+  set_progress_rio (rio, NULL, NULL);
+
+  ret = download_files_rio (rio, mem_unit, batch_files, num_batch_files, directory, download_done, &state);
+  if (ret < 0)
+    printf ("Download failed. Reason: %s.\n", strerror (-ret));
+  else
+    printf ("%i of %i files downloaded.\n", ret, num_batch_files);
+
+  set_progress_rio (rio, ((is_a_tty) ? progress : progress_no_tty), NULL);
+
+  /* batch_jobs marked the files that are not on the player done */
+  for (i = 0, num_done = 0 ; i < num_batch_files ; i++)
+    if (state.jobs[i].done)
+      num_done++;
+
+  if (num_done == num_batch_files)
+    journal_end_rio (rio);
+  else if (state.interrupted || ret == -EINTR)
+    printf ("Download interrupted. Run rioutil --resume to download the remaining files.\n");
+  else
+    printf ("%i files were not downloaded. Run rioutil --resume to try them again.\n",
+	    num_batch_files - num_done);
+
+  free_batch_jobs (state.jobs, list);
+
+  return ret;
+}
+
 int download_tracks (rios_t *rio, char *copt, u_int32_t mem_unit){
-  return parse_input (rio, copt, mem_unit, download_single_file);
+  int ret, i;
+
+  num_batch_files = 0;
+  parse_input (rio, copt, mem_unit, collect_file);
+
+  if (stdout_fd >= 0) {
+    /* --stdout: send the tracks (in order) down the original stdout */
+    for (i = 0, ret = 0 ; i < num_batch_files && ret == 0 ; i++) {
+      if ((ret = download_to_sink_rio (rio, mem_unit, batch_files[i], fd_sink_rio, &stdout_fd)) != URIO_SUCCESS)
+	printf ("\nDownload of file %i failed. Reason: %s.\n", batch_files[i], strerror (-ret));
+      else
+	printf ("\n");
+    }
+
+    free (batch_files);
+    batch_files = NULL;
+    max_batch_files = 0;
+
+    return ret;
+  }
+
+  ret = download_batch (rio, mem_unit, NULL);
+
+  free (batch_files);
+  batch_files = NULL;
+  max_batch_files = 0;
+
+  return (ret < 0) ? ret : 0;
+}
+
+int backup_device (rios_t *rio, char *file_name) {
+  int i, num_files = 0, ret;
+
+  for (i = 0 ; i < return_mem_units_rio (rio) ; i++)
+    num_files += return_num_files_rio (rio, i);
+
+  printf ("Backing up %i files to %s\n", num_files, file_name);
+
+  if ((ret = backup_rio (rio, file_name)) < 0) {
+    printf ("\nBackup failed. Reason: %s.\n", strerror (-ret));
+
+    return ret;
+  }
+
+  printf ("\n%i of %i files backed up.\n", ret, num_files);
+
+  return (ret == num_files) ? 0 : 1;
+}
+
+int restore_device (rios_t *rio, char *file_name) {
+  int ret;
+
+  printf ("Restoring the rio from %s. Everything on it will be erased.\n", file_name);
+
+  if ((ret = restore_rio (rio, file_name)) < 0) {
+    printf ("\nRestore failed. Reason: %s.\n", strerror (-ret));
+
+    return ret;
+  }
+
+  printf ("\n%i files restored.\n", ret);
+
+  return 0;
+}
+
+/*
+  delete_batch:
+
+  Delete the files in batch_files in one pass. The journal lets
+  rioutil --resume finish the deletes if rioutil dies part way through.
+*/
+static int delete_batch (rios_t *rio, u_int32_t mem_unit) {
+  flist_rio_t *list;
+  rio_job_t *jobs;
+  int ret;
+
+  jobs = batch_jobs (rio, RIO_JOB_DELETE, mem_unit, NULL, &list);
+
+  if (journal_begin_rio (rio, jobs, num_batch_files) != URIO_SUCCESS)
+    fprintf (stderr, "Could not write the journal. An interrupted delete can not be resumed.\n");
+
+  ret = delete_files_rio (rio, mem_unit, batch_files, num_batch_files);
+  if (ret < 0)
+    printf ("Delete failed. Reason: %s.\n", strerror (-ret));
+  else
+    printf ("%i of %i files deleted.\n", ret, num_batch_files);
+
+  /* the delete pass has ended (even if some files could not be removed) */
+  journal_end_rio (rio);
+
+  free_batch_jobs (jobs, list);
+
+  return ret;
 }
 
 int delete_tracks (rios_t *rio, char *dopt, u_int32_t mem_unit) {
-  return parse_input (rio, dopt, mem_unit, delete_single_file);
+  int ret;
+
+  num_batch_files = 0;
+  parse_input (rio, dopt, mem_unit, collect_file);
+
+  ret = delete_batch (rio, mem_unit);
+
+  free (batch_files);
+  batch_files = NULL;
+  max_batch_files = 0;
+
+  return (ret == num_batch_files) ? 0 : 1;
+}
+
+/*
+  resume_jobs:
+
+  Finish the batch recorded in the journal by an interrupted upload,
+  download or delete. Jobs that were finished (or can no longer be done)
+  are dropped and the rest are run again, with a new journal.
+*/
+int resume_jobs (rios_t *rio) {
+  flist_rio_t *lists[MAX_MEM_UNITS], *tmpf;
+  rio_job_t *jobs;
+  int num_jobs, pending, ret = 0;
+  int i, j;
+
+  if ((num_jobs = journal_load_rio (rio, &jobs)) < 0) {
+    if (num_jobs == -ENOENT)
+      printf ("There is nothing to resume.\n");
+    else
+      printf ("Could not read the journal. Reason: %s.\n", strerror (-num_jobs));
+
+    return (num_jobs == -ENOENT) ? 0 : num_jobs;
+  }
+
+  fprintf(stderr, "Setting up signal handler\n");
+  signal (SIGINT, aborttransfer);
+  signal (SIGKILL, aborttransfer);
+
+  pending = journal_reconcile_rio (rio, jobs, num_jobs);
+  printf ("%i of %i jobs left to do.\n", pending, num_jobs);
+
+  if (pending <= 0) {
+    journal_end_rio (rio);
+    journal_free_rio (jobs, num_jobs);
+
+    return 0;
+  }
+
+  memset (lists, 0, sizeof (lists));
+
+  for (j = 0 ; j < return_mem_units_rio (rio) ; j++)
+    if (return_flist_rio (rio, j, RALL, &lists[j]) < 0)
+      lists[j] = NULL;
+
+  /* uploads go through add_tracks again, which schedules and journals them */
+  for (i = 0 ; i < num_jobs ; i++)
+    if (!jobs[i].done && jobs[i].op == RIO_JOB_UPLOAD) {
+      upstack_push (jobs[i].memory_unit, jobs[i].title, jobs[i].artist, jobs[i].album,
+		    jobs[i].path, 0, 0);
+      jobs[i].done = 1;
+      pending--;
+    }
+
+  /* the memory units were planned when the batch was first started */
+  if (upstack.head != NULL)
+    ret = add_tracks (rio, 1);
+
+  /* downloads and deletes are run in batches of files on the same memory
+     unit (and, for downloads, into the same directory) */
+  for (i = 0 ; i < num_jobs && pending > 0 ; i++) {
+    if (jobs[i].done)
+      continue;
+
+    num_batch_files = 0;
+
+    for (j = i ; j < num_jobs ; j++) {
+      if (jobs[j].done || jobs[j].op != jobs[i].op || jobs[j].memory_unit != jobs[i].memory_unit ||
+	  (jobs[i].path && (jobs[j].path == NULL || strcmp (jobs[i].path, jobs[j].path) != 0)))
+	continue;
+
+      for (tmpf = lists[jobs[j].memory_unit] ; tmpf ; tmpf = tmpf->next)
+	if (tmpf->rio_num == jobs[j].rio_num)
+	  break;
+
+      if (tmpf != NULL)
+	collect_file (rio, tmpf->num, jobs[j].memory_unit);
+
+      jobs[j].done = 1;
+      pending--;
+    }
+
+    if (num_batch_files == 0)
+      continue;
+
+    if (jobs[i].op == RIO_JOB_DOWNLOAD)
+      ret = download_batch (rio, jobs[i].memory_unit, jobs[i].path);
+    else
+      ret = delete_batch (rio, jobs[i].memory_unit);
+
+    ret = (ret < 0) ? ret : 0;
+  }
+
+  for (j = 0 ; j < MAX_MEM_UNITS ; j++)
+    free_flist_rio (lists[j]);
+
+  free (batch_files);
+  batch_files = NULL;
+  max_batch_files = 0;
+
+  journal_free_rio (jobs, num_jobs);
+
+  return ret;
 }
 
   
@@ -708,6 +2313,7 @@ static void usage (void) {
   printf(" uploading:\n");
   printf("  -a, --upload=<file>    upload an track\n");
   printf("  -b, --bulk=<filelist>  upload mutiple tracks\n");
+  printf("  -S, --sync=<dir>       make the music on the rio match a directory\n");
   printf("  -u, --update=<file>    update with a new firmware\n\n");
 
   printf(" uploading from pipe:\n");
@@ -715,29 +2321,44 @@ static void usage (void) {
 
   printf("  -s, --artist=<string>  artist. MAX:63 chars\n");
   printf("  -t, --title=<string>   title.  MAX:63 chars\n");
-  printf("  -r, --album=<string>   album.  MAX:63 chars\n\n");
+  printf("  -r, --album=<string>   album.  MAX:63 chars\n");
+  printf("  -w, --weight=<int>     priority of the following files with --order=priority\n");
+  printf("  -y, --order=<policy>   upload order: command (default), smallest, largest,\n");
+  printf("                         album or priority\n\n");
 
 
   printf(" other commands:\n");
   printf("  -j, --playlist <name> <list of mem_unit,song> create playlist (S-Series and newer)\n");
   printf("       i.e. rioutil -j fubar 0,0 1,0     (song 0 on mem_unit 0, song 0 on mem_unit 1)\n");
+  printf("  -R, --retag <song> <file> [<song> <file> ...] replace the tags of songs with those\n");
+  printf("                         of local files without uploading them (S-Series and newer)\n");
   printf("  -i, --info             rio info\n");
   printf("  -l, --list             list tracks\n");
   printf("  -f, --format           format rio memory (default is internal)\n");
   printf("  -n, --name=<string>    change the name. MAX:15 chars\n");
   printf("  -c, --download=<int>   download a track(s)\n");
-  printf("  -d, --delete=<int>     delete a track(s)\n\n");
+  printf("  -x, --stdout           with -c, write the track(s) to stdout instead of files\n");
+  printf("  -d, --delete=<int>     delete a track(s)\n");
+  printf("  -B, --backup=<file>    save every track, the settings and the layout of the rio\n");
+  printf("  -U, --restore=<file>   erase the rio and restore it from a backup\n");
+  printf("  -q, --resume           finish an interrupted upload, download or delete\n");
+  printf("  -X, --scan <files or directories> read the tags and length of local files\n");
+  printf("                         without a rio and report how fast it went\n\n");
 
   printf(" options:\n");
 #if !defined(__FreeBSD__) || !defined(__NetBSD__)
   printf("  -o, --device=<int>     minor number of rio (assigned by driver), /dev/usb/rio?\n");
+  printf("                         a list (-o 0,1,2) uploads the same tracks to each rio\n");
 #else
   printf("  -o, --device=<int>     minor number of rio (assigned by driver), /dev/urio?\n");
+  printf("                         a list (-o 0,1,2) uploads the same tracks to each rio\n");
 #endif
   printf("  -k, --nocolor          supress ansi color\n");
   printf("  -m, --memory=<int>     memory unit to upload/download/delete/format to/from\n");
   printf("  -e, --debug            increase verbosity level.\n");
   printf("  -z, --recovery         use recovery mode. for use with players in \"upgrader\" mode\n");
+  printf("  -P, --jobs=<int>       threads used by --scan (default: one per cpu)\n");
+  printf("  -J, --json             print the results of --scan as JSON\n");
 
   printf(" rioutil info: librioutil driver: %s\n", return_conn_method_rio ());
   printf("  -v, --version          print version\n");
@@ -793,7 +2414,7 @@ static void progress_no_tty(int x, int X, void *ptr) {
 }
 
 static struct stack_item *new_stack_item (int mem_unit, char *title, char *artist, char *album,
-					  char *filename, int recursive_depth) {
+					  char *filename, int recursive_depth, int weight) {
   struct stack_item *p;
 
   if (filename == NULL) {
@@ -822,16 +2443,17 @@ static struct stack_item *new_stack_item (int mem_unit, char *title, char *artis
   p->data->album    = (album) ? strdup (album) : NULL;
   p->data->filename = strdup (filename);
   p->data->recursive_depth = recursive_depth;
+  p->data->weight   = weight;
 
   return p;
 }
 
 /* upload stack routines */
 static void upstack_push (int mem_unit, char *title, char *artist, char *album,
-			  char *filename, int recursive_depth) {
+			  char *filename, int recursive_depth, int weight) {
   struct stack_item *p;
   
-  p = new_stack_item (mem_unit, title, artist, album, filename, recursive_depth);
+  p = new_stack_item (mem_unit, title, artist, album, filename, recursive_depth, weight);
   p->next = NULL;
 
   if (upstack.tail != NULL) {
@@ -842,10 +2464,10 @@ static void upstack_push (int mem_unit, char *title, char *artist, char *album,
 }
 
 static void upstack_push_top (int mem_unit, char *title, char *artist, char *album,
-	       char *filename, int recursive_depth) {
+	       char *filename, int recursive_depth, int weight) {
   struct stack_item *p;
   
-  p = new_stack_item (mem_unit, title, artist, album, filename, recursive_depth);
+  p = new_stack_item (mem_unit, title, artist, album, filename, recursive_depth, weight);
   p->next = upstack.head;
 
   if (upstack.head == NULL)
@@ -1142,3 +2764,50 @@ int overwrite_file (rios_t *rio, int mem_unit, int argc, char *argv[]) {
 
   return ret;
 }
+
+/*
+  retag_files:
+
+  Copy the tags of local files onto tracks already on the player. Only the
+  track headers are sent. Arguments come in <song> <file> pairs.
+*/
+int retag_files (rios_t *rio, int mem_unit, int argc, char *argv[], char *title, char *artist,
+		 char *album) {
+  flist_rio_t probe;
+  int song, i;
+  int ret = 0;
+
+  if (optind + 1 >= argc) {
+    fprintf (stderr, "Retagging needs at least one <song> <file> pair.\n");
+
+    return -EINVAL;
+  }
+
+  for (i = optind ; i + 1 < argc ; i += 2) {
+    if (sscanf (argv[i], "%d", &song) != 1) {
+      printf ("%s is not a song number\n", argv[i]);
+      continue;
+    }
+
+    printf ("Retagging %i with tags from %s:", song, argv[i + 1]);
+
+    if ((ret = probe_file_rio (rio, argv[i + 1], &probe)) == URIO_SUCCESS) {
+      /* user-supplied tags win, just as they do for uploads */
+      if (artist)
+	strncpy (probe.artist, artist, 63);
+      if (title)
+	strncpy (probe.title, title, 63);
+      if (album)
+	strncpy (probe.album, album, 63);
+
+      ret = set_file_info_rio (rio, mem_unit, song, &probe);
+    }
+
+    if (ret < 0)
+      printf (" Incomplete: %s\n", strerror (-ret));
+    else
+      printf (" Complete\n");
+  }
+
+  return ret;
+}
@@ -57,8 +57,12 @@ struct _song {
   char *album;
     
   char *filename;
+  off_t size;
 
   int recursive_depth;
+
+  /* set with -w. higher weights go first with --order=priority */
+  int weight;
 };
 
 struct stack_item {
@@ -74,7 +78,7 @@ struct upload_stack {
 void printfiles(file_list *);
 void progress(int x, int X, void *ptr);
 
-int add_tracks (rio_instance_t *rio);
+int add_tracks (rio_instance_t *rio, int mflag);
 int delete_tracks (rio_instance_t *rio, char *dopt, u_int32_t mflag);
 int download_tracks (rio_instance_t *rio, char *copt, u_int32_t mflag);
 
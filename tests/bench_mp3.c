@@ -0,0 +1,92 @@
+#include "rioi.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+
+/*
+  Measures how fast mp3_info walks the frames of a file. Not run by
+  make check: build it with "make bench_mp3" and run it from this
+  directory, optionally with the size of the test file in MiB and the
+  number of passes.
+*/
+int main(int argc, char *argv[])
+{
+    const char temp_filename[] = "bench.mp3";
+    long size_mib = (argc > 1) ? atol(argv[1]) : 256;
+    int passes = (argc > 2) ? atoi(argv[2]) : 5;
+    long frame_len, written = 0;
+    char *frame_buffer;
+    struct timeval start, end;
+    double seconds;
+    int i, ret = 0;
+
+    {
+	FILE *frame_file = fopen("frame.mp3", "r");
+	if (!frame_file) {
+	    perror("Unable to open frame file\n");
+	    return 1;
+	}
+
+	fseek(frame_file, 0, SEEK_END);
+	frame_len = ftell(frame_file);
+	frame_buffer = malloc(frame_len);
+
+	rewind(frame_file);
+
+	if (fread(frame_buffer, frame_len, 1, frame_file) < 1) {
+	    perror("Unable to read frame file\n");
+	    fclose(frame_file);
+	    return 1;
+	}
+
+	fclose(frame_file);
+    }
+
+    {
+	FILE *test_file = fopen(temp_filename, "w");
+	if (!test_file) {
+	    perror("Unable to open test file\n");
+	    return 1;
+	}
+
+	for (written = 0 ; written < size_mib << 20 ; written += frame_len)
+	    fwrite(frame_buffer, frame_len, 1, test_file);
+
+	fclose(test_file);
+    }
+
+    gettimeofday(&start, NULL);
+
+    for (i = 0 ; i < passes && ret == 0 ; i++) {
+	rios_t rio;
+	info_page_t info;
+	rio_probe_t probe;
+
+	memset(&rio, 0, sizeof(rio));
+	memset(&info, 0, sizeof(info));
+	info.data = (rio_file_t *)calloc(1, sizeof(rio_file_t));
+
+	if (probe_open_rio((char *)temp_filename, &probe) != URIO_SUCCESS ||
+	    mp3_info(&info, &probe, &rio) != URIO_SUCCESS) {
+	    fprintf(stderr, "Failed to get MP3 info\n");
+	    ret = 1;
+	}
+
+	probe_close_rio(&probe);
+	free(info.data);
+    }
+
+    gettimeofday(&end, NULL);
+
+    seconds = (end.tv_sec - start.tv_sec) + (end.tv_usec - start.tv_usec) / 1000000.0;
+
+    if (ret == 0)
+	printf("%i passes over %li MiB (%li frames): %.3f s, %.1f MiB/s\n", passes, size_mib,
+	       written / frame_len, seconds, (double)(size_mib * passes) / seconds);
+
+    remove(temp_filename);
+    free(frame_buffer);
+
+    return ret;
+}
@@ -0,0 +1,155 @@
+#include "rioi.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+
+static int errors;
+
+/* holds the worker inside the first job's completion callback */
+static pthread_mutex_t gate_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t gate_cond = PTHREAD_COND_INITIALIZER;
+static int worker_waiting, gate_open;
+static int first_result = 1;
+
+static void blocking_callback(rios_t *rio, rio_event_t *event, void *ptr)
+{
+    if (event->type != RIO_EVENT_DONE)
+	return;
+
+    pthread_mutex_lock(&gate_lock);
+    first_result = event->result;
+    worker_waiting = 1;
+    pthread_cond_broadcast(&gate_cond);
+
+    while (!gate_open)
+	pthread_cond_wait(&gate_cond, &gate_lock);
+    pthread_mutex_unlock(&gate_lock);
+}
+
+static void expect_event(rios_t *rio, int job, int result)
+{
+    struct pollfd pfd;
+    rio_event_t event;
+
+    pfd.fd = event_fd_rio(rio);
+    pfd.events = POLLIN;
+
+    /* progress events are not expected: these jobs never reach the device */
+    while (next_event_rio(rio, &event) == -EAGAIN) {
+	if (poll(&pfd, 1, 5000) <= 0) {
+	    fprintf(stderr, "job %d: no event\n", job);
+	    ++errors;
+	    return;
+	}
+    }
+
+    if (event.job != job || event.type != RIO_EVENT_DONE || event.result != result) {
+	fprintf(stderr, "expected job %d done with %d, got job %d type %d result %d\n",
+		job, result, event.job, event.type, event.result);
+	++errors;
+    }
+}
+
+/* threads queueing the first jobs on an instance at the same moment */
+#define RACERS 8
+
+static rios_t race_rio;
+static pthread_barrier_t race_barrier;
+static int race_ids[RACERS];
+
+static void *race_thread(void *arg)
+{
+    int i = (int)(long)arg;
+
+    pthread_barrier_wait(&race_barrier);
+    race_ids[i] = delete_file_rio_async(&race_rio, 0, 0, NULL, NULL);
+
+    return NULL;
+}
+
+/* one worker numbers the jobs: two would both hand out 1 */
+static void check_one_worker(void)
+{
+    pthread_t threads[RACERS];
+    int i, j;
+
+    memset(&race_rio, 0, sizeof(race_rio));
+    pthread_barrier_init(&race_barrier, NULL, RACERS);
+
+    for (i = 0 ; i < RACERS ; i++)
+	pthread_create(&threads[i], NULL, race_thread, (void *)(long)i);
+
+    for (i = 0 ; i < RACERS ; i++)
+	pthread_join(threads[i], NULL);
+
+    for (i = 0 ; i < RACERS ; i++)
+	for (j = i + 1 ; j < RACERS ; j++)
+	    if (race_ids[i] <= 0 || race_ids[i] == race_ids[j]) {
+		fprintf(stderr, "jobs %d and %d got ids %d and %d\n", i, j, race_ids[i], race_ids[j]);
+		++errors;
+	    }
+
+    stop_async_rio(&race_rio);
+    pthread_barrier_destroy(&race_barrier);
+}
+
+int main()
+{
+    rios_t rio;
+    int first, second, third;
+
+    /* no device: uploads fail at once because there are no memory units */
+    memset(&rio, 0, sizeof(rio));
+
+    first = add_song_rio_async(&rio, 0, "frame.mp3", NULL, NULL, NULL, blocking_callback, NULL);
+    second = add_song_rio_async(&rio, 0, "frame.mp3", NULL, NULL, NULL, NULL, NULL);
+    third = delete_file_rio_async(&rio, 0, 0, NULL, NULL);
+
+    if (first <= 0 || second <= first || third <= second) {
+	fprintf(stderr, "unexpected job ids %d %d %d\n", first, second, third);
+	++errors;
+    }
+
+    pthread_mutex_lock(&gate_lock);
+    while (!worker_waiting)
+	pthread_cond_wait(&gate_cond, &gate_lock);
+    pthread_mutex_unlock(&gate_lock);
+
+    if (first_result != -1) {
+	fprintf(stderr, "first job returned %d\n", first_result);
+	++errors;
+    }
+
+    /* the first job is over, the second has not started */
+    if (cancel_job_rio(&rio, first) != -ENOENT) {
+	fprintf(stderr, "cancelled a finished job\n");
+	++errors;
+    }
+
+    if (cancel_job_rio(&rio, second) != 0) {
+	fprintf(stderr, "could not cancel a queued job\n");
+	++errors;
+    }
+
+    pthread_mutex_lock(&gate_lock);
+    gate_open = 1;
+    pthread_cond_broadcast(&gate_cond);
+    pthread_mutex_unlock(&gate_lock);
+
+    expect_event(&rio, second, -ECANCELED);
+    expect_event(&rio, third, -EINVAL);
+
+    stop_async_rio(&rio);
+
+    if (rio.async != NULL || rio.abort != 0) {
+	fprintf(stderr, "worker not stopped cleanly\n");
+	++errors;
+    }
+
+    check_one_worker();
+
+    return errors;
+}
@@ -0,0 +1,186 @@
+#include "rioi.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static int errors;
+
+static unsigned char audio[16 * 576];
+static size_t audio_len;
+
+/* wrap the audio in tags: an id3v2 tag, Lyrics and an id3v1 tag */
+static size_t tagged(unsigned char *buf, const char *title, int v2, int lyrics, int v1)
+{
+    size_t len = 0, tag_len = strlen(title) + 11;
+
+    if (v2) {
+	memcpy(buf, "ID3\x03\x00\x00\x00\x00", 8);
+	buf[8] = (tag_len >> 7) & 0x7f;
+	buf[9] = tag_len & 0x7f;
+
+	memcpy(buf + 10, "TIT2", 4);
+	memset(buf + 14, 0, 7);
+	buf[17] = strlen(title) + 1;
+	memcpy(buf + 21, title, strlen(title));
+
+	len = 10 + tag_len;
+    }
+
+    memcpy(buf + len, audio, audio_len);
+    len += audio_len;
+
+    if (lyrics) {
+	char block[128];
+	int block_len = sprintf(block, "LYRICSBEGININD0000210LYR%05i%s", (int)strlen(title), title);
+
+	len += sprintf((char *)buf + len, "%s%06iLYRICS200", block, block_len);
+    }
+
+    if (v1) {
+	memset(buf + len, 0, 128);
+	memcpy(buf + len, "TAG", 3);
+	strncpy((char *)buf + len + 3, title, 30);
+	len += 128;
+    }
+
+    return len;
+}
+
+static u_int64_t audio_of(unsigned char *buf, size_t len)
+{
+    rio_probe_t probe;
+
+    probe_memory_rio(buf, len, &probe);
+
+    return probe_audio_rio(&probe);
+}
+
+/* only the tags differ: the fingerprints must not */
+static void check_tags_ignored(void)
+{
+    unsigned char buf[sizeof(audio) + 1024];
+    u_int64_t plain, other;
+    int i;
+
+    plain = audio_of(buf, tagged(buf, "", 0, 0, 0));
+    if (plain == 0) {
+	fprintf(stderr, "no fingerprint for the bare audio\n");
+	++errors;
+    }
+
+    for (i = 1 ; i < 8 ; i++) {
+	other = audio_of(buf, tagged(buf, (i & 1) ? "One title" : "Another, longer title",
+				     i & 1, i & 2, i & 4));
+	if (other != plain) {
+	    fprintf(stderr, "tags %d: %016llx, bare audio %016llx\n", i,
+		    (unsigned long long)other, (unsigned long long)plain);
+	    ++errors;
+	}
+    }
+
+    /* a single byte of audio */
+    audio[audio_len / 2] ^= 0x01;
+    other = audio_of(buf, tagged(buf, "One title", 1, 0, 1));
+    audio[audio_len / 2] ^= 0x01;
+
+    if (other == plain) {
+	fprintf(stderr, "a changed byte of audio was not noticed\n");
+	++errors;
+    }
+
+    /* a tag and nothing else */
+    if (audio_of(buf, tagged(buf, "One title", 1, 0, 1) - audio_len - 128) != 0) {
+	fprintf(stderr, "a file without audio has a fingerprint\n");
+	++errors;
+    }
+}
+
+/* XXH64 with seed 0 */
+static void check_vectors(void)
+{
+    if (fingerprint_rio(audio, 0) != 0xef46db3751d8e999ULL ||
+	fingerprint_rio((u_int8_t *)"a", 1) != 0xd24ec4f1a98c6e5bULL) {
+	fprintf(stderr, "fingerprint_rio does not match XXH64\n");
+	++errors;
+    }
+}
+
+static void check_manifest(int columns)
+{
+    const char manifest_name[] = "test_audio.manifest";
+    rios_t rio;
+    flist_rio_t file;
+    rio_probe_t probe;
+    u_int64_t frame_audio;
+    FILE *fh;
+    int ret;
+
+    memset(&rio, 0, sizeof(rio));
+    memset(&file, 0, sizeof(file));
+
+    rio.info.total_memory_units = 1;
+    rio.info.memory[0].files = &file;
+    file.num = 0;
+    file.rio_num = 5;
+
+    if (probe_open_rio("frame.mp3", &probe) != URIO_SUCCESS) {
+	fprintf(stderr, "Unable to open frame file\n");
+	++errors;
+	return;
+    }
+
+    frame_audio = probe_audio_rio(&probe);
+    probe_close_rio(&probe);
+
+    fh = fopen(manifest_name, "w");
+    fprintf(fh, "# rioutil manifest v1\n");
+    if (columns == 4)
+	fprintf(fh, "0 5 576 0123456789abcdef\n");
+    else
+	fprintf(fh, "0 5 576 0123456789abcdef %016llx\n", (unsigned long long)frame_audio);
+    fclose(fh);
+
+    if (open_manifest_rio(&rio, (char *)manifest_name) != URIO_SUCCESS ||
+	manifest_lookup_rio(&rio, 0, 5) == NULL) {
+	fprintf(stderr, "%d columns: manifest not loaded\n", columns);
+	++errors;
+    } else if (manifest_lookup_rio(&rio, 0, 5)->audio != ((columns == 4) ? 0 : frame_audio)) {
+	fprintf(stderr, "%d columns: audio %016llx\n", columns,
+		(unsigned long long)manifest_lookup_rio(&rio, 0, 5)->audio);
+	++errors;
+    }
+
+    /* an older manifest can not tell */
+    ret = same_audio_rio(&rio, "frame.mp3", 0, 0);
+    if (ret != ((columns == 4) ? 0 : 1)) {
+	fprintf(stderr, "%d columns: same_audio_rio returned %d\n", columns, ret);
+	++errors;
+    }
+
+    free_manifest_rio(&rio);
+    remove(manifest_name);
+}
+
+int main()
+{
+    FILE *frame_file = fopen("frame.mp3", "r");
+    size_t frame_len;
+
+    if (!frame_file) {
+	perror("Unable to open frame file\n");
+	return 1;
+    }
+
+    frame_len = fread(audio, 1, sizeof(audio) / 16, frame_file);
+    fclose(frame_file);
+
+    for (audio_len = frame_len ; audio_len + frame_len <= sizeof(audio) ; audio_len += frame_len)
+	memcpy(audio + audio_len, audio, frame_len);
+
+    check_vectors();
+    check_tags_ignored();
+    check_manifest(4);
+    check_manifest(5);
+
+    return errors;
+}
@@ -66,23 +66,217 @@ struct File files[] =
 };
 const size_t file_count = sizeof(files)/sizeof(files[0]);
 
+/* an id3v2.3 tag holding one TIT2 frame */
+static size_t make_tag(unsigned char *tag, int encoding, const unsigned char *text, size_t length)
+{
+    size_t frame = length + 1, size = 10 + frame;
+
+    memcpy(tag, "ID3\x03\x00\x00", 6);
+    tag[6] = (size >> 21) & 0x7f;
+    tag[7] = (size >> 14) & 0x7f;
+    tag[8] = (size >> 7) & 0x7f;
+    tag[9] = size & 0x7f;
+
+    memcpy(tag + 10, "TIT2", 4);
+    tag[14] = frame >> 24;
+    tag[15] = frame >> 16;
+    tag[16] = frame >> 8;
+    tag[17] = frame;
+    tag[18] = tag[19] = 0;
+    tag[20] = encoding;
+    memcpy(tag + 21, text, length);
+
+    return 21 + length;
+}
+
+static void title_of(int encoding, const unsigned char *text, size_t length, const char *to, char *title)
+{
+    unsigned char tag[1024];
+    rio_file_t info;
+    rio_probe_t probe;
+
+    memset(&info, 0, sizeof(info));
+    probe_memory_rio(tag, make_tag(tag, encoding, text, length), &probe);
+    get_id3_info(&probe, &info, to);
+
+    strcpy(title, info.title);
+}
+
+/* conversions that do not need iconv, cut at a character boundary */
+static void check_fast_paths(void)
+{
+    unsigned char text[256];
+    char title[64], expected[64];
+    int i;
+
+    /* 70 Latin-1 e-acute do not fit, 31 (62 bytes of UTF-8) do */
+    memset(text, 0xe9, 70);
+    title_of(0, text, 70, "UTF-8", title);
+    for (i = 0 ; i < 31 ; i++)
+	memcpy(expected + 2 * i, "\xc3\xa9", 2);
+    expected[62] = 0;
+    check("latin1-truncated", title, expected);
+
+    /* a character outside the BMP from a surrogate pair */
+    memcpy(text, "\x3d\xd8\x00\xde" "a\0", 6);
+    title_of(1, text, 6, "UTF-8", title);
+    check("utf16le-surrogates", title, "\xf0\x9f\x98\x80" "a");
+
+    memcpy(text, "\x00" "A\x00\xe9\x30\x6f", 6);
+    title_of(2, text, 6, "UTF-8", title);
+    check("utf16be", title, "A\xc3\xa9\xe3\x81\xaf");
+
+    title_of(2, text, 4, "ISO-8859-1//TRANSLIT", title);
+    check("utf16be-latin1", title, "A\xe9");
+
+    /* 21 three byte characters fill the title, a 22nd does not fit */
+    for (i = 0 ; i < 22 ; i++)
+	memcpy(text + 3 * i, "\xe3\x81\xaf", 3);
+    title_of(3, text, 66, "UTF-8", title);
+    text[63] = 0;
+    check("utf8-truncated", title, (char *)text);
+}
+
+#ifdef HAVE_ICONV
+#include <iconv.h>
+
+static unsigned int seed = 1;
+
+static unsigned int next_random(void)
+{
+    seed = seed * 1103515245 + 12345;
+    return (seed >> 16) & 0x7fff;
+}
+
+static u_int32_t random_char(void)
+{
+    switch (next_random() % 5) {
+    case 0:
+	return 0x20 + next_random() % 0x5f;
+    case 1:
+	return 0xa0 + next_random() % 0x60;
+    case 2:
+	return 0x3000 + next_random() % 0x400;
+    case 3:
+	return 0x10000 + next_random() * 8;
+    default:
+	/* sometimes a lone surrogate */
+	return (next_random() % 8) ? 0x41 + next_random() % 26 : 0xd800 + next_random() % 0x800;
+    }
+}
+
+static size_t random_text(int encoding, unsigned char *text)
+{
+    size_t length = 0;
+    int i, count = next_random() % 48;
+    u_int32_t c;
+
+    for (i = 0 ; i < count ; i++) {
+	c = random_char();
+
+	if (encoding == 0) {
+	    text[length++] = 0x20 + c % 0xe0;
+	} else if (encoding == 3) {
+	    /* now and then a stray byte */
+	    if (next_random() % 16 == 0)
+		text[length++] = 0x80 + next_random() % 0x80;
+	    else if (c < 0x80)
+		text[length++] = c;
+	    else if (c < 0x800) {
+		text[length++] = 0xc0 | (c >> 6);
+		text[length++] = 0x80 | (c & 0x3f);
+	    } else if (c < 0x10000) {
+		text[length++] = 0xe0 | (c >> 12);
+		text[length++] = 0x80 | ((c >> 6) & 0x3f);
+		text[length++] = 0x80 | (c & 0x3f);
+	    } else {
+		text[length++] = 0xf0 | (c >> 18);
+		text[length++] = 0x80 | ((c >> 12) & 0x3f);
+		text[length++] = 0x80 | ((c >> 6) & 0x3f);
+		text[length++] = 0x80 | (c & 0x3f);
+	    }
+	} else {
+	    u_int32_t units[2];
+	    int j, n = 1;
+
+	    if (c >= 0x10000) {
+		units[0] = 0xd800 + ((c - 0x10000) >> 10);
+		units[1] = 0xdc00 + ((c - 0x10000) & 0x3ff);
+		n = 2;
+	    } else
+		units[0] = c;
+
+	    for (j = 0 ; j < n ; j++) {
+		text[length++] = (encoding == 1) ? units[j] & 0xff : units[j] >> 8;
+		text[length++] = (encoding == 1) ? units[j] >> 8 : units[j] & 0xff;
+	    }
+	}
+    }
+
+    return length;
+}
+
+/* the converters in id3.c must give what iconv alone would */
+static void check_against_iconv(void)
+{
+    const char *from[4] = {"ISO-8859-1", "UTF-16LE", "UTF-16BE", "UTF-8"};
+    const char *to[2] = {"UTF-8", "ISO-8859-1//TRANSLIT"};
+    unsigned char text[512];
+    char title[64], expected[64];
+    int i, encoding, target;
+
+    for (i = 0 ; i < 2000 ; i++)
+	for (encoding = 0 ; encoding < 4 ; encoding++)
+	    for (target = 0 ; target < 2 ; target++) {
+		size_t length = random_text(encoding, text), in_left = length, out_left = 63;
+		char *in = (char *)text, *out = expected;
+		iconv_t ic = iconv_open(to[target], from[encoding]);
+
+		iconv(ic, &in, &in_left, &out, &out_left);
+		iconv_close(ic);
+		*out = 0;
+
+		title_of(encoding, text, length, to[target], title);
+
+		if (strcmp(title, expected)) {
+		    fprintf(stderr, "%s to %s, text %i:\n", from[encoding], to[target], i);
+		    check("iconv", title, expected);
+		}
+	    }
+}
+#endif
+
 int main()
 {
     struct File *f;
     for(f = files; f != (files + file_count); ++f)
     {
 	rio_file_t info;
+	rio_probe_t probe;
 	memset(&info, 0, sizeof(info));
 
-	get_id3_info((char *)f->filename, &info, "UTF-8");
+	if (probe_open_rio((char *)f->filename, &probe) != URIO_SUCCESS) {
+	    fprintf(stderr, "Unable to open %s\n", f->filename);
+	    ++errors;
+	    continue;
+	}
+
+	get_id3_info(&probe, &info, "UTF-8");
 	check("UTF8-title", info.title, f->utf8_title);
 	check("UTF8-artist", info.artist, f->utf8_artist);
 
-	get_id3_info((char *)f->filename, &info, "ISO-8859-1//TRANSLIT");
+	get_id3_info(&probe, &info, "ISO-8859-1//TRANSLIT");
 	check("LATIN1-title", info.title, f->latin1_title);
 	check("LATIN1-artist", info.artist, f->latin1_artist);
+
+	probe_close_rio(&probe);
     }
 
+    check_fast_paths();
+#ifdef HAVE_ICONV
+    check_against_iconv();
+#endif
+
     return errors;
 }
 
@@ -91,21 +285,27 @@ int main2(int argc, char *argv[])
     while (*++argv)
     {
 	rio_file_t info;
+	rio_probe_t probe;
 	memset(&info, 0, sizeof(info));
 
-	get_id3_info(*argv, &info, "UTF-8");
+	if (probe_open_rio(*argv, &probe) != URIO_SUCCESS)
+	    continue;
+
+	get_id3_info(&probe, &info, "UTF-8");
 
 	printf("Title(UTF-8): '%s'\n", info.title);
 	printf("Artist(UTF-8): '%s'\n", info.artist);
 
-	get_id3_info(*argv, &info, "US-ASCII//TRANSLIT");
+	get_id3_info(&probe, &info, "US-ASCII//TRANSLIT");
 	printf("Title(ASCII): '%s'\n", info.title);
 	printf("Artist(ASCII): '%s'\n", info.artist);
 
-	get_id3_info(*argv, &info, "ISO-8859-1//TRANSLIT");
+	get_id3_info(&probe, &info, "ISO-8859-1//TRANSLIT");
 	printf("Title(ISO-8859-1): '%s'\n", info.title);
 	printf("Artist(ISO-8859-1): '%s'\n", info.artist);
 
+	probe_close_rio(&probe);
+
     }
 
     return 0;
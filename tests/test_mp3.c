@@ -1,6 +1,7 @@
 #include "rioi.h"
 #include <limits.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
 int main()
@@ -10,7 +11,7 @@ int main()
     void *frame_buffer;
     const char temp_filename[] = "temp.mp3";
     const long file_size = INT_MAX/29;
-    const int expected_time = 3358;
+    const int expected_time = 3085;
 
     {
 	FILE *frame_file = fopen("frame.mp3", "r");
@@ -62,10 +63,12 @@ int main()
 	memset(&rio_latin1, 0, sizeof(rio_latin1));
 
 	info_page_t info;
+	rio_probe_t probe;
 	memset(&info, 0, sizeof(info));
 	info.data = (rio_file_t *)calloc(1, sizeof(rio_file_t));
 
-	if (mp3_info(&info, (char *)temp_filename, &rio_latin1) == URIO_SUCCESS) {
+	if (probe_open_rio((char *)temp_filename, &probe) == URIO_SUCCESS &&
+	    mp3_info(&info, &probe, &rio_latin1) == URIO_SUCCESS) {
 	    if (info.data->time != expected_time) {
 		fprintf(stderr, "Expected time: %d\n", expected_time);
 		fprintf(stderr, "Actual time:   %d\n", info.data->time);
@@ -75,6 +78,57 @@ int main()
 	    fprintf(stderr, "Failed to get MP3 info\n");
 	    ++errors;
 	}
+
+	probe_close_rio(&probe);
+    }
+
+    {
+	/* the same file, probed in memory */
+	unsigned char *buffer = malloc(file_size + frame_len);
+	rio_file_t *header = (rio_file_t *)calloc(1, sizeof(rio_file_t));
+	long length;
+
+	for (length = 0 ; length < file_size ; length += frame_len)
+	    memcpy(buffer + length, frame_buffer, frame_len);
+
+	if (probe_buffer_rio(buffer, length, header, "ISO-8859-1//TRANSLIT") != 0 ||
+	    header->time != expected_time) {
+	    fprintf(stderr, "Expected time in memory: %d\n", expected_time);
+	    fprintf(stderr, "Actual time in memory:   %d\n", header->time);
+	    ++errors;
+	}
+
+	/* the same file, a few odd sized blocks at a time */
+	{
+	    mp3_stream_t stream;
+	    long offset, amount;
+
+	    memset(header, 0, sizeof(rio_file_t));
+	    mp3_stream_init_rio(&stream);
+
+	    for (offset = 0 ; offset < length ; offset += amount) {
+		amount = (length - offset < 4093) ? length - offset : 4093;
+		mp3_stream_feed_rio(&stream, buffer + offset, amount);
+	    }
+
+	    mp3_stream_finish_rio(&stream, header);
+
+	    if (header->time != expected_time) {
+		fprintf(stderr, "Expected time from a stream: %d\n", expected_time);
+		fprintf(stderr, "Actual time from a stream:   %d\n", header->time);
+		++errors;
+	    }
+	}
+
+	/* no frames at all */
+	memset(buffer, 0, 4096);
+	if (probe_buffer_rio(buffer, 4096, header, "UTF-8") >= 0) {
+	    fprintf(stderr, "Found an MP3 in a buffer of zeros\n");
+	    ++errors;
+	}
+
+	free(header);
+	free(buffer);
     }
 
     remove(temp_filename);
@@ -0,0 +1,91 @@
+#include "rioi.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static int errors;
+
+/* the plan must never put more on a unit than it can hold */
+static void check_plan(const char *name, u_int64_t *capacity, int num_units,
+		       u_int32_t *sizes, int num_files, u_int32_t granule,
+		       int expected_placed)
+{
+    int *units = calloc(num_files, sizeof(int));
+    u_int64_t used[MAX_MEM_UNITS];
+    int placed, counted = 0, i;
+
+    memset(used, 0, sizeof(used));
+
+    placed = pack_units_rio(capacity, num_units, sizes, num_files, granule, units);
+
+    for (i = 0; i < num_files; ++i) {
+	if (units[i] < 0)
+	    continue;
+
+	if (units[i] >= num_units) {
+	    fprintf(stderr, "%s: file %d assigned to unit %d\n", name, i, units[i]);
+	    ++errors;
+	    continue;
+	}
+
+	used[units[i]] += (sizes[i] + granule - 1) / granule * granule;
+	++counted;
+    }
+
+    for (i = 0; i < num_units; ++i) {
+	if (used[i] > capacity[i]) {
+	    fprintf(stderr, "%s: unit %d overcommitted (%llu > %llu)\n", name, i,
+		    (unsigned long long)used[i], (unsigned long long)capacity[i]);
+	    ++errors;
+	}
+    }
+
+    if (placed != counted) {
+	fprintf(stderr, "%s: returned %d but placed %d\n", name, placed, counted);
+	++errors;
+    }
+
+    if (expected_placed >= 0 && placed != expected_placed) {
+	fprintf(stderr, "%s: expected %d placed, got %d\n", name, expected_placed, placed);
+	++errors;
+    }
+
+    free(units);
+}
+
+int main()
+{
+    {
+	/* greedy placement strands space here: 5 and 4 on one unit, 6 on the other */
+	u_int64_t capacity[] = { 10, 10 };
+	u_int32_t sizes[] = { 5, 6, 4, 5 };
+	check_plan("two units", capacity, 2, sizes, 4, 1, 4);
+    }
+
+    {
+	u_int64_t capacity[] = { 16 };
+	u_int32_t sizes[] = { 5, 5, 5 };
+	check_plan("granule", capacity, 1, sizes, 3, 4, 2);
+    }
+
+    {
+	u_int64_t capacity[] = { 3, 0 };
+	u_int32_t sizes[] = { 8, 0 };
+	check_plan("too large", capacity, 2, sizes, 2, 1, 1);
+    }
+
+    {
+	/* enough files and space to force a coarser table */
+	u_int64_t capacity[] = { 4ULL << 30, 1ULL << 30 };
+	u_int32_t sizes[1000];
+	int i;
+
+	srand(1);
+	for (i = 0; i < 1000; ++i)
+	    sizes[i] = 2000000 + rand() % 10000000;
+
+	check_plan("large batch", capacity, 2, sizes, 1000, 0x4000, -1);
+    }
+
+    return errors;
+}
@@ -0,0 +1,306 @@
+#include "rioi.h"
+#include "driver.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+static int errors;
+
+#define CHECK(cond, ...)				\
+    do {						\
+	if (!(cond)) {					\
+	    fprintf(stderr, __VA_ARGS__);		\
+	    fprintf(stderr, "\n");			\
+	    ++errors;					\
+	}						\
+    } while (0)
+
+/* a player that answers every exchange: unit 0 holds the files in sizes */
+static struct {
+    int request, value, index;
+    int replies;		/* 64 byte replies since the last command */
+
+    u_int32_t sizes[8];
+    int num_files;
+
+    int data_blocks;		/* CRIODATA checksums received */
+    int aborts;			/* CRIOABRT received */
+    int blocks_sent;		/* blocks of file data sent */
+} dev;
+
+static int stub_control_msg(rios_t *rio, u_int8_t request, u_int16_t value,
+			    u_int16_t index, u_int16_t length, unsigned char *buffer)
+{
+    memset(buffer, 0, length);
+    buffer[0] = 1;
+
+    dev.request = request;
+    dev.value = value;
+    dev.index = index;
+    dev.replies = 0;
+
+    return URIO_SUCCESS;
+}
+
+static int stub_write_bulk(rios_t *rio, unsigned char *buffer, u_int32_t size)
+{
+    if (size == 64 && memcmp(buffer, "CRIODATA", 8) == 0)
+	++dev.data_blocks;
+    if (size == 64 && memcmp(buffer, "CRIOABRT", 8) == 0)
+	++dev.aborts;
+
+    return size;
+}
+
+static int stub_read_bulk(rios_t *rio, unsigned char *buffer, u_int32_t size)
+{
+    memset(buffer, 0, size);
+
+    if (dev.request == RIO_MEMRI && size == 256) {
+	rio_mem_t *memory = (rio_mem_t *)buffer;
+
+	/* a single memory unit. the reply is 256 bytes, not a whole rio_mem_t */
+	if (dev.value == 0) {
+	    memory->size = 0x4000000;
+	    memory->free = 0x2000000;
+	    strcpy(memory->name, "Internal");
+	}
+    } else if (dev.request == RIO_FILEI && size == sizeof(rio_file_t)) {
+	rio_file_t *file = (rio_file_t *)buffer;
+
+	if (dev.value == 0 && dev.index < dev.num_files) {
+	    file->file_no = (dev.index + 1) * 0x10;
+	    file->size = dev.sizes[dev.index];
+	    file->type = TYPE_MP3;
+	    sprintf(file->name, "file%d.mp3", dev.index);
+	}
+    } else if (size == 64) {
+	/* an upload is started with SRIORDY, everything else is acknowledged */
+	strcpy((char *)buffer, (dev.request == RIO_WRITE && dev.replies == 0) ? "SRIORDY" : "SRIODATA");
+	++dev.replies;
+    } else
+	memset(buffer, 'a' + dev.blocks_sent++ % 26, size);
+
+    return size;
+}
+
+static struct rio_transport stub_transport = {
+    stub_read_bulk, stub_write_bulk, stub_control_msg
+};
+
+static struct player_device_info entry;
+static struct rioutil_usbdevice usbdev;
+static rios_t rio;
+
+static void open_stub(int num_files)
+{
+    int i;
+
+    free_info_rio(&rio);
+
+    memset(&rio, 0, sizeof(rio));
+    memset(&dev, 0, sizeof(dev));
+
+    entry.type = RIOFUSE;
+    entry.gen = 5;
+    usbdev.entry = &entry;
+    usbdev.transport = &stub_transport;
+    rio.dev = &usbdev;
+
+    dev.num_files = num_files;
+    for (i = 0; i < num_files; ++i)
+	dev.sizes[i] = 40000 + i;
+}
+
+/* run op to the end. returns the result, *steps is the number of steps taken */
+static int run_op(rio_op_t *op, int *steps)
+{
+    int ret;
+
+    for (*steps = 1; (ret = rio_step(op)) == RIO_STEP_AGAIN; ++*steps)
+	if (*steps > 100)
+	    return -ELOOP;
+
+    return ret;
+}
+
+static void check_refresh(void)
+{
+    rio_op_t *op;
+    int ret, steps;
+
+    open_stub(3);
+
+    ret = refresh_begin_rio(&rio, &op);
+    CHECK(ret == URIO_SUCCESS, "refresh_begin_rio returned %d", ret);
+    if (ret != URIO_SUCCESS)
+	return;
+
+    CHECK(rio.lock == 1, "the player is not locked during a refresh");
+    CHECK(dev.request == 0, "refresh_begin_rio talked to the player");
+
+    /* start, unit 0, three files and the end of the list, unit 1 */
+    ret = run_op(op, &steps);
+    CHECK(ret == URIO_SUCCESS, "refresh returned %d", ret);
+    CHECK(steps == 7, "refresh took %d steps", steps);
+    CHECK(rio.lock == 0, "the player is still locked after a refresh");
+    CHECK(rio.info.total_memory_units == 1, "%d memory units", rio.info.total_memory_units);
+    CHECK(rio.info.memory[0].num_files == 3, "%d files listed", rio.info.memory[0].num_files);
+
+    rio_op_free(op);
+
+    /* a refresh that is given up leaves no partial list behind */
+    refresh_begin_rio(&rio, &op);
+    rio_step(op);
+    rio_step(op);
+    rio_step(op);
+    rio_op_free(op);
+
+    CHECK(rio.info.memory[0].files == NULL && rio.info.total_memory_units == 0,
+	  "an unfinished refresh left a file list");
+    CHECK(rio.lock == 0, "the player is still locked after rio_op_free");
+
+    /* the blocking call runs the same steps */
+    ret = update_info_rio(&rio);
+    CHECK(ret == URIO_SUCCESS && rio.info.memory[0].num_files == 3,
+	  "update_info_rio returned %d with %d files", ret, rio.info.memory[0].num_files);
+}
+
+static void check_upload(void)
+{
+    const char file_name[] = "test_step.dat";
+    rio_upload_t *upload;
+    rio_op_t *op, *other;
+    FILE *fh;
+    int ret, steps, i;
+
+    open_stub(0);
+    generate_mem_list_rio(&rio);
+
+    fh = fopen(file_name, "w");
+    for (i = 0; i < 40000; ++i)
+	fputc(i & 0xff, fh);
+    fclose(fh);
+
+    ret = prepare_upload_rio(&rio, (char *)file_name, NULL, NULL, NULL, &upload);
+    remove(file_name);
+
+    CHECK(ret == URIO_SUCCESS, "prepare_upload_rio returned %d", ret);
+    if (ret != URIO_SUCCESS)
+	return;
+
+    CHECK(upload_begin_rio(&rio, 1, upload, &op) == -EINVAL, "upload to a missing unit");
+
+    /* the checksums were made for another type of player */
+    entry.type = RIOCHIBA;
+    CHECK(upload_begin_rio(&rio, 0, upload, &op) == -EINVAL, "upload to another type of player");
+    entry.type = RIOFUSE;
+
+    dev.request = 0;
+    ret = upload_begin_rio(&rio, 0, upload, &op);
+    CHECK(ret == URIO_SUCCESS, "upload_begin_rio returned %d", ret);
+    if (ret != URIO_SUCCESS) {
+	free_upload_rio(upload);
+	return;
+    }
+
+    CHECK(dev.request == 0, "upload_begin_rio talked to the player");
+    CHECK(refresh_begin_rio(&rio, &other) == -EBUSY, "a second operation was started");
+
+    /* start, three blocks, the end of the data, the header */
+    ret = run_op(op, &steps);
+    CHECK(ret == URIO_SUCCESS, "upload returned %d", ret);
+    CHECK(steps == 6, "upload took %d steps", steps);
+    CHECK(dev.data_blocks == 3, "%d blocks uploaded", dev.data_blocks);
+    CHECK(dev.aborts == 0, "a finished upload was aborted");
+    CHECK(rio.lock == 0, "the player is still locked after an upload");
+    CHECK(rio.info.memory[0].num_files == 1, "%d files listed", rio.info.memory[0].num_files);
+
+    /* stepping a finished operation only repeats its result */
+    CHECK(rio_step(op) == URIO_SUCCESS, "a finished upload was stepped again");
+
+    rio_op_free(op);
+
+    /* an operation that never started is not aborted */
+    upload_begin_rio(&rio, 0, upload, &op);
+    rio_op_free(op);
+    CHECK(dev.aborts == 0, "an upload that never started was aborted");
+    CHECK(rio.lock == 0, "the player is still locked after rio_op_free");
+
+    /* one that has is */
+    upload_begin_rio(&rio, 0, upload, &op);
+    rio_step(op);
+    rio_step(op);
+    rio_op_free(op);
+    CHECK(dev.aborts == 1, "an unfinished upload was not aborted (%d)", dev.aborts);
+    CHECK(rio.lock == 0, "the player is still locked after rio_op_free");
+    CHECK(rio.info.memory[0].num_files == 1, "an unfinished upload was listed");
+
+    free_upload_rio(upload);
+}
+
+static void check_download(void)
+{
+    rio_memory_sink_t msink;
+    rio_op_t *op;
+    size_t i;
+    int ret, steps;
+
+    open_stub(2);
+    generate_mem_list_rio(&rio);
+
+    memset(&msink, 0, sizeof(msink));
+
+    ret = download_begin_rio(&rio, 0, 1, memory_sink_rio, &msink, &op);
+    CHECK(ret == URIO_SUCCESS, "download_begin_rio returned %d", ret);
+    if (ret != URIO_SUCCESS)
+	return;
+
+    CHECK(rio.lock == 1, "the player is not locked during a download");
+
+    /* start, three blocks, the acknowledgement */
+    ret = run_op(op, &steps);
+    CHECK(ret == URIO_SUCCESS, "download returned %d", ret);
+    CHECK(steps == 5, "download took %d steps", steps);
+    CHECK(msink.length == dev.sizes[1], "%d bytes downloaded", (int)msink.length);
+    CHECK(rio.lock == 0, "the player is still locked after a download");
+
+    for (i = 0; i < msink.length; ++i)
+	if (msink.data[i] != 'a' + i / RIO_FTS) {
+	    CHECK(0, "byte %d of the download is wrong", (int)i);
+	    break;
+	}
+
+    rio_op_free(op);
+
+    /* an unfinished download is aborted and the sink only has what arrived */
+    msink.length = 0;
+    download_begin_rio(&rio, 0, 0, memory_sink_rio, &msink, &op);
+    rio_step(op);
+    rio_step(op);
+    rio_op_free(op);
+    CHECK(dev.aborts == 1, "an unfinished download was not aborted (%d)", dev.aborts);
+    CHECK(msink.length == RIO_FTS, "%d bytes of an unfinished download", (int)msink.length);
+    CHECK(rio.lock == 0, "the player is still locked after rio_op_free");
+
+    /* a file that is not listed */
+    download_begin_rio(&rio, 0, 5, memory_sink_rio, &msink, &op);
+    ret = run_op(op, &steps);
+    CHECK(ret == -ENOENT && steps == 1, "download of a missing file returned %d", ret);
+    rio_op_free(op);
+    CHECK(dev.aborts == 1, "a missing file was aborted");
+
+    free(msink.data);
+}
+
+int main()
+{
+    check_refresh();
+    check_upload();
+    check_download();
+
+    free_info_rio(&rio);
+
+    return errors;
+}